@@ -0,0 +1,56 @@
+#include "../whyjson.h"
+
+int main(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--check") == 0) {
+    JsonTape tape;
+    if (!json_tape_map(&tape, argv[2], 1)) {
+      fprintf(stderr, "Error: %s is not a valid tape (%d)\n", argv[2], errno);
+      return 1;
+    }
+    printf("%lu words, %lu bytes of strings\n", (unsigned long)tape.len,
+           (unsigned long)tape.pool_len);
+    if (tape.shared_nodes > 0) {
+      printf("%lu shared nodes, %.2fx smaller\n",
+             (unsigned long)tape.shared_nodes, json_tape_dedup_ratio(&tape));
+    }
+    json_tape_free(&tape);
+    return 0;
+  }
+  int dedup = argc == 4 && strcmp(argv[1], "--dedup") == 0;
+  if (argc != 3 && !dedup) {
+    fprintf(stderr, "Usage: %s [--dedup] in.json out.tape\n"
+                    "       %s --check file.tape\n",
+            argv[0], argv[0]);
+    return 1;
+  }
+  argv += dedup;
+
+  FILE *in = fopen(argv[1], "r");
+  if (in == NULL) {
+    fprintf(stderr, "Error: Could not open %s\n", argv[1]);
+    return 1;
+  }
+  JsonIt it;
+  JsonTape tape;
+  json_tape_init(&tape);
+  tape.flags = dedup ? JSON_TAPE_DEDUP : 0;
+  json_file(&it, in);
+  errno = 0;
+  if (!json_tape_build(&it, &tape)) {
+    fprintf(stderr, "Error: Could not parse %s (%d)\n", argv[1], errno);
+    fclose(in);
+    return 1;
+  }
+  fclose(in);
+
+  FILE *out = fopen(argv[2], "wb");
+  int ok = out != NULL && json_tape_write(&tape, out);
+  if (out != NULL && fclose(out) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "Error: Could not write %s\n", argv[2]);
+  }
+  json_tape_free(&tape);
+  return !ok;
+}
@@ -1,4 +1,17 @@
+#include <stdlib.h>
+
+/* lets a test fail growing anything past a size, 0 never fails */
+static size_t test_realloc_limit = 0;
+static void *test_realloc(void *ptr, size_t size) {
+  if (test_realloc_limit != 0 && size > test_realloc_limit) {
+    return NULL;
+  }
+  return realloc(ptr, size);
+}
+
+#define realloc test_realloc
 #include "../whyjson.h"
+#undef realloc
 #include "obsidian.h"
 #include <string.h>
 
@@ -441,6 +454,2721 @@ int main(int argc, char *argv[]) {
   })
 #endif
 
+  OBS_TEST_GROUP("Sax", {
+    ;
+    OBS_TEST("Events", {
+      setup_sax("{ \"a\": [1, 2.5, \"hey\", true, null], \"b\": {} }");
+      obs_test_true(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_str_eq(rec.buf, "{ k:a [ i:1 f:2.5 s:hey b:1 n ] k:b { } } ");
+      obs_test_eq(int, errno, 0);
+    })
+
+    OBS_TEST("Outer value", {
+      setup_sax("\"swifty\"");
+      obs_test_true(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_str_eq(rec.buf, "s:swifty ");
+    })
+
+    OBS_TEST("Raw numbers", {
+      setup_sax("[1, 2.50, -3e2]");
+      it.flags |= JSON_FLAG_RAW_NUMBERS;
+      obs_test_true(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_str_eq(rec.buf, "[ r:1 r:2.50 r:-3e2 ] ");
+    })
+
+    OBS_TEST("Lazy strings are decoded", {
+      setup_sax("{\"caf\\u00e9\": \"a\\nb\"}");
+      it.flags |= JSON_FLAG_LAZY_STRINGS;
+      obs_test_true(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_str_eq(rec.buf, "{ k:caf\xc3\xa9 s:a\nb } ");
+    })
+
+    OBS_TEST("Abort", {
+      setup_sax("[1, 2, 3, 4]");
+      rec.abort_at = 3;
+      obs_test_false(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_eq(int, errno, JSON_ERR_ABORTED);
+      obs_test_str_eq(rec.buf, "[ i:1 i:2 ");
+    })
+
+    OBS_TEST("Missing comma", {
+      setup_sax("[1 2]");
+      obs_test_false(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_eq(int, errno, JSON_ERR_MISSING_COMMA);
+    })
+
+    OBS_TEST("Multiple values", {
+      setup_sax("[1, 2], 2");
+      obs_test_false(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+    })
+
+    OBS_TEST("Matches json_next", {
+      setup_file("generated.json");
+      SaxRecorder rec;
+      memset(&rec, 0, sizeof(SaxRecorder));
+      int events = 0;
+      while (json_next(&tok, &it) && tok.type != JSON_END) {
+        events += 1 + (tok.key.buf != NULL);
+      }
+      obs_test_eq(int, errno, 0);
+      fseek(file, 0, SEEK_SET);
+      obs_test_true(json_file(&it, file));
+      obs_test_true(json_parse_sax(&it, &sax_recorder_handler, &rec));
+      obs_test_eq(int, rec.events, events);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Raw numbers", {
+    ;
+    OBS_TEST("Integers", {
+      setup_str("[-42, 9223372036854775807, 18446744073709551615, 1_000]");
+      it.flags |= JSON_FLAG_RAW_NUMBERS;
+      int64_t i = 0;
+      uint64_t u = 0;
+      expect_next_type(JSON_ARRAY);
+      expect_next_raw_num("-42", 1);
+      obs_test_true(json_num_as_i64(&tok.value._num, &i));
+      obs_test_eq(long, (long)i, -42);
+      obs_test_false(json_num_as_u64(&tok.value._num, &u));
+      obs_test_eq(int, errno, JSON_ERR_OUT_OF_RANGE);
+      expect_next_raw_num("9223372036854775807", 1);
+      obs_test_true(json_num_as_i64(&tok.value._num, &i));
+      obs_test_true(i == INT64_MAX);
+      expect_next_raw_num("18446744073709551615", 1);
+      obs_test_false(json_num_as_i64(&tok.value._num, &i));
+      obs_test_eq(int, errno, JSON_ERR_OUT_OF_RANGE);
+      obs_test_true(json_num_as_u64(&tok.value._num, &u));
+      obs_test_true(u == UINT64_MAX);
+      expect_next_raw_num("1000", 1);
+      obs_test_true(tok.value._num.allocated);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Floats", {
+      setup_str("{ \"a\": 2.5e3, \"b\": +.5, \"c\": "
+                "3.14159265358979323846264338327950288 }");
+      it.flags |= JSON_FLAG_RAW_NUMBERS;
+      int64_t i = 0;
+      expect_next_type(JSON_OBJECT);
+      expect_next_raw_num("2.5e3", 0);
+      obs_test_eq(double, json_num_as_double(&tok.value._num), 2500.0);
+      obs_test_false(json_num_as_i64(&tok.value._num, &i));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+      expect_next_raw_num(".5", 0);
+      obs_test_eq(double, json_num_as_double(&tok.value._num), 0.5);
+      expect_next_raw_num("3.14159265358979323846264338327950288", 0);
+      char *str = json_num_as_str(&tok.value._num, NULL);
+      obs_test_str_eq(str, "3.14159265358979323846264338327950288");
+      free(str);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_END);
+    })
+  })
+
+  OBS_TEST_GROUP("Lazy strings", {
+    ;
+    OBS_TEST("Raw slices", {
+      const char *json =
+          "{ \"a\": \"plain\", \"b\\n\": \"tab\\there \\u00e9\" }";
+      setup_str(json);
+      it.flags |= JSON_FLAG_LAZY_STRINGS;
+      char buf[32];
+      expect_next_type(JSON_OBJECT);
+      test_next_json(0, 1);
+      obs_test_eq(uint8_t, JSON_STRING, tok.type);
+      obs_test_true(tok.key.raw && !tok.key.has_escapes);
+      obs_test_false(tok.value._str.allocated);
+      /* should just point into our json */
+      obs_test_true(tok.value._str.buf > json &&
+                    tok.value._str.buf < json + strlen(json));
+      obs_test_eq(size_t, json_decode_str_into(&tok.value._str, buf), 5);
+      obs_test_str_eq(buf, "plain");
+
+      test_next_json(0, 1);
+      obs_test_true(tok.key.raw && tok.key.has_escapes);
+      obs_test_eq(size_t, json_decode_str_into(&tok.key, buf), 2);
+      obs_test_str_eq(buf, "b\n");
+      size_t len;
+      char *str = json_get_str(&tok.value._str, &len);
+      obs_test_str_eq(str, "tab\there \u00e9");
+      obs_test_eq(size_t, len, strlen("tab\there \u00e9"));
+      free(str);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Invalid escapes still error", {
+      setup_str("[\"\\uD800\\u0065\"]");
+      it.flags |= JSON_FLAG_LAZY_STRINGS;
+      expect_next_type(JSON_ARRAY);
+      expect_error(JSON_ERR_INVALID_UTF8);
+    })
+
+    OBS_TEST("Unknown escape", {
+      setup_str("\"\\x\"");
+      it.flags |= JSON_FLAG_LAZY_STRINGS;
+      expect_error(JSON_ERR_UNKNOWN_TOK);
+    })
+
+    OBS_TEST("File", {
+      FILE *file = tmpfile();
+      fputs("[\"a\\\"b\", \"c\"]", file);
+      rewind(file);
+      JsonIt it;
+      JsonTok tok;
+      obs_test_true(json_file(&it, file));
+      it.flags |= JSON_FLAG_LAZY_STRINGS;
+      expect_next_type(JSON_ARRAY);
+      test_next_json(0, 1);
+      obs_test_true(tok.value._str.raw && tok.value._str.has_escapes);
+      obs_test_true(tok.value._str.allocated);
+      char *str = json_get_str(&tok.value._str, NULL);
+      obs_test_str_eq(str, "a\"b");
+      free(str);
+      test_next_json(0, 1);
+      obs_test_false(tok.value._str.has_escapes);
+      obs_test_str_eq(tok.value._str.buf, "c");
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Insitu", {
+    ;
+    OBS_TEST("Decoded in place", {
+      char json[] = "{ \"a\\n\": [\"x\\u00e9y\", \"plain\"], \"b\": 2 }";
+      JsonIt it;
+      JsonTok tok;
+      errno = 0;
+      obs_test_true(json_insitu(&it, json, strlen(json)));
+      expect_next_type(JSON_OBJECT);
+      expect_next_key_only(JSON_ARRAY, "a\n");
+      obs_test_true(tok.key.buf > json && tok.key.buf < json + sizeof(json));
+      expect_next_array_string("x\u00e9y");
+      obs_test_false(tok.value._str.allocated);
+      obs_test_true(tok.value._str.buf > json &&
+                    tok.value._str.buf < json + sizeof(json));
+      expect_next_array_string("plain");
+      obs_test_false(tok.value._str.allocated);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_obj_value(JSON_INT, "b", long, 2);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Lazy", {
+      char json[] = "[\"a\\tb\"]";
+      JsonIt it;
+      JsonTok tok;
+      errno = 0;
+      obs_test_true(json_insitu(&it, json, strlen(json)));
+      it.flags |= JSON_FLAG_LAZY_STRINGS;
+      expect_next_type(JSON_ARRAY);
+      test_next_json(0, 1);
+      obs_test_true(tok.value._str.raw && tok.value._str.has_escapes);
+      /* still null terminated just not decoded */
+      obs_test_str_eq(tok.value._str.buf, "a\\tb");
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Errors", {
+      char json[] = "[\"\\uDC00\"]";
+      JsonIt it;
+      JsonTok tok;
+      errno = 0;
+      obs_test_true(json_insitu(&it, json, strlen(json)));
+      expect_next_type(JSON_ARRAY);
+      expect_error(JSON_ERR_INVALID_UTF8);
+    })
+  })
+
+  OBS_TEST_GROUP("Long strings", {
+    ;
+    OBS_TEST("Runs around escapes", {
+      setup_str("[\"0123456789abcdefghijklmnopqrstuvwxyz\\n0123456789abcdefgh"
+                "ijklmnopqrstuvwxyz\\u00e9\\\"0123456789abcdefghijkl\", "
+                "\"éééééééééééééééé\"]");
+      expect_next_type(JSON_ARRAY);
+      expect_next_array_string(
+          "0123456789abcdefghijklmnopqrstuvwxyz\n0123456789abcdefghijklmnopq"
+          "rstuvwxyzé\"0123456789abcdefghijkl");
+      expect_next_array_string("éééééééééééééééé");
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Control characters", {
+      setup_str("[\"0123456789abcdefghijklmnopqrstuvwxyz\t0123\"]");
+      expect_next_type(JSON_ARRAY);
+      expect_error(JSON_ERR_MISSING_QUOTE);
+    })
+
+    OBS_TEST("File across buffer boundaries", {
+      /* long enough to cross a few of the BUFSIZ windows */
+      size_t len = BUFSIZ * 3 + 7;
+      char *expected = malloc(len + 1);
+      FILE *file = tmpfile();
+      fputs("[\"", file);
+      for (size_t i = 0; i < len; i++) {
+        expected[i] = i % 97 == 0 ? '\n' : 'a' + i % 26;
+        if (expected[i] == '\n') {
+          fputs("\\n", file);
+        } else {
+          fputc(expected[i], file);
+        }
+      }
+      expected[len] = '\0';
+      fputs("\", \"end\"]", file);
+      rewind(file);
+
+      JsonIt it;
+      JsonTok tok;
+      obs_test_true(json_file(&it, file));
+      expect_next_type(JSON_ARRAY);
+      test_next_json(0, 1);
+      obs_test_eq(size_t, tok.value._str.len, len);
+      obs_test_str_eq(tok.value._str.buf, expected);
+      expect_next_array_string("end");
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+      free(expected);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Isa", {
+    ;
+    JsonIsa best = json_active_isa();
+
+    OBS_TEST("Picks the best supported", {
+      obs_test_true(json_internal_isa_supported(best));
+      for (int isa = best + 1; isa <= JSON_ISA_AVX512; isa++) {
+        obs_test_false(json_internal_isa_supported(isa));
+      }
+      obs_test_true(json_set_isa(JSON_ISA_SCALAR));
+      obs_test_eq(int, json_active_isa(), JSON_ISA_SCALAR);
+      obs_test_false(json_set_isa((JsonIsa)42));
+      obs_test_eq(int, json_active_isa(), JSON_ISA_SCALAR);
+      obs_test_str_eq(json_isa_name(JSON_ISA_AVX2), "avx2");
+    })
+
+    OBS_TEST("Kernels agree with scalar", {
+      const char pattern[] = "  \tab\r\ncd e\"f\\g[h]i{j}k\x01l\xc3\xa9m:";
+      char buf[200];
+      for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = pattern[i % (sizeof(pattern) - 1)];
+      }
+      static const char *const needles[] = {
+          ":", "m:", "e\"f\\g", "\x01l\xc3", "ab\r\ncd e\"f\\g[h]i{j}k",
+          "zz", ": "};
+      JsonKernels scalar = *json_internal_kernels();
+      for (int isa = JSON_ISA_SCALAR; isa <= (int)best; isa++) {
+        if (!json_set_isa(isa)) {
+          continue;
+        }
+        const JsonKernels *k = json_internal_kernels();
+        const char *end = buf + sizeof(buf);
+        for (const char *cur = buf; cur < end; cur++) {
+          obs_test_eq(const char *, k->find_str_special(cur, end, ':'),
+                      scalar.find_str_special(cur, end, ':'));
+          obs_test_eq(const char *, k->skip_whitespace(cur, end),
+                      scalar.skip_whitespace(cur, end));
+          obs_test_eq(const char *, k->find_structural(cur, end),
+                      scalar.find_structural(cur, end));
+          obs_test_eq(const char *, k->skip_ascii(cur, end),
+                      scalar.skip_ascii(cur, end));
+          for (size_t n = 0; n < sizeof(needles) / sizeof(needles[0]); n++) {
+            size_t len = strlen(needles[n]);
+            obs_test_eq(const char *,
+                        k->find_substr(cur, end, needles[n], len),
+                        scalar.find_substr(cur, end, needles[n], len));
+          }
+        }
+      }
+      json_set_isa(best);
+    })
+
+    OBS_TEST("Parses the same with every isa", {
+      int expected = -1;
+      for (int isa = JSON_ISA_SCALAR; isa <= (int)best; isa++) {
+        if (!json_set_isa(isa)) {
+          continue;
+        }
+        {
+          setup_file("generated.json");
+          int count = 0;
+          while (json_next(&tok, &it) && tok.type != JSON_END) {
+            count++;
+          }
+          obs_test_eq(int, errno, 0);
+          if (expected == -1) {
+            expected = count;
+          }
+          obs_test_eq(int, count, expected);
+          fclose(file);
+        }
+        {
+          /* line / column tracking across bulk whitespace */
+          setup_str("[\n                                  \n    1,\n  x]");
+          expect_next_type(JSON_ARRAY);
+          expect_next_array_value(JSON_INT, long, 1);
+          obs_test_false(json_next(&tok, &it));
+          obs_test_eq(int, it.cur_line, 4);
+          obs_test_eq(int, it.cur_col, 3);
+        }
+      }
+      json_set_isa(best);
+    })
+  })
+
+  OBS_TEST_GROUP("Validate", {
+    ;
+    OBS_TEST("Valid", {
+      expect_valid("");
+      expect_valid("  \n ");
+      expect_valid("{\"a\": [1, -2.5e3, {\"b\": null}], \"c\": true, \"d\": []}");
+      expect_valid("[\"\\uD83D\\uDE00 \\n \\\"\", \"\u00e9\", false]");
+      expect_valid("12");
+      /* doesn't need to be null terminated */
+      obs_test_true(json_validate("[1, 2]garbage", 6, NULL));
+
+      FILE *file = fopen("generated.json", "r");
+      fseek(file, 0, SEEK_END);
+      long len = ftell(file);
+      rewind(file);
+      char *buf = malloc(len);
+      obs_test_eq(size_t, fread(buf, 1, len, file), (size_t)len);
+      obs_test_true(json_validate(buf, len, NULL));
+      free(buf);
+      fclose(file);
+    })
+
+    OBS_TEST("Errors", {
+      expect_invalid("[1", JSON_ERR_UNMATCHED_TOKENS, 2);
+      expect_invalid("{\"a\": 1", JSON_ERR_UNMATCHED_TOKENS, 7);
+      expect_invalid("[1]]", JSON_ERR_UNMATCHED_TOKENS, 3);
+      expect_invalid("[1}", JSON_ERR_UNMATCHED_TOKENS, 2);
+      expect_invalid("[1 2]", JSON_ERR_MISSING_COMMA, 3);
+      expect_invalid("{\"a\" 1}", JSON_ERR_UNKNOWN_TOK, 5);
+      expect_invalid("[tru]", JSON_ERR_INVALID_VALUE, 4);
+      expect_invalid("[1] 2", JSON_ERR_INVALID_VALUE, 4);
+      expect_invalid("[\"a\tb\"]", JSON_ERR_MISSING_QUOTE, 3);
+      expect_invalid("[\"ab", JSON_ERR_MISSING_QUOTE, 4);
+      expect_invalid("[\"\\x\"]", JSON_ERR_UNKNOWN_TOK, 2);
+      expect_invalid("[1, \"\\uDC00\"]", JSON_ERR_INVALID_UTF8, 5);
+      expect_invalid("[1, 2, 3e++9]", JSON_ERR_INVALID_VALUE, 10);
+    })
+
+    OBS_TEST("Line and column", {
+      JsonErrInfo info;
+      const char *str = "{\n  \"a\": [1,\n   x]\n}";
+      obs_test_false(json_validate(str, strlen(str), &info));
+      obs_test_eq(int, info.line, 3);
+      obs_test_eq(int, info.col, 4);
+      obs_test_true(info.msg != NULL);
+    })
+
+    OBS_TEST("Utf8", {
+      expect_invalid("[\"ok\", \"\xff\"]", JSON_ERR_INVALID_UTF8, 8);
+      expect_invalid("[\"\xc3\"]", JSON_ERR_INVALID_UTF8, 2);
+      /* the first error wins */
+      expect_invalid("[1 \"\xff\"]", JSON_ERR_MISSING_COMMA, 3);
+    })
+
+    OBS_TEST("Depth", {
+      char deep[WHY_JSON_MAX_DEPTH * 2 + 3];
+      memset(deep, '[', WHY_JSON_MAX_DEPTH);
+      memset(deep + WHY_JSON_MAX_DEPTH, ']', WHY_JSON_MAX_DEPTH);
+      deep[WHY_JSON_MAX_DEPTH * 2] = '\0';
+      expect_valid(deep);
+      memmove(deep + 1, deep, WHY_JSON_MAX_DEPTH * 2 + 1);
+      deep[0] = '[';
+      expect_invalid(deep, JSON_ERR_TOO_DEEP, WHY_JSON_MAX_DEPTH);
+    })
+
+#ifndef JSON_STRICT
+    OBS_TEST("Non strict", {
+      expect_valid("{ a: 5, b a h da : \"bob\", k: [1, ], : \"empty\", }");
+      expect_invalid("{ a\"b: 1}", JSON_ERR_MISSING_QUOTE, 3);
+    })
+#else
+    OBS_TEST("Strict", {
+      expect_invalid("{ \"a\": 2, }", JSON_ERR_MISSING_QUOTE, 10);
+      expect_invalid("[2, ]", JSON_ERR_INVALID_VALUE, 4);
+      expect_invalid("{a: 2}", JSON_ERR_MISSING_QUOTE, 1);
+    })
+#endif
+  })
+
+  OBS_TEST_GROUP("Nesting", {
+    ;
+    OBS_TEST("Deeper than the inline levels", {
+      /* alternate objects and arrays so every bit gets tested */
+      int levels = WHY_JSON_INLINE_DEPTH * 3 + 5;
+      char *str = malloc(levels * 6 + 2);
+      char *cur = str;
+      for (int i = 0; i < levels; i++) {
+        cur += sprintf(cur, i % 2 ? "[" : "{\"a\":");
+      }
+      *cur++ = '1';
+      for (int i = levels - 1; i >= 0; i--) {
+        *cur++ = i % 2 ? ']' : '}';
+      }
+      *cur = '\0';
+
+      setup_str(str);
+      for (int i = 0; i < levels; i++) {
+        test_next_json(0, 1);
+        obs_test_eq(uint8_t, tok.type, (i & 1) ? JSON_ARRAY : JSON_OBJECT);
+      }
+      expect_next_array_value(JSON_INT, long, 1);
+      obs_test_eq(int, it.depth, levels);
+      for (int i = levels - 1; i >= 0; i--) {
+        expect_next_type((i & 1) ? JSON_ARRAY_END : JSON_OBJECT_END);
+      }
+      obs_test_eq(int, it.depth, 0);
+      expect_next_type(JSON_END);
+      obs_test_true(it.nesting_spill == NULL);
+      free(str);
+    })
+
+    OBS_TEST("Max depth", {
+      setup_str("[[{\"a\": [1]}]]");
+      it.max_depth = 3;
+      expect_next_type(JSON_ARRAY);
+      expect_next_type(JSON_ARRAY);
+      expect_next_type(JSON_OBJECT);
+      expect_next_key_only(JSON_ARRAY, "a");
+      expect_error(JSON_ERR_TOO_DEEP);
+    })
+
+    OBS_TEST("Next after destroy", {
+      setup_str("[]");
+      expect_next_type(JSON_ARRAY);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+      test_next_json(JSON_ERR_INVALID_ARGS, 0);
+    })
+  })
+
+  OBS_TEST_GROUP("Iterator", {
+    ;
+    OBS_TEST("Hot part fits in two cache lines", {
+      /* past nesting_spill is only touched for errors and attachments */
+      obs_test_true(sizeof(void *) != 8 ||
+                    offsetof(JsonIt, nesting_spill) <= 128);
+      obs_test_true(sizeof(void *) != 8 || sizeof(JsonIt) <= 192);
+    })
+
+    OBS_TEST("Error text", {
+      setup_str("[1, }");
+      obs_test_str_eq(it.err, "");
+      expect_next_type(JSON_ARRAY);
+      obs_test_str_eq(it.err, "");
+      expect_next_array_value(JSON_INT, long, 1);
+      test_next_json(JSON_ERR_INVALID_VALUE, 0);
+      obs_test_true(it.err[0] != '\0');
+    })
+
+    OBS_TEST("Own error buffer", {
+      char buf[WHY_JSON_ERR_BUF_SIZE];
+      setup_str("[}");
+      json_set_err_buf(&it, buf);
+      expect_next_type(JSON_ARRAY);
+      test_next_json(JSON_ERR_INVALID_VALUE, 0);
+      obs_test_true(it.err == buf);
+      obs_test_true(buf[0] != '\0');
+
+      /* other iterators failing don't touch it */
+      char before[WHY_JSON_ERR_BUF_SIZE];
+      JsonIt other;
+      JsonTok other_tok;
+      strcpy(before, it.err);
+      obs_test_true(json_str(&other, "[1, 2"));
+      while (json_next(&other_tok, &other)) {
+      }
+      obs_test_neq(int, errno, 0);
+      obs_test_str_eq(it.err, before);
+      obs_test_true(strcmp(other.err, before) != 0);
+    })
+
+    OBS_TEST("File buffer", {
+      setup_file("generated.json");
+      obs_test_true(it.source_str != NULL);
+      while (json_next(&tok, &it) && tok.type != JSON_END) {
+      }
+      obs_test_eq(int, errno, 0);
+      obs_test_true(it.source_str == NULL);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Packed tokens", {
+    ;
+    OBS_TEST("Sizes", {
+      obs_test_true(sizeof(JsonTok) <= 32);
+      obs_test_true(sizeof(JsonStr) <= sizeof(void *) + 4);
+    })
+
+    OBS_TEST("Array of tokens", {
+      /* keep every token around, strings have to be taken out of them */
+      JsonTok toks[4];
+      setup_str("{\"a\": \"x\", \"bb\": 2.5}");
+      for (int i = 0; i < 4; i++) {
+        test_next_json(0, 1);
+        toks[i] = tok;
+        if (tok.type == JSON_STRING) {
+          size_t len;
+          toks[i].value._str.buf = json_get_str(&tok.value._str, &len);
+          toks[i].value._str.allocated = 1;
+        }
+        toks[i].key.buf = NULL;
+      }
+      obs_test_eq(uint8_t, toks[0].type, JSON_OBJECT);
+      obs_test_eq(uint8_t, toks[0].first, 1);
+      obs_test_eq(uint8_t, toks[1].type, JSON_STRING);
+      obs_test_str_eq(toks[1].value._str.buf, "x");
+      obs_test_eq(size_t, toks[1].value._str.len, 1);
+      obs_test_eq(uint8_t, toks[2].type, JSON_FLT);
+      obs_test_eq(uint8_t, toks[2].first, 0);
+      obs_test_eq(double, toks[2].value._flt, 2.5);
+      obs_test_eq(uint8_t, toks[3].type, JSON_OBJECT_END);
+      free((char *)toks[1].value._str.buf);
+      expect_next_type(JSON_END);
+    })
+  })
+
+  OBS_TEST_GROUP("Small strings", {
+    ;
+    OBS_TEST("Short keys and values aren't allocated", {
+      setup_str("[{\"_id\": \"abc\", \"age\": 3, \"name\": \"Bob\"}, \"x\"]");
+      expect_next_type(JSON_ARRAY);
+      expect_next_type(JSON_OBJECT);
+      expect_next_obj_string("_id", "abc");
+      obs_test_true(!tok.key.allocated && !tok.value._str.allocated);
+      obs_test_true(tok.key.buf == it.small_key);
+      obs_test_true(tok.value._str.buf == it.small_value);
+      expect_next_obj_value(JSON_INT, "age", long, 3);
+      expect_next_obj_string("name", "Bob");
+      obs_test_true(!tok.key.allocated && !tok.value._str.allocated);
+
+      /* json_get_str has to copy it out */
+      size_t len;
+      char *copy = json_get_str(&tok.value._str, &len);
+      obs_test_str_eq(copy, "Bob");
+      obs_test_eq(size_t, len, 3);
+      obs_test_str_eq(tok.value._str.buf, "Bob");
+      free(copy);
+
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_array_string("x");
+      obs_test_true(!tok.value._str.allocated);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Outgrowing the small buffer", {
+      /* 15 fits (with the null terminator), 16 doesn't */
+      setup_str("[\"123456789012345\", \"1234567890123456\", "
+                "\"12345678901234\\u00e9\", \"abc\"]");
+      expect_next_type(JSON_ARRAY);
+      expect_next_array_string("123456789012345");
+      obs_test_true(!tok.value._str.allocated);
+      expect_next_array_string("1234567890123456");
+      obs_test_true(tok.value._str.allocated);
+      /* the escape is what pushes it over */
+      expect_next_array_string("12345678901234\xc3\xa9");
+      obs_test_true(tok.value._str.allocated);
+      obs_test_eq(size_t, tok.value._str.len, 16);
+      /* and back to the small buffer */
+      expect_next_array_string("abc");
+      obs_test_true(!tok.value._str.allocated);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+    })
+  })
+
+  OBS_TEST_GROUP("Intern", {
+    ;
+    OBS_TEST("Keys get stable ids", {
+      JsonIntern table;
+      json_intern_init(&table);
+      /* add the keys we care about first so we know their ids */
+      obs_test_eq(int, json_intern(&table, "name", 4), 0);
+      obs_test_eq(int, json_intern(&table, "age", 3), 1);
+      obs_test_eq(int, json_intern(&table, "name", 4), 0);
+
+      setup_str("[{\"age\": 1, \"name\": \"a\", \"n\\u0061me\": 2, "
+                "\"other\": null}, {\"other\": 3}]");
+      json_set_intern(&it, &table);
+      expect_next_type(JSON_ARRAY);
+      obs_test_eq(int, tok.key_id, -1);
+      expect_next_type(JSON_OBJECT);
+      expect_next_obj_value(JSON_INT, "age", long, 1);
+      obs_test_eq(int, tok.key_id, 1);
+      expect_next_obj_string("name", "a");
+      obs_test_eq(int, tok.key_id, 0);
+      obs_test_eq(int, tok.value_id, -1);
+      const char *name = tok.key.buf;
+      /* escapes are decoded before interning */
+      expect_next_obj_value(JSON_INT, "name", long, 2);
+      obs_test_eq(int, tok.key_id, 0);
+      obs_test_true(tok.key.buf == name);
+      expect_next_key_only(JSON_NULL, "other");
+      obs_test_eq(int, tok.key_id, 2);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_OBJECT);
+      expect_next_obj_value(JSON_INT, "other", long, 3);
+      obs_test_eq(int, tok.key_id, 2);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+
+      obs_test_eq(int, table.count, 3);
+      size_t len;
+      obs_test_str_eq(json_intern_str(&table, 2, &len), "other");
+      obs_test_eq(size_t, len, 5);
+      obs_test_true(json_intern_str(&table, 3, NULL) == NULL);
+      obs_test_eq(int, json_intern_find(&table, "age", 3), 1);
+      obs_test_eq(int, json_intern_find(&table, "ag", 2), -1);
+      json_intern_free(&table);
+    })
+
+    OBS_TEST("Values", {
+      JsonIntern table;
+      json_intern_init(&table);
+      setup_str("[\"female\", \"male\", \"female\", 2, "
+                "\"a string that is far too long to be worth interning at "
+                "all really\"]");
+      json_set_intern(&it, &table);
+      it.flags |= JSON_FLAG_INTERN_VALUES;
+      expect_next_type(JSON_ARRAY);
+      expect_next_array_string("female");
+      obs_test_eq(int, tok.value_id, 0);
+      obs_test_true(!tok.value._str.allocated);
+      expect_next_array_string("male");
+      obs_test_eq(int, tok.value_id, 1);
+      expect_next_array_string("female");
+      obs_test_eq(int, tok.value_id, 0);
+      expect_next_array_value(JSON_INT, long, 2);
+      obs_test_eq(int, tok.value_id, -1);
+      test_next_json(0, 1);
+      obs_test_eq(int, tok.value_id, -1);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+      obs_test_eq(int, table.count, 2);
+      json_intern_free(&table);
+    })
+
+    OBS_TEST("Generated", {
+      /* every key in the file should map to the same id each time */
+      JsonIntern table;
+      json_intern_init(&table);
+      setup_file("generated.json");
+      json_set_intern(&it, &table);
+      int keys = 0;
+      while (json_next(&tok, &it) && tok.type != JSON_END) {
+        if (tok.key.buf != NULL) {
+          keys++;
+          obs_test_true(tok.key_id >= 0);
+          obs_test_eq(int, json_intern_find(&table, tok.key.buf, tok.key.len),
+                      tok.key_id);
+        }
+      }
+      obs_test_eq(int, errno, 0);
+      obs_test_true(keys > table.count * 10);
+      json_intern_free(&table);
+      fclose(file);
+    })
+
+    OBS_TEST("Many strings", {
+      /* grows the slots and the chunks */
+      JsonIntern table;
+      json_intern_init(&table);
+      char buf[32];
+      for (int i = 0; i < 5000; i++) {
+        int len = sprintf(buf, "key %d", i);
+        obs_test_eq(int, json_intern(&table, buf, len), i);
+      }
+      for (int i = 0; i < 5000; i += 7) {
+        int len = sprintf(buf, "key %d", i);
+        obs_test_eq(int, json_intern_find(&table, buf, len), i);
+        obs_test_str_eq(json_intern_str(&table, i, NULL), buf);
+      }
+      json_intern_free(&table);
+      obs_test_eq(int, table.count, 0);
+    })
+  })
+
+  OBS_TEST_GROUP("Key sets", {
+    ;
+    OBS_TEST("Key index", {
+      static const char *const keys[] = {"id", "name", "tags", ""};
+      setup_str("{\"name\": \"a\", \"other\": 1, \"\": 2, "
+                "\"tags\": {\"id\": 3, \"nam\": 4}}");
+      obs_test_true(json_keyset(&it, keys, 4));
+      expect_next_type(JSON_OBJECT);
+      obs_test_eq(int, tok.key_index, -1);
+      expect_next_obj_string("name", "a");
+      obs_test_eq(int, tok.key_index, 1);
+      expect_next_obj_value(JSON_INT, "other", long, 1);
+      obs_test_eq(int, tok.key_index, -1);
+      expect_next_obj_value(JSON_INT, "", long, 2);
+      obs_test_eq(int, tok.key_index, 3);
+      expect_next_key_only(JSON_OBJECT, "tags");
+      obs_test_eq(int, tok.key_index, 2);
+      expect_next_obj_value(JSON_INT, "id", long, 3);
+      obs_test_eq(int, tok.key_index, 0);
+      expect_next_obj_value(JSON_INT, "nam", long, 4);
+      obs_test_eq(int, tok.key_index, -1);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Skip unknown keys", {
+      static const char *const keys[] = {"a", "b", "d"};
+      setup_str("{\"junk\": 0, \"a\": 1,\n \"x\": {\"y\": [1, {\"z\": \"}]\"}],"
+                "\n \"w\": \"\\\"]\"}, \"b\": \"s\", \"c\": [true, null],"
+                " \"d\": 3, \"e\": -1.5e3}");
+      obs_test_true(json_keyset(&it, keys, 3));
+      it.flags |= JSON_FLAG_SKIP_UNKNOWN_KEYS;
+      expect_next_type(JSON_OBJECT);
+      expect_next_obj_value(JSON_INT, "a", long, 1);
+      obs_test_eq(int, tok.key_index, 0);
+      expect_next_obj_string("b", "s");
+      obs_test_eq(int, tok.key_index, 1);
+      obs_test_eq(int, it.cur_line, 3);
+      expect_next_obj_value(JSON_INT, "d", long, 3);
+      obs_test_eq(int, tok.key_index, 2);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Skipped values still have to match", {
+      static const char *const keys[] = {"a"};
+      setup_str("{\"x\": [1}, \"a\": 1}");
+      obs_test_true(json_keyset(&it, keys, 1));
+      it.flags |= JSON_FLAG_SKIP_UNKNOWN_KEYS;
+      expect_next_type(JSON_OBJECT);
+      expect_error(JSON_ERR_UNMATCHED_TOKENS);
+    })
+
+    OBS_TEST("Generated", {
+      static const char *const keys[] = {"index", "age", "name"};
+      setup_file("generated.json");
+      obs_test_true(json_keyset(&it, keys, 3));
+      it.flags |= JSON_FLAG_SKIP_UNKNOWN_KEYS;
+      long sums[3] = {0};
+      int counts[3] = {0};
+      while (json_next(&tok, &it) && tok.type != JSON_END) {
+        if (tok.key.buf != NULL) {
+          obs_test_true(tok.key_index >= 0);
+          counts[tok.key_index]++;
+          if (tok.type == JSON_INT) {
+            sums[tok.key_index] += tok.value._int;
+          }
+        }
+      }
+      obs_test_eq(int, errno, 0);
+      /* the friends' names are skipped along with friends */
+      obs_test_eq(int, counts[0], 209);
+      obs_test_eq(int, counts[1], 209);
+      obs_test_eq(int, counts[2], 209);
+      obs_test_eq(long, sums[0], 21736);
+      obs_test_eq(long, sums[1], 6310);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Bind", {
+    ;
+    OBS_TEST("Nested objects", {
+      typedef struct {
+        double lat;
+        double lng;
+      } Point;
+      typedef struct {
+        long id;
+        const char *name;
+        int active;
+        Point at;
+      } Place;
+      static const JsonBindField point_fields[] = {
+          JSON_BIND(Point, lat, JSON_BIND_DOUBLE, NULL),
+          JSON_BIND(Point, lng, JSON_BIND_DOUBLE, NULL),
+      };
+      static const JsonBindDesc point = {point_fields, 2, sizeof(Point)};
+      static const JsonBindField place_fields[] = {
+          JSON_BIND(Place, id, JSON_BIND_LONG, NULL),
+          JSON_BIND(Place, name, JSON_BIND_STR, NULL),
+          JSON_BIND(Place, active, JSON_BIND_BOOL, NULL),
+          JSON_BIND(Place, at, JSON_BIND_OBJECT, &point),
+      };
+      static const JsonBindDesc place = {place_fields, 4, sizeof(Place)};
+
+      JsonIt it;
+      JsonArena arena;
+      Place out = {-1, NULL, 0, {0, 0}};
+      json_arena_init(&arena);
+      obs_test_true(json_str(&it, "{\"at\": {\"lng\": 2, \"lat\": 1.5},"
+                                  " \"extra\": [1, {\"a\": \"]\"}],"
+                                  " \"name\": \"caf\\u00e9\", \"active\": true}"));
+      obs_test_true(json_bind(&it, &place, &out, &arena));
+      obs_test_eq(int, errno, 0);
+      /* missing fields are left alone */
+      obs_test_eq(long, out.id, -1);
+      obs_test_str_eq(out.name, "caf\xc3\xa9");
+      obs_test_eq(int, out.active, 1);
+      obs_test_eq(double, out.at.lat, 1.5);
+      obs_test_eq(double, out.at.lng, 2.0);
+      json_arena_free(&arena);
+    })
+
+    OBS_TEST("Arrays", {
+      typedef struct {
+        const char *name;
+        JsonBindArray tags;
+      } Item;
+      static const JsonBindField tag_fields[] = {
+          {NULL, 0, JSON_BIND_STR, NULL},
+      };
+      static const JsonBindDesc tag = {tag_fields, 1, sizeof(const char *)};
+      static const JsonBindField item_fields[] = {
+          JSON_BIND(Item, name, JSON_BIND_STR, NULL),
+          JSON_BIND(Item, tags, JSON_BIND_ARRAY, &tag),
+      };
+      static const JsonBindDesc item = {item_fields, 2, sizeof(Item)};
+
+      JsonIt it;
+      JsonArena arena;
+      JsonBindArray out;
+      json_arena_init(&arena);
+      obs_test_true(json_str(&it, "[{\"name\": \"a\", \"tags\": [\"x\", \"y\","
+                                  " null, \"z\", \"w\"]}, {\"tags\": []},"
+                                  " {\"name\": null}]"));
+      obs_test_true(json_bind(&it, &item, &out, &arena));
+      obs_test_eq(size_t, out.len, 3);
+      Item *items = (Item *)out.items;
+      obs_test_str_eq(items[0].name, "a");
+      obs_test_eq(size_t, items[0].tags.len, 5);
+      const char **tags = (const char **)items[0].tags.items;
+      obs_test_str_eq(tags[0], "x");
+      obs_test_str_eq(tags[1], "y");
+      obs_test_true(tags[2] == NULL);
+      obs_test_str_eq(tags[4], "w");
+      /* items start zeroed */
+      obs_test_true(items[1].name == NULL);
+      obs_test_eq(size_t, items[1].tags.len, 0);
+      obs_test_true(items[2].name == NULL);
+      json_arena_free(&arena);
+    })
+
+    OBS_TEST("Wrong types", {
+      typedef struct {
+        long id;
+      } Id;
+      static const JsonBindField fields[] = {
+          JSON_BIND(Id, id, JSON_BIND_LONG, NULL),
+      };
+      static const JsonBindDesc desc = {fields, 1, sizeof(Id)};
+      JsonIt it;
+      JsonArena arena;
+      Id out;
+      json_arena_init(&arena);
+
+      obs_test_true(json_str(&it, "{\"id\": \"1\"}"));
+      obs_test_false(json_bind(&it, &desc, &out, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+
+      obs_test_true(json_str(&it, "{\"id\": 1.5}"));
+      obs_test_false(json_bind(&it, &desc, &out, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+
+      obs_test_true(json_str(&it, "{\"id\": 1} 2"));
+      obs_test_false(json_bind(&it, &desc, &out, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+
+      obs_test_true(json_str(&it, "{\"x\": [1}, \"id\": 1}"));
+      obs_test_false(json_bind(&it, &desc, &out, &arena));
+      obs_test_eq(int, errno, JSON_ERR_UNMATCHED_TOKENS);
+      json_arena_free(&arena);
+    })
+
+    OBS_TEST("Generated", {
+      typedef struct {
+        long id;
+        const char *name;
+      } Friend;
+      typedef struct {
+        long index;
+        long age;
+        double latitude;
+        const char *name;
+        JsonBindArray friends;
+      } Person;
+      static const JsonBindField friend_fields[] = {
+          JSON_BIND(Friend, id, JSON_BIND_LONG, NULL),
+          JSON_BIND(Friend, name, JSON_BIND_STR, NULL),
+      };
+      static const JsonBindDesc friend_desc = {friend_fields, 2,
+                                               sizeof(Friend)};
+      static const JsonBindField person_fields[] = {
+          JSON_BIND(Person, index, JSON_BIND_LONG, NULL),
+          JSON_BIND(Person, age, JSON_BIND_LONG, NULL),
+          JSON_BIND(Person, latitude, JSON_BIND_DOUBLE, NULL),
+          JSON_BIND(Person, name, JSON_BIND_STR, NULL),
+          JSON_BIND(Person, friends, JSON_BIND_ARRAY, &friend_desc),
+      };
+      static const JsonBindDesc person = {person_fields, 5, sizeof(Person)};
+
+      FILE *file = fopen("generated.json", "r");
+      JsonIt it;
+      JsonArena arena;
+      JsonBindArray people;
+      json_arena_init(&arena);
+      obs_test_true(json_file(&it, file));
+      obs_test_true(json_bind(&it, &person, &people, &arena));
+      obs_test_eq(size_t, people.len, 209);
+      Person *all = (Person *)people.items;
+      long index = 0, age = 0;
+      size_t i;
+      for (i = 0; i < people.len; i++) {
+        index += all[i].index;
+        age += all[i].age;
+        obs_test_true(all[i].name != NULL);
+      }
+      obs_test_eq(long, index, 21736);
+      obs_test_eq(long, age, 6310);
+      obs_test_str_eq(all[0].name, "Beatrice Barr");
+      obs_test_eq(double, all[0].latitude, 35.592234);
+      obs_test_eq(size_t, all[0].friends.len, 3);
+      obs_test_str_eq(((Friend *)all[0].friends.items)[2].name,
+                      "Bowers Chase");
+      json_arena_free(&arena);
+      fclose(file);
+    })
+    OBS_TEST("Arena", {
+      JsonArena arena;
+      json_arena_init(&arena);
+      char *small = (char *)json_arena_alloc(&arena, 10);
+      obs_test_true(small != NULL);
+      obs_test_eq(size_t, (size_t)((uintptr_t)small & 15), 0);
+      /* bigger than a chunk gets a chunk of its own */
+      char *big =
+          (char *)json_arena_alloc(&arena, WHY_JSON_ARENA_CHUNK_SIZE * 3);
+      obs_test_true(big != NULL);
+      memset(big, 1, WHY_JSON_ARENA_CHUNK_SIZE * 3);
+      /* sizes that would overflow fail rather than wrapping */
+      obs_test_true(json_arena_alloc(&arena, SIZE_MAX - 8) == NULL);
+      obs_test_true(json_arena_alloc(&arena, SIZE_MAX - sizeof(char *) - 15) ==
+                    NULL);
+      obs_test_true(json_arena_alloc(&arena, 1) != NULL);
+      json_arena_free(&arena);
+    })
+    OBS_TEST("Shape speculation", {
+      typedef struct {
+        long a;
+        long b;
+      } Pair;
+      static const JsonBindField fields[] = {
+          JSON_BIND(Pair, a, JSON_BIND_LONG, NULL),
+          JSON_BIND(Pair, b, JSON_BIND_LONG, NULL),
+      };
+      static const JsonBindDesc desc = {fields, 2, sizeof(Pair)};
+      JsonIt it;
+      JsonArena arena;
+      JsonBindArray out;
+      json_arena_init(&arena);
+
+      /* 3 keys per record (one unknown) so 6 hits after the first */
+      obs_test_true(json_str(&it, "[{\"a\": 1, \"x\": [], \"b\": 2},"
+                                  " {\"a\": 3, \"x\": {}, \"b\": 4},"
+                                  "\n{\"a\":5,\"x\":0,\"b\":6}]"));
+      obs_test_true(json_bind(&it, &desc, &out, &arena));
+      obs_test_eq(size_t, it.shape_hits, 6);
+      obs_test_eq(size_t, it.shape_misses, 0);
+      obs_test_eq(size_t, out.len, 3);
+      obs_test_eq(long, ((Pair *)out.items)[2].a, 5);
+      obs_test_eq(long, ((Pair *)out.items)[2].b, 6);
+
+      /* a different order (or a longer key) falls back for that record */
+      obs_test_true(json_str(&it, "[{\"a\": 1, \"b\": 2}, {\"b\": 3, \"a\": 4},"
+                                  " {\"a\": 5, \"bb\": 0, \"b\": 6}, {\"a\": 7}]"));
+      obs_test_true(json_bind(&it, &desc, &out, &arena));
+      obs_test_eq(size_t, it.shape_hits, 2);
+      obs_test_eq(size_t, it.shape_misses, 2);
+      Pair *pairs = (Pair *)out.items;
+      obs_test_eq(long, pairs[1].a, 4);
+      obs_test_eq(long, pairs[1].b, 3);
+      obs_test_eq(long, pairs[2].b, 6);
+      obs_test_eq(long, pairs[3].a, 7);
+      obs_test_eq(long, pairs[3].b, 0);
+
+      /* the decoded key is what's remembered, escapes only match slowly */
+      obs_test_true(json_str(&it, "[{\"\\u0061\": 1}, {\"a\": 2},"
+                                  " {\"\\u0061\": 3}, {\"\\\"\": 1}]"));
+      obs_test_true(json_bind(&it, &desc, &out, &arena));
+      obs_test_eq(size_t, it.shape_hits, 1);
+      obs_test_eq(size_t, it.shape_misses, 2);
+      obs_test_eq(long, ((Pair *)out.items)[2].a, 3);
+      json_arena_free(&arena);
+    })
+
+    OBS_TEST("Shape speculation generated", {
+      typedef struct {
+        long id;
+        const char *name;
+      } Friend;
+      typedef struct {
+        long age;
+        JsonBindArray friends;
+      } Person;
+      static const JsonBindField friend_fields[] = {
+          JSON_BIND(Friend, id, JSON_BIND_LONG, NULL),
+          JSON_BIND(Friend, name, JSON_BIND_STR, NULL),
+      };
+      static const JsonBindDesc friend_desc = {friend_fields, 2,
+                                               sizeof(Friend)};
+      static const JsonBindField person_fields[] = {
+          JSON_BIND(Person, age, JSON_BIND_LONG, NULL),
+          JSON_BIND(Person, friends, JSON_BIND_ARRAY, &friend_desc),
+      };
+      static const JsonBindDesc person = {person_fields, 2, sizeof(Person)};
+
+      /* in memory so keys can't be split across reads */
+      FILE *file = fopen("generated.json", "r");
+      fseek(file, 0, SEEK_END);
+      long len = ftell(file);
+      rewind(file);
+      char *buf = malloc(len);
+      obs_test_eq(size_t, fread(buf, 1, len, file), (size_t)len);
+      fclose(file);
+
+      JsonIt it;
+      JsonArena arena;
+      JsonBindArray people;
+      json_arena_init(&arena);
+      obs_test_true(json_insitu(&it, buf, len));
+      obs_test_true(json_bind(&it, &person, &people, &arena));
+      obs_test_eq(size_t, people.len, 209);
+      /* 22 keys in every record after the first and 2 in each friend */
+      obs_test_eq(size_t, it.shape_misses, 0);
+      obs_test_eq(size_t, it.shape_hits, 208 * 22 + 209 * 2 * 2);
+      long age = 0;
+      size_t i;
+      for (i = 0; i < people.len; i++) {
+        age += ((Person *)people.items)[i].age;
+      }
+      obs_test_eq(long, age, 6310);
+      json_arena_free(&arena);
+      free(buf);
+    })
+  })
+
+  OBS_TEST_GROUP("Columns", {
+    ;
+    OBS_TEST("Types", {
+      static const JsonColumnSpec specs[] = {
+          {"id", JSON_COLUMN_I64, JSON_NULLS_ERROR},
+          {"score", JSON_COLUMN_F64, JSON_NULLS_ALLOW},
+          {"ok", JSON_COLUMN_BOOL, JSON_NULLS_ZERO},
+          {"name", JSON_COLUMN_STR, JSON_NULLS_ALLOW},
+          {"at.city", JSON_COLUMN_STR, JSON_NULLS_ZERO},
+      };
+      JsonIt it;
+      JsonArena arena;
+      JsonColumn cols[5];
+      json_arena_init(&arena);
+      obs_test_true(json_str(
+          &it, "[{\"id\": 1, \"score\": 2.5, \"ok\": true, \"name\": \"a\","
+               " \"at\": {\"city\": \"x\", \"zip\": [1]}, \"junk\": {}},"
+               " {\"name\": \"b\\n\", \"id\": 2, \"score\": null, \"ok\": false},"
+               " {\"id\": 3, \"score\": 4, \"ok\": true, \"name\": null,"
+               " \"at\": {\"city\": \"yz\"}}]"));
+      obs_test_true(json_columns(&it, specs, 5, cols, &arena));
+      obs_test_eq(int, errno, 0);
+
+      const int64_t *ids = (const int64_t *)cols[0].values;
+      obs_test_eq(size_t, cols[0].len, 3);
+      obs_test_eq(long, (long)ids[0], 1);
+      obs_test_eq(long, (long)ids[2], 3);
+      obs_test_eq(int, cols[0].validity[0], 7);
+
+      const double *scores = (const double *)cols[1].values;
+      obs_test_eq(double, scores[0], 2.5);
+      obs_test_eq(double, scores[2], 4.0);
+      obs_test_eq(size_t, cols[1].null_count, 1);
+      obs_test_eq(int, cols[1].validity[0], 5);
+
+      /* bools are a bitmap too */
+      obs_test_eq(int, ((const uint8_t *)cols[2].values)[0], 5);
+      obs_test_eq(int, cols[2].validity[0], 7);
+
+      const int32_t *offsets = (const int32_t *)cols[3].values;
+      obs_test_eq(int, offsets[0], 0);
+      obs_test_eq(int, offsets[1], 1);
+      obs_test_eq(int, offsets[2], 3);
+      obs_test_eq(int, offsets[3], 3);
+      obs_test_true(memcmp(cols[3].data, "ab\n", 3) == 0);
+      obs_test_eq(int, cols[3].validity[0], 3);
+
+      /* the missing city is a valid empty string */
+      offsets = (const int32_t *)cols[4].values;
+      obs_test_eq(int, offsets[1], 1);
+      obs_test_eq(int, offsets[2], 1);
+      obs_test_eq(int, offsets[3], 3);
+      obs_test_eq(size_t, cols[4].null_count, 0);
+      obs_test_true(memcmp(cols[4].data, "xyz", 3) == 0);
+      json_arena_free(&arena);
+    })
+
+    OBS_TEST("Errors", {
+      static const JsonColumnSpec specs[] = {
+          {"id", JSON_COLUMN_I64, JSON_NULLS_ERROR},
+      };
+      JsonIt it;
+      JsonArena arena;
+      JsonColumn col;
+      json_arena_init(&arena);
+
+      obs_test_true(json_str(&it, "[{\"id\": 1}, {\"other\": 2}]"));
+      obs_test_false(json_columns(&it, specs, 1, &col, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+      obs_test_str_eq(it.err, "id is null or missing in row 1");
+
+      obs_test_true(json_str(&it, "[{\"id\": 1}, {\"id\": 1.5}]"));
+      obs_test_false(json_columns(&it, specs, 1, &col, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+      obs_test_str_eq(it.err, "Wrong type for id in row 1");
+
+      obs_test_true(json_str(&it, "[{\"id\": {\"a\": 1}}]"));
+      obs_test_false(json_columns(&it, specs, 1, &col, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+
+      obs_test_true(json_str(&it, "[{\"id\": 1}, 2]"));
+      obs_test_false(json_columns(&it, specs, 1, &col, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+
+      obs_test_true(json_str(&it, "{\"id\": 1}"));
+      obs_test_false(json_columns(&it, specs, 1, &col, &arena));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+
+      obs_test_true(json_str(&it, "[{\"x\": [1}, \"id\": 1}]"));
+      obs_test_false(json_columns(&it, specs, 1, &col, &arena));
+      obs_test_eq(int, errno, JSON_ERR_UNMATCHED_TOKENS);
+
+      obs_test_true(json_str(&it, "[]"));
+      obs_test_true(json_columns(&it, specs, 1, &col, &arena));
+      obs_test_eq(size_t, col.len, 0);
+      json_arena_free(&arena);
+    })
+
+    OBS_TEST("Generated", {
+      static const JsonColumnSpec specs[] = {
+          {"age", JSON_COLUMN_I64, JSON_NULLS_ERROR},
+          {"balance", JSON_COLUMN_STR, JSON_NULLS_ERROR},
+          {"isActive", JSON_COLUMN_BOOL, JSON_NULLS_ERROR},
+          {"latitude", JSON_COLUMN_F64, JSON_NULLS_ERROR},
+      };
+      FILE *file = fopen("generated.json", "r");
+      JsonIt it;
+      JsonArena arena;
+      JsonColumn cols[4];
+      obs_test_true(json_file(&it, file));
+      json_arena_init(&arena);
+      obs_test_true(json_columns(&it, specs, 4, cols, &arena));
+      obs_test_eq(size_t, cols[0].len, 209);
+      long age = 0;
+      size_t i;
+      for (i = 0; i < cols[0].len; i++) {
+        age += (long)((const int64_t *)cols[0].values)[i];
+      }
+      obs_test_eq(long, age, 6310);
+      obs_test_true(memcmp(cols[1].data, "$1,808.19", 9) == 0);
+      /* the first person isn't active */
+      obs_test_eq(int, ((const uint8_t *)cols[2].values)[0] & 1, 0);
+      obs_test_eq(double, ((const double *)cols[3].values)[0], 35.592234);
+      obs_test_true(((uintptr_t)cols[0].values & 63) == 0);
+      json_arena_free(&arena);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Number arrays", {
+    ;
+    OBS_TEST("Doubles", {
+      static const char *const nums[] = {
+          "0",     "-0",   "1.5",  "-2.25e3",           "12345678901234567",
+          "1e-10", "3E+2", "0.1",  "123456789.87654321", "1e300",
+          "-1e-300", "4.9e-324", "1_000", "12345678901234567890123", "1."};
+      char json[512] = "[";
+      size_t i;
+      for (i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+        strcat(json, nums[i]);
+        strcat(json, i + 1 < sizeof(nums) / sizeof(nums[0]) ? ", " : "]");
+      }
+
+      setup_str(json);
+      double *buf = NULL;
+      size_t cap = 0, len = 0;
+      expect_next_type(JSON_ARRAY);
+      obs_test_true(json_read_f64_array(&tok, &it, &buf, &cap, &len));
+      obs_test_eq(size_t, len, sizeof(nums) / sizeof(nums[0]));
+      obs_test_true(cap >= len);
+      for (i = 0; i < len - 3; i++) {
+        /* exactly what strtod gives */
+        obs_test_eq(double, buf[i], strtod(nums[i], NULL));
+      }
+      obs_test_eq(double, buf[12], 1000.0);
+      obs_test_eq(double, buf[13], 12345678901234567890123.0);
+      obs_test_eq(double, buf[14], 1.0);
+      expect_next_type(JSON_END);
+      free(buf);
+    })
+
+    OBS_TEST("Integers", {
+      setup_str("{\"a\": [1, -2, 123456789012345678, 9223372036854775807,"
+                " -9223372036854775808], \"b\": true}");
+      int64_t small[2];
+      int64_t *buf = malloc(sizeof(small));
+      size_t cap = 2, len = 0;
+      expect_next_type(JSON_OBJECT);
+      expect_next_key_only(JSON_ARRAY, "a");
+      obs_test_true(json_read_i64_array(&tok, &it, &buf, &cap, &len));
+      obs_test_eq(size_t, len, 5);
+      obs_test_true(buf[0] == 1);
+      obs_test_true(buf[1] == -2);
+      obs_test_true(buf[2] == 123456789012345678LL);
+      obs_test_true(buf[3] == INT64_MAX);
+      obs_test_true(buf[4] == INT64_MIN);
+      /* and json_next carries on after the array */
+      expect_next_obj_value(JSON_BOOL, "b", int, 1);
+      expect_next_type(JSON_OBJECT_END);
+      expect_next_type(JSON_END);
+      free(buf);
+    })
+
+    OBS_TEST("Errors", {
+      int64_t *buf = NULL;
+      size_t cap = 0, len = 0;
+      {
+        setup_str("[1, 2, \"3\"]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_false(json_read_i64_array(&tok, &it, &buf, &cap, &len));
+        obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+        obs_test_eq(size_t, len, 2);
+        obs_test_str_eq(it.err, "Expected an integer at index 2");
+      }
+      {
+        setup_str("[1, 2.5]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_false(json_read_i64_array(&tok, &it, &buf, &cap, &len));
+        obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+        obs_test_eq(size_t, len, 1);
+      }
+      {
+        setup_str("[9223372036854775808]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_false(json_read_i64_array(&tok, &it, &buf, &cap, &len));
+        obs_test_eq(int, errno, JSON_ERR_OUT_OF_RANGE);
+      }
+      {
+        setup_str("[1, null]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_false(
+            json_read_f64_array(&tok, &it, (double **)&buf, &cap, &len));
+        obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+        obs_test_eq(size_t, len, 1);
+      }
+      {
+        setup_str("[1, 2");
+        expect_next_type(JSON_ARRAY);
+        obs_test_false(
+            json_read_f64_array(&tok, &it, (double **)&buf, &cap, &len));
+        obs_test_eq(int, errno, JSON_ERR_UNMATCHED_TOKENS);
+      }
+      {
+        setup_str("{\"a\": 1}");
+        expect_next_type(JSON_OBJECT);
+        obs_test_false(
+            json_read_f64_array(&tok, &it, (double **)&buf, &cap, &len));
+        obs_test_eq(int, errno, JSON_ERR_INVALID_ARGS);
+        json_destroy(&tok, &it);
+      }
+      free(buf);
+    })
+
+    OBS_TEST("Matrices", {
+      double *buf = NULL;
+      size_t cap = 0, rows, width;
+      {
+        setup_str("[[1, 2, 3], [4, 5, 6.5],\n [], [7, 8, 9]]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_false(
+            json_read_f64_matrix(&tok, &it, &buf, &cap, &rows, &width));
+        obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+        obs_test_eq(size_t, rows, 2);
+        obs_test_eq(size_t, width, 0);
+      }
+      {
+        setup_str("[[1, 2, 3], [4, 5, 6.5], [7, 8, 9]]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_true(
+            json_read_f64_matrix(&tok, &it, &buf, &cap, &rows, &width));
+        obs_test_eq(size_t, rows, 3);
+        obs_test_eq(size_t, width, 3);
+        obs_test_eq(double, buf[5], 6.5);
+        obs_test_eq(double, buf[8], 9.0);
+        expect_next_type(JSON_END);
+      }
+      {
+        int64_t *ints = NULL;
+        setup_str("[[1, 2], [3, true]]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_false(
+            json_read_i64_matrix(&tok, &it, &ints, &cap, &rows, &width));
+        obs_test_eq(size_t, rows, 1);
+        obs_test_eq(size_t, width, 1);
+        obs_test_str_eq(it.err, "Expected an integer at [1][1]");
+        free(ints);
+      }
+      {
+        setup_str("[]");
+        expect_next_type(JSON_ARRAY);
+        obs_test_true(
+            json_read_f64_matrix(&tok, &it, &buf, &cap, &rows, &width));
+        obs_test_eq(size_t, rows, 0);
+        obs_test_eq(size_t, width, 0);
+      }
+      free(buf);
+    })
+
+    OBS_TEST("Files", {
+      /* numbers get split across reads */
+      FILE *file = tmpfile();
+      long i;
+      fputs("[", file);
+      for (i = 0; i < 10000; i++) {
+        fprintf(file, "%s%s%ld.25", i > 0 ? "," : "", (i & 1) ? "-" : "",
+                i * 7919);
+      }
+      fputs("]", file);
+      rewind(file);
+
+      JsonIt it;
+      JsonTok tok;
+      double *buf = NULL;
+      size_t cap = 0, len = 0;
+      obs_test_true(json_file(&it, file));
+      expect_next_type(JSON_ARRAY);
+      obs_test_true(json_read_f64_array(&tok, &it, &buf, &cap, &len));
+      obs_test_eq(size_t, len, 10000);
+      int all = 1;
+      for (i = 0; i < 10000; i++) {
+        double expected = (double)(i * 7919) + 0.25;
+        all &= buf[i] == ((i & 1) ? -expected : expected);
+      }
+      obs_test_true(all);
+      expect_next_type(JSON_END);
+      free(buf);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Tape", {
+    ;
+    OBS_TEST("Navigation", {
+      JsonIt it;
+      JsonTape tape;
+      json_tape_init(&tape);
+      obs_test_true(json_str(&it, "{\"a\": [1, -2.5, \"x\", true, null, {}],"
+                                  " \"b\": {\"c\": \"x\"}, \"d\": false}"));
+      obs_test_true(json_tape_build(&it, &tape));
+      obs_test_eq(int, json_tape_type(&tape, 0), JSON_OBJECT);
+      obs_test_eq(size_t, json_tape_len(&tape, 0), 3);
+      obs_test_eq(size_t, json_tape_next(&tape, 0), tape.len);
+
+      size_t a = json_tape_get(&tape, 0, "a");
+      obs_test_eq(int, json_tape_type(&tape, a), JSON_ARRAY);
+      obs_test_eq(size_t, json_tape_len(&tape, a), 6);
+      obs_test_eq(long, (long)json_tape_int(&tape, json_tape_at(&tape, a, 0)),
+                  1);
+      obs_test_eq(double, json_tape_flt(&tape, json_tape_at(&tape, a, 1)),
+                  -2.5);
+      size_t len;
+      obs_test_str_eq(json_tape_str(&tape, json_tape_at(&tape, a, 2), &len),
+                      "x");
+      obs_test_true(json_tape_bool(&tape, json_tape_at(&tape, a, 3)));
+      obs_test_eq(int, json_tape_type(&tape, json_tape_at(&tape, a, 4)),
+                  JSON_NULL);
+      size_t empty = json_tape_at(&tape, a, 5);
+      obs_test_eq(int, json_tape_type(&tape, empty), JSON_OBJECT);
+      obs_test_eq(size_t, json_tape_child(&tape, empty), 0);
+      obs_test_eq(size_t, json_tape_at(&tape, a, 6), 0);
+
+      size_t c = json_tape_get(&tape, json_tape_get(&tape, 0, "b"), "c");
+      /* the same string is only stored once */
+      obs_test_true(tape.words[c] == tape.words[json_tape_at(&tape, a, 2)]);
+      obs_test_false(json_tape_bool(&tape, json_tape_get(&tape, 0, "d")));
+      obs_test_eq(size_t, json_tape_get(&tape, 0, "e"), 0);
+
+      /* walking the members */
+      size_t key = json_tape_child(&tape, 0);
+      obs_test_str_eq(json_tape_str(&tape, key, &len), "a");
+      key = json_tape_next(&tape, key + 1);
+      obs_test_str_eq(json_tape_str(&tape, key, &len), "b");
+      json_tape_free(&tape);
+      obs_test_eq(size_t, tape.len, 0);
+    })
+
+    OBS_TEST("Errors", {
+      JsonIt it;
+      JsonTape tape;
+      json_tape_init(&tape);
+      obs_test_true(json_str(&it, "[1, {\"a\": }]"));
+      obs_test_false(json_tape_build(&it, &tape));
+      obs_test_true(errno != 0);
+      obs_test_eq(size_t, tape.len, 0);
+      obs_test_true(tape.own_words == NULL);
+    })
+
+    OBS_TEST("Write and load", {
+      JsonTape tape;
+      json_tape_init(&tape);
+      FILE *file = fopen("generated.json", "r");
+      JsonIt it;
+      obs_test_true(json_file(&it, file));
+      obs_test_true(json_tape_build(&it, &tape));
+      fclose(file);
+
+      file = fopen("generated.tape", "wb");
+      obs_test_true(json_tape_write(&tape, file));
+      fclose(file);
+
+      JsonTape mapped;
+      obs_test_true(json_tape_map(&mapped, "generated.tape", 1));
+      obs_test_eq(size_t, mapped.len, tape.len);
+      obs_test_true(memcmp(mapped.words, tape.words,
+                           tape.len * sizeof(uint64_t)) == 0);
+      obs_test_eq(size_t, json_tape_len(&mapped, 0), 209);
+      long age = 0;
+      size_t person = json_tape_child(&mapped, 0);
+      while (person != 0 && person < mapped.len) {
+        age += (long)json_tape_int(&mapped, json_tape_get(&mapped, person,
+                                                         "age"));
+        person = json_tape_next(&mapped, person);
+      }
+      obs_test_eq(long, age, 6310);
+      size_t len;
+      obs_test_str_eq(
+          json_tape_str(&mapped,
+                        json_tape_get(&mapped, json_tape_at(&mapped, 0, 0),
+                                      "name"),
+                        &len),
+          "Beatrice Barr");
+
+      /* loading from memory, any flipped bit fails the checksum */
+      uint64_t *buf = malloc(mapped.file_len);
+      memcpy(buf, mapped.file, mapped.file_len);
+      JsonTape loaded;
+      obs_test_true(json_tape_load(&loaded, buf, mapped.file_len, 1));
+      ((char *)buf)[mapped.file_len - 3] ^= 1;
+      obs_test_true(json_tape_load(&loaded, buf, mapped.file_len, 0));
+      obs_test_false(json_tape_load(&loaded, buf, mapped.file_len, 1));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+      ((char *)buf)[mapped.file_len - 3] ^= 1;
+      /* a different version isn't loaded at all */
+      ((uint32_t *)buf)[2]++;
+      obs_test_false(json_tape_load(&loaded, buf, mapped.file_len, 0));
+      ((uint32_t *)buf)[2]--;
+      obs_test_false(json_tape_load(&loaded, buf, 40, 0));
+      free(buf);
+
+      json_tape_free(&mapped);
+      json_tape_free(&tape);
+      remove("generated.tape");
+      obs_test_false(json_tape_map(&mapped, "generated.tape", 0));
+    })
+
+    OBS_TEST("Verify", {
+      JsonIt it;
+      JsonTape tape;
+      json_tape_init(&tape);
+      obs_test_true(json_str(&it, "{\"a\": [1, \"b\"], \"c\": {\"d\": 2.5}}"));
+      obs_test_true(json_tape_build(&it, &tape));
+      obs_test_true(json_internal_tape_verify(&tape));
+
+      /* a size that runs past its parent */
+      uint64_t *words = tape.own_words;
+      uint64_t saved = words[3];
+      words[3] += 1;
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[3] = saved;
+      /* a key that isn't a string */
+      saved = words[2];
+      words[2] = WHY_JSON_TAPE_WORD(JSON_NULL, 0);
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[2] = saved;
+      /* a string outside of the pool */
+      words[2] = WHY_JSON_TAPE_WORD(JSON_STRING, tape.pool_len);
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[2] = saved;
+      obs_test_true(json_internal_tape_verify(&tape));
+      json_tape_free(&tape);
+    })
+  })
+
+  OBS_TEST_GROUP("Tape dedup", {
+    ;
+    OBS_TEST("Sharing", {
+      const char *json = "[{\"a\": [1, 2]}, {\"a\": [1, 2]}, [1, 2],"
+                         " {\"a\": [1, 2], \"b\": {}}, {}, [1, 2.5]]";
+      JsonIt it;
+      JsonTape plain, tape;
+      json_tape_init(&plain);
+      obs_test_true(json_str(&it, json));
+      obs_test_true(json_tape_build(&it, &plain));
+      json_tape_init(&tape);
+      tape.flags = JSON_TAPE_DEDUP;
+      obs_test_true(json_str(&it, json));
+      obs_test_true(json_tape_build(&it, &tape));
+
+      obs_test_eq(size_t, plain.shared_nodes, 0);
+      obs_test_eq(double, json_tape_dedup_ratio(&plain), 1);
+      obs_test_eq(size_t, tape.shared_nodes, 5);
+      obs_test_eq(size_t, tape.len + tape.shared_words, plain.len);
+      obs_test_true(json_tape_dedup_ratio(&tape) > 1);
+      obs_test_true(json_internal_tape_verify(&tape));
+
+      /* navigation doesn't change */
+      obs_test_eq(size_t, json_tape_len(&tape, 0), 6);
+      size_t second = json_tape_at(&tape, 0, 1);
+      obs_test_eq(int, json_tape_type(&tape, second), JSON_OBJECT);
+      size_t a = json_tape_get(&tape, second, "a");
+      obs_test_eq(int, json_tape_type(&tape, a), JSON_ARRAY);
+      obs_test_eq(size_t, json_tape_len(&tape, a), 2);
+      obs_test_eq(long, (long)json_tape_int(&tape, json_tape_at(&tape, a, 1)),
+                  2);
+      size_t key = json_tape_child(&tape, second);
+      size_t len;
+      obs_test_str_eq(json_tape_str(&tape, key, &len), "a");
+      size_t fourth = json_tape_at(&tape, 0, 3);
+      /* a shared value is a single word */
+      size_t shared = json_tape_get(&tape, fourth, "a");
+      obs_test_eq(size_t, json_tape_next(&tape, shared), shared + 1);
+      obs_test_str_eq(json_tape_str(&tape, shared + 1, &len), "b");
+      obs_test_eq(int, json_tape_type(&tape, json_tape_get(&tape, fourth, "b")),
+                  JSON_OBJECT);
+      obs_test_eq(size_t, json_tape_len(&tape, json_tape_at(&tape, 0, 4)), 0);
+      obs_test_eq(double,
+                  json_tape_flt(&tape, json_tape_at(&tape,
+                                                    json_tape_at(&tape, 0, 5),
+                                                    1)),
+                  2.5);
+
+      /* a shared node can only point back at a finished object / array */
+      uint64_t *words = tape.own_words;
+      size_t ref = json_tape_at(&tape, 0, 2);
+      uint64_t saved = words[ref];
+      words[ref] = WHY_JSON_TAPE_WORD(WHY_JSON_TAPE_REF, 0);
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[ref] = WHY_JSON_TAPE_WORD(WHY_JSON_TAPE_REF, 3);
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[ref] = WHY_JSON_TAPE_WORD(WHY_JSON_TAPE_REF, ref + 1);
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[ref] = saved;
+      obs_test_true(json_internal_tape_verify(&tape));
+
+      json_tape_free(&plain);
+      json_tape_free(&tape);
+    })
+
+    OBS_TEST("Index out of memory", {
+      /* [{"k000": null, ..., "k399": null}, 1] fits in the first 1024 words
+         until the object is indexed */
+      char json[8192];
+      size_t pos = 0;
+      int i;
+      json[pos++] = '[';
+      json[pos++] = '{';
+      for (i = 0; i < 400; i++) {
+        pos += (size_t)snprintf(json + pos, sizeof(json) - pos,
+                                "%s\"k%03d\": null", i > 0 ? ", " : "", i);
+      }
+      snprintf(json + pos, sizeof(json) - pos, "}, 1]");
+
+      JsonIt it;
+      JsonTape tape;
+      json_tape_init(&tape);
+      tape.flags = JSON_TAPE_DEDUP;
+      tape.index_min = 1;
+      obs_test_true(json_str(&it, json));
+      test_realloc_limit = 1024 * sizeof(uint64_t);
+      obs_test_false(json_tape_build(&it, &tape));
+      test_realloc_limit = 0;
+      obs_test_eq(int, errno, JSON_ERR_OOM);
+      obs_test_str_eq(it.err, "Out of memory");
+      obs_test_eq(size_t, tape.len, 0);
+
+      /* and it builds once there is room */
+      json_tape_init(&tape);
+      tape.flags = JSON_TAPE_DEDUP;
+      tape.index_min = 1;
+      obs_test_true(json_str(&it, json));
+      obs_test_true(json_tape_build(&it, &tape));
+      obs_test_eq(size_t, json_tape_len(&tape, json_tape_child(&tape, 0)), 400);
+      json_tape_free(&tape);
+    })
+
+    OBS_TEST("Generated", {
+      JsonTape plain, tape;
+      json_tape_init(&plain);
+      json_tape_init(&tape);
+      tape.flags = JSON_TAPE_DEDUP;
+      FILE *file = fopen("generated.json", "r");
+      JsonIt it;
+      obs_test_true(json_file(&it, file));
+      obs_test_true(json_tape_build(&it, &plain));
+      rewind(file);
+      obs_test_true(json_file(&it, file));
+      obs_test_true(json_tape_build(&it, &tape));
+      fclose(file);
+      obs_test_eq(size_t, tape.len + tape.shared_words, plain.len);
+
+      long age = 0, friends = 0;
+      size_t person = json_tape_child(&tape, 0);
+      while (person != 0 && person < tape.len) {
+        age += (long)json_tape_int(&tape, json_tape_get(&tape, person, "age"));
+        friends += (long)json_tape_len(&tape,
+                                       json_tape_get(&tape, person, "friends"));
+        person = json_tape_next(&tape, person);
+      }
+      obs_test_eq(long, age, 6310);
+      obs_test_eq(long, friends, 209 * 3);
+
+      /* the counts survive being written out */
+      file = fopen("generated_dedup.tape", "wb");
+      obs_test_true(json_tape_write(&tape, file));
+      fclose(file);
+      JsonTape mapped;
+      obs_test_true(json_tape_map(&mapped, "generated_dedup.tape", 1));
+      obs_test_eq(size_t, mapped.shared_words, tape.shared_words);
+      obs_test_eq(double, json_tape_dedup_ratio(&mapped),
+                  json_tape_dedup_ratio(&tape));
+      json_tape_free(&mapped);
+      remove("generated_dedup.tape");
+      json_tape_free(&plain);
+      json_tape_free(&tape);
+    })
+  })
+
+  OBS_TEST_GROUP("Tape index", {
+    ;
+    OBS_TEST("Lookups", {
+      /* [{"k0": 0, ..., "k99": 99}, {"k0": 0, ...}, "end"] */
+      char json[4096];
+      size_t pos = 0;
+      int copy, i;
+      json[pos++] = '[';
+      for (copy = 0; copy < 2; copy++) {
+        json[pos++] = '{';
+        for (i = 0; i < 100; i++) {
+          pos += (size_t)snprintf(json + pos, sizeof(json) - pos,
+                                  "%s\"k%d\": %d", i > 0 ? ", " : "", i, i);
+        }
+        pos += (size_t)snprintf(json + pos, sizeof(json) - pos, "}, ");
+      }
+      snprintf(json + pos, sizeof(json) - pos, "\"end\"]");
+
+      JsonIt it;
+      JsonTape plain, tape;
+      json_tape_init(&plain);
+      plain.index_min = 1000;
+      obs_test_true(json_str(&it, json));
+      obs_test_true(json_tape_build(&it, &plain));
+      json_tape_init(&tape);
+      obs_test_true(json_str(&it, json));
+      obs_test_true(json_tape_build(&it, &tape));
+      obs_test_true(json_internal_tape_verify(&tape));
+      obs_test_true(json_internal_tape_verify(&plain));
+
+      size_t obj = json_tape_at(&tape, 0, 1);
+      obs_test_true((tape.words[obj + 1] & WHY_JSON_TAPE_INDEXED) != 0);
+      obs_test_false((plain.words[json_tape_at(&plain, 0, 1) + 1] &
+                      WHY_JSON_TAPE_INDEXED) != 0);
+      obs_test_eq(size_t, json_tape_len(&tape, obj), 100);
+      int found = 0;
+      for (i = 0; i < 100; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "k%d", i);
+        found += json_tape_int(&tape, json_tape_get(&tape, obj, key)) == i &&
+                 json_tape_int(&plain,
+                               json_tape_get(&plain, json_tape_at(&plain, 0, 1),
+                                             key)) == i;
+      }
+      obs_test_eq(int, found, 100);
+      obs_test_eq(size_t, json_tape_get(&tape, obj, "k100"), 0);
+      obs_test_eq(size_t, json_tape_get(&tape, obj, ""), 0);
+      size_t len;
+      obs_test_str_eq(json_tape_str(&tape, json_tape_at(&tape, 0, 2), &len),
+                      "end");
+      obs_test_eq(size_t, json_tape_next(&tape, 0), tape.len);
+
+      /* a slot pointing at something that isn't one of the keys */
+      uint64_t *words = tape.own_words;
+      size_t end = json_tape_next(&tape, obj);
+      size_t slots = (size_t)words[end - 1];
+      obs_test_eq(size_t, slots, 256);
+      size_t i_word = end - 1 - slots / 2;
+      while (words[i_word] == 0) {
+        i_word++;
+      }
+      uint64_t saved = words[i_word];
+      words[i_word] += 1;
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[i_word] = 0;
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[i_word] = saved;
+      /* a slot count that doesn't fit */
+      words[end - 1] = 512;
+      obs_test_false(json_internal_tape_verify(&tape));
+      words[end - 1] = slots;
+      obs_test_true(json_internal_tape_verify(&tape));
+
+      json_tape_free(&plain);
+      json_tape_free(&tape);
+
+      /* the copy is still shared */
+      json_tape_init(&tape);
+      tape.flags = JSON_TAPE_DEDUP;
+      obs_test_true(json_str(&it, json));
+      obs_test_true(json_tape_build(&it, &tape));
+      obs_test_eq(size_t, tape.shared_nodes, 1);
+      obs_test_eq(long,
+                  (long)json_tape_int(
+                      &tape, json_tape_get(&tape, json_tape_at(&tape, 0, 1),
+                                           "k42")),
+                  42);
+      obs_test_true(json_internal_tape_verify(&tape));
+      json_tape_free(&tape);
+    })
+
+    OBS_TEST("Duplicate keys", {
+      JsonIt it;
+      JsonTape tape;
+      json_tape_init(&tape);
+      tape.index_min = 1;
+      obs_test_true(json_str(&it, "{\"a\": 1, \"b\": {\"c\": true}, \"a\": 2}"));
+      obs_test_true(json_tape_build(&it, &tape));
+      obs_test_true((tape.words[1] & WHY_JSON_TAPE_INDEXED) != 0);
+      /* the first one wins like it does without an index */
+      obs_test_eq(long, (long)json_tape_int(&tape, json_tape_get(&tape, 0, "a")),
+                  1);
+      obs_test_true(json_tape_bool(
+          &tape, json_tape_get(&tape, json_tape_get(&tape, 0, "b"), "c")));
+      obs_test_true(json_internal_tape_verify(&tape));
+
+      FILE *file = fopen("index.tape", "wb");
+      obs_test_true(json_tape_write(&tape, file));
+      fclose(file);
+      JsonTape mapped;
+      obs_test_true(json_tape_map(&mapped, "index.tape", 1));
+      obs_test_eq(long,
+                  (long)json_tape_int(&mapped, json_tape_get(&mapped, 0, "a")),
+                  1);
+      json_tape_free(&mapped);
+      remove("index.tape");
+      json_tape_free(&tape);
+    })
+  })
+
+  OBS_TEST_GROUP("Raw spans", {
+    ;
+    OBS_TEST("Strings", {
+      const char *json = "{\"a\": 1, \"payload\": {\"x\": [1, {\"y\": \"}\"}],"
+                         " \"z\": \"\\\"]\"}, \"b\" : [true, null], "
+                         "\"c\": \"str\"}";
+      setup_str(json);
+      JsonSpan span;
+      it.flags |= JSON_FLAG_SPANS;
+      expect_next_type(JSON_OBJECT);
+      obs_test_eq(size_t, it.span.begin, 0);
+      obs_test_eq(size_t, it.span.end, 0);
+      expect_next_obj_value(JSON_INT, "a", long, 1);
+      obs_test_eq(size_t, it.span.end - it.span.begin, 1);
+      obs_test_eq(char, json[it.span.begin], '1');
+
+      expect_next_key_only(JSON_OBJECT, "payload");
+      obs_test_true(json_skip_raw(&tok, &it, &span));
+      obs_test_eq(int, tok.type, JSON_OBJECT_END);
+      obs_test_eq(size_t, span.end - span.begin, 34);
+      obs_test_true(strncmp(json + span.begin,
+                            "{\"x\": [1, {\"y\": \"}\"}], \"z\": \"\\\"]\"}",
+                            34) == 0);
+
+      expect_next_key_only(JSON_ARRAY, "b");
+      obs_test_true(json_skip_raw(&tok, &it, &span));
+      obs_test_true(strncmp(json + span.begin, "[true, null]", 12) == 0);
+      obs_test_eq(size_t, span.end - span.begin, 12);
+
+      /* scalars just give where json_next found them */
+      expect_next_obj_string("c", "str");
+      obs_test_true(json_skip_raw(&tok, &it, &span));
+      obs_test_eq(size_t, span.begin, strlen(json) - 6);
+      obs_test_eq(size_t, span.end, strlen(json) - 1);
+
+      expect_next_type(JSON_OBJECT_END);
+      obs_test_eq(size_t, it.span.begin, strlen(json) - 1);
+      obs_test_eq(size_t, it.span.end, strlen(json));
+      expect_next_type(JSON_END);
+    })
+
+    OBS_TEST("Without spans", {
+      setup_str("[[1, [2]], 3, {}]");
+      JsonSpan span;
+      expect_next_type(JSON_ARRAY);
+      expect_next_type(JSON_ARRAY);
+      obs_test_true(json_skip_raw(&tok, &it, &span));
+      obs_test_eq(size_t, span.begin, 1);
+      obs_test_eq(size_t, span.end, 9);
+      expect_next_array_value(JSON_INT, long, 3);
+      obs_test_false(json_skip_raw(&tok, &it, &span));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_ARGS);
+      errno = 0;
+      expect_next_type(JSON_OBJECT);
+      obs_test_true(json_skip_raw(&tok, &it, &span));
+      obs_test_eq(size_t, span.begin, 14);
+      obs_test_eq(size_t, span.end, 16);
+      expect_next_type(JSON_ARRAY_END);
+      expect_next_type(JSON_END);
+
+      /* skipping the whole document */
+      obs_test_true(json_str(&it, " [1, {\"a\": [}]"));
+      expect_next_type(JSON_ARRAY);
+      obs_test_false(json_skip_raw(&tok, &it, &span));
+      obs_test_eq(int, errno, JSON_ERR_UNMATCHED_TOKENS);
+    })
+
+    OBS_TEST("Files", {
+      /* the same spans whether it's read from a file or a string */
+      FILE *file = fopen("generated.json", "rb");
+      fseek(file, 0, SEEK_END);
+      size_t len = (size_t)ftell(file);
+      fseek(file, 0, SEEK_SET);
+      char *buf = malloc(len + 1);
+      obs_test_eq(size_t, fread(buf, 1, len, file), len);
+      buf[len] = '\0';
+      fseek(file, 0, SEEK_SET);
+
+      JsonIt str_it, file_it;
+      JsonTok str_tok, file_tok;
+      JsonSpan str_span, file_span;
+      errno = 0;
+      obs_test_true(json_str(&str_it, buf));
+      obs_test_true(json_file(&file_it, file));
+      str_it.flags |= JSON_FLAG_SPANS;
+      file_it.flags |= JSON_FLAG_SPANS;
+      int records = 0, same = 0, braces = 0;
+      while (json_next(&file_tok, &file_it) && file_tok.type != JSON_END) {
+        obs_test_true(json_next(&str_tok, &str_it));
+        same += str_it.span.begin == file_it.span.begin &&
+                str_it.span.end == file_it.span.end;
+        if (file_tok.type == JSON_OBJECT && file_it.depth == 1) {
+          obs_test_true(json_skip_raw(&str_tok, &str_it, &str_span));
+          obs_test_true(json_skip_raw(&file_tok, &file_it, &file_span));
+          same += str_span.begin == file_span.begin &&
+                  str_span.end == file_span.end;
+          braces += buf[file_span.begin] == '{' &&
+                    buf[file_span.end - 1] == '}';
+          records++;
+        }
+      }
+      obs_test_eq(int, errno, 0);
+      obs_test_eq(int, records, 209);
+      obs_test_eq(int, braces, 209);
+      obs_test_eq(int, same, 209 * 2 + 2);
+      obs_test_eq(size_t, file_it.span.end, len - 1);
+      free(buf);
+      fclose(file);
+    })
+  })
+
+  OBS_TEST_GROUP("Transform", {
+    ;
+    OBS_TEST("Rules", {
+      static const JsonTransformRule rules[] = {
+          {"user.password", JSON_TRANSFORM_DROP, NULL},
+          {"old", JSON_TRANSFORM_RENAME, "new"},
+          {"id", JSON_TRANSFORM_REPLACE, "8"},
+          {"user.ts", JSON_TRANSFORM_INSERT, "123"},
+      };
+      char buf[512];
+      obs_test_true(transform_str(
+          "{\"id\": 7, \"user\": {\"name\": \"Bob\", \"password\": \"hunter2\","
+          " \"tags\": [\"a\", \"b\"]}, \"payload\": {\"big\": [1, 2.50, "
+          "{\"x\": null}]}, \"old\": true}",
+          rules, 4, buf, sizeof(buf)));
+      /* untouched values are copied as they were (spaces and all) */
+      obs_test_str_eq(buf, "{\"id\":8,\"user\":{\"name\":\"Bob\",\"tags\":"
+                           "[\"a\", \"b\"],\"ts\":123},\"payload\":{\"big\": "
+                           "[1, 2.50, {\"x\": null}]},\"new\":true}");
+
+      /* nothing to do is a straight copy */
+      obs_test_true(transform_str("  {\"a\" : [1, 2]}\n", rules, 0, buf,
+                                  sizeof(buf)));
+      obs_test_str_eq(buf, "{\"a\" : [1, 2]}");
+      obs_test_true(transform_str("\"str\"", rules, 4, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "\"str\"");
+    })
+
+    OBS_TEST("Wildcards", {
+      static const JsonTransformRule rules[] = {
+          {"*.a", JSON_TRANSFORM_DROP, NULL},
+          {"*.c.*", JSON_TRANSFORM_REPLACE, "0"},
+          {"*.c.*", JSON_TRANSFORM_RENAME, "unused"},
+          {"*.d", JSON_TRANSFORM_INSERT, "{}"},
+          {"*.b", JSON_TRANSFORM_RENAME, "quote\"d"},
+      };
+      char buf[512];
+      obs_test_true(transform_str("[{\"a\": 1, \"b\": 2}, {\"a\": 3, "
+                                  "\"c\": {\"a\": 4, \"e\": [5]}}, [6]]",
+                                  rules, 5, buf, sizeof(buf)));
+      /* the first rule that matches wins, arrays don't get inserts */
+      obs_test_str_eq(buf, "[{\"quote\\\"d\":2,\"d\":{}},"
+                           "{\"c\":{\"a\":0,\"e\":0},\"d\":{}},[6]]");
+    })
+
+    OBS_TEST("Escaped keys", {
+      static const JsonTransformRule rules[] = {
+          {"a\\.b", JSON_TRANSFORM_DROP, NULL},
+          {"\\*", JSON_TRANSFORM_REPLACE, "0"},
+          {"c\\\\", JSON_TRANSFORM_RENAME, "c"},
+          {"a.d\\.e", JSON_TRANSFORM_INSERT, "1"},
+      };
+      char buf[512];
+      obs_test_true(transform_str("{\"a.b\": 1, \"a\": {\"b\": 2}, \"*\": 3,"
+                                  " \"x\": 4, \"c\\\\\": 5}",
+                                  rules, 4, buf, sizeof(buf)));
+      /* "a.b" is one key so a.b (nested) isn't touched and * is a key */
+      obs_test_str_eq(buf, "{\"a\":{\"b\":2,\"d.e\":1},\"*\":0,\"x\":4,"
+                           "\"c\":5}");
+
+      /* the nested path doesn't match the key with a . in it */
+      static const JsonTransformRule nested[] = {
+          {"a.b", JSON_TRANSFORM_DROP, NULL},
+      };
+      obs_test_true(transform_str("{\"a.b\": 1, \"a\": {\"b\": 2}}", nested, 1,
+                                  buf, sizeof(buf)));
+      obs_test_str_eq(buf, "{\"a.b\":1,\"a\":{}}");
+    })
+
+    OBS_TEST("Errors", {
+      static const JsonTransformRule rules[] = {
+          {"a", JSON_TRANSFORM_DROP, NULL},
+      };
+      char buf[512];
+      obs_test_false(transform_str("{\"a\": [1, }", rules, 1, buf,
+                                   sizeof(buf)));
+      obs_test_true(errno != 0);
+      obs_test_false(transform_str("{\"b\": [1, }", rules, 1, buf,
+                                   sizeof(buf)));
+      obs_test_true(errno != 0);
+      JsonIt it;
+      obs_test_true(json_str(&it, "{}"));
+      obs_test_false(json_transform(&it, rules, 1, NULL));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_ARGS);
+
+      /* paths that don't fit aren't copied without the rules */
+      char json[1024];
+      size_t pos = 0;
+      json[pos++] = '{';
+      json[pos++] = '"';
+      memset(json + pos, 'k', WHY_JSON_TRANSFORM_MAX_PATH);
+      pos += WHY_JSON_TRANSFORM_MAX_PATH;
+      snprintf(json + pos, sizeof(json) - pos, "\": 1, \"a\": 2}");
+      obs_test_false(transform_str(json, rules, 1, buf, sizeof(buf)));
+      obs_test_eq(int, errno, JSON_ERR_TOO_LONG);
+      /* one short of it is fine */
+      json[WHY_JSON_TRANSFORM_MAX_PATH + 1] = '"';
+      json[WHY_JSON_TRANSFORM_MAX_PATH + 2] = ':';
+      json[WHY_JSON_TRANSFORM_MAX_PATH + 3] = ' ';
+      obs_test_true(transform_str(json, rules, 1, buf, sizeof(buf)));
+      obs_test_eq(size_t, strlen(buf), WHY_JSON_TRANSFORM_MAX_PATH + 5);
+
+      /* *.*.(...) 129 levels of arrays each in the last */
+      static char deep_path[WHY_JSON_TRANSFORM_MAX_PATH + 8];
+      pos = 0;
+      while (pos + 2 < sizeof(deep_path)) {
+        deep_path[pos++] = '*';
+        deep_path[pos++] = '.';
+      }
+      deep_path[pos - 1] = '\0';
+      const JsonTransformRule deep[] = {
+          {deep_path, JSON_TRANSFORM_REPLACE, "0"},
+      };
+      int levels, i;
+      for (levels = WHY_JSON_TRANSFORM_MAX_PATH / 2 + 1;
+           levels >= WHY_JSON_TRANSFORM_MAX_PATH / 2; levels--) {
+        for (i = 0; i < levels; i++) {
+          json[i] = '[';
+          json[levels + i] = ']';
+        }
+        json[levels * 2] = '\0';
+        int ok = transform_str(json, deep, 1, buf, sizeof(buf));
+        obs_test_eq(int, ok, levels == WHY_JSON_TRANSFORM_MAX_PATH / 2);
+        obs_test_eq(int, errno, ok ? 0 : JSON_ERR_TOO_DEEP);
+      }
+      obs_test_str_eq(buf, json);
+    })
+
+    OBS_TEST("Files", {
+      static const JsonTransformRule rules[] = {
+          {"*.friends", JSON_TRANSFORM_DROP, NULL},
+          {"*.balance", JSON_TRANSFORM_REPLACE, "\"$0\""},
+          {"*.isActive", JSON_TRANSFORM_RENAME, "active"},
+      };
+      FILE *in = fopen("generated.json", "rb");
+      FILE *out = tmpfile();
+      JsonIt it;
+      errno = 0;
+      obs_test_true(json_file(&it, in));
+      obs_test_true(json_transform(&it, rules, 3, out));
+
+      /* read it back */
+      rewind(out);
+      obs_test_true(json_file(&it, out));
+      JsonTok tok;
+      JsonSpan span;
+      long age = 0;
+      int records = 0, friends = 0, balances = 0, active = 0;
+      while (json_next(&tok, &it) && tok.type != JSON_END) {
+        if (it.depth != 2) {
+          continue;
+        }
+        records += strcmp(tok.key.buf, "index") == 0;
+        friends += strcmp(tok.key.buf, "friends") == 0;
+        balances += tok.type == JSON_STRING &&
+                    strcmp(tok.key.buf, "balance") == 0 &&
+                    strcmp(tok.value._str.buf, "$0") == 0;
+        active += tok.type == JSON_BOOL && strcmp(tok.key.buf, "active") == 0;
+        if (tok.type == JSON_INT && strcmp(tok.key.buf, "age") == 0) {
+          age += tok.value._int;
+        }
+        if (tok.type == JSON_OBJECT || tok.type == JSON_ARRAY) {
+          json_skip_raw(&tok, &it, &span);
+        }
+      }
+      obs_test_eq(int, errno, 0);
+      obs_test_eq(int, records, 209);
+      obs_test_eq(int, friends, 0);
+      obs_test_eq(int, balances, 209);
+      obs_test_eq(int, active, 209);
+      obs_test_eq(long, age, 6310);
+      fclose(out);
+
+      /* with no rules it's the same bytes */
+      rewind(in);
+      out = tmpfile();
+      obs_test_true(json_file(&it, in));
+      obs_test_true(json_transform(&it, rules, 0, out));
+      rewind(in);
+      rewind(out);
+      int a, b, same = 1;
+      while ((b = getc(out)) != EOF) {
+        a = getc(in);
+        same &= a == b;
+      }
+      obs_test_true(same);
+      /* everything but the trailing newline */
+      obs_test_eq(int, getc(in), '\n');
+      obs_test_eq(int, getc(in), EOF);
+      fclose(out);
+      fclose(in);
+    })
+  })
+
+  OBS_TEST_GROUP("JSONPath", {
+    ;
+    OBS_TEST("Compile", {
+      JsonPath path;
+      JsonErrInfo info;
+      obs_test_true(json_path_compile(&path, "$", &info));
+      obs_test_eq(int, path.n, 0);
+      json_path_free(&path);
+
+      obs_test_true(json_path_compile(
+          &path, "$..friends[?(@.id >= 1.5)]['na.me'][1:10:2][3][*]", &info));
+      obs_test_eq(int, path.n, 6);
+      obs_test_true(path.steps[0].recursive);
+      obs_test_str_eq(path.steps[0].key, "friends");
+      obs_test_eq(int, path.steps[1].type, JSON_PATH_FILTER);
+      obs_test_eq(int, path.steps[1].op, JSON_PATH_GE);
+      obs_test_str_eq(path.steps[1].key, "id");
+      obs_test_true(path.steps[1].num == 1.5);
+      obs_test_str_eq(path.steps[2].key, "na.me");
+      obs_test_eq(size_t, path.steps[3].end, 10);
+      obs_test_eq(size_t, path.steps[3].step, 2);
+      obs_test_eq(size_t, path.steps[4].start, 3);
+      obs_test_eq(size_t, path.steps[4].end, 4);
+      obs_test_eq(int, path.steps[5].type, JSON_PATH_ANY);
+      json_path_free(&path);
+
+      obs_test_false(json_path_compile(&path, "a.b", &info));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_VALUE);
+      obs_test_eq(size_t, info.offset, 0);
+      obs_test_false(json_path_compile(&path, "$.a[-1]", &info));
+      obs_test_eq(size_t, info.offset, 4);
+      obs_test_false(json_path_compile(&path, "$.a[0:4:0]", &info));
+      obs_test_false(json_path_compile(&path, "$.a[?(@.b.c)]", &info));
+      obs_test_eq(size_t, info.offset, 9);
+      obs_test_false(json_path_compile(&path, "$.a[?(@.b == )]", &info));
+      obs_test_false(json_path_compile(&path, "$.a['b]", &info));
+      obs_test_false(json_path_compile(&path, "$.a[1", &info));
+      obs_test_false(json_path_compile(&path, "$.", &info));
+      obs_test_false(json_path_compile(&path, "$a", &info));
+    })
+
+    OBS_TEST("Members and slices", {
+      static const char json[] =
+          "{\"a\": {\"b\": [10, 11, 12, 13, {\"c\": 1}]}, \"b\": \"x\", "
+          "\"e\": {\"email\": \"a@b\", \"f\": [{\"email\": \"c@d\"}]}}";
+      char buf[256];
+      obs_test_true(path_str("$.a.b[1]", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "11");
+      obs_test_true(path_str("$.a.b[0:10:2]", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "10,12,{\"c\": 1}");
+      obs_test_true(path_str("$.a.b[3:]", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "13,{\"c\": 1}");
+      obs_test_true(path_str("$['b']", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "\"x\"");
+      obs_test_true(path_str("$.*", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "{\"b\": [10, 11, 12, 13, {\"c\": 1}]},\"x\","
+                           "{\"email\": \"a@b\", \"f\": [{\"email\": "
+                           "\"c@d\"}]}");
+      obs_test_true(path_str("$", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, json);
+      obs_test_true(path_str("$.nope.b", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "");
+
+      /* recursive, in document order */
+      obs_test_true(path_str("$..email", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "\"a@b\",\"c@d\"");
+      obs_test_true(path_str("$..b", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "[10, 11, 12, 13, {\"c\": 1}],\"x\"");
+      obs_test_true(path_str("$..[4].c", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "1");
+      obs_test_true(path_str("$.e..*", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "\"a@b\",[{\"email\": \"c@d\"}],"
+                           "{\"email\": \"c@d\"},\"c@d\"");
+    })
+
+    OBS_TEST("Filters", {
+      static const char json[] =
+          "{\"friends\": [{\"name\": \"A\", \"id\": 0}, {\"id\": 2, "
+          "\"name\": \"B\"}, {\"name\": \"C\", \"id\": 3.5}, {\"name\": "
+          "\"D\"}, {\"name\": \"E\", \"id\": \"9\"}, [1], 7]}";
+      char buf[256];
+      /* name comes before id in most of them so it waits on the filter */
+      obs_test_true(path_str("$.friends[?(@.id > 1)].name", json, buf,
+                             sizeof(buf)));
+      obs_test_str_eq(buf, "\"B\",\"C\"");
+      obs_test_true(path_str("$.friends[?(@.id != 2)].name", json, buf,
+                             sizeof(buf)));
+      obs_test_str_eq(buf, "\"A\",\"C\",\"E\"");
+      obs_test_true(path_str("$.friends[?(@.id)].name", json, buf,
+                             sizeof(buf)));
+      obs_test_str_eq(buf, "\"A\",\"B\",\"C\",\"E\"");
+      obs_test_true(path_str("$.friends[?(@.name == 'D')]", json, buf,
+                             sizeof(buf)));
+      obs_test_str_eq(buf, "{\"name\": \"D\"}");
+      obs_test_true(path_str("$.friends[?(@.name < \"C\")].id", json, buf,
+                             sizeof(buf)));
+      obs_test_str_eq(buf, "0,2");
+      obs_test_true(path_str("$.friends[?(@ > 5)]", json, buf, sizeof(buf)));
+      obs_test_str_eq(buf, "7");
+      obs_test_true(path_str("$..[?(@.id <= 0)]..name", json, buf,
+                             sizeof(buf)));
+      obs_test_str_eq(buf, "\"A\"");
+
+      /* dropped once the object ends without the member */
+      obs_test_true(path_str("$[?(@.b == true)].a", "[{\"a\": 1, \"b\": "
+                             "true}, {\"a\": 2}, {\"a\": 3, \"b\": true}]",
+                             buf, sizeof(buf)));
+      obs_test_str_eq(buf, "1,3");
+      obs_test_true(path_str("$..[?(@.b)].a", "[{\"a\": 1, \"b\": 2}, "
+                             "{\"a\": [{\"a\": 3, \"b\": 4}], \"b\": 5}]",
+                             buf, sizeof(buf)));
+      obs_test_str_eq(buf, "1,[{\"a\": 3, \"b\": 4}],3");
+      obs_test_true(path_str("$..a", "{\"x\": [{\"a\": 1, \"b\": 2}], "
+                             "\"a\": null}", buf, sizeof(buf)));
+      obs_test_str_eq(buf, "1,null");
+
+      /* strings held back for the filter are still null terminated */
+      JsonPath path;
+      JsonIt it;
+      path_terminated counts;
+      memset(&counts, 0, sizeof(counts));
+      obs_test_true(json_path_compile(&path, "$[?(@.keep == true)].name",
+                                      NULL));
+      obs_test_true(json_str(&it, "[{\"name\": \"ab\", \"keep\": true},"
+                                  " {\"name\": \"\", \"keep\": true},"
+                                  " {\"name\": \"cd\", \"keep\": false},"
+                                  " {\"name\": \"e\\nf\", \"keep\": true}]"));
+      obs_test_true(json_path_query(&it, &path, path_terminate, &counts));
+      obs_test_eq(int, counts.strings, 3);
+      obs_test_eq(int, counts.terminated, 3);
+      obs_test_str_eq(counts.joined, "ab;;e\nf;");
+      json_path_free(&path);
+    })
+
+    OBS_TEST("Errors", {
+      char buf[256];
+      obs_test_false(path_str("$.a", "{\"a\": [1, }", buf, sizeof(buf)));
+      obs_test_true(errno != 0);
+      obs_test_false(path_str("$.b", "{\"a\": [1, }", buf, sizeof(buf)));
+      obs_test_true(errno != 0);
+
+      JsonPath path;
+      JsonIt it;
+      obs_test_true(json_path_compile(&path, "$.a", NULL));
+      obs_test_true(json_str(&it, "{}"));
+      obs_test_false(json_path_query(&it, &path, NULL, NULL));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_ARGS);
+      json_path_free(&path);
+    })
+
+    OBS_TEST("Files", {
+      JsonPath path;
+      JsonIt it;
+      path_values values;
+      FILE *f = fopen("generated.json", "rb");
+
+      obs_test_true(json_path_compile(&path, "$[*].friends[?(@.id > 1)].name",
+                                      NULL));
+      memset(&values, 0, sizeof(values));
+      obs_test_true(json_file(&it, f));
+      obs_test_true(json_path_query(&it, &path, path_value, &values));
+      obs_test_eq(int, values.strings, 209);
+      obs_test_str_eq(values.first, "Bowers Chase");
+      json_path_free(&path);
+
+      obs_test_true(json_path_compile(&path, "$[?(@.isActive == true)].age",
+                                      NULL));
+      memset(&values, 0, sizeof(values));
+      rewind(f);
+      obs_test_true(json_file(&it, f));
+      obs_test_true(json_path_query(&it, &path, path_value, &values));
+      obs_test_eq(long, values.ints, 3360);
+      json_path_free(&path);
+
+      obs_test_true(json_path_compile(&path, "$..name", NULL));
+      memset(&values, 0, sizeof(values));
+      rewind(f);
+      obs_test_true(json_file(&it, f));
+      obs_test_true(json_path_query(&it, &path, path_value, &values));
+      obs_test_eq(int, values.strings, 836);
+      obs_test_str_eq(values.first, "Beatrice Barr");
+      json_path_free(&path);
+
+      /* stopping early */
+      obs_test_true(json_path_compile(&path, "$[*].tags[0:2]", NULL));
+      memset(&values, 0, sizeof(values));
+      values.stop_at = 5;
+      rewind(f);
+      obs_test_true(json_file(&it, f));
+      obs_test_false(json_path_query(&it, &path, path_value, &values));
+      obs_test_eq(int, errno, JSON_ERR_ABORTED);
+      obs_test_eq(int, values.strings, 5);
+      json_path_free(&path);
+      fclose(f);
+    })
+  })
+
+  OBS_TEST_GROUP("Prefilter", {
+    ;
+    OBS_TEST("Candidates", {
+      static const char logs[] =
+          "{\"level\": \"info\", \"service\": \"db\", \"msg\": \"ok\"}\n"
+          "\n"
+          "{\"level\": \"error\", \"service\": \"db\", \"msg\": \"slow\"}\r\n"
+          "{\"level\": \"error\", \"service\": \"web\", \"msg\": \"db down\"}\n"
+          "{\"level\": \"info\", \"service\": \"db\", \"msg\": \"error\"}\n"
+          "  {\"level\": \"error\", \"service\": \"db\", \"msg\": \"disk\"}";
+      JsonFilterTerm terms[] = {{"\"error\"", 7, 0, 0, 0},
+                                {"\"db\"", 4, 0, 0, 0}};
+      JsonFilter filter;
+      JsonIt it;
+      JsonTok tok;
+      int candidates = 0, matches = 0;
+      obs_test_true(
+          json_filter_init(&filter, terms, 2, logs, sizeof(logs) - 1));
+      while (json_filter_next(&filter, &it)) {
+        int error = 0, db = 0;
+        candidates++;
+        while (json_next(&tok, &it) && tok.type != JSON_END) {
+          if (tok.type != JSON_STRING) {
+            continue;
+          }
+          error |= strcmp(tok.key.buf, "level") == 0 &&
+                   strcmp(tok.value._str.buf, "error") == 0;
+          db |= strcmp(tok.key.buf, "service") == 0 &&
+                strcmp(tok.value._str.buf, "db") == 0;
+        }
+        obs_test_eq(int, errno, 0);
+        matches += error && db;
+      }
+      obs_test_eq(int, errno, 0);
+      /* the fourth record only has "error" as a message */
+      obs_test_eq(int, candidates, 3);
+      obs_test_eq(int, matches, 2);
+      obs_test_eq(size_t, filter.records, 5);
+      obs_test_eq(size_t, filter.candidates, 3);
+      obs_test_eq(size_t, terms[0].tested, 5);
+      obs_test_eq(size_t, terms[0].passed, 4);
+      obs_test_eq(size_t, terms[1].tested, 4);
+      obs_test_eq(size_t, terms[1].passed, 3);
+      obs_test_eq(size_t, filter.record.end, sizeof(logs) - 1);
+      obs_test_eq(int, logs[filter.record.begin], '{');
+    })
+
+    OBS_TEST("Reorders by selectivity", {
+      size_t cap = 1000 * 64, len = 0;
+      char *buf = (char *)malloc(cap);
+      for (int i = 0; i < 1000; i++) {
+        len += (size_t)snprintf(buf + len, cap - len,
+                                "{\"id\": %d, \"kind\": \"%s\"}\n", i,
+                                i % 100 == 42 ? "rare" : "common");
+      }
+      JsonFilterTerm terms[] = {{"\"kind\"", 6, 0, 0, 0},
+                                {"\"rare\"", 6, 0, 0, 0}};
+      JsonFilter filter;
+      JsonIt it;
+      JsonTok tok;
+      int found = 0;
+      obs_test_true(json_filter_init(&filter, terms, 2, buf, len));
+      while (json_filter_next(&filter, &it)) {
+        while (json_next(&tok, &it) && tok.type != JSON_END) {
+          found += tok.type == JSON_INT && tok.value._int % 100 == 42;
+        }
+      }
+      obs_test_eq(int, found, 10);
+      obs_test_eq(size_t, filter.records, 1000);
+      obs_test_eq(size_t, filter.candidates, 10);
+      /* "kind" is in all of them so "rare" went first */
+      obs_test_eq(int, filter.order[0], 1);
+      obs_test_true(terms[0].tested < 300);
+      obs_test_eq(size_t, terms[1].tested, 1000);
+      free(buf);
+    })
+
+    OBS_TEST("Substrings", {
+      static const char hay[] =
+          "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab"
+          "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab";
+      const char *end = hay + sizeof(hay) - 1;
+      obs_test_eq(const char *, json_internal_find_substr(hay, end, "ab", 2),
+                  strstr(hay, "ab"));
+      obs_test_eq(const char *, json_internal_find_substr(hay, end, "aab", 3),
+                  strstr(hay, "aab"));
+      obs_test_eq(const char *, json_internal_find_substr(hay, end, "ba", 2),
+                  strstr(hay, "ba"));
+      obs_test_eq(const char *,
+                  json_internal_find_substr(hay + 70, end, "ab", 2),
+                  strstr(hay + 70, "ab"));
+      obs_test_eq(const char *, json_internal_find_substr(hay, end, "bb", 2),
+                  end);
+      obs_test_eq(const char *, json_internal_find_substr(hay, end, "", 0),
+                  hay);
+    })
+
+    OBS_TEST("Errors", {
+      JsonFilterTerm terms[WHY_JSON_FILTER_MAX_TERMS + 1];
+      JsonFilter filter;
+      JsonIt it;
+      JsonTok tok;
+      memset(terms, 0, sizeof(terms));
+      obs_test_false(json_filter_init(&filter, terms,
+                                      WHY_JSON_FILTER_MAX_TERMS + 1, "", 0));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_ARGS);
+      obs_test_false(json_filter_init(&filter, NULL, 0, NULL, 4));
+      obs_test_eq(int, errno, JSON_ERR_INVALID_ARGS);
+
+      /* no terms is every record, ones that aren't utf8 are passed over */
+      obs_test_true(json_filter_init(&filter, NULL, 0, "\n1\n\xff\n 2 ", 8));
+      obs_test_true(json_filter_next(&filter, &it));
+      expect_next_array_value(JSON_INT, long, 1);
+      obs_test_true(json_filter_next(&filter, &it));
+      expect_next_array_value(JSON_INT, long, 2);
+      obs_test_false(json_filter_next(&filter, &it));
+      obs_test_eq(int, errno, 0);
+      obs_test_eq(size_t, filter.records, 3);
+    })
+  })
+
+  OBS_TEST_GROUP("Schema", {
+    ;
+    OBS_TEST("Types", {
+      JsonSchemaErr err;
+      obs_test_eq(int, schema_valid("{\"type\": \"string\"}", "\"a\"", &err),
+                  1);
+      obs_test_eq(int, schema_valid("{\"type\": \"string\"}", "1", &err), 0);
+      obs_test_eq(int, errno, JSON_ERR_SCHEMA);
+      obs_test_str_eq(err.path, "$");
+      obs_test_str_eq(err.msg, "Has the wrong type");
+      obs_test_eq(size_t, err.offset, 0);
+
+      /* integers are numbers and 2.0 is an integer */
+      obs_test_eq(int, schema_valid("{\"type\": \"number\"}", "2", &err), 1);
+      obs_test_eq(int, schema_valid("{\"type\": \"integer\"}", "2.0", &err),
+                  1);
+      obs_test_eq(int, schema_valid("{\"type\": \"integer\"}", "2.5", &err),
+                  0);
+      obs_test_eq(int,
+                  schema_valid("{\"type\": [\"null\", \"boolean\"]}",
+                               "[null, true]", &err),
+                  0);
+      obs_test_eq(int,
+                  schema_valid("{\"items\": {\"type\": [\"null\", "
+                               "\"boolean\"]}}",
+                               "[null, true, {}]", &err),
+                  0);
+      obs_test_str_eq(err.path, "$[2]");
+      obs_test_eq(size_t, err.offset, 13);
+      obs_test_eq(int, schema_valid("true", "{\"a\": [1]}", &err), 1);
+      obs_test_eq(int, schema_valid("false", "1", &err), 0);
+      obs_test_str_eq(err.msg, "Isn't allowed by the schema");
+    })
+
+    OBS_TEST("Objects", {
+      static const char schema[] =
+          "{\"type\": \"object\", \"required\": [\"id\", \"tags\"],"
+          " \"properties\": {"
+          "  \"id\": {\"type\": \"integer\", \"minimum\": 1},"
+          "  \"tags\": {\"type\": \"array\", \"maxItems\": 2,"
+          "            \"items\": {\"minLength\": 1, \"maxLength\": 3}},"
+          "  \"a b\": {\"enum\": [\"x\", 2, false, null]},"
+          "  \"nested\": {\"properties\": {\"deep\": {\"type\": \"null\"}}}"
+          " },"
+          " \"description\": \"unknown keywords are ignored\","
+          " \"$defs\": {\"x\": [1, {\"y\": 2}]}}";
+      JsonSchemaErr err;
+      obs_test_eq(int,
+                  schema_valid(schema,
+                               "{\"id\": 1, \"tags\": [\"\xc3\xa9t\xc3\xa9\"],"
+                               " \"other\": {\"deep\": 1},"
+                               " \"a b\": 2.0}",
+                               &err),
+                  1);
+      obs_test_eq(int, errno, 0);
+      /* required (and properties) only apply to objects */
+      obs_test_eq(int, schema_valid("{\"required\": [\"a\"]}", "[1]", &err),
+                  1);
+      obs_test_eq(int, schema_valid("{\"required\": [\"a\"]}", "[]", &err),
+                  1);
+      obs_test_eq(int,
+                  schema_valid("{\"items\": {\"required\": [\"a\"]}}",
+                               "[[], {\"a\": 1}, {}]", &err),
+                  0);
+      obs_test_str_eq(err.path, "$[2].a");
+      obs_test_eq(int, schema_valid(schema, "{\"id\": 1}", &err), 0);
+      obs_test_eq(int, errno, JSON_ERR_SCHEMA);
+      obs_test_str_eq(err.path, "$.tags");
+      obs_test_str_eq(err.msg, "Is required but missing");
+      obs_test_eq(size_t, err.offset, 8);
+      obs_test_eq(int, schema_valid(schema, "{\"id\": 0, \"tags\": []}", &err),
+                  0);
+      obs_test_str_eq(err.path, "$.id");
+      obs_test_str_eq(err.msg, "Is less than the minimum");
+      obs_test_eq(int,
+                  schema_valid(schema, "{\"id\": 1, \"tags\": [\"a\", \"\"]}",
+                               &err),
+                  0);
+      obs_test_str_eq(err.path, "$.tags[1]");
+      obs_test_str_eq(err.msg, "Is shorter than minLength");
+      obs_test_eq(int,
+                  schema_valid(schema,
+                               "{\"id\": 1, \"tags\": [\"a\", \"b\", \"c\"]}",
+                               &err),
+                  0);
+      obs_test_str_eq(err.path, "$.tags");
+      obs_test_str_eq(err.msg, "Has more items than maxItems");
+      obs_test_eq(int,
+                  schema_valid(schema,
+                               "{\"id\": 1, \"tags\": [], \"a b\": true}",
+                               &err),
+                  0);
+      obs_test_str_eq(err.path, "$['a b']");
+      obs_test_str_eq(err.msg, "Isn't one of the enum values");
+      obs_test_eq(int,
+                  schema_valid("{\"properties\": {\"a'\\\"b\\\\\": "
+                               "{\"type\": \"null\"}}}",
+                               "{\"a'\\\"b\\\\\": 1}", &err),
+                  0);
+      obs_test_str_eq(err.path, "$['a\\'\\\"b\\\\']");
+      obs_test_eq(int,
+                  schema_valid(schema,
+                               "{\"id\": 1, \"tags\": [], \"nested\": "
+                               "{\"deep\": [null]}}",
+                               &err),
+                  0);
+      obs_test_str_eq(err.path, "$.nested.deep");
+      obs_test_str_eq(err.msg, "Has the wrong type");
+
+      /* the error message has the path too */
+      JsonSchema compiled;
+      JsonIt it;
+      obs_test_true(json_schema_compile(&compiled, schema, NULL));
+      obs_test_true(json_str(&it, "{\"id\": 1, \"tags\": 1}"));
+      obs_test_false(json_schema_validate(&it, &compiled, NULL));
+      obs_test_str_eq(it.err, "$.tags: Has the wrong type");
+      json_schema_free(&compiled);
+    })
+
+    OBS_TEST("Patterns", {
+      static const char email[] =
+          "{\"pattern\": \"^[a-z0-9._]+@[a-z]+\\\\.(com|net)$\"}";
+      static const char simple[] =
+          "{\"pattern\": \"^[\\\\w.]+@\\\\w+\\\\.[a-z]+$\"}";
+      JsonSchemaErr err;
+      obs_test_eq(int, schema_valid(email, "\"a\"", &err), -1);
+      obs_test_eq(int, schema_valid(simple, "\"a.b@c.com\"", &err), 1);
+      obs_test_eq(int, schema_valid(simple, "\"a.b@c.com \"", &err), 0);
+      obs_test_str_eq(err.msg, "Doesn't match the pattern");
+      obs_test_eq(int, schema_valid(simple, "\"@c.com\"", &err), 0);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"b+c?d*$\"}", "\"abbd\"",
+                                    &err),
+                  1);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"b+c?d*$\"}", "\"abbda\"",
+                                    &err),
+                  0);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"[^0-9]\"}", "\"123\"",
+                                    &err),
+                  0);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"[^0-9]\"}", "\"12x\"",
+                                    &err),
+                  1);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"\"}", "\"\"", &err), 1);
+      /* patterns only apply to strings */
+      obs_test_eq(int, schema_valid("{\"pattern\": \"x\"}", "1", &err), 1);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"^a?b+$\"}", "\"bb\"",
+                                    &err),
+                  1);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"^a?b+$\"}", "\"aab\"",
+                                    &err),
+                  0);
+      obs_test_eq(int, schema_valid("{\"pattern\": \"x*$\"}", "\"abc\"",
+                                    &err),
+                  1);
+    })
+
+    OBS_TEST("Adversarial patterns", {
+      /* these take exponential time for a backtracking matcher */
+      static const char schema[] =
+          "{\"pattern\": \"a*a*a*a*a*a*a*a*a*a*a*a*b\"}";
+      size_t len = 100000;
+      char *str = (char *)malloc(len + 3);
+      JsonSchemaErr err;
+      str[0] = '"';
+      memset(str + 1, 'a', len);
+      str[len + 1] = '"';
+      str[len + 2] = '\0';
+      obs_test_eq(int, schema_valid(schema, str, &err), 0);
+      obs_test_str_eq(err.msg, "Doesn't match the pattern");
+      str[len] = 'b';
+      obs_test_eq(int, schema_valid(schema, str, &err), 1);
+      obs_test_eq(int,
+                  schema_valid("{\"pattern\": \"^(a+)+$\"}", str, &err), -1);
+      obs_test_eq(int,
+                  schema_valid("{\"pattern\": \"^[ab]*a[ab]*a[ab]*c$\"}",
+                               str, &err),
+                  0);
+      free(str);
+    })
+
+    OBS_TEST("Compile errors", {
+      static const char *const bad[] = {
+          "1",
+          "{\"type\": \"thing\"}",
+          "{\"type\": [\"string\", 1]}",
+          "{\"properties\": []}",
+          "{\"properties\": {\"a\": 1}}",
+          "{\"required\": [1]}",
+          "{\"items\": [{}]}",
+          "{\"enum\": [[]]}",
+          "{\"minimum\": \"1\"}",
+          "{\"minLength\": -1}",
+          "{\"maxItems\": 1.5}",
+          "{\"pattern\": \"a{2}\"}",
+          "{\"pattern\": \"*a\"}",
+          "{} {}",
+      };
+      JsonSchema schema;
+      JsonErrInfo info;
+      size_t i;
+      for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        obs_test_false(json_schema_compile(&schema, bad[i], &info));
+        obs_test_neq(int, info.err, 0);
+        obs_test_neq(int, errno, 0);
+        obs_test_true(info.msg != NULL);
+        obs_test_true(schema.nodes == NULL);
+      }
+      obs_test_false(json_schema_compile(&schema, "{\"type\": \"thing\"}",
+                                         &info));
+      obs_test_eq(int, info.err, JSON_ERR_INVALID_VALUE);
+      obs_test_str_eq(info.msg, "Unknown type");
+
+      /* broken documents are still json errors */
+      JsonSchemaErr err;
+      obs_test_eq(int, schema_valid("{}", "[1,", &err), 0);
+      obs_test_neq(int, errno, JSON_ERR_SCHEMA);
+      obs_test_str_eq(err.path, "");
+    })
+
+    OBS_TEST("Files", {
+      static const char schema_str[] =
+          "{\"type\": \"array\", \"items\": {"
+          "  \"type\": \"object\", \"required\": [\"index\", \"age\", "
+          "\"email\", \"friends\"],"
+          "  \"properties\": {"
+          "    \"index\": {\"type\": \"integer\", \"minimum\": 0},"
+          "    \"age\": {\"type\": \"integer\", \"minimum\": 18,"
+          "             \"maximum\": 120},"
+          "    \"eyeColor\": {\"type\": \"string\", \"minLength\": 3},"
+          "    \"email\": {\"pattern\": \"^\\\\w+@\\\\w+\\\\.com$\"},"
+          "    \"friends\": {\"items\": {\"required\": [\"id\", \"name\"]}}"
+          "  }"
+          "}}";
+      JsonSchema schema;
+      JsonSchemaErr err;
+      JsonIt it;
+      FILE *f = fopen("generated.json", "rb");
+
+      obs_test_true(json_schema_compile(&schema, schema_str, NULL));
+      obs_test_true(json_file(&it, f));
+      obs_test_true(json_schema_validate(&it, &schema, &err));
+      obs_test_eq(int, errno, 0);
+      json_schema_free(&schema);
+
+      obs_test_true(json_schema_compile(
+          &schema, "{\"items\": {\"properties\": {\"age\": {\"maximum\": 30}}}}",
+          NULL));
+      rewind(f);
+      obs_test_true(json_file(&it, f));
+      obs_test_false(json_schema_validate(&it, &schema, &err));
+      obs_test_eq(int, errno, JSON_ERR_SCHEMA);
+      obs_test_str_eq(err.path, "$[0].age");
+      obs_test_str_eq(err.msg, "Is more than the maximum");
+      json_schema_free(&schema);
+      fclose(f);
+    })
+  })
+
   /* TODO */
   OBS_TEST_GROUP("Files", {})
 
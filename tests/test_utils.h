@@ -70,6 +70,16 @@
     obs_test_mem_eq(val_type, &tok.value, &tmp);                               \
   } while (0)
 
+#define expect_next_raw_num(str, is_integral)                                  \
+  do {                                                                         \
+    test_next_json(0, 1);                                                      \
+    obs_test_eq(uint8_t, JSON_NUMBER_RAW, tok.type);                           \
+    obs_test_eq(size_t, tok.value._num.len, strlen(str));                      \
+    obs_test(strncmp(tok.value._num.buf, str, strlen(str)) == 0,               \
+             "%.*s != %s", (int)tok.value._num.len, tok.value._num.buf, str);  \
+    obs_test_eq(int, tok.value._num.integral, is_integral);                    \
+  } while (0)
+
 #define expect_next_type(expect_type)                                          \
   do {                                                                         \
     test_next_json(0, 1);                                                      \
@@ -89,6 +99,25 @@
     obs_test_eq(uint8_t, tok.type, JSON_ERROR);                                \
   } while (0)
 
+#define expect_valid(str)                                                      \
+  do {                                                                         \
+    JsonErrInfo info;                                                          \
+    int res = json_validate(str, strlen(str), &info);                          \
+    if (!res) {                                                                \
+      obs_err("%s is invalid at %zu: %s", str, info.offset, info.msg);         \
+    }                                                                          \
+    obs_test_true(res);                                                        \
+  } while (0)
+
+#define expect_invalid(str, expect_err, expect_offset)                         \
+  do {                                                                         \
+    JsonErrInfo info;                                                          \
+    obs_test_false(json_validate(str, strlen(str), &info));                    \
+    obs_test_eq(int, info.err, expect_err);                                    \
+    obs_test_eq(int, errno, expect_err);                                       \
+    obs_test_eq(size_t, info.offset, (size_t)(expect_offset));                 \
+  } while (0)
+
 #define setup_str(str)                                                         \
   JsonIt it;                                                                   \
   JsonTok tok;                                                                 \
@@ -102,4 +131,187 @@
   errno = 0;                                                                   \
   obs_test_true(json_file(&it, file));
 
+/*
+ Records every sax event into a string so we can compare it against
+ what we expect i.e. `{ k:a i:5 }`
+ */
+typedef struct sax_recorder_t {
+  char buf[4096];
+  size_t len;
+  int events;
+  int abort_at;
+} SaxRecorder;
+
+static int sax_record(void *ctx, const char *fmt, ...) {
+  SaxRecorder *rec = (SaxRecorder *)ctx;
+  rec->events++;
+  if (rec->len < sizeof(rec->buf)) {
+    va_list ap;
+    va_start(ap, fmt);
+    rec->len += vsnprintf(rec->buf + rec->len, sizeof(rec->buf) - rec->len,
+                          fmt, ap);
+    va_end(ap);
+  }
+  return rec->abort_at == 0 || rec->events < rec->abort_at;
+}
+
+static int sax_start_object(void *ctx) { return sax_record(ctx, "{ "); }
+static int sax_end_object(void *ctx) { return sax_record(ctx, "} "); }
+static int sax_start_array(void *ctx) { return sax_record(ctx, "[ "); }
+static int sax_end_array(void *ctx) { return sax_record(ctx, "] "); }
+static int sax_key(void *ctx, const char *str, size_t len) {
+  return sax_record(ctx, "k:%.*s ", (int)len, str);
+}
+static int sax_string(void *ctx, const char *str, size_t len) {
+  return sax_record(ctx, "s:%.*s ", (int)len, str);
+}
+static int sax_int(void *ctx, long value) {
+  return sax_record(ctx, "i:%ld ", value);
+}
+static int sax_flt(void *ctx, double value) {
+  return sax_record(ctx, "f:%g ", value);
+}
+static int sax_bool(void *ctx, int value) {
+  return sax_record(ctx, "b:%d ", value);
+}
+static int sax_null(void *ctx) { return sax_record(ctx, "n "); }
+static int sax_number(void *ctx, const JsonNum *num) {
+  return sax_record(ctx, "r:%.*s ", (int)num->len, num->buf);
+}
+
+static const JsonHandler sax_recorder_handler = {
+    sax_start_object, sax_end_object, sax_start_array, sax_end_array,
+    sax_key,          sax_string,     sax_int,         sax_flt,
+    sax_bool,         sax_null,       sax_number};
+
+#define setup_sax(str)                                                         \
+  JsonIt it;                                                                   \
+  SaxRecorder rec;                                                             \
+  memset(&rec, 0, sizeof(SaxRecorder));                                        \
+  errno = 0;                                                                   \
+  obs_test_true(json_str(&it, str));
+
+/* runs json_transform over str putting what it wrote in buf */
+static int transform_str(const char *str, const JsonTransformRule *rules,
+                         int n, char *buf, size_t cap) {
+  JsonIt it;
+  FILE *out = tmpfile();
+  errno = 0;
+  int ok = json_str(&it, str) && json_transform(&it, rules, n, out);
+  size_t len = (size_t)ftell(out);
+  rewind(out);
+  len = fread(buf, 1, len < cap - 1 ? len : cap - 1, out);
+  buf[len] = '\0';
+  fclose(out);
+  return ok;
+}
+
+/*
+ The source bytes of each json_path_query match joined by ','.
+ */
+typedef struct path_matches_t {
+  const char *src;
+  char *buf;
+  size_t cap;
+  size_t len;
+  int count;
+} path_matches;
+
+static int path_match(void *ctx, JsonType type, const JsonValue *value,
+                      JsonSpan span) {
+  path_matches *matches = (path_matches *)ctx;
+  size_t len = span.end - span.begin;
+  (void)type;
+  (void)value;
+  if (matches->count++ > 0 && matches->len + 1 < matches->cap) {
+    matches->buf[matches->len++] = ',';
+  }
+  if (matches->len + len < matches->cap) {
+    memcpy(matches->buf + matches->len, matches->src + span.begin, len);
+    matches->len += len;
+  }
+  matches->buf[matches->len] = '\0';
+  return 1;
+}
+
+static int path_str(const char *expr, const char *str, char *buf, size_t cap) {
+  JsonPath path;
+  JsonIt it;
+  path_matches matches = {str, buf, cap, 0, 0};
+  buf[0] = '\0';
+  errno = 0;
+  if (!json_path_compile(&path, expr, NULL)) {
+    return 0;
+  }
+  int ok = json_str(&it, str) && json_path_query(&it, &path, path_match,
+                                                 &matches);
+  json_path_free(&path);
+  return ok;
+}
+
+/*
+ Counts (and sums) what json_path_query gives stopping after stop_at strings.
+ */
+typedef struct path_values_t {
+  int strings;
+  long ints;
+  char first[64];
+  int stop_at;
+} path_values;
+
+static int path_value(void *ctx, JsonType type, const JsonValue *value,
+                      JsonSpan span) {
+  path_values *values = (path_values *)ctx;
+  (void)span;
+  if (type == JSON_STRING) {
+    if (values->strings++ == 0) {
+      snprintf(values->first, sizeof(values->first), "%.*s",
+               (int)value->_str.len, value->_str.buf);
+    }
+  } else if (type == JSON_INT) {
+    values->ints += value->_int;
+  }
+  return values->stop_at == 0 || values->strings < values->stop_at;
+}
+
+/*
+ Counts the strings json_path_query gives and how many of them are null
+ terminated at their length.
+ */
+typedef struct path_terminated_t {
+  int strings;
+  int terminated;
+  char joined[64];
+} path_terminated;
+
+static int path_terminate(void *ctx, JsonType type, const JsonValue *value,
+                          JsonSpan span) {
+  path_terminated *counts = (path_terminated *)ctx;
+  size_t len = strlen(counts->joined);
+  (void)span;
+  if (type == JSON_STRING) {
+    counts->strings++;
+    counts->terminated += strlen(value->_str.buf) == value->_str.len;
+    snprintf(counts->joined + len, sizeof(counts->joined) - len, "%s;",
+             value->_str.buf);
+  }
+  return 1;
+}
+
+/*
+ Validates str against the schema, leaving the first violation in err.
+ Returns -1 if the schema doesn't compile.
+ */
+static int schema_valid(const char *schema_str, const char *str,
+                        JsonSchemaErr *err) {
+  JsonSchema schema;
+  JsonIt it;
+  if (!json_schema_compile(&schema, schema_str, NULL)) {
+    return -1;
+  }
+  int ok = json_str(&it, str) && json_schema_validate(&it, &schema, err);
+  json_schema_free(&schema);
+  return ok;
+}
+
 #endif
@@ -80,12 +80,151 @@ SOFTWARE.
 #define WHY_JSON_ERR_BUF_SIZE (256)
 #endif
 
-#ifndef WHY_JSON_INITIAL_MATCH_STACK
-#define WHY_JSON_INITIAL_MATCH_STACK (32)
+/* How many levels of nesting the iterator can track without allocating */
+#ifndef WHY_JSON_INLINE_DEPTH
+#define WHY_JSON_INLINE_DEPTH (64)
 #endif
 
-#define WHY_JSON_UTF8_ACCEPT (1)
-#define WHY_JSON_UTF8_REJECT (0)
+/*
+ Keys and string values shorter than this are decoded into the iterator
+ rather than allocated (includes the null terminator).
+ */
+#ifndef WHY_JSON_SMALL_STR_SIZE
+#define WHY_JSON_SMALL_STR_SIZE (16)
+#endif
+
+/* How much an arena allocates at a time (bigger allocations get their own) */
+#ifndef WHY_JSON_ARENA_CHUNK_SIZE
+#define WHY_JSON_ARENA_CHUNK_SIZE (4096)
+#endif
+
+/* How many keys of an array's records json_bind remembers (shape_hits) */
+#ifndef WHY_JSON_SHAPE_MAX_KEYS
+#define WHY_JSON_SHAPE_MAX_KEYS (32)
+#endif
+
+/* The longest (dotted) path json_columns can match */
+#ifndef WHY_JSON_COLUMN_MAX_PATH
+#define WHY_JSON_COLUMN_MAX_PATH (256)
+#endif
+
+/* The longest (dotted) path json_transform can match */
+#ifndef WHY_JSON_TRANSFORM_MAX_PATH
+#define WHY_JSON_TRANSFORM_MAX_PATH (256)
+#endif
+
+/* The most steps a compiled JsonPath can have (at most 63) */
+#ifndef WHY_JSON_PATH_MAX_STEPS
+#define WHY_JSON_PATH_MAX_STEPS (32)
+#endif
+
+/* The most terms a JsonFilter can have */
+#ifndef WHY_JSON_FILTER_MAX_TERMS
+#define WHY_JSON_FILTER_MAX_TERMS (16)
+#endif
+
+/* How many records a JsonFilter sees between putting its terms in order */
+#ifndef WHY_JSON_FILTER_REORDER
+#define WHY_JSON_FILTER_REORDER (256)
+#endif
+
+/* The longest path json_schema_validate reports (longer ones are cut short) */
+#ifndef WHY_JSON_SCHEMA_MAX_PATH
+#define WHY_JSON_SCHEMA_MAX_PATH (256)
+#endif
+
+/* The most characters / classes a json_schema pattern can be made of */
+#ifndef WHY_JSON_SCHEMA_MAX_ATOMS
+#define WHY_JSON_SCHEMA_MAX_ATOMS (256)
+#endif
+
+/* Bumped whenever the tape (or its file format) changes */
+#define WHY_JSON_TAPE_VERSION (3)
+
+/* A tape word is a tag (JsonType) in the top 8 bits and a 56 bit payload */
+#define WHY_JSON_TAPE_TAG(word) ((JsonType)((word) >> 56))
+#define WHY_JSON_TAPE_PAYLOAD(word) ((word) & (((uint64_t)1 << 56) - 1))
+#define WHY_JSON_TAPE_WORD(tag, payload)                                       \
+  (((uint64_t)(tag) << 56) | (uint64_t)(payload))
+/* The tag of a node that is shared with an earlier one (JSON_TAPE_DEDUP) */
+#define WHY_JSON_TAPE_REF (0xFF)
+/* Set in the member count of objects that end with a hash index */
+#define WHY_JSON_TAPE_INDEXED ((uint64_t)1 << 63)
+
+/* Objects with at least this many members get a hash index in the tape */
+#ifndef WHY_JSON_TAPE_INDEX_MIN
+#define WHY_JSON_TAPE_INDEX_MIN (32)
+#endif
+
+/* Strings longer than this aren't interned */
+#ifndef WHY_JSON_INTERN_MAX_LEN
+#define WHY_JSON_INTERN_MAX_LEN (64)
+#endif
+
+/* the most strings an intern table can hold (ids have to fit in an int16_t) */
+#define WHY_JSON_INTERN_MAX (32767)
+
+/* the longest string (or raw number) a JsonStr can hold */
+#define WHY_JSON_MAX_STR_LEN ((size_t)(1u << 29) - 1)
+
+#ifndef WHY_JSON_NUM_BUF_SIZE
+#define WHY_JSON_NUM_BUF_SIZE (64)
+#endif
+
+#ifndef WHY_JSON_MAX_DEPTH
+#define WHY_JSON_MAX_DEPTH (1024)
+#endif
+
+#define WHY_JSON_UTF8_ACCEPT (0)
+#define WHY_JSON_UTF8_REJECT (1)
+
+/*
+ The scanning kernels (whitespace, strings, utf8 and structural characters)
+ come in a few variants, the best one the cpu supports is picked on first use.
+
+ With GCC / Clang on x86 we build every variant (using target attributes so
+ you don't need -mavx2 and friends) and ask the cpu at runtime, otherwise we
+ can only use what the compiler was told it has (SSE2 is always around on
+ x86_64).  Everything falls back to 8 bytes at a time using a plain uint64_t.
+ Define WHY_JSON_NO_SIMD to force the fallback.
+ */
+#if !defined WHY_JSON_NO_SIMD && (defined __x86_64__ || defined __i386__) &&   \
+    (defined __clang__ || (defined __GNUC__ && __GNUC__ >= 5))
+#define WHY_JSON_DISPATCH
+#define WHY_JSON_SSE2
+#define WHY_JSON_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif !defined WHY_JSON_NO_SIMD &&                                             \
+    (defined __SSE2__ || defined _M_X64 ||                                     \
+     (defined _M_IX86_FP && _M_IX86_FP >= 2))
+#define WHY_JSON_SSE2
+#define WHY_JSON_TARGET(isa)
+#include <emmintrin.h>
+#else
+#define WHY_JSON_TARGET(isa)
+#endif
+
+/*
+ Numbers are parsed 8 digits at a time in a uint64_t (json_read_f64_array)
+ which relies on the byte order.
+ */
+#if !defined WHY_JSON_NO_SIMD &&                                               \
+    ((defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) ||   \
+     defined _M_X64 || defined _M_IX86 || defined _M_ARM64)
+#define WHY_JSON_SWAR_DIGITS
+#endif
+
+/*
+ json_tape_map maps the file read only where it can (else it just reads it).
+ Define WHY_JSON_NO_MMAP to always read it.
+ */
+#if !defined WHY_JSON_NO_MMAP && (defined __unix__ || defined __APPLE__)
+#define WHY_JSON_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #if defined __cplusplus
 extern "C" {
@@ -109,8 +248,40 @@ enum json_err_t {
   JSON_ERR_MISSING_QUOTE = -10,
   JSON_ERR_INVALID_IDENT = -11,
   JSON_ERR_INVALID_VALUE = -12,
+  JSON_ERR_ABORTED = -13,
+  JSON_ERR_OUT_OF_RANGE = -14,
+  JSON_ERR_TOO_DEEP = -15,
+  JSON_ERR_TOO_LONG = -16,
+  /* the json doesn't match the schema (json_schema_validate) */
+  JSON_ERR_SCHEMA = -17,
 };
 
+/*
+ Where and why json_validate failed.
+ */
+typedef struct JsonErrInfo {
+  JsonErr err;
+  /* the byte offset of the offending character (len if it ran out) */
+  size_t offset;
+  /* both start at 1 */
+  int line;
+  int col;
+  const char *msg;
+} JsonErrInfo;
+
+/*
+ The instruction set used by the scanning kernels.
+ */
+typedef enum JsonIsa {
+  /* 8 bytes at a time, no intrinsics */
+  JSON_ISA_SCALAR = 0,
+  JSON_ISA_SSE2 = 1,
+  JSON_ISA_SSE42 = 2,
+  JSON_ISA_AVX2 = 3,
+  /* requires AVX-512BW */
+  JSON_ISA_AVX512 = 4,
+} JsonIsa;
+
 /*
  Represents an object's data type.
  */
@@ -127,6 +298,39 @@ enum json_type_t {
   JSON_OBJECT_END = 9,
   JSON_ARRAY_END = 10,
   JSON_END = 11,
+  JSON_NUMBER_RAW = 12,
+};
+
+/*
+ Flags you can set on the iterator (it.flags) after initialising it.
+ */
+enum json_flag_t {
+  /*
+   Numbers are given as JSON_NUMBER_RAW (the digits as a string) rather than
+   being converted, use the json_num_as_* functions to convert them.
+  */
+  JSON_FLAG_RAW_NUMBERS = 1 << 0,
+  /*
+   Strings (and quoted keys) are given as they appear in the json (raw = 1)
+   and are only decoded when you call json_get_str/json_decode_str_into.
+  */
+  JSON_FLAG_LAZY_STRINGS = 1 << 1,
+  /* Set by json_insitu, the source is writeable and strings are decoded in it */
+  JSON_FLAG_INSITU = 1 << 2,
+  /* Set once the iterator is destroyed (you can't call next after this) */
+  JSON_FLAG_DESTROYED = 1 << 3,
+  /*
+   String values are interned too (not just keys) giving them a value_id,
+   only does anything with an intern table (json_set_intern).
+  */
+  JSON_FLAG_INTERN_VALUES = 1 << 4,
+  /*
+   Members whose key isn't in the key set (json_keyset) are skipped over
+   (values and all) rather than given to you.
+  */
+  JSON_FLAG_SKIP_UNKNOWN_KEYS = 1 << 5,
+  /* json_next records where each value is in the source (it.span) */
+  JSON_FLAG_SPANS = 1 << 6,
 };
 
 /*
@@ -136,13 +340,44 @@ enum json_type_t {
  Can grab a mutable copy of buf via json_get_string()
  Which will often just toggle the allocation flag
  and clear the buf/len fields to avoid having to allocate
+
+ If raw is set (JSON_FLAG_LAZY_STRINGS) then buf is the string exactly as it
+ was in the json (without quotes) and isn't null terminated, has_escapes
+ tells you if it has to be decoded or if it can just be used as is.
  */
+
+/*
+ Tokens are packed to 4 bytes so that a JsonStr is a pointer and a single
+ 32 bit word (the length and it's flags) and a JsonTok is 32 bytes on 64 bit
+ rather than 64, which matters once you keep arrays of them around.
+ */
+#pragma pack(push, 4)
+
 typedef struct json_str_t JsonStr;
 struct json_str_t {
-  /* TODO: Pack */
   const char *buf;
-  size_t len;
-  char allocated;
+  /* strings longer than WHY_JSON_MAX_STR_LEN are a JSON_ERR_TOO_LONG */
+  uint32_t len : 29;
+  uint32_t allocated : 1;
+  uint32_t raw : 1;
+  uint32_t has_escapes : 1;
+};
+
+/*
+ Represents a number that hasn't been converted yet (JSON_NUMBER_RAW)
+ i.e. `-12.5e3`, any underscores or leading `+` are stripped out.
+
+ buf isn't null terminated (it often just points into the source string)
+ and the first 3 members are laid out the same as JsonStr so we can free
+ it the same way.
+ */
+typedef struct json_num_t JsonNum;
+struct json_num_t {
+  const char *buf;
+  uint32_t len : 29;
+  uint32_t allocated : 1;
+  /* no '.' or exponent */
+  uint32_t integral : 1;
 };
 
 /*
@@ -155,6 +390,7 @@ union json_value_t {
   long _int;
   double _flt;
   JsonStr _str;
+  JsonNum _num;
   char _bool;
 };
 
@@ -166,424 +402,6140 @@ union json_value_t {
 
  First represents if the token is the first inside it's array/object
  JSON_OBJECT_END, JSON_ARRAY_END are always first.
+
+ key_id/value_id are the ids of the key/string value in the intern table
+ (json_set_intern) or -1 if they weren't interned.  key_index is the index
+ of the key in the key set (json_keyset) or -1 if it's not in it.
  */
 typedef struct json_tok_t JsonTok;
 struct json_tok_t {
-  /* TODO: Pack */
   JsonStr key;
-  JsonType type;
   JsonValue value;
-  char first;
+  JsonType type;
+  uint8_t first;
+  int16_t key_id;
+  int16_t value_id;
+  int16_t key_index;
 };
 
+#pragma pack(pop)
+
 /*
- Holds the iterator structure itself.
- Avoid touching this too much outside of cur_line/cur_col/depth/err
+ A simple bump allocator, everything allocated from it is freed at once
+ with json_arena_free.  Pointers from it never move.
  */
-typedef struct json_it_t JsonIt;
-struct json_it_t {
-  /* TODO: Pack */
-  FILE *stream;
-  const char *source_str;
-  int tok_init;
-
-  char err[WHY_JSON_ERR_BUF_SIZE];
-
-  uint8_t *match_stack;
-  size_t match_len;
-
-  size_t cur_loc;
-  int cur_line;
-  int cur_col;
-  int depth;
-  uint32_t state;
-
-  size_t buf_len;
-#ifndef WHY_JSON_ALLOCATE_BUF
-  /* Only used for file streams */
-  char buf[WHY_JSON_BUF_SIZE + 1];
-#else
-  char *buf;
-#endif
+typedef struct json_arena_t JsonArena;
+struct json_arena_t {
+  /* the current chunk, starts with a pointer to the previous one */
+  char *chunk;
+  size_t len;
+  size_t cap;
 };
 
 /*
- Use a file as a source for the json iterator.
- Note: Won't seek to the start so make sure file is set to the location
-       You want reading to start at.
- */
-_WHY_JSON_FUNC_ int json_file(JsonIt *it, FILE *file);
+ A table of unique strings each given a small stable id (in the order they
+ were added from 0) so repeated keys/values are stored once and you can
+ switch on the id rather than comparing strings.
 
-/*
- Initialises a json iterator from a constant string
- You can use literals in this, it won't attempt to edit it.
+ Strings are copied into an arena so the pointers it gives you are valid
+ till json_intern_free.  Can be shared between iterators.
  */
-_WHY_JSON_FUNC_ int json_str(JsonIt *it, const char *str);
-
-/*
-  Goes to the next element in the json.  If the current element is at an object
-  or array it will stop at the key allowing you to skip it else if you call
-  next it'll step into it.
-*/
-_WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it);
-
-/*
-  Skips the json object useful for when you just want to visit the outer
-  objects or don't want to visit an object for whatever reason.
+typedef struct json_intern_entry_t JsonInternEntry;
+struct json_intern_entry_t {
+  const char *buf;
+  uint32_t len;
+  uint32_t hash;
+};
 
-  Errors if the current key is not an object or array.
-*/
-_WHY_JSON_FUNC_ int json_skip(JsonTok *tok, JsonIt *it);
+typedef struct json_intern_t JsonIntern;
+struct json_intern_t {
+  /* entry i is the string with id i */
+  JsonInternEntry *entries;
+  int count;
+  int cap;
+  /* open addressing, each slot holds an id + 1 (0 is empty) */
+  uint16_t *slots;
+  uint32_t slot_mask;
+  JsonArena strs;
+};
 
 /*
- Destroys the given token and iterator data.
- Won't free the token itself nor the iterator since presumably
- you have stack allocated them (or should).
-
- They both can be NULL in the case you don't know if they are null or
- you want to just free one.
+ The keys given to json_keyset, looked up by their length and first/last
+ bytes (the keys themselves aren't copied).
  */
-_WHY_JSON_FUNC_ void json_destroy(JsonTok *tok, JsonIt *it);
+typedef struct json_keyset_t JsonKeySet;
+struct json_keyset_t {
+  const char *const *keys;
+  uint32_t *lens;
+  /* open addressing, each slot holds an index (-1 is empty) */
+  int16_t *slots;
+  uint32_t mask;
+  int n;
+};
 
 /*
- If you want a writeable version you can use this
- It will avoid allocations by just invalidating the string after this call
-
- Our strings are by default readonly because it is often more efficient
- and possibly allows us to re-use buffers in the future!
- Less Allocations are the better.
+ What a field is bound as (json_bind).
  */
-_WHY_JSON_FUNC_ char *json_get_str(JsonStr *str, size_t *len);
+typedef uint8_t JsonBindType;
+enum json_bind_type_t {
+  /* long, numbers with a fraction/exponent are an error */
+  JSON_BIND_LONG,
+  /* double, integers are converted */
+  JSON_BIND_DOUBLE,
+  /* int (1 or 0) */
+  JSON_BIND_BOOL,
+  /* const char * (null terminated, allocated in the arena), null is NULL */
+  JSON_BIND_STR,
+  /* a struct inside of this one described by nested */
+  JSON_BIND_OBJECT,
+  /* a JsonBindArray of nested->size items */
+  JSON_BIND_ARRAY,
+};
 
-#ifndef WHY_JSON_NO_DEFINITIONS
+typedef struct json_bind_desc_t JsonBindDesc;
 
 /*
-  == Helper Functions ==
-  These are helper functions and should not be called by your code
- */
+ Binds the member `key` to the field at `offset` in the struct.
 
-/*
- Report an error.  Given a format and some var args.
+ For arrays nested describes each item, if it's first field has a NULL key
+ the items are just that field (i.e. an array of strings) else they are
+ objects.
  */
-#ifdef __GNUC__
-__attribute__((format(printf, 3, 4)))
-#endif
-_WHY_JSON_FUNC_ int
-json_internal_error(JsonIt *it, int err, const char *fmt, ...);
+typedef struct json_bind_field_t JsonBindField;
+struct json_bind_field_t {
+  const char *key;
+  size_t offset;
+  JsonBindType type;
+  const JsonBindDesc *nested;
+};
 
 /*
-  Returns JSON_ACCEPT if the json is legal else JSON_REJECT
-  if neither than it needs more characters to determine.
+ Describes a struct, size is only used for arrays of them.
  */
-_WHY_JSON_FUNC_ uint32_t json_internal_is_legal_utf8(uint32_t *state,
-                                                     const char *bytes,
-                                                     size_t length);
+struct json_bind_desc_t {
+  const JsonBindField *fields;
+  int n;
+  size_t size;
+};
 
 /*
-  Peeks the next character
+ What JSON_BIND_ARRAY fields are bound into, items is in the arena.
  */
-_WHY_JSON_FUNC_ int json_internal_peek_char(JsonIt *it);
-
-/*
-  Gets the next character moving forward cur_loc and cur_col/line
-  Avoid just doing cur_loc++ and prefer using this to make sure
-  our line numbers are right.
-*/
-_WHY_JSON_FUNC_ int json_internal_next_char(JsonIt *it);
+typedef struct json_bind_array_t JsonBindArray;
+struct json_bind_array_t {
+  void *items;
+  size_t len;
+};
 
 /*
- Initialise the iterator.
- Prefer to call json_string/json_file rather than initialising it yourself
+ i.e. JSON_BIND(Person, age, JSON_BIND_LONG, NULL)
  */
-_WHY_JSON_FUNC_ int json_internal_init(JsonIt *it);
+#define JSON_BIND(type, field, bind_type, nested)                              \
+  { #field, offsetof(type, field), bind_type, nested }
 
 /*
- Writes the character given into the temporary buffer reallocating as needed
- Uses a typical reallocation as min 4 (start 8) and doubling each time.
+ The type of a column (json_columns), the buffers follow the Arrow layout.
  */
-_WHY_JSON_FUNC_ int json_internal_into_buf(char **tmp, size_t *tmp_len,
-                                           size_t *tmp_cap, JsonIt *it, int c);
+typedef uint8_t JsonColumnType;
+enum json_column_type_t {
+  /* values is an int64_t per row */
+  JSON_COLUMN_I64,
+  /* values is a double per row, integers are converted */
+  JSON_COLUMN_F64,
+  /* values is a bitmap like validity */
+  JSON_COLUMN_BOOL,
+  /* values is len + 1 int32_t offsets into data (not null terminated) */
+  JSON_COLUMN_STR,
+};
 
 /*
- Is the character whitespace.
-
- NOTE: As according to the JSON RPC Spec it will only check for ascii
- whitespace i.e. '\r', '\n', '\t', ' ' and won't check for Unicode whitespace
+ What happens when a row's value is null or missing.
  */
-_WHY_JSON_FUNC_ int json_internal_is_whitespace(char c);
+typedef uint8_t JsonNullPolicy;
+enum json_null_policy_t {
+  /* it's a null (validity bit is 0 and the value is zeroed) */
+  JSON_NULLS_ALLOW,
+  /* errors with JSON_ERR_INVALID_VALUE */
+  JSON_NULLS_ERROR,
+  /* it's a valid 0 / false / "" */
+  JSON_NULLS_ZERO,
+};
 
 /*
- Ignore all whitespace moving the iterator to the first non-whitespace char
+ A column to pull out of every row, path is the key or a dotted path into
+ nested objects i.e. "address.city".
  */
-_WHY_JSON_FUNC_ void json_internal_ignore_whitespace(JsonIt *it);
+typedef struct json_column_spec_t JsonColumnSpec;
+struct json_column_spec_t {
+  const char *path;
+  JsonColumnType type;
+  JsonNullPolicy nulls;
+};
 
 /*
- Resize the match stack to allow atleast one more member.
+ The values of a column, all the buffers are in the arena (64 byte aligned).
  */
-_WHY_JSON_FUNC_ int json_internal_resize_match_stack(JsonIt *it);
-
-/*
- Count all closing braces and return 0 (with errno == 0 == JSON_ERR_NO_ERROR)
- If a proper closing brace was found else return 1 if no closing braces were
- found and return 0 (with errno != 0) if an error occurred.
+typedef struct json_column_t JsonColumn;
+struct json_column_t {
+  /* a bit per row (least significant first) set if it isn't null */
+  uint8_t *validity;
+  void *values;
+  /* string bytes (JSON_COLUMN_STR only) */
+  char *data;
+  /* rows */
+  size_t len;
+  size_t null_count;
+  size_t data_len;
 
- TODO: Ugh this is ugly, let's fix it.
-       Honestly we could just return 1 and check the type?
-       Still not great
- */
-_WHY_JSON_FUNC_ int json_internal_count_braces(JsonTok *tok, JsonIt *it);
+  /* how many rows / bytes of data fit before growing */
+  size_t cap;
+  size_t data_cap;
+};
 
 /*
- Free a json string
- Automatically done for token and iterator upon next or destroy calls
- so you shouldn't have to do it manually!
+ Flags you can set on a tape (tape.flags) before json_tape_build.
  */
-_WHY_JSON_FUNC_ void json_internal_free_str(JsonStr *str);
+enum json_tape_flag_t {
+  /*
+   Objects and arrays that are identical to one seen earlier are stored once
+   and shared, navigating the tape is the same either way.
+  */
+  JSON_TAPE_DEDUP = 1 << 0,
+};
 
 /*
- Does the character need a '\' before it
+ A whole document flattened into an array of 64 bit words (json_tape_build),
+ every offset in it is relative so it can be written out and mapped back in
+ as is (json_tape_write / json_tape_map).
+
+ Nodes are indexes into words, the root is node 0:
+ - strings are a single word whose payload is an offset into the pool
+ - true, false and null are a single word (the payload of bools is 1 or 0)
+ - integers and floats are a word followed by the int64_t / double
+ - objects and arrays are a word whose payload is how many words they take
+   up (so the next node is node + size) then a word holding how many members
+   / items they have, followed by the items (for objects each is a key string
+   then the value)
+ - with JSON_TAPE_DEDUP an object / array identical to an earlier one is a
+   single word whose payload is the node it's the same as
+ - objects with index_min or more members (WHY_JSON_TAPE_INDEX_MIN if it's
+   0) have WHY_JSON_TAPE_INDEXED set in their count and end with a hash
+   index: a power of two number of uint32_t slots (packed two to a word)
+   holding the offset of each key from the object (0 is empty) then a word
+   holding how many slots there are
+
+ Use the json_tape_* functions rather than reading the words yourself.
  */
-_WHY_JSON_FUNC_ int json_internal_char_needs_escaping(int c);
+typedef struct json_tape_t JsonTape;
+struct json_tape_t {
+  const uint64_t *words;
+  size_t len;
+  /* each string is a uint32_t length, the bytes then a null terminator */
+  const char *pool;
+  size_t pool_len;
+
+  /* what json_tape_free gives back */
+  uint64_t *own_words;
+  char *own_pool;
+  /* the file (json_tape_map) mapped or read in */
+  void *file;
+  size_t file_len;
+  int file_mapped;
+
+  int flags;
+  /* objects with this many members get a hash index (0 is the default) */
+  size_t index_min;
+  /* objects / arrays replaced by a shared node and the words that saved */
+  size_t shared_nodes;
+  size_t shared_words;
+};
 
 /*
- Convert the character to hex equivalent (i.e. 0 => 0, A/a => 10, ...)
- Returns -1 if it failed to convert.
+ What a json_transform rule does to the members / items at its path.
  */
-_WHY_JSON_FUNC_ int json_internal_hex(int c);
+typedef enum JsonTransformOp {
+  /* leaves it out */
+  JSON_TRANSFORM_DROP = 0,
+  /* writes value (which has to be valid json) in place of its value */
+  JSON_TRANSFORM_REPLACE = 1,
+  /* gives the member the key value */
+  JSON_TRANSFORM_RENAME = 2,
+  /*
+   Adds a member (the last part of the path is the key) with value to the
+   end of every object at the rest of the path, it doesn't check if there is
+   one already so pair it with a JSON_TRANSFORM_DROP to replace it.
+  */
+  JSON_TRANSFORM_INSERT = 3,
+} JsonTransformOp;
 
 /*
- Parse a codepoint of size `len` i.e. used for \uXXXX and \UXXXXXXXX
+ A path is the dotted keys from the root, items of arrays are * which also
+ matches any key (i.e. "users.*.password").  A . * or \ that is part of a
+ key is escaped with a \ (i.e. "a\\.b" is the key "a.b").
  */
-_WHY_JSON_FUNC_ int json_internal_parse_codepoint(JsonIt *it,
-                                                  uint32_t *codepoint, int len);
+typedef struct json_transform_rule_t JsonTransformRule;
+struct json_transform_rule_t {
+  const char *path;
+  JsonTransformOp op;
+  const char *value;
+};
 
 /*
- Converts a codepoint to utf8 writing into buf
+ A range of bytes in the source [begin, end) counted from the start of the
+ string or from where the file was when json_file was called.
  */
-_WHY_JSON_FUNC_ int json_internal_to_utf8(char **tmp, size_t *tmp_len,
-                                          size_t *tmp_cap, JsonIt *it,
-                                          uint32_t cp);
+typedef struct json_span_t JsonSpan;
+struct json_span_t {
+  size_t begin;
+  size_t end;
+};
 
 /*
- Parses a 'string' like object till the given ending character.
- Will stop at the ending character
+ What a single step of a JsonPath selects from the object / array before it.
  */
-_WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
-                                                 char ending);
+typedef enum JsonPathStepType {
+  /* .key or ['key'] */
+  JSON_PATH_KEY = 0,
+  /* [i] or [start:end:step] (an index is just [i:i+1]) */
+  JSON_PATH_SLICE = 1,
+  /* .* or [*] */
+  JSON_PATH_ANY = 2,
+  /* [?(@.key op literal)] */
+  JSON_PATH_FILTER = 3,
+} JsonPathStepType;
+
+typedef enum JsonPathOp {
+  /* [?(@.key)] the member is there */
+  JSON_PATH_EXISTS = 0,
+  JSON_PATH_EQ = 1,
+  JSON_PATH_NE = 2,
+  JSON_PATH_LT = 3,
+  JSON_PATH_LE = 4,
+  JSON_PATH_GT = 5,
+  JSON_PATH_GE = 6,
+} JsonPathOp;
+
+typedef struct json_path_step_t JsonPathStep;
+struct json_path_step_t {
+  JsonPathStepType type;
+  /* came after .. so it matches at any depth */
+  int recursive;
+  /* the key (JSON_PATH_KEY) or the member a filter tests (NULL for @) */
+  const char *key;
+  size_t key_len;
+  /* JSON_PATH_SLICE, end is exclusive */
+  size_t start;
+  size_t end;
+  size_t step;
+  /* JSON_PATH_FILTER, numbers are JSON_FLT and booleans are 0 / 1 in num */
+  JsonPathOp op;
+  JsonType literal_type;
+  double num;
+  const char *str;
+  size_t str_len;
+};
 
 /*
- Parse an identifier that is a key without the quotes
+ A compiled json_path_compile expression, free it with json_path_free.
  */
-_WHY_JSON_FUNC_ int json_internal_parse_identifier(JsonStr *out, JsonIt *it);
+typedef struct json_path_t JsonPath;
+struct json_path_t {
+  JsonPathStep steps[WHY_JSON_PATH_MAX_STEPS];
+  int n;
+  /* the keys and strings of the steps point in here */
+  char *strs;
+};
 
 /*
- Parse a key for an object.
+ Bytes a record has to contain (as they are in the source, so watch out for
+ whitespace and escapes) to be worth parsing.
  */
-_WHY_JSON_FUNC_ int json_internal_parse_key(JsonTok *tok, JsonIt *it);
+typedef struct json_filter_term_t JsonFilterTerm;
+struct json_filter_term_t {
+  const char *needle;
+  size_t len;
+  /*
+   Records it was searched for in, how many it was found in (passed / tested
+   is its selectivity) and the bytes that took.
+  */
+  size_t tested;
+  size_t passed;
+  size_t scanned;
+};
 
 /*
- Check if the iterator characters match the given string
- Will stop at the character that failed to match
+ Goes through newline delimited json records (json_filter_init) only giving
+ the ones every term is in.
  */
-_WHY_JSON_FUNC_ int json_internal_matches(const char *str, JsonIt *it);
+typedef struct json_filter_t JsonFilter;
+struct json_filter_t {
+  JsonFilterTerm *terms;
+  int n;
+  /* the order terms are searched for in, the cheapest to rule records out */
+  uint8_t order[WHY_JSON_FILTER_MAX_TERMS];
+  const char *buf;
+  const char *cur;
+  const char *end;
+  /* where the last candidate is in buf (without the newline) */
+  JsonSpan record;
+  /* records (blank lines aren't) and how many were candidates */
+  size_t records;
+  size_t candidates;
+};
 
-/*
- Parses integers and floats.
- */
-_WHY_JSON_FUNC_ int json_internal_parse_num(JsonType *type, JsonValue *value,
-                                            JsonIt *it);
+struct json_schema_node_t;
+struct json_schema_prop_t;
+struct json_schema_enum_t;
 
 /*
- Parses json values i.e. flts, ints, objects, arrays, bool, null, strings
+ A compiled json_schema_compile schema, free it with json_schema_free.
+ Node 0 is the root, the arrays hold onto each other by index.
  */
-_WHY_JSON_FUNC_ int json_internal_parse_value(JsonType *type, JsonValue *value,
-                                              JsonIt *it);
+typedef struct json_schema_t JsonSchema;
+struct json_schema_t {
+  struct json_schema_node_t *nodes;
+  size_t nodes_len;
+  size_t nodes_cap;
+  struct json_schema_prop_t *props;
+  size_t props_len;
+  size_t props_cap;
+  struct json_schema_enum_t *enums;
+  size_t enums_len;
+  size_t enums_cap;
+  /* property / required names, enum strings and patterns */
+  char *strs;
+  size_t strs_len;
+  size_t strs_cap;
+};
 
 /*
- Parses opening braces that is `{` and `[` and handles the stack response
+ The first place json_schema_validate found that doesn't match.
  */
-_WHY_JSON_FUNC_ int json_internal_parse_opening_braces(JsonIt *it);
+typedef struct json_schema_err_t JsonSchemaErr;
+struct json_schema_err_t {
+  /* as a JSONPath i.e. $.friends[2].name */
+  char path[WHY_JSON_SCHEMA_MAX_PATH];
+  const char *msg;
+  /* where the value starts in the source */
+  size_t offset;
+};
 
-/* == Definitions == */
+struct json_tee_t;
 
 /*
-  Taken UTF8 validation from online since building it myself seemed annoying
-  Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
-  See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
-*/
+ Holds the iterator structure itself.
+ Avoid touching this too much outside of cur_line/cur_col/depth/err
 
-/* clang-format off */
-static const uint8_t utf8d[] = {
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 00..1f */
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 20..3f */
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 40..5f */
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 60..7f */
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, /* 80..9f */
-  7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, /* a0..bf */
-  8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, /* c0..df */
-  0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, /* e0..ef */
-  0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, /* f0..ff */
-  0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, /* s0..s0 */
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, /* s1..s2 */
-  1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, /* s3..s4 */
-  1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, /* s5..s6 */
-  1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /* s7..s8 */
+ It's split into the hot part (everything parsing a string touches) which
+ comes first and the cold part, file buffers are allocated separately so a
+ string iterator is only a couple of cache lines.
+ */
+typedef struct json_it_t JsonIt;
+struct json_it_t {
+  /* == Hot == */
+  /* for file streams this is the read buffer (allocated by json_file) */
+  const char *source_str;
+  size_t cur_loc;
+  size_t buf_len;
+  FILE *stream;
+  uint32_t state;
+  /* json_flag_t */
+  uint32_t flags;
+  int depth;
+  /* Nesting deeper than this is an error (WHY_JSON_MAX_DEPTH by default) */
+  int max_depth;
+  int cur_line;
+  int cur_col;
+
+  /* short keys/strings are decoded in here (JsonStr.buf points at them) */
+  char small_key[WHY_JSON_SMALL_STR_SIZE];
+  char small_value[WHY_JSON_SMALL_STR_SIZE];
+
+  /*
+   One bit per level of nesting (set for objects), the first
+   WHY_JSON_INLINE_DEPTH levels are stored inline and only deeper levels
+   spill onto the heap.
+  */
+  uint64_t nesting[(WHY_JSON_INLINE_DEPTH + 63) / 64];
+
+  /* == Cold == */
+  uint64_t *nesting_spill;
+  uint32_t nesting_spill_cap;
+  int tok_init;
+
+  /*
+   The current error message ("" if there isn't one).  It is written into
+   err_buf if you gave one (json_set_err_buf) else a buffer shared by every
+   iterator on the thread, so copy it if you need it after the next error.
+  */
+  const char *err;
+  char *err_buf;
+
+  /* keys (and maybe values) are interned into this if it's set */
+  JsonIntern *intern;
+  /* allocated by json_keyset, freed by json_destroy */
+  JsonKeySet *keyset;
+
+  /*
+   How many keys json_bind matched against the previous record in an array
+   (just a memcmp) vs had to parse because the record was shaped differently.
+  */
+  size_t shape_hits;
+  size_t shape_misses;
+
+  /* how much of the file was read before the current buffer */
+  size_t buf_offset;
+  /*
+   With JSON_FLAG_SPANS where the last value json_next gave is in the source
+   (for objects / arrays it's empty at their opening bracket since they
+   haven't been read yet, use json_skip_raw) or the closing bracket for the
+   end tokens.
+  */
+  JsonSpan span;
+  /* json_transform copies what's read through here */
+  struct json_tee_t *tee;
 };
-/* clang-format on */
 
-_WHY_JSON_FUNC_ char *json_get_str(JsonStr *str, size_t *len) {
-  if (!str->buf) {
-    return NULL;
+/*
+ Use a file as a source for the json iterator.
+ Note: Won't seek to the start so make sure file is set to the location
+       You want reading to start at.
+ */
+_WHY_JSON_FUNC_ int json_file(JsonIt *it, FILE *file);
+
+/*
+ Initialises a json iterator from a constant string
+ You can use literals in this, it won't attempt to edit it.
+ */
+_WHY_JSON_FUNC_ int json_str(JsonIt *it, const char *str);
+
+/*
+ Initialises a json iterator from a buffer that you own and don't mind us
+ writing to (like rapidjson's insitu parsing).
+
+ Strings are decoded and null terminated inside buf itself so no string
+ (other than unquoted keys) is ever allocated, this means that buf gets
+ mangled and strings are only valid as long as buf is.
+ */
+_WHY_JSON_FUNC_ int json_insitu(JsonIt *it, char *buf, size_t len);
+
+/*
+ Gives the iterator it's own buffer (atleast WHY_JSON_ERR_BUF_SIZE chars) to
+ write error messages into rather than the shared one, call it after
+ json_file/json_str/json_insitu.
+ */
+_WHY_JSON_FUNC_ void json_set_err_buf(JsonIt *it, char *buf);
+
+/*
+ Initialises an empty intern table (doesn't allocate till you add to it).
+ */
+_WHY_JSON_FUNC_ void json_intern_init(JsonIntern *table);
+
+/*
+ Frees everything in the table, strings from it are invalid after this.
+ */
+_WHY_JSON_FUNC_ void json_intern_free(JsonIntern *table);
+
+/*
+ Gives the id for the string adding it if it's not there yet, the id never
+ changes so you can add your keys first to know their ids up front.
+
+ Returns -1 if the table is full (WHY_JSON_INTERN_MAX) or out of memory.
+ */
+_WHY_JSON_FUNC_ int json_intern(JsonIntern *table, const char *buf,
+                                size_t len);
+
+/*
+ Like json_intern but doesn't add it (-1 if it's not in the table).
+ */
+_WHY_JSON_FUNC_ int json_intern_find(const JsonIntern *table, const char *buf,
+                                     size_t len);
+
+/*
+ The string for the given id (NULL if it's not valid), null terminated.
+ */
+_WHY_JSON_FUNC_ const char *json_intern_str(const JsonIntern *table, int id,
+                                            size_t *len);
+
+/*
+ Interns every key (and every short string value with
+ JSON_FLAG_INTERN_VALUES) into table setting tok.key_id/value_id, their
+ buffers then point into the table rather than being allocated.
+
+ Only used by json_next, call it after json_file/json_str/json_insitu.
+ */
+_WHY_JSON_FUNC_ void json_set_intern(JsonIt *it, JsonIntern *table);
+
+/*
+ Registers the keys you expect, json_next then sets tok.key_index to the
+ index of the key in keys (or -1 if it isn't one of them) so you can switch
+ on it rather than comparing strings.  With JSON_FLAG_SKIP_UNKNOWN_KEYS
+ members with other keys are skipped without parsing their values.
+
+ keys isn't copied so it has to outlive the iterator (i.e. a static array),
+ pass NULL to remove the key set.  Call it after json_file/json_str.
+ */
+_WHY_JSON_FUNC_ int json_keyset(JsonIt *it, const char *const *keys, int n);
+
+/*
+ Initialises an empty arena (doesn't allocate till you use it).
+ */
+_WHY_JSON_FUNC_ void json_arena_init(JsonArena *arena);
+
+/*
+ Allocates size bytes (aligned for any type) that live till json_arena_free.
+ Returns NULL if out of memory.
+ */
+_WHY_JSON_FUNC_ void *json_arena_alloc(JsonArena *arena, size_t size);
+
+/*
+ Frees everything allocated from the arena.
+ */
+_WHY_JSON_FUNC_ void json_arena_free(JsonArena *arena);
+
+/*
+ Decodes the json (which has to be an object, or an array of them) straight
+ into out as described by desc in one pass.  If it's an array out is a
+ JsonBindArray of desc->size items.
+
+ Strings and arrays are allocated in arena, members with keys that aren't
+ in desc are skipped without being parsed and fields that aren't in the json
+ are left as they were.  Like json_parse_sax the iterator is destroyed once
+ it's done (or an error occurs).
+ */
+_WHY_JSON_FUNC_ int json_bind(JsonIt *it, const JsonBindDesc *desc, void *out,
+                              JsonArena *arena);
+
+/*
+ Streams an array of objects (rows) appending a value per row to each of the
+ n columns in out (as described by specs) without building the rows.
+ Members that aren't in a spec (and arrays) are skipped without parsing them.
+
+ All the buffers are allocated in arena.  A value of the wrong type is an
+ error (JSON_ERR_INVALID_VALUE) as is a non object row.
+ */
+_WHY_JSON_FUNC_ int json_columns(JsonIt *it, const JsonColumnSpec *specs,
+                                 int n, JsonColumn *out, JsonArena *arena);
+
+/*
+ Reads the array tok is at (json_next just gave you a JSON_ARRAY) straight
+ into a buffer of numbers rather than a json_next per number.
+
+ *buf has to be NULL or from malloc, it's grown (realloc) as needed and
+ *cap is how many numbers fit in it.  Either way it's yours to free.
+ *len is how many numbers there were.
+
+ Anything that isn't a number is an error (JSON_ERR_INVALID_VALUE) and *len
+ is then its index.  Afterwards tok is at the end of the array so json_next
+ carries on after it.
+ */
+_WHY_JSON_FUNC_ int json_read_f64_array(JsonTok *tok, JsonIt *it, double **buf,
+                                        size_t *cap, size_t *len);
+
+/*
+ Same as json_read_f64_array but numbers with a fraction or exponent are
+ errors as are ones that don't fit (JSON_ERR_OUT_OF_RANGE).
+ */
+_WHY_JSON_FUNC_ int json_read_i64_array(JsonTok *tok, JsonIt *it,
+                                        int64_t **buf, size_t *cap,
+                                        size_t *len);
+
+/*
+ Reads an array of arrays of numbers (all the same width) into buf one row
+ after the other.  On an error *rows and *width are the row and column of
+ the number that failed (or of the row that is the wrong width).
+ */
+_WHY_JSON_FUNC_ int json_read_f64_matrix(JsonTok *tok, JsonIt *it,
+                                         double **buf, size_t *cap,
+                                         size_t *rows, size_t *width);
+
+/*
+ json_read_f64_matrix for integers (see json_read_i64_array)
+ */
+_WHY_JSON_FUNC_ int json_read_i64_matrix(JsonTok *tok, JsonIt *it,
+                                         int64_t **buf, size_t *cap,
+                                         size_t *rows, size_t *width);
+
+/*
+ Initialises an empty tape.
+ */
+_WHY_JSON_FUNC_ void json_tape_init(JsonTape *tape);
+
+/*
+ Parses the whole document into the tape (which has to be empty), strings
+ are stored once no matter how often they appear (and objects / arrays too
+ with JSON_TAPE_DEDUP in tape->flags).  Like json_parse_sax the iterator is
+ destroyed once it's done.
+ */
+_WHY_JSON_FUNC_ int json_tape_build(JsonIt *it, JsonTape *tape);
+
+/*
+ Frees everything the tape owns (built, mapped or read) and empties it.
+ */
+_WHY_JSON_FUNC_ void json_tape_free(JsonTape *tape);
+
+/*
+ Writes the tape in a versioned binary format (with a checksum) that
+ json_tape_load / json_tape_map can use without parsing anything.
+ */
+_WHY_JSON_FUNC_ int json_tape_write(const JsonTape *tape, FILE *file);
+
+/*
+ Uses a tape that json_tape_write wrote (buf has to be 8 byte aligned and
+ outlive the tape, nothing is copied).  Only the header is checked unless
+ verify is set which also checks the checksum and that every node is in
+ bounds.  Returns 0 setting errno (JSON_ERR_INVALID_VALUE if it's corrupt or
+ from a different version / byte order).
+ */
+_WHY_JSON_FUNC_ int json_tape_load(JsonTape *tape, const void *buf,
+                                   size_t len, int verify);
+
+/*
+ json_tape_load on a file that is mapped read only (or read in if mmap
+ isn't around), it's unmapped by json_tape_free.
+ */
+_WHY_JSON_FUNC_ int json_tape_map(JsonTape *tape, const char *path,
+                                  int verify);
+
+/*
+ How much bigger the tape would be without JSON_TAPE_DEDUP (1 if nothing
+ was shared), i.e. (len + shared_words) / len.
+ */
+_WHY_JSON_FUNC_ double json_tape_dedup_ratio(const JsonTape *tape);
+
+/*
+ The type of a node (JSON_OBJECT, JSON_STRING, ...)
+ */
+_WHY_JSON_FUNC_ JsonType json_tape_type(const JsonTape *tape, size_t node);
+
+/*
+ The node after this one (skipping over everything inside it).
+ */
+_WHY_JSON_FUNC_ size_t json_tape_next(const JsonTape *tape, size_t node);
+
+/*
+ How many members / items an object / array has (0 for anything else).
+ */
+_WHY_JSON_FUNC_ size_t json_tape_len(const JsonTape *tape, size_t node);
+
+/*
+ The first item of an array or the first key of an object (the value is
+ the node after the key) or 0 if it's empty.
+ */
+_WHY_JSON_FUNC_ size_t json_tape_child(const JsonTape *tape, size_t node);
+
+/*
+ The value of the member with the given key or 0 if there isn't one (a
+ hash lookup for objects with an index, otherwise a scan of the keys).
+ */
+_WHY_JSON_FUNC_ size_t json_tape_get(const JsonTape *tape, size_t node,
+                                     const char *key);
+
+/*
+ The i'th item of an array or 0 if it's out of range.
+ */
+_WHY_JSON_FUNC_ size_t json_tape_at(const JsonTape *tape, size_t node,
+                                    size_t i);
+
+/*
+ A string's bytes (null terminated) or NULL if it's not a string.
+ */
+_WHY_JSON_FUNC_ const char *json_tape_str(const JsonTape *tape, size_t node,
+                                          size_t *len);
+
+/*
+ The value of an integer (floats are truncated) or 0.
+ */
+_WHY_JSON_FUNC_ int64_t json_tape_int(const JsonTape *tape, size_t node);
+
+/*
+ The value of a float (integers are converted) or 0.
+ */
+_WHY_JSON_FUNC_ double json_tape_flt(const JsonTape *tape, size_t node);
+
+/*
+ 1 for true, 0 for anything else.
+ */
+_WHY_JSON_FUNC_ int json_tape_bool(const JsonTape *tape, size_t node);
+
+/*
+ Streams the json to out applying the n rules as it goes, everything they
+ don't touch is copied from the source byte for byte (objects / arrays with
+ nothing to change in them are skipped without parsing them) so it runs in
+ constant memory.  Objects / arrays that do have something changed in them
+ are written without whitespace between their members.
+
+ Paths (escaped) longer than WHY_JSON_TRANSFORM_MAX_PATH - 1 are a
+ JSON_ERR_TOO_LONG and going through more than WHY_JSON_TRANSFORM_MAX_PATH / 2
+ levels is a JSON_ERR_TOO_DEEP, rather than copying them without the rules.
+
+ Turns on JSON_FLAG_SPANS and JSON_FLAG_RAW_NUMBERS (and off
+ JSON_FLAG_LAZY_STRINGS), like json_parse_sax the iterator is destroyed once
+ it's done.
+ */
+_WHY_JSON_FUNC_ int json_transform(JsonIt *it, const JsonTransformRule *rules,
+                                   int n, FILE *out);
+
+/*
+ Compiles a JSONPath expression for json_path_query, supported are:
+ - $ the root, .key / ['key'] members, .* / [*] everything in it
+ - ..key / ..* / ..[...] the same but at any depth
+ - [i] and [start:end:step] slices (no negative indexes since we don't know
+   how long the array is until it's over)
+ - [?(@.key op literal)] and [?(@ op literal)] filters where op is one of
+   == != < <= > >= (or left out to test the member is there) and literal
+   is a number, 'string', true, false or null.
+
+ Returns 1 if it compiled else 0 setting errno and (if it isn't NULL) info
+ with where in expr it went wrong.
+ */
+_WHY_JSON_FUNC_ int json_path_compile(JsonPath *path, const char *expr,
+                                      JsonErrInfo *info);
+
+/*
+ Frees the strings the path holds onto.
+ */
+_WHY_JSON_FUNC_ void json_path_free(JsonPath *path);
+
+/*
+ Streams the json calling fn for everything path selects in document order.
+ value is NULL for objects / arrays (span has their bytes) and otherwise
+ only valid till fn returns.
+
+ Only the objects / arrays the path could still match something in are
+ parsed, the rest are skipped without parsing them.  Matches that depend on
+ a filter that hasn't been decided yet (i.e. name before id for
+ $.friends[?(@.id > 1)].name) are held onto until it is.
+
+ Return 0 from fn to stop, json_path_query then returns 0 with errno set to
+ JSON_ERR_ABORTED.  Turns on JSON_FLAG_SPANS (and off
+ JSON_FLAG_LAZY_STRINGS), like json_parse_sax the iterator is destroyed once
+ it's done.
+ */
+_WHY_JSON_FUNC_ int json_path_query(JsonIt *it, const JsonPath *path,
+                                    int (*fn)(void *ctx, JsonType type,
+                                              const JsonValue *value,
+                                              JsonSpan span),
+                                    void *ctx);
+
+/*
+ Sets up filter to go through the len bytes of newline delimited json in buf
+ with the n terms (which it resets the stats of).  Neither are copied so
+ both have to outlive it.
+ */
+_WHY_JSON_FUNC_ int json_filter_init(JsonFilter *filter, JsonFilterTerm *terms,
+                                     int n, const char *buf, size_t len);
+
+/*
+ Moves to the next record that has every term in it and initialises it over
+ just that record (like json_str) so you can check it properly, the terms
+ are only a cheap first pass.  Records that aren't valid utf8 are passed
+ over.
+
+ Every WHY_JSON_FILTER_REORDER records the terms are reordered by how many
+ bytes they take to search for per record they rule out.
+
+ Returns 0 (with errno 0) once there are no more records.
+ */
+_WHY_JSON_FUNC_ int json_filter_next(JsonFilter *filter, JsonIt *it);
+
+/*
+ Compiles a JSON Schema (given as json) for json_schema_validate, supported
+ keywords are type, properties, required, items (a single schema), enum (of
+ strings, numbers, booleans and null), minimum, maximum, minLength,
+ maxLength, minItems, maxItems and pattern.  Patterns support literals, .,
+ [classes], \d \w \s (and their negations), ^ $ and the * + ? quantifiers
+ (no groups, alternation or counts) and match bytes rather than code points.
+ Other keywords are ignored.
+
+ Returns 1 if it compiled else 0 setting errno and (if it isn't NULL) info.
+ */
+_WHY_JSON_FUNC_ int json_schema_compile(JsonSchema *schema, const char *json,
+                                        JsonErrInfo *info);
+
+/*
+ Frees everything the schema holds onto.
+ */
+_WHY_JSON_FUNC_ void json_schema_free(JsonSchema *schema);
+
+/*
+ Checks the json matches schema as it streams, keeping a little state per
+ open object / array rather than building the document.  Objects / arrays
+ the schema says nothing about the insides of are skipped without parsing
+ them (use json_validate if their syntax matters).
+
+ Returns 1 if it matches, otherwise 0 with errno set to JSON_ERR_SCHEMA
+ and err (if it isn't NULL) filled in for the first value that didn't, or
+ whatever error the iterator ran into.  Turns off JSON_FLAG_LAZY_STRINGS
+ (and on JSON_FLAG_SPANS), like json_parse_sax the iterator is destroyed
+ once it's done.
+ */
+_WHY_JSON_FUNC_ int json_schema_validate(JsonIt *it, const JsonSchema *schema,
+                                         JsonSchemaErr *err);
+
+/*
+  Goes to the next element in the json.  If the current element is at an object
+  or array it will stop at the key allowing you to skip it else if you call
+  next it'll step into it.
+*/
+_WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it);
+
+/*
+  Skips the json object useful for when you just want to visit the outer
+  objects or don't want to visit an object for whatever reason.
+
+  Errors if the current key is not an object or array.
+*/
+_WHY_JSON_FUNC_ int json_skip(JsonTok *tok, JsonIt *it);
+
+/*
+  Skips the object / array json_next just gave (without parsing what's in
+  it) giving the range of source bytes it was in, so it can be copied out
+  as is.  Works for any other value too if JSON_FLAG_SPANS is set.
+
+  tok is left as if the object / array was stepped through to its end.
+*/
+_WHY_JSON_FUNC_ int json_skip_raw(JsonTok *tok, JsonIt *it, JsonSpan *span);
+
+/*
+ Destroys the given token and iterator data.
+ Won't free the token itself nor the iterator since presumably
+ you have stack allocated them (or should).
+
+ They both can be NULL in the case you don't know if they are null or
+ you want to just free one.
+ */
+_WHY_JSON_FUNC_ void json_destroy(JsonTok *tok, JsonIt *it);
+
+/*
+ If you want a writeable version you can use this
+ It will avoid allocations by just invalidating the string after this call
+
+ Our strings are by default readonly because it is often more efficient
+ and possibly allows us to re-use buffers in the future!
+ Less Allocations are the better.
+ */
+_WHY_JSON_FUNC_ char *json_get_str(JsonStr *str, size_t *len);
+
+/*
+ Decodes the string into buf (null terminating it) returning the length.
+ buf has to be atleast str->len + 1 (decoding never makes a string longer).
+
+ This is mainly useful for raw strings (JSON_FLAG_LAZY_STRINGS) since you
+ can decode them into your own buffers rather than allocating.
+ */
+_WHY_JSON_FUNC_ size_t json_decode_str_into(const JsonStr *str, char *buf);
+
+/*
+ Converts a raw number to an integer, fails (returning 0) if the number
+ has a fractional part/exponent (errno == JSON_ERR_INVALID_VALUE) or
+ doesn't fit (errno == JSON_ERR_OUT_OF_RANGE).
+ */
+_WHY_JSON_FUNC_ int json_num_as_i64(const JsonNum *num, int64_t *out);
+
+/*
+ Same as json_num_as_i64 but negative numbers are out of range.
+ */
+_WHY_JSON_FUNC_ int json_num_as_u64(const JsonNum *num, uint64_t *out);
+
+/*
+ Converts a raw number to the closest double.
+ */
+_WHY_JSON_FUNC_ double json_num_as_double(const JsonNum *num);
+
+/*
+ Gives you the exact decimal string of the number (null terminated)
+ i.e. for big integers or high precision decimals.
+
+ Like json_get_str it is yours to free.
+ */
+_WHY_JSON_FUNC_ char *json_num_as_str(JsonNum *num, size_t *len);
+
+/*
+ Callbacks for json_parse_sax, any of them can be NULL to ignore that event.
+ Strings (keys and values) are only valid till the callback returns
+ so copy them if you want to keep them around.
+
+ Return 0 from a callback to abort the parse, json_parse_sax will then
+ return 0 with errno set to JSON_ERR_ABORTED.
+ */
+typedef struct json_handler_t JsonHandler;
+struct json_handler_t {
+  int (*start_object)(void *ctx);
+  int (*end_object)(void *ctx);
+  int (*start_array)(void *ctx);
+  int (*end_array)(void *ctx);
+  int (*key)(void *ctx, const char *str, size_t len);
+  int (*string)(void *ctx, const char *str, size_t len);
+  int (*integer)(void *ctx, long value);
+  int (*flt)(void *ctx, double value);
+  int (*boolean)(void *ctx, int value);
+  int (*null)(void *ctx);
+  /* only used if JSON_FLAG_RAW_NUMBERS is set */
+  int (*number)(void *ctx, const JsonNum *num);
+};
+
+/*
+ Parses the entire json in a single loop calling the handler for each token
+ rather than returning to you after each one (i.e. like rapidjson's Reader).
+
+ Follows the same rules (and errors) as json_next and like json_next will
+ destroy the iterator once it's done or an error occurs.  Strings are always
+ decoded (JSON_FLAG_LAZY_STRINGS is cleared).
+ */
+_WHY_JSON_FUNC_ int json_parse_sax(JsonIt *it, const JsonHandler *handler,
+                                   void *ctx);
+
+/*
+ The instruction set the scanning kernels are using, they are picked on first
+ use as the best one your cpu supports.
+ */
+_WHY_JSON_FUNC_ JsonIsa json_active_isa(void);
+
+/*
+ A printable name for the instruction set i.e. "avx2"
+ */
+_WHY_JSON_FUNC_ const char *json_isa_name(JsonIsa isa);
+
+/*
+ Forces the scanning kernels to use a specific instruction set (mostly for
+ testing / benchmarking).  Returns 0 if the cpu (or the compiler) doesn't
+ support it in which case nothing changes.
+
+ This changes the kernels for the whole process and isn't thread safe, other
+ threads parsing at the time may switch part way through so call it before
+ starting any.
+ */
+_WHY_JSON_FUNC_ int json_set_isa(JsonIsa isa);
+
+/*
+ Checks that the len bytes in buf are valid json (following the same strict /
+ relaxed rules as json_next) without producing any tokens or allocating.
+
+ Returns 1 if valid else 0 setting errno and (if it isn't NULL) info.
+ Nesting deeper than WHY_JSON_MAX_DEPTH is an error (JSON_ERR_TOO_DEEP).
+ */
+_WHY_JSON_FUNC_ int json_validate(const char *buf, size_t len,
+                                  JsonErrInfo *info);
+
+#ifndef WHY_JSON_NO_DEFINITIONS
+
+/*
+  == Helper Functions ==
+  These are helper functions and should not be called by your code
+ */
+
+/*
+ Report an error.  Given a format and some var args.
+ */
+#ifdef __GNUC__
+__attribute__((format(printf, 3, 4)))
+#endif
+_WHY_JSON_FUNC_ int
+json_internal_error(JsonIt *it, int err, const char *fmt, ...);
+
+/*
+ Clears the error after a token went fine, unless the stream failed to read
+ or had invalid utf8 in which case that's the error (and it's non zero).
+ */
+_WHY_JSON_FUNC_ int json_internal_clear_error(JsonIt *it);
+
+/*
+  Returns JSON_ACCEPT if the json is legal else JSON_REJECT
+  if neither than it needs more characters to determine.
+ */
+_WHY_JSON_FUNC_ uint32_t json_internal_is_legal_utf8(uint32_t *state,
+                                                     const char *bytes,
+                                                     size_t length);
+
+/*
+  Peeks the next character
+ */
+_WHY_JSON_FUNC_ int json_internal_peek_char(JsonIt *it);
+
+/*
+  Gets the next character moving forward cur_loc and cur_col/line
+  Avoid just doing cur_loc++ and prefer using this to make sure
+  our line numbers are right.
+*/
+_WHY_JSON_FUNC_ int json_internal_next_char(JsonIt *it);
+
+/*
+ Initialise the iterator.
+ Prefer to call json_string/json_file rather than initialising it yourself
+ */
+_WHY_JSON_FUNC_ int json_internal_init(JsonIt *it);
+
+/*
+ Writes the character given into the temporary buffer reallocating as needed
+ Uses a typical reallocation as min 4 (start 8) and doubling each time.
+ */
+_WHY_JSON_FUNC_ int json_internal_into_buf(char **tmp, size_t *tmp_len,
+                                           size_t *tmp_cap, JsonIt *it, int c);
+
+/*
+ Writes n characters into the temporary buffer with a single copy.
+ */
+_WHY_JSON_FUNC_ int json_internal_into_buf_n(char **tmp, size_t *tmp_len,
+                                             size_t *tmp_cap, JsonIt *it,
+                                             const char *src, size_t n);
+
+/*
+ Count trailing zeros (mask can't be 0)
+ */
+_WHY_JSON_FUNC_ int json_internal_ctz(uint64_t mask);
+
+/*
+ The scanning kernels for a single instruction set, see json_active_isa.
+ */
+typedef struct JsonKernels {
+  JsonIsa isa;
+  const char *(*find_str_special)(const char *cur, const char *end,
+                                  char ending);
+  const char *(*skip_whitespace)(const char *cur, const char *end);
+  const char *(*find_structural)(const char *cur, const char *end);
+  const char *(*skip_ascii)(const char *cur, const char *end);
+  const char *(*find_substr)(const char *cur, const char *end,
+                             const char *needle, size_t len);
+} JsonKernels;
+
+/*
+ Is the instruction set supported by both the compiler and the cpu.
+ */
+_WHY_JSON_FUNC_ int json_internal_isa_supported(JsonIsa isa);
+
+/*
+ The kernels currently in use, picks the best ones on the first call.
+ */
+_WHY_JSON_FUNC_ const JsonKernels *json_internal_kernels(void);
+
+/*
+ Finds the first character in [cur, end) that has to be handled specially
+ inside of a string that is `"`, `\`, `ending` or a control character.
+ Returns end if there isn't one.
+ */
+_WHY_JSON_FUNC_ const char *
+json_internal_find_str_special(const char *cur, const char *end, char ending);
+
+/*
+ Returns the first character in [cur, end) that isn't whitespace (or end).
+ */
+_WHY_JSON_FUNC_ const char *json_internal_skip_whitespace(const char *cur,
+                                                         const char *end);
+
+/*
+ Returns the first bracket or quote in [cur, end) (or end).
+ */
+_WHY_JSON_FUNC_ const char *json_internal_find_structural(const char *cur,
+                                                         const char *end);
+
+/*
+ Returns the first byte in [cur, end) that isn't ascii (or end).
+ */
+_WHY_JSON_FUNC_ const char *json_internal_skip_ascii(const char *cur,
+                                                    const char *end);
+
+/*
+ Returns the first place in [cur, end) the len bytes of needle are (or end).
+ */
+_WHY_JSON_FUNC_ const char *json_internal_find_substr(const char *cur,
+                                                     const char *end,
+                                                     const char *needle,
+                                                     size_t len);
+
+/*
+ Copies all the characters that don't need special handling (as per above)
+ into tmp a run at a time.  Leaves the iterator at the special char (or EOF).
+ */
+_WHY_JSON_FUNC_ int json_internal_str_run(JsonIt *it, char **tmp,
+                                          size_t *tmp_len, size_t *tmp_cap,
+                                          char ending);
+
+/*
+ Is the character whitespace.
+
+ NOTE: As according to the JSON RPC Spec it will only check for ascii
+ whitespace i.e. '\r', '\n', '\t', ' ' and won't check for Unicode whitespace
+ */
+_WHY_JSON_FUNC_ int json_internal_is_whitespace(char c);
+
+/*
+ Ignore all whitespace moving the iterator to the first non-whitespace char
+ */
+_WHY_JSON_FUNC_ void json_internal_ignore_whitespace(JsonIt *it);
+
+/*
+ Is the innermost collection an object (0 if we aren't in any)
+ */
+_WHY_JSON_FUNC_ int json_internal_in_object(const JsonIt *it);
+
+/*
+ Pushes a new level of nesting, errors if it's nested too deeply.
+ */
+_WHY_JSON_FUNC_ int json_internal_push_nesting(JsonIt *it, int is_object);
+
+/*
+ Count all closing braces and return 0 (with errno == 0 == JSON_ERR_NO_ERROR)
+ If a proper closing brace was found else return 1 if no closing braces were
+ found and return 0 (with errno != 0) if an error occurred.
+
+ TODO: Ugh this is ugly, let's fix it.
+       Honestly we could just return 1 and check the type?
+       Still not great
+ */
+_WHY_JSON_FUNC_ int json_internal_count_braces(JsonTok *tok, JsonIt *it);
+
+/*
+ Free a json string
+ Automatically done for token and iterator upon next or destroy calls
+ so you shouldn't have to do it manually!
+ */
+_WHY_JSON_FUNC_ void json_internal_free_str(JsonStr *str);
+
+/*
+ Does the character need a '\' before it
+ */
+_WHY_JSON_FUNC_ int json_internal_char_needs_escaping(int c);
+
+/*
+ Convert the character to hex equivalent (i.e. 0 => 0, A/a => 10, ...)
+ Returns -1 if it failed to convert.
+ */
+_WHY_JSON_FUNC_ int json_internal_hex(int c);
+
+/*
+ Parse a codepoint of size `len` i.e. used for \uXXXX and \UXXXXXXXX
+ */
+_WHY_JSON_FUNC_ int json_internal_parse_codepoint(JsonIt *it,
+                                                  uint32_t *codepoint, int len);
+
+/*
+ Converts a codepoint to utf8 writing into buf
+ */
+_WHY_JSON_FUNC_ int json_internal_to_utf8(char **tmp, size_t *tmp_len,
+                                          size_t *tmp_cap, JsonIt *it,
+                                          uint32_t cp);
+
+/*
+ Converts a codepoint to utf8 writing into out returning the amount written
+ (0 if it isn't a valid codepoint).
+ */
+_WHY_JSON_FUNC_ int json_internal_encode_utf8(uint32_t cp, char *out);
+
+/*
+ Reads `len` hex characters from src into codepoint
+ */
+_WHY_JSON_FUNC_ int json_internal_hex_codepoint(const char *src, size_t len,
+                                                uint32_t *codepoint);
+
+/*
+ Decodes all the escapes in src writing the result into out, it is fine for
+ out to be src (it'll never write past where it has read).  out can be NULL
+ if you just want to check that the escapes are valid.
+
+ Errors are reported to the iterator if given else just through errno.
+ */
+_WHY_JSON_FUNC_ int json_internal_unescape(JsonIt *it, const char *src,
+                                           size_t len, char *out,
+                                           size_t *out_len);
+
+/*
+ Scans a string (after the opening quote) without decoding it for
+ JSON_FLAG_LAZY_STRINGS.  Will point into the source if it can.
+ */
+_WHY_JSON_FUNC_ int json_internal_scan_str(JsonStr *out, JsonIt *it);
+
+/*
+ Parses a 'string' like object till the given ending character.
+ Will stop at the ending character
+
+ If small isn't NULL (it->small_key/small_value) short strings are decoded
+ into it rather than allocated.
+ */
+_WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
+                                                 char ending, char *small);
+
+/*
+ Swaps the (decoded) string for the interned copy setting id, id is -1 if
+ the string can't be interned (too long, table full, or raw with escapes).
+ */
+_WHY_JSON_FUNC_ void json_internal_intern_str(JsonIt *it, JsonStr *str,
+                                              int16_t *id);
+
+/*
+ Allocates from the arena with the given alignment (a power of 2).
+ */
+_WHY_JSON_FUNC_ void *json_internal_arena_alloc(JsonArena *arena, size_t size,
+                                                size_t align);
+
+/*
+ The decoded bytes of key (only different for lazy keys with escapes which
+ are decoded into scratch), NULL if it's too long for scratch.
+ */
+_WHY_JSON_FUNC_ const char *
+json_internal_decoded_key(const JsonStr *key,
+                          char scratch[WHY_JSON_INTERN_MAX_LEN + 1],
+                          size_t *len);
+
+/*
+ The keys of the first record of an array json_bind has seen (in order).
+ Records after it are checked against them with a memcmp on the source
+ rather than parsing each key.
+ */
+typedef struct JsonBindShape {
+  int len;
+  /* set once the first record is done */
+  int learned;
+  /* NULL if the key can't be matched as is (i.e. it had escapes) */
+  const char *keys[WHY_JSON_SHAPE_MAX_KEYS];
+  uint32_t lens[WHY_JSON_SHAPE_MAX_KEYS];
+  /* index into desc->fields or -1 if it's skipped */
+  int16_t fields[WHY_JSON_SHAPE_MAX_KEYS];
+} JsonBindShape;
+
+/*
+ If the source is at "key" moves past it and returns 1 else doesn't move.
+ */
+_WHY_JSON_FUNC_ int json_internal_match_key(JsonIt *it, const char *key,
+                                            size_t len);
+
+/*
+ Binds a single value into dst as described by field.
+ */
+_WHY_JSON_FUNC_ int json_internal_bind_value(JsonIt *it, JsonArena *arena,
+                                             JsonTok *tok,
+                                             const JsonBindField *field,
+                                             char *dst);
+
+/*
+ Binds an object into out, the iterator should be at the '{'.
+ shape is only given for records of an array (else NULL).
+ */
+_WHY_JSON_FUNC_ int json_internal_bind_object(JsonIt *it, JsonArena *arena,
+                                              JsonTok *tok,
+                                              const JsonBindDesc *desc,
+                                              char *out, JsonBindShape *shape);
+
+/*
+ Binds an array of desc into out, the iterator should be at the '['.
+ */
+_WHY_JSON_FUNC_ int json_internal_bind_array(JsonIt *it, JsonArena *arena,
+                                             JsonTok *tok,
+                                             const JsonBindDesc *desc,
+                                             JsonBindArray *out);
+
+/*
+ Makes sure there is room for another row in the column (and need more
+ bytes of data).
+ */
+_WHY_JSON_FUNC_ int json_internal_column_reserve(JsonIt *it, JsonArena *arena,
+                                                 const JsonColumnSpec *spec,
+                                                 JsonColumn *col, size_t need);
+
+/*
+ Appends tok's value to the column, tok is NULL if the row didn't have it.
+ */
+_WHY_JSON_FUNC_ int json_internal_column_append(JsonIt *it, JsonArena *arena,
+                                                const JsonColumnSpec *spec,
+                                                JsonColumn *col,
+                                                const JsonTok *tok);
+
+/*
+ The column whose path is path (or if prefix is set that is nested inside
+ it) or -1.
+ */
+_WHY_JSON_FUNC_ int json_internal_column_find(const JsonColumnSpec *specs,
+                                              int n, const char *path,
+                                              size_t len, int prefix);
+
+/*
+ Parses a number that is entirely in [cur, end) into out (a double or an
+ int64_t), returns 0 if it's not in the simple form (or too long) we handle.
+ */
+_WHY_JSON_FUNC_ int json_internal_fast_num(const char *cur, const char *end,
+                                           int integral, void *out);
+
+/*
+ Reads a single number into out (a double or an int64_t), only sets errno.
+ */
+_WHY_JSON_FUNC_ int json_internal_read_num(JsonIt *it, int integral,
+                                           void *out);
+
+/*
+ Reads an array of numbers (the iterator at the '[') onto the end of buf,
+ *count is how many (or the index of the failing one).
+ row is only for errors, (size_t)-1 if it's not in a matrix.
+ */
+_WHY_JSON_FUNC_ int json_internal_read_row(JsonIt *it, int integral,
+                                           void **buf, size_t *cap,
+                                           size_t *len, size_t *count,
+                                           size_t row);
+
+/*
+ What all the json_read_*_array / matrix functions share, width is NULL for
+ flat arrays (where rows is the length).
+ */
+_WHY_JSON_FUNC_ int json_internal_read_nums(JsonTok *tok, JsonIt *it,
+                                            int integral, void **buf,
+                                            size_t *cap, size_t *rows,
+                                            size_t *width);
+
+/*
+ The state json_tape_build keeps on the side.
+ */
+typedef struct JsonTapeBuilder {
+  JsonTape *tape;
+  size_t cap;
+  size_t pool_cap;
+  /* pool offset + 1 of every distinct string (0 is empty) */
+  size_t *slots;
+  size_t slot_mask;
+  size_t strings;
+  /* where each open object / array starts */
+  size_t *stack;
+  size_t depth;
+  size_t stack_cap;
+  /* JSON_TAPE_DEDUP: the hash of each open object / array so far */
+  uint64_t *hashes;
+  /* pairs of a hash and node + 1 of every distinct object / array */
+  uint64_t *nodes;
+  size_t node_mask;
+  size_t node_count;
+} JsonTapeBuilder;
+
+/*
+ What json_tape_write puts before the words and pool.
+ */
+typedef struct JsonTapeHeader {
+  char magic[8];
+  uint32_t version;
+  /* 0x01020304 as written so a different byte order is caught */
+  uint32_t byte_order;
+  uint64_t len;
+  uint64_t pool_len;
+  uint64_t checksum;
+  uint64_t shared_nodes;
+  uint64_t shared_words;
+  uint64_t reserved[1];
+} JsonTapeHeader;
+
+/*
+ Makes sure n more words fit on the tape.
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_reserve(JsonTapeBuilder *b, size_t n);
+
+/*
+ Appends n words to the tape.
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_emit(JsonTapeBuilder *b, uint64_t word,
+                                            uint64_t extra, int n);
+
+/*
+ Appends a string node (adding it to the pool if it's new).
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_str(JsonTapeBuilder *b,
+                                           const JsonStr *str);
+
+/*
+ Appends a hash index of the keys to the object that starts at start.
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_index(JsonTapeBuilder *b, size_t start);
+
+/*
+ Checks an object's hash index has every key (and nothing else) in it.
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_check_index(const JsonTape *tape,
+                                                   size_t start);
+
+/*
+ Called as an object / array ends with its hash, if there is an identical
+ one already it is replaced by a shared node.
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_share(JsonTapeBuilder *b, size_t start,
+                                             uint64_t hash);
+
+/*
+ The node a shared node stands for (anything else is itself).
+ */
+_WHY_JSON_FUNC_ size_t json_internal_tape_resolve(const JsonTape *tape,
+                                                  size_t node);
+
+/*
+ Are the two nodes the same json.
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_same(const JsonTape *tape, size_t a,
+                                            size_t b);
+
+/*
+ 64 bit FNV-1a style hash of buf a word at a time (zero padded).
+ */
+_WHY_JSON_FUNC_ uint64_t json_internal_tape_checksum(const void *buf,
+                                                     size_t len, uint64_t hash);
+
+/*
+ Checks every node is in bounds and well formed.
+ */
+_WHY_JSON_FUNC_ int json_internal_tape_verify(const JsonTape *tape);
+
+/*
+ Where json_transform is copying from (an absolute offset) and to.
+ */
+typedef struct json_tee_t {
+  FILE *out;
+  size_t from;
+} JsonTee;
+
+/*
+ Writes what's left of the tee up to upto (which is in the current buffer).
+ */
+_WHY_JSON_FUNC_ void json_internal_tee(JsonIt *it, size_t upto);
+
+/*
+ How long the segment at the start of path is (up to the first . that isn't
+ escaped).
+ */
+_WHY_JSON_FUNC_ size_t json_internal_path_seg(const char *path, size_t len);
+
+/*
+ Matches path (len bytes, dotted) against the start of pattern giving the
+ rest of pattern ("" if it matched all of it) or NULL.
+ */
+_WHY_JSON_FUNC_ const char *json_internal_path_rest(const char *pattern,
+                                                    const char *path,
+                                                    size_t len);
+
+/*
+ Writes buf as a quoted json string.
+ */
+_WHY_JSON_FUNC_ void json_internal_write_str(FILE *out, const char *buf,
+                                             size_t len);
+
+/*
+ Writes the scalar json_next just gave, copied from the source if it's
+ still in the buffer.
+ */
+_WHY_JSON_FUNC_ void json_internal_write_scalar(JsonIt *it, const JsonTok *tok,
+                                                FILE *out);
+
+/*
+ Skips the object / array json_next just gave copying it to out (unless
+ it's NULL).
+ */
+_WHY_JSON_FUNC_ int json_internal_copy_value(JsonTok *tok, JsonIt *it,
+                                             FILE *out);
+
+/*
+ Reads the digits at *cur (moving it past them) or returns 0 if there are
+ none.
+ */
+_WHY_JSON_FUNC_ int json_internal_path_uint(const char **cur, size_t *value);
+
+/*
+ Copies the len bytes at src to the end of strs (null terminating them).
+ */
+_WHY_JSON_FUNC_ const char *json_internal_path_copy(char *strs, size_t *used,
+                                                    const char *src,
+                                                    size_t len);
+
+/*
+ Parses the filter at *cur (just after the ?) into step moving *cur past it.
+ Returns why it couldn't or NULL.
+ */
+_WHY_JSON_FUNC_ const char *json_internal_path_filter(const char **cur,
+                                                      JsonPathStep *step,
+                                                      char *strs,
+                                                      size_t *used);
+
+/*
+ Where json_path_query is in one object / array it is going through.
+ */
+typedef struct json_path_frame_t {
+  /* bit i is set if steps [0, i) matched (bit n means it's a match) */
+  uint64_t states;
+  /* filters waiting on a member of this object */
+  uint64_t pending;
+  /*
+   The filter each state is waiting on (frame * 64 + step) or -1 if it
+   isn't, and what each pending filter waits on once it passes.
+  */
+  int64_t dep[WHY_JSON_PATH_MAX_STEPS + 1];
+  int64_t then[WHY_JSON_PATH_MAX_STEPS];
+  size_t index;
+  /* the result it is a match for or SIZE_MAX */
+  size_t result;
+  int is_object;
+} JsonPathFrame;
+
+/*
+ A match waiting on a filter (dep) or on the ones before it, the bytes of
+ strings / raw numbers are at offset in the query's byte buffer.
+ */
+typedef struct json_path_result_t {
+  int64_t dep;
+  JsonType type;
+  /* dropped since its filter failed */
+  uint8_t dropped;
+  /* an object / array that hasn't ended yet */
+  uint8_t open;
+  JsonValue value;
+  size_t offset;
+  JsonSpan span;
+} JsonPathResult;
+
+typedef struct json_path_run_t {
+  const JsonPath *path;
+  JsonPathFrame *frames;
+  size_t frame_cap;
+  size_t top;
+
+  JsonPathResult *results;
+  size_t result_head;
+  size_t result_len;
+  size_t result_cap;
+  char *bytes;
+  size_t bytes_len;
+  size_t bytes_cap;
+
+  int (*fn)(void *ctx, JsonType type, const JsonValue *value, JsonSpan span);
+  void *ctx;
+  /* fn asked us to stop */
+  int aborted;
+} JsonPathRun;
+
+/*
+ Adds state to frame, a state that doesn't wait on a filter wins over one
+ that does.
+ */
+_WHY_JSON_FUNC_ void json_internal_path_add(JsonPathFrame *frame, int state,
+                                            int64_t dep);
+
+/*
+ Does the step (ignoring filters) match the member / item tok.
+ */
+_WHY_JSON_FUNC_ int json_internal_path_matches(const JsonPathStep *step,
+                                               int in_object,
+                                               const JsonTok *tok,
+                                               size_t index);
+
+/*
+ Does the value tok pass the comparison of the filter step.
+ */
+_WHY_JSON_FUNC_ int json_internal_path_test(const JsonPathStep *step,
+                                            const JsonTok *tok);
+
+/*
+ Decides the filter (frame * 64 + step) passing on or dropping everything
+ waiting on it.
+ */
+_WHY_JSON_FUNC_ void json_internal_path_resolve(JsonPathRun *run,
+                                                size_t frame, int step,
+                                                int pass);
+
+/*
+ Gives fn the match (or holds onto it if it or one before it is waiting).
+ Returns 0 if we are out of memory or fn aborted.
+ */
+_WHY_JSON_FUNC_ int json_internal_path_result(JsonPathRun *run, int64_t dep,
+                                              JsonType type,
+                                              const JsonValue *value,
+                                              JsonSpan span, int open);
+
+/*
+ Gives fn the matches at the front that aren't waiting anymore.
+ */
+_WHY_JSON_FUNC_ int json_internal_path_flush(JsonPathRun *run);
+
+/*
+ Initialises it over the len bytes of str (json_str without the strlen).
+ */
+_WHY_JSON_FUNC_ int json_internal_str(JsonIt *it, const char *str, size_t len);
+
+/*
+ The bytes searched per record ruled out (lower is better to do first).
+ */
+_WHY_JSON_FUNC_ double json_internal_filter_rank(const JsonFilterTerm *term);
+
+/*
+ Puts the terms in order of their rank.
+ */
+_WHY_JSON_FUNC_ void json_internal_filter_reorder(JsonFilter *filter);
+
+/*
+ What a json_schema_node_t allows, type is a bit per JSON Schema type (0 is
+ any of them) and limits says which of the limits are set.
+ */
+enum json_schema_bits_t {
+  JSON_SCHEMA_STRING = 1 << 0,
+  JSON_SCHEMA_NUMBER = 1 << 1,
+  JSON_SCHEMA_INTEGER = 1 << 2,
+  JSON_SCHEMA_BOOLEAN = 1 << 3,
+  JSON_SCHEMA_NULL = 1 << 4,
+  JSON_SCHEMA_OBJECT = 1 << 5,
+  JSON_SCHEMA_ARRAY = 1 << 6,
+  /* the false schema */
+  JSON_SCHEMA_NOTHING = 1 << 7,
+
+  JSON_SCHEMA_MINIMUM = 1 << 0,
+  JSON_SCHEMA_MAXIMUM = 1 << 1,
+  JSON_SCHEMA_MIN_LENGTH = 1 << 2,
+  JSON_SCHEMA_MAX_LENGTH = 1 << 3,
+  JSON_SCHEMA_MIN_ITEMS = 1 << 4,
+  JSON_SCHEMA_MAX_ITEMS = 1 << 5,
+};
+
+typedef struct json_schema_node_t {
+  uint32_t types;
+  uint32_t limits;
+  double minimum;
+  double maximum;
+  size_t min_length;
+  size_t max_length;
+  size_t min_items;
+  size_t max_items;
+  /* the first of a list of properties or -1 */
+  int props;
+  /* the schema of every item or -1 */
+  int items;
+  /* required names are [required, required + required_len) of the props */
+  int required;
+  int required_len;
+  int enums;
+  int enums_len;
+  /* in strs (null terminated) or SIZE_MAX */
+  size_t pattern;
+} JsonSchemaNode;
+
+/*
+ A member of properties (next is the one after in the node or -1) or a
+ required name (node is -1).
+ */
+typedef struct json_schema_prop_t {
+  size_t name;
+  size_t len;
+  int node;
+  int next;
+} JsonSchemaProp;
+
+typedef struct json_schema_enum_t {
+  JsonType type;
+  double num;
+  size_t str;
+  size_t len;
+} JsonSchemaEnum;
+
+/*
+ What json_schema_validate keeps for each open object / array.
+ */
+typedef struct json_schema_frame_t {
+  int node;
+  int is_object;
+  /* bit i is set once required name i was seen */
+  uint64_t seen;
+  size_t count;
+  /* how much of the path is this object / array */
+  size_t path_len;
+} JsonSchemaFrame;
+
+/*
+ One character / class / escape of a pattern and what repeats it (0, *, +
+ or ?).
+ */
+typedef struct json_re_atom_t {
+  const char *re;
+  size_t len;
+  char quantifier;
+} JsonReAtom;
+
+/*
+ A pattern as a list of atoms, state i is "about to match atom i" and state
+ len is a match.
+ */
+typedef struct json_re_t {
+  JsonReAtom atoms[WHY_JSON_SCHEMA_MAX_ATOMS];
+  size_t len;
+  int bol;
+  int eol;
+} JsonRe;
+
+/*
+ Makes room for one more element of size in *buf, 0 if we are out of
+ memory.
+ */
+_WHY_JSON_FUNC_ int json_internal_schema_grow(void **buf, size_t len,
+                                              size_t *cap, size_t size);
+
+/*
+ Copies the len bytes of str into the schema's strs (null terminated)
+ giving where or SIZE_MAX if we are out of memory.
+ */
+_WHY_JSON_FUNC_ size_t json_internal_schema_str(JsonSchema *schema,
+                                                const char *str, size_t len);
+
+/*
+ Compiles the schema json_next just gave (an object or boolean) giving its
+ node or -1 with *msg set (unless it was the iterator that failed).
+ */
+_WHY_JSON_FUNC_ int json_internal_schema_node(JsonSchema *schema, JsonIt *it,
+                                              JsonTok *tok, const char **msg);
+
+/*
+ The number json_next just gave as a double.
+ */
+_WHY_JSON_FUNC_ int json_internal_schema_number(const JsonTok *tok,
+                                                double *num);
+
+/*
+ Returns why the value json_next just gave doesn't match the node or NULL.
+ */
+_WHY_JSON_FUNC_ const char *json_internal_schema_check(const JsonSchema *schema,
+                                                       int node,
+                                                       const JsonTok *tok);
+
+/*
+ Appends the member key / item index to path (unless it doesn't fit) giving
+ its new length.
+ */
+_WHY_JSON_FUNC_ size_t json_internal_schema_segment(char *path, size_t len,
+                                                    const char *key,
+                                                    size_t key_len,
+                                                    int is_object,
+                                                    size_t index);
+
+/*
+ Splits the pattern into atoms, 0 if it isn't one we can run.
+ */
+_WHY_JSON_FUNC_ int json_internal_re_compile(JsonRe *out, const char *re);
+
+/*
+ How many bytes the character / class / escape at re takes up.
+ */
+_WHY_JSON_FUNC_ size_t json_internal_re_atom_len(const char *re);
+
+/*
+ Does c match the escape \e (i.e. d for \d).
+ */
+_WHY_JSON_FUNC_ int json_internal_re_escape(char e, unsigned char c);
+
+/*
+ Does the single atom at re (len bytes) match c.
+ */
+_WHY_JSON_FUNC_ int json_internal_re_atom(const char *re, size_t len,
+                                          unsigned char c);
+
+/*
+ Adds the states that can be reached from set without reading anything.
+ */
+_WHY_JSON_FUNC_ void json_internal_re_closure(const JsonRe *re, uint64_t *set);
+
+/*
+ Does re match anywhere in text (unless it starts with ^), this runs every
+ state at once so it's O(len * atoms) whatever the pattern / text.
+ */
+_WHY_JSON_FUNC_ int json_internal_re_search(const char *re, const char *text,
+                                            size_t len);
+
+/*
+ The index of the key in the key set or -1.
+ */
+_WHY_JSON_FUNC_ int json_internal_keyset_find(const JsonKeySet *set,
+                                              const char *buf, size_t len);
+
+/*
+ Moves the iterator to `to` (inside of the current buffer) keeping the line
+ and column up to date.
+ */
+_WHY_JSON_FUNC_ void json_internal_advance(JsonIt *it, const char *to);
+
+/*
+ Skips over a string (after the opening quote) without decoding it.
+ */
+_WHY_JSON_FUNC_ int json_internal_skip_str(JsonIt *it);
+
+/*
+ Skips over an entire value (collections and all) without producing tokens
+ or decoding anything, brackets still have to match.
+ */
+_WHY_JSON_FUNC_ int json_internal_skip_value(JsonIt *it);
+
+/*
+ 32 bit FNV-1a, used for the intern table.
+ */
+_WHY_JSON_FUNC_ uint32_t json_internal_hash(const char *buf, size_t len);
+
+/*
+ Is buf one of the iterator's small string buffers (so we can't free it)
+ */
+_WHY_JSON_FUNC_ int json_internal_is_small_str(const JsonIt *it,
+                                               const char *buf);
+
+/*
+ Parse an identifier that is a key without the quotes
+ */
+_WHY_JSON_FUNC_ int json_internal_parse_identifier(JsonStr *out, JsonIt *it,
+                                                   char *small);
+
+/*
+ Parse a key for an object.
+ */
+_WHY_JSON_FUNC_ int json_internal_parse_key(JsonTok *tok, JsonIt *it);
+
+/*
+ Check if the iterator characters match the given string
+ Will stop at the character that failed to match
+ */
+_WHY_JSON_FUNC_ int json_internal_matches(const char *str, JsonIt *it);
+
+/*
+ Parses integers and floats.
+ */
+_WHY_JSON_FUNC_ int json_internal_parse_num(JsonType *type, JsonValue *value,
+                                            JsonIt *it);
+
+/*
+ Parses json values i.e. flts, ints, objects, arrays, bool, null, strings
+ */
+_WHY_JSON_FUNC_ int json_internal_parse_value(JsonType *type, JsonValue *value,
+                                              JsonIt *it);
+
+/*
+ Parses opening braces that is `{` and `[` and handles the stack response
+ */
+_WHY_JSON_FUNC_ int json_internal_parse_opening_braces(JsonIt *it);
+
+/*
+ Returns the offset of the first invalid (or unfinished) utf8 sequence
+ or length if there isn't one.
+ */
+_WHY_JSON_FUNC_ size_t json_internal_utf8_invalid_at(const char *bytes,
+                                                    size_t length);
+
+/*
+ Checks the escape just after a `\` returning how many characters it takes
+ up or 0 (setting errno) if it's invalid.
+ */
+_WHY_JSON_FUNC_ size_t json_internal_validate_escape(const char *cur,
+                                                    const char *end);
+
+/*
+ Checks a string (after the opening quote) up to the ending character,
+ returns the character after the ending or NULL (setting errno, msg and
+ fail_at) if it's invalid.
+ */
+_WHY_JSON_FUNC_ const char *
+json_internal_validate_str(const char *cur, const char *end, char ending,
+                           const char **msg, const char **fail_at);
+
+/*
+ Checks a number returning the character after it or NULL (like above).
+ Accepts the same numbers as json_internal_parse_num.
+ */
+_WHY_JSON_FUNC_ const char *json_internal_validate_num(const char *cur,
+                                                      const char *end,
+                                                      const char **msg,
+                                                      const char **fail_at);
+
+/*
+ Calls the handler callback for a scalar value (not objects/arrays)
+ */
+_WHY_JSON_FUNC_ int json_internal_sax_value(const JsonHandler *handler,
+                                            void *ctx, JsonType type,
+                                            JsonValue *value);
+
+/* == Definitions == */
+
+/*
+  Taken UTF8 validation from online since building it myself seemed annoying
+  Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
+  See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
+*/
+
+/* clang-format off */
+static const uint8_t utf8d[] = {
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 00..1f */
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 20..3f */
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 40..5f */
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 60..7f */
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, /* 80..9f */
+  7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, /* a0..bf */
+  8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, /* c0..df */
+  0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, /* e0..ef */
+  0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, /* f0..ff */
+  0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, /* s0..s0 */
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, /* s1..s2 */
+  1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, /* s3..s4 */
+  1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, /* s5..s6 */
+  1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /* s7..s8 */
+};
+/* clang-format on */
+
+_WHY_JSON_FUNC_ char *json_get_str(JsonStr *str, size_t *len) {
+  if (!str->buf) {
+    return NULL;
+  }
+
+  if (str->allocated) {
+    char *tmp = (char *)str->buf;
+    size_t tmp_len = str->len;
+    if (str->raw && str->has_escapes) {
+      /* decoding only ever shrinks so we can do it in place */
+      tmp_len = json_decode_str_into(str, tmp);
+    }
+    if (len) {
+      *len = tmp_len;
+    }
+    str->allocated = 0;
+    str->raw = 0;
+    str->has_escapes = 0;
+    str->buf = NULL;
+    str->len = 0;
+    return tmp;
+  } else {
+    char *tmp = malloc(sizeof(char) * (str->len + 1));
+    if (tmp == NULL) {
+      errno = JSON_ERR_OOM;
+      return NULL;
+    }
+    size_t tmp_len = json_decode_str_into(str, tmp);
+    if (len) {
+      *len = tmp_len;
+    }
+    return tmp;
+  }
+}
+
+_WHY_JSON_FUNC_ size_t json_decode_str_into(const JsonStr *str, char *buf) {
+  size_t len = str->len;
+  if (str->raw && str->has_escapes) {
+    if (!json_internal_unescape(NULL, str->buf, str->len, buf, &len)) {
+      len = 0;
+    }
+  } else if (buf != str->buf) {
+    memmove(buf, str->buf, len);
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/*
+ The shared error buffer has to be per thread, define WHY_JSON_THREAD_LOCAL
+ yourself for compilers we don't know (as nothing if you only ever use one
+ thread).
+ */
+#if defined WHY_JSON_THREAD_LOCAL
+#define WHY_JSON_INTERNAL_THREAD_LOCAL WHY_JSON_THREAD_LOCAL
+#elif defined _MSC_VER
+#define WHY_JSON_INTERNAL_THREAD_LOCAL __declspec(thread)
+#elif defined __GNUC__
+#define WHY_JSON_INTERNAL_THREAD_LOCAL __thread
+#elif defined __STDC_VERSION__ && __STDC_VERSION__ >= 201112L
+#define WHY_JSON_INTERNAL_THREAD_LOCAL _Thread_local
+#else
+#error "No thread local storage for errors, #define WHY_JSON_THREAD_LOCAL"
+#endif
+
+/* where the error message goes if the iterator doesn't have it's own buffer */
+static WHY_JSON_INTERNAL_THREAD_LOCAL char
+    json_internal_err_buf[WHY_JSON_ERR_BUF_SIZE];
+
+#undef WHY_JSON_INTERNAL_THREAD_LOCAL
+
+_WHY_JSON_FUNC_ int json_internal_error(JsonIt *it, int err, const char *fmt,
+                                        ...) {
+  int res;
+  char *buf = it->err_buf ? it->err_buf : json_internal_err_buf;
+  if (it->stream != NULL && ferror(it->stream)) {
+    errno = JSON_ERR_CANT_READ;
+    res = snprintf(buf, WHY_JSON_ERR_BUF_SIZE, "Read failure occurred");
+  } else if (it->state == WHY_JSON_UTF8_REJECT ||
+             (it->stream != NULL && feof(it->stream) &&
+              it->state != WHY_JSON_UTF8_ACCEPT)) {
+    errno = JSON_ERR_INVALID_UTF8;
+    res = snprintf(buf, WHY_JSON_ERR_BUF_SIZE, "Invalid Utf8 Sequence");
+  } else if (err == JSON_ERR_NO_ERROR) {
+    /* this happens for every token so don't bother formatting anything */
+    errno = JSON_ERR_NO_ERROR;
+    it->err = "";
+    return 0;
+  } else {
+    va_list ap;
+    va_start(ap, fmt);
+    errno = err;
+    res = vsnprintf(buf, WHY_JSON_ERR_BUF_SIZE, fmt, ap);
+    va_end(ap);
+  }
+  it->err = buf;
+  return res;
+}
+
+_WHY_JSON_FUNC_ int json_internal_clear_error(JsonIt *it) {
+  if ((it->stream != NULL && ferror(it->stream)) ||
+      it->state == WHY_JSON_UTF8_REJECT ||
+      (it->stream != NULL && feof(it->stream) &&
+       it->state != WHY_JSON_UTF8_ACCEPT)) {
+    /* json_internal_error works out which one it is */
+    return json_internal_error(it, JSON_ERR_CANT_READ, "Read failure occurred");
+  }
+  /* this happens for every token so don't bother formatting anything */
+  errno = JSON_ERR_NO_ERROR;
+  it->err = "";
+  return 0;
+}
+
+_WHY_JSON_FUNC_ uint32_t json_internal_is_legal_utf8(uint32_t *state,
+                                                     const char *bytes,
+                                                     size_t length) {
+  uint32_t type;
+  if (bytes == NULL || state == NULL) {
+    return 0;
+  }
+
+  size_t i = 0;
+  while (i < length) {
+    if (*state == WHY_JSON_UTF8_ACCEPT) {
+      /* ascii never changes the state so we can skip it in bulk */
+      i = json_internal_skip_ascii(bytes + i, bytes + length) - bytes;
+      if (i == length) {
+        break;
+      }
+    }
+
+    type = utf8d[(uint8_t)bytes[i]];
+    *state = utf8d[256 + (*state) * 16 + type];
+
+    if (*state == WHY_JSON_UTF8_REJECT) {
+      break;
+    }
+    i++;
+  }
+
+  return *state;
+}
+
+
+_WHY_JSON_FUNC_ int json_internal_peek_char(JsonIt *it) {
+  if (it->state == WHY_JSON_UTF8_REJECT) {
+    return EOF;
+  }
+
+  if (it->stream != NULL) {
+    if (it->cur_loc == it->buf_len) {
+      if (it->tee != NULL) {
+        json_internal_tee(it, it->buf_offset + it->buf_len);
+      }
+      it->buf_offset += it->buf_len;
+      it->cur_loc = 0;
+      char *buf = (char *)it->source_str;
+      it->buf_len = fread(buf, sizeof(char), WHY_JSON_BUF_SIZE, it->stream);
+      if (it->buf_len == 0 || it->state == WHY_JSON_UTF8_REJECT) {
+        it->buf_len = 0;
+        buf[0] = '\0';
+        return EOF;
+      }
+    }
+    return it->source_str[it->cur_loc];
+  } else if (it->source_str != NULL) {
+    if (it->cur_loc >= it->buf_len) {
+      return EOF;
+    } else {
+      return it->source_str[it->cur_loc];
+    }
+  } else {
+    errno = JSON_ERR_INVALID_ARGS;
+    return 0;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_init(JsonIt *it) {
+  it->flags = 0;
+  it->stream = NULL;
+  it->source_str = NULL;
+  it->cur_line = it->cur_col = 1;
+  it->state = WHY_JSON_UTF8_ACCEPT;
+  it->buf_len = 0;
+  it->tok_init = 0;
+  it->depth = 0;
+  it->max_depth = WHY_JSON_MAX_DEPTH;
+  it->cur_loc = 0;
+  it->err = "";
+  it->err_buf = NULL;
+  it->intern = NULL;
+  it->keyset = NULL;
+  it->shape_hits = it->shape_misses = 0;
+  it->buf_offset = 0;
+  it->span.begin = it->span.end = 0;
+  it->tee = NULL;
+  /* the nesting bits are only read once they are pushed so no need to clear */
+  it->nesting_spill = NULL;
+  it->nesting_spill_cap = 0;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_file(JsonIt *it, FILE *file) {
+  int res = json_internal_init(it);
+  if (file == NULL) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS, "File should be valid");
+    return 0;
+  }
+
+  char *buf = (char *)malloc(sizeof(char) * (WHY_JSON_BUF_SIZE + 1));
+  if (buf == NULL) {
+    json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+    return 0;
+  }
+  buf[0] = '\0';
+  it->stream = file;
+  it->source_str = buf;
+
+  return res;
+}
+
+_WHY_JSON_FUNC_ void json_set_err_buf(JsonIt *it, char *buf) {
+  it->err_buf = buf;
+  if (buf != NULL) {
+    buf[0] = '\0';
+  }
+}
+
+_WHY_JSON_FUNC_ void json_set_intern(JsonIt *it, JsonIntern *table) {
+  it->intern = table;
+}
+
+#define WHY_JSON_KEYSET_SLOT(buf, len, mask)                                   \
+  (((uint32_t)(len)*31u + (uint8_t)(buf)[0] * 7u +                              \
+    (uint8_t)(buf)[(len)-1]) &                                                 \
+   (mask))
+
+_WHY_JSON_FUNC_ int json_keyset(JsonIt *it, const char *const *keys, int n) {
+  free(it->keyset);
+  it->keyset = NULL;
+  if (keys == NULL || n <= 0) {
+    return 1;
+  } else if (n > WHY_JSON_INTERN_MAX) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS, "Too many keys (%d)", n);
+    return 0;
+  }
+
+  /* keep the slots at most half full */
+  uint32_t slots = 8;
+  while (slots < (uint32_t)n * 2) {
+    slots *= 2;
+  }
+
+  /* all in one allocation */
+  JsonKeySet *set = (JsonKeySet *)malloc(
+      sizeof(JsonKeySet) + sizeof(uint32_t) * n + sizeof(int16_t) * slots);
+  if (set == NULL) {
+    json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+    return 0;
+  }
+  set->keys = keys;
+  set->lens = (uint32_t *)(set + 1);
+  set->slots = (int16_t *)(set->lens + n);
+  set->mask = slots - 1;
+  set->n = n;
+  memset(set->slots, 0xFF, sizeof(int16_t) * slots);
+
+  int i;
+  for (i = 0; i < n; i++) {
+    size_t len = strlen(keys[i]);
+    set->lens[i] = (uint32_t)len;
+    if (json_internal_keyset_find(set, keys[i], len) >= 0) {
+      /* duplicates just keep the first index */
+      continue;
+    }
+    uint32_t slot = len == 0 ? 0 : WHY_JSON_KEYSET_SLOT(keys[i], len, set->mask);
+    while (set->slots[slot] >= 0) {
+      slot = (slot + 1) & set->mask;
+    }
+    set->slots[slot] = (int16_t)i;
+  }
+
+  it->keyset = set;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_keyset_find(const JsonKeySet *set,
+                                              const char *buf, size_t len) {
+  uint32_t slot = len == 0 ? 0 : WHY_JSON_KEYSET_SLOT(buf, len, set->mask);
+  int16_t i;
+  while ((i = set->slots[slot]) >= 0) {
+    if (set->lens[i] == len && memcmp(set->keys[i], buf, len) == 0) {
+      return i;
+    }
+    slot = (slot + 1) & set->mask;
+  }
+  return -1;
+}
+
+#undef WHY_JSON_KEYSET_SLOT
+
+_WHY_JSON_FUNC_ void json_arena_init(JsonArena *arena) {
+  arena->chunk = NULL;
+  arena->len = 0;
+  arena->cap = 0;
+}
+
+_WHY_JSON_FUNC_ void *json_internal_arena_alloc(JsonArena *arena, size_t size,
+                                                size_t align) {
+  if (size > SIZE_MAX - sizeof(char *) - align) {
+    return NULL;
+  }
+  /* aligned by address since malloc only promises 16 bytes */
+  uintptr_t base = (uintptr_t)arena->chunk;
+  size_t start =
+      ((base + arena->len + align - 1) & ~(uintptr_t)(align - 1)) - base;
+  if (arena->chunk == NULL || start > arena->cap ||
+      size > arena->cap - start) {
+    /* the header is a pointer to the previous chunk */
+    size_t need = sizeof(char *) + align + size;
+    size_t cap = WHY_JSON_ARENA_CHUNK_SIZE;
+    while (cap < need) {
+      cap = cap > SIZE_MAX / 2 ? need : cap * 2;
+    }
+    char *chunk = (char *)malloc(cap);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    memcpy(chunk, &arena->chunk, sizeof(char *));
+    arena->chunk = chunk;
+    arena->cap = cap;
+    base = (uintptr_t)chunk;
+    start = ((base + sizeof(char *) + align - 1) & ~(uintptr_t)(align - 1)) -
+            base;
+  }
+  arena->len = start + size;
+  return arena->chunk + start;
+}
+
+_WHY_JSON_FUNC_ void *json_arena_alloc(JsonArena *arena, size_t size) {
+  return json_internal_arena_alloc(arena, size, 16);
+}
+
+_WHY_JSON_FUNC_ void json_arena_free(JsonArena *arena) {
+  char *chunk = arena->chunk;
+  while (chunk != NULL) {
+    char *prev;
+    memcpy(&prev, chunk, sizeof(char *));
+    free(chunk);
+    chunk = prev;
+  }
+  json_arena_init(arena);
+}
+
+_WHY_JSON_FUNC_ const char *
+json_internal_decoded_key(const JsonStr *key,
+                          char scratch[WHY_JSON_INTERN_MAX_LEN + 1],
+                          size_t *len) {
+  if (!key->raw || !key->has_escapes) {
+    *len = key->len;
+    return key->buf;
+  } else if (key->len > WHY_JSON_INTERN_MAX_LEN) {
+    return NULL;
+  }
+  *len = json_decode_str_into(key, scratch);
+  return scratch;
+}
+
+_WHY_JSON_FUNC_ int json_internal_bind_value(JsonIt *it, JsonArena *arena,
+                                             JsonTok *tok,
+                                             const JsonBindField *field,
+                                             char *dst) {
+  if (field->type == JSON_BIND_OBJECT) {
+    return json_internal_bind_object(it, arena, tok, field->nested, dst,
+                                     NULL);
+  } else if (field->type == JSON_BIND_ARRAY) {
+    return json_internal_bind_array(it, arena, tok, field->nested,
+                                    (JsonBindArray *)dst);
+  }
+
+  if (!json_internal_parse_value(&tok->type, &tok->value, it)) {
+    return 0;
+  }
+
+  int ok = 0;
+  switch (field->type) {
+  case JSON_BIND_LONG:
+    if (tok->type == JSON_INT) {
+      *(long *)dst = tok->value._int;
+      ok = 1;
+    } else if (tok->type == JSON_NUMBER_RAW) {
+      int64_t num;
+      if (!json_num_as_i64(&tok->value._num, &num)) {
+        return 0;
+      }
+      *(long *)dst = (long)num;
+      ok = 1;
+    }
+    break;
+  case JSON_BIND_DOUBLE:
+    if (tok->type == JSON_INT || tok->type == JSON_FLT) {
+      *(double *)dst =
+          tok->type == JSON_INT ? (double)tok->value._int : tok->value._flt;
+      ok = 1;
+    } else if (tok->type == JSON_NUMBER_RAW) {
+      *(double *)dst = json_num_as_double(&tok->value._num);
+      ok = 1;
+    }
+    break;
+  case JSON_BIND_BOOL:
+    if (tok->type == JSON_BOOL) {
+      *(int *)dst = tok->value._bool;
+      ok = 1;
+    }
+    break;
+  case JSON_BIND_STR:
+    if (tok->type == JSON_STRING) {
+      char *copy = (char *)json_internal_arena_alloc(
+          arena, tok->value._str.len + 1, 1);
+      if (copy == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        return 0;
+      }
+      json_decode_str_into(&tok->value._str, copy);
+      *(const char **)dst = copy;
+      ok = 1;
+    } else if (tok->type == JSON_NULL) {
+      *(const char **)dst = NULL;
+      ok = 1;
+    }
+    break;
+  }
+
+  if (tok->type == JSON_NULL) {
+    /* just leave the field as it was */
+    ok = 1;
+  }
+  if (!ok) {
+    json_internal_error(it, JSON_ERR_INVALID_VALUE, "Wrong type for %s",
+                        field->key ? field->key : "array item");
+  }
+  return ok;
+}
+
+_WHY_JSON_FUNC_ int json_internal_match_key(JsonIt *it, const char *key,
+                                            size_t len) {
+  if (json_internal_peek_char(it) != '"' ||
+      it->buf_len - it->cur_loc < len + 2) {
+    return 0;
+  }
+  const char *cur = it->source_str + it->cur_loc;
+  if (memcmp(cur + 1, key, len) != 0 || cur[len + 1] != '"') {
+    return 0;
+  }
+  /* keys can't have newlines */
+  it->cur_loc += len + 2;
+  it->cur_col += len + 2;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_bind_object(JsonIt *it, JsonArena *arena,
+                                              JsonTok *tok,
+                                              const JsonBindDesc *desc,
+                                              char *out, JsonBindShape *shape) {
+  if (json_internal_peek_char(it) != '{') {
+    json_internal_error(it, JSON_ERR_INVALID_VALUE, "Expected an object");
+    return 0;
+  }
+  if (!json_internal_parse_opening_braces(it)) {
+    return 0;
+  }
+
+  int first = 1;
+  /* members are normally in the same order as the fields so try that first */
+  int guess = 0;
+  int member = 0;
+  int speculate = shape != NULL && shape->learned;
+  while (1) {
+    json_internal_ignore_whitespace(it);
+    int peek = json_internal_peek_char(it);
+    if (peek == EOF) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched {");
+      return 0;
+    } else if (!first && peek != '}') {
+      if (json_internal_next_char(it) != ',') {
+        json_internal_error(it, JSON_ERR_MISSING_COMMA,
+                            "Was expecting a comma");
+        return 0;
+      }
+      json_internal_ignore_whitespace(it);
+#ifndef WHY_JSON_STRICT
+      peek = json_internal_peek_char(it);
+#endif
+    }
+
+    if (peek == '}') {
+      json_internal_next_char(it);
+      it->depth--;
+      if (shape != NULL) {
+        shape->learned = 1;
+      }
+      return 1;
+    } else if (peek == EOF) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched {");
+      return 0;
+    }
+
+    const JsonBindField *field = NULL;
+    int matched = 0;
+    if (speculate) {
+      if (member < shape->len && shape->keys[member] != NULL &&
+          json_internal_match_key(it, shape->keys[member],
+                                  shape->lens[member])) {
+        it->shape_hits++;
+        int index = shape->fields[member];
+        field = index < 0 ? NULL : &desc->fields[index];
+        matched = 1;
+      } else {
+        /* the rest of this record goes the slow way */
+        it->shape_misses++;
+        speculate = 0;
+      }
+    }
+
+    if (!matched) {
+      if (!json_internal_parse_key(tok, it)) {
+        return 0;
+      }
+
+      char scratch[WHY_JSON_INTERN_MAX_LEN + 1];
+      size_t len = 0;
+      const char *key = json_internal_decoded_key(&tok->key, scratch, &len);
+      int i;
+      for (i = 0; key != NULL && i < desc->n; i++) {
+        const JsonBindField *cur = &desc->fields[(guess + i) % desc->n];
+        if (strncmp(cur->key, key, len) == 0 && cur->key[len] == '\0') {
+          field = cur;
+          guess = (guess + i + 1) % desc->n;
+          break;
+        }
+      }
+
+      if (shape != NULL && !shape->learned && member == shape->len &&
+          member < WHY_JSON_SHAPE_MAX_KEYS) {
+        /* keys that needed decoding won't be the same bytes in the source */
+        char *copy = NULL;
+        size_t j;
+        for (j = 0; key != NULL && j < len; j++) {
+          if (key[j] == '"' || key[j] == '\\' ||
+              (unsigned char)key[j] < 0x20) {
+            break;
+          }
+        }
+        if (key != NULL && j == len) {
+          copy = (char *)json_internal_arena_alloc(arena, len + 1, 1);
+          if (copy == NULL) {
+            json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+            return 0;
+          }
+          memcpy(copy, key, len);
+        }
+        shape->keys[member] = copy;
+        shape->lens[member] = (uint32_t)len;
+        shape->fields[member] =
+            field == NULL ? -1 : (int16_t)(field - desc->fields);
+        shape->len++;
+      }
+    }
+
+    json_internal_ignore_whitespace(it);
+    int next = json_internal_next_char(it);
+    if (next != ':') {
+      json_internal_error(it, JSON_ERR_UNKNOWN_TOK,
+                          "Didn't expect %c was expecting ':'", next);
+      return 0;
+    }
+    json_internal_ignore_whitespace(it);
+
+    if (field == NULL) {
+      if (!json_internal_skip_value(it)) {
+        return 0;
+      }
+    } else if (!json_internal_bind_value(it, arena, tok, field,
+                                         out + field->offset)) {
+      return 0;
+    }
+    first = 0;
+    member++;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_bind_array(JsonIt *it, JsonArena *arena,
+                                             JsonTok *tok,
+                                             const JsonBindDesc *desc,
+                                             JsonBindArray *out) {
+  if (json_internal_peek_char(it) != '[') {
+    json_internal_error(it, JSON_ERR_INVALID_VALUE, "Expected an array");
+    return 0;
+  }
+  if (!json_internal_parse_opening_braces(it)) {
+    return 0;
+  }
+
+  const JsonBindField *item =
+      desc->n > 0 && desc->fields[0].key == NULL ? &desc->fields[0] : NULL;
+  /* records are usually all the same shape, so learn it from the first */
+  JsonBindShape shape;
+  shape.len = 0;
+  shape.learned = 0;
+  size_t cap = 0;
+  out->items = NULL;
+  out->len = 0;
+  int first = 1;
+  while (1) {
+    json_internal_ignore_whitespace(it);
+    int peek = json_internal_peek_char(it);
+    if (peek == EOF) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched [");
+      return 0;
+    } else if (!first && peek != ']') {
+      if (json_internal_next_char(it) != ',') {
+        json_internal_error(it, JSON_ERR_MISSING_COMMA,
+                            "Was expecting a comma");
+        return 0;
+      }
+      json_internal_ignore_whitespace(it);
+#ifndef WHY_JSON_STRICT
+      peek = json_internal_peek_char(it);
+#endif
+    }
+
+    if (peek == ']') {
+      json_internal_next_char(it);
+      it->depth--;
+      return 1;
+    } else if (peek == EOF) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched [");
+      return 0;
+    }
+
+    if (out->len == cap) {
+      /* the old items are just left in the arena */
+      cap = cap == 0 ? 4 : cap * 2;
+      char *items = (char *)json_arena_alloc(arena, cap * desc->size);
+      if (items == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        return 0;
+      }
+      if (out->len > 0) {
+        memcpy(items, out->items, out->len * desc->size);
+      }
+      out->items = items;
+    }
+
+    char *dst = (char *)out->items + out->len * desc->size;
+    memset(dst, 0, desc->size);
+    if (item != NULL ? !json_internal_bind_value(it, arena, tok, item,
+                                                 dst + item->offset)
+                     : !json_internal_bind_object(it, arena, tok, desc, dst,
+                                                  &shape)) {
+      return 0;
+    }
+    out->len++;
+    first = 0;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_bind(JsonIt *it, const JsonBindDesc *desc, void *out,
+                              JsonArena *arena) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || desc == NULL || out == NULL ||
+      arena == NULL) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator, descriptor, out and arena");
+    return 0;
+  }
+
+  JsonTok tok;
+  memset(&tok, 0, sizeof(JsonTok));
+  errno = JSON_ERR_NO_ERROR;
+
+  json_internal_ignore_whitespace(it);
+  int peek = json_internal_peek_char(it);
+  int ok;
+  if (peek == '{') {
+    ok = json_internal_bind_object(it, arena, &tok, desc, (char *)out, NULL);
+  } else if (peek == '[') {
+    ok = json_internal_bind_array(it, arena, &tok, desc, (JsonBindArray *)out);
+  } else {
+    json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                        "Can only bind an object or an array");
+    ok = 0;
+  }
+
+  if (ok) {
+    json_internal_ignore_whitespace(it);
+    if (json_internal_peek_char(it) != EOF) {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                          "Can only have one outer value");
+      ok = 0;
+    } else if (json_internal_clear_error(it) != 0) {
+      /* ferror or bad utf8 */
+      ok = 0;
+    }
+  }
+
+  json_destroy(&tok, it);
+  return ok;
+}
+
+_WHY_JSON_FUNC_ int json_internal_column_reserve(JsonIt *it, JsonArena *arena,
+                                                 const JsonColumnSpec *spec,
+                                                 JsonColumn *col, size_t need) {
+  if (col->len == col->cap) {
+    size_t cap = col->cap == 0 ? 64 : col->cap * 2;
+    size_t bits = (cap + 7) / 8;
+    size_t old_bits = (col->cap + 7) / 8;
+    size_t width = spec->type == JSON_COLUMN_STR ? sizeof(int32_t)
+                                                 : sizeof(int64_t);
+    size_t values = spec->type == JSON_COLUMN_BOOL
+                        ? bits
+                        : width * (cap + (spec->type == JSON_COLUMN_STR));
+    /* the old buffers are just left in the arena */
+    uint8_t *validity = (uint8_t *)json_internal_arena_alloc(arena, bits, 64);
+    char *buf = (char *)json_internal_arena_alloc(arena, values, 64);
+    if (validity == NULL || buf == NULL) {
+      json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+      return 0;
+    }
+
+    if (col->cap > 0) {
+      memcpy(validity, col->validity, old_bits);
+      memcpy(buf, col->values,
+             spec->type == JSON_COLUMN_BOOL
+                 ? old_bits
+                 : width * (col->cap + (spec->type == JSON_COLUMN_STR)));
+    } else if (spec->type == JSON_COLUMN_STR) {
+      *(int32_t *)buf = 0;
+    }
+    /* bits are only ever set */
+    memset(validity + old_bits, 0, bits - old_bits);
+    if (spec->type == JSON_COLUMN_BOOL) {
+      memset(buf + old_bits, 0, bits - old_bits);
+    }
+    col->validity = validity;
+    col->values = buf;
+    col->cap = cap;
+  }
+
+  if (col->data_len + need > col->data_cap) {
+    size_t cap = col->data_cap == 0 ? 256 : col->data_cap * 2;
+    while (cap < col->data_len + need) {
+      cap *= 2;
+    }
+    char *data = (char *)json_internal_arena_alloc(arena, cap, 64);
+    if (data == NULL) {
+      json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+      return 0;
+    }
+    if (col->data_len > 0) {
+      memcpy(data, col->data, col->data_len);
+    }
+    col->data = data;
+    col->data_cap = cap;
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_column_append(JsonIt *it, JsonArena *arena,
+                                                const JsonColumnSpec *spec,
+                                                JsonColumn *col,
+                                                const JsonTok *tok) {
+  JsonType type = tok == NULL ? JSON_NULL : tok->type;
+  /* strings also need room for the null terminator json_decode_str_into adds */
+  size_t need = spec->type == JSON_COLUMN_STR && type == JSON_STRING
+                    ? (size_t)tok->value._str.len + 1
+                    : 0;
+  if (!json_internal_column_reserve(it, arena, spec, col, need)) {
+    return 0;
+  }
+
+  size_t row = col->len;
+  int valid = 1;
+  int ok = 1;
+  if (type == JSON_NULL) {
+    if (spec->nulls == JSON_NULLS_ERROR) {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                          "%s is null or missing in row %lu", spec->path,
+                          (unsigned long)row);
+      return 0;
+    }
+    valid = spec->nulls == JSON_NULLS_ZERO;
+  }
+
+  switch (spec->type) {
+  case JSON_COLUMN_I64: {
+    int64_t *values = (int64_t *)col->values;
+    values[row] = 0;
+    if (type == JSON_INT) {
+      values[row] = tok->value._int;
+    } else if (type == JSON_NUMBER_RAW) {
+      ok = json_num_as_i64(&tok->value._num, &values[row]);
+    } else {
+      ok = type == JSON_NULL;
+    }
+    break;
+  }
+  case JSON_COLUMN_F64: {
+    double *values = (double *)col->values;
+    values[row] = 0;
+    if (type == JSON_INT) {
+      values[row] = (double)tok->value._int;
+    } else if (type == JSON_FLT) {
+      values[row] = tok->value._flt;
+    } else if (type == JSON_NUMBER_RAW) {
+      values[row] = json_num_as_double(&tok->value._num);
+    } else {
+      ok = type == JSON_NULL;
+    }
+    break;
+  }
+  case JSON_COLUMN_BOOL:
+    if (type == JSON_BOOL) {
+      ((uint8_t *)col->values)[row / 8] |=
+          (uint8_t)((tok->value._bool != 0) << (row % 8));
+    } else {
+      ok = type == JSON_NULL;
+    }
+    break;
+  case JSON_COLUMN_STR: {
+    int32_t *offsets = (int32_t *)col->values;
+    if (type == JSON_STRING) {
+      col->data_len +=
+          json_decode_str_into(&tok->value._str, col->data + col->data_len);
+      if (col->data_len > INT32_MAX) {
+        json_internal_error(it, JSON_ERR_TOO_LONG,
+                            "%s has more than 2GB of strings", spec->path);
+        return 0;
+      }
+    } else {
+      ok = type == JSON_NULL;
+    }
+    offsets[row + 1] = (int32_t)col->data_len;
+    break;
+  }
+  }
+
+  if (!ok) {
+    if (errno == JSON_ERR_OUT_OF_RANGE) {
+      json_internal_error(it, JSON_ERR_OUT_OF_RANGE,
+                          "%s is out of range in row %lu", spec->path,
+                          (unsigned long)row);
+    } else {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                          "Wrong type for %s in row %lu", spec->path,
+                          (unsigned long)row);
+    }
+    return 0;
+  }
+  if (valid) {
+    col->validity[row / 8] |= (uint8_t)(1u << (row % 8));
+  } else {
+    col->null_count++;
+  }
+  col->len++;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_column_find(const JsonColumnSpec *specs,
+                                              int n, const char *path,
+                                              size_t len, int prefix) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (strncmp(specs[i].path, path, len) == 0 &&
+        specs[i].path[len] == (prefix ? '.' : '\0')) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+_WHY_JSON_FUNC_ int json_columns(JsonIt *it, const JsonColumnSpec *specs,
+                                 int n, JsonColumn *out, JsonArena *arena) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || (n > 0 && specs == NULL) ||
+      (n > 0 && out == NULL) || arena == NULL) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator, specs, out and arena");
+    return 0;
+  }
+
+  int i;
+  memset(out, 0, sizeof(JsonColumn) * n);
+  /* which columns the current row had */
+  uint8_t *seen = (uint8_t *)json_internal_arena_alloc(arena, n + 1, 1);
+  if (seen == NULL) {
+    json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+    json_destroy(NULL, it);
+    return 0;
+  }
+
+  JsonTok tok;
+  if (!json_next(&tok, it)) {
+    return 0;
+  } else if (tok.type != JSON_ARRAY) {
+    json_internal_error(it, JSON_ERR_INVALID_VALUE, "Expected an array");
+    json_destroy(&tok, it);
+    return 0;
+  }
+
+  char path[WHY_JSON_COLUMN_MAX_PATH];
+  /* where the path is cut back to for each level of nesting in a row */
+  size_t prefix[WHY_JSON_COLUMN_MAX_PATH / 2];
+  while (json_next(&tok, it)) {
+    if (tok.type == JSON_ARRAY_END) {
+      if (!json_next(&tok, it)) {
+        return 0;
+      } else if (tok.type != JSON_END) {
+        json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                            "Can only have one outer value");
+        json_destroy(&tok, it);
+        return 0;
+      }
+      return 1;
+    } else if (tok.type != JSON_OBJECT) {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                          "Rows have to be objects");
+      json_destroy(&tok, it);
+      return 0;
+    }
+
+    memset(seen, 0, n);
+    int level = 0;
+    prefix[0] = 0;
+    while (json_next(&tok, it)) {
+      if (tok.type == JSON_OBJECT_END) {
+        if (level-- == 0) {
+          break;
+        }
+        continue;
+      }
+
+      /* build the dotted path of this member */
+      size_t len = prefix[level];
+      int col = -1;
+      int nested = -1;
+      if (len + (level > 0) + tok.key.len < sizeof(path)) {
+        if (level > 0) {
+          path[len++] = '.';
+        }
+        if (tok.key.raw) {
+          len += json_decode_str_into(&tok.key, path + len);
+        } else {
+          memcpy(path + len, tok.key.buf, tok.key.len);
+          len += tok.key.len;
+        }
+        col = json_internal_column_find(specs, n, path, len, 0);
+        if (tok.type == JSON_OBJECT) {
+          nested = json_internal_column_find(specs, n, path, len, 1);
+        }
+      }
+
+      if (nested >= 0 &&
+          level + 1 < (int)(sizeof(prefix) / sizeof(prefix[0]))) {
+        prefix[++level] = len;
+      } else if (col >= 0 && (!seen[col] || tok.type == JSON_OBJECT ||
+                              tok.type == JSON_ARRAY)) {
+        /* objects and arrays are always the wrong type so this errors */
+        seen[col] = 1;
+        if (!json_internal_column_append(it, arena, &specs[col], &out[col],
+                                         &tok)) {
+          json_destroy(&tok, it);
+          return 0;
+        }
+      } else if (tok.type == JSON_OBJECT || tok.type == JSON_ARRAY) {
+        /* nothing we want in here so skip it without parsing it */
+        json_internal_ignore_whitespace(it);
+        if (!json_internal_skip_value(it)) {
+          json_destroy(&tok, it);
+          return 0;
+        }
+        tok.type = JSON_NULL;
+      }
+    }
+    if (errno != JSON_ERR_NO_ERROR) {
+      return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (!seen[i] &&
+          !json_internal_column_append(it, arena, &specs[i], &out[i], NULL)) {
+        json_destroy(&tok, it);
+        return 0;
+      }
+    }
+  }
+  return 0;
+}
+
+/* every power of 10 that a double holds exactly */
+static const double json_internal_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+_WHY_JSON_FUNC_ int json_internal_fast_num(const char *cur, const char *end,
+                                           int integral, void *out) {
+  int negative = 0;
+  if (cur < end && *cur == '-') {
+    negative = 1;
+    cur++;
+  }
+
+  /* up to 19 digits always fits in a uint64_t */
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int frac_digits = 0;
+  int seen_dot = 0;
+  while (1) {
+#ifdef WHY_JSON_SWAR_DIGITS
+    while (end - cur >= 8 && digits <= 19 - 8) {
+      uint64_t chunk;
+      memcpy(&chunk, cur, sizeof(chunk));
+      /* each byte has to be 0x30 - 0x39 */
+      if (((chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+           (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) !=
+          0x3333333333333333ULL) {
+        break;
+      }
+      /* pairs, then fours, then all eight */
+      chunk -= 0x3030303030303030ULL;
+      chunk = (chunk * 10) + (chunk >> 8);
+      chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+               (((chunk >> 16) & 0x000000FF000000FFULL) *
+                (1 + (10000ULL << 32)))) >>
+              32;
+      mantissa = mantissa * 100000000 + chunk;
+      digits += 8;
+      frac_digits += seen_dot * 8;
+      cur += 8;
+    }
+#endif
+    while (cur < end && *cur >= '0' && *cur <= '9') {
+      if (digits == 19) {
+        return 0;
+      }
+      mantissa = mantissa * 10 + (uint64_t)(*cur - '0');
+      digits++;
+      frac_digits += seen_dot;
+      cur++;
+    }
+
+    if (cur < end && *cur == '.' && !seen_dot && !integral) {
+      seen_dot = 1;
+      cur++;
+    } else {
+      break;
+    }
+  }
+
+  int exp = 0;
+  if (cur < end && (*cur == 'e' || *cur == 'E') && !integral) {
+    int exp_negative = 0;
+    cur++;
+    if (cur < end && (*cur == '-' || *cur == '+')) {
+      exp_negative = *cur == '-';
+      cur++;
+    }
+    const char *exp_start = cur;
+    while (cur < end && *cur >= '0' && *cur <= '9' && cur - exp_start < 4) {
+      exp = exp * 10 + (*cur - '0');
+      cur++;
+    }
+    if (cur == exp_start) {
+      return 0;
+    }
+    exp = exp_negative ? -exp : exp;
+  }
+
+  if (cur != end || digits == 0) {
+    return 0;
+  }
+
+  if (integral) {
+    if (digits > 18) {
+      return 0;
+    }
+    *(int64_t *)out = negative ? -(int64_t)mantissa : (int64_t)mantissa;
+    return 1;
+  }
+
+  /* exact when both the mantissa and the power of 10 are exact doubles */
+  exp -= frac_digits;
+  if (mantissa > ((uint64_t)1 << 53) || exp < -22 || exp > 22) {
+    return 0;
+  }
+  double value = (double)mantissa;
+  value = exp < 0 ? value / json_internal_pow10[-exp]
+                  : value * json_internal_pow10[exp];
+  *(double *)out = negative ? -value : value;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_read_num(JsonIt *it, int integral,
+                                           void *out) {
+  if (json_internal_peek_char(it) == EOF) {
+    errno = JSON_ERR_INVALID_VALUE;
+    return 0;
+  }
+
+  const char *cur = it->source_str + it->cur_loc;
+  const char *end = it->source_str + it->buf_len;
+  const char *msg;
+  const char *fail_at;
+  const char *num_end = json_internal_validate_num(cur, end, &msg, &fail_at);
+
+  /* a number running into the end of a file buffer might carry on */
+  if (num_end != NULL && (num_end != end || it->stream == NULL) &&
+      json_internal_fast_num(cur, num_end, integral, out)) {
+    it->cur_col += num_end - cur;
+    it->cur_loc = num_end - it->source_str;
+    return 1;
+  }
+
+  /* everything else (underscores, huge numbers, errors) goes the slow way */
+  JsonType type = JSON_ERROR;
+  JsonValue value;
+  uint32_t flags = it->flags;
+  it->flags |= JSON_FLAG_RAW_NUMBERS;
+  int ok = json_internal_parse_num(&type, &value, it);
+  it->flags = flags;
+  if (!ok) {
+    return 0;
+  }
+
+  if (integral) {
+    ok = json_num_as_i64(&value._num, (int64_t *)out);
+  } else {
+    /* strtod can leave ERANGE in errno for denormals, that's fine */
+    errno = JSON_ERR_NO_ERROR;
+    *(double *)out = json_num_as_double(&value._num);
+    ok = errno != JSON_ERR_OOM;
+    errno = ok ? JSON_ERR_NO_ERROR : errno;
+  }
+  json_internal_free_str(&value._str);
+  return ok;
+}
+
+_WHY_JSON_FUNC_ int json_internal_read_row(JsonIt *it, int integral,
+                                           void **buf, size_t *cap,
+                                           size_t *len, size_t *count,
+                                           size_t row) {
+  *count = 0;
+  if (json_internal_peek_char(it) != '[') {
+    if (row == (size_t)-1) {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE, "Expected an array");
+    } else {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                          "Expected an array for row %lu", (unsigned long)row);
+    }
+    return 0;
+  }
+  if (!json_internal_parse_opening_braces(it)) {
+    return 0;
+  }
+
+  int first = 1;
+  while (1) {
+    json_internal_ignore_whitespace(it);
+    int peek = json_internal_peek_char(it);
+    if (peek == EOF) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched [");
+      return 0;
+    } else if (!first && peek != ']') {
+      if (json_internal_next_char(it) != ',') {
+        json_internal_error(it, JSON_ERR_MISSING_COMMA,
+                            "Was expecting a comma");
+        return 0;
+      }
+      json_internal_ignore_whitespace(it);
+#ifndef WHY_JSON_STRICT
+      peek = json_internal_peek_char(it);
+#endif
+    }
+
+    if (peek == ']') {
+      json_internal_next_char(it);
+      it->depth--;
+      return 1;
+    } else if (peek == EOF) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched [");
+      return 0;
+    }
+
+    if (*len == *cap) {
+      size_t new_cap = *cap == 0 ? 64 : *cap * 2;
+      void *new_buf = realloc(*buf, new_cap * sizeof(double));
+      if (new_buf == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        return 0;
+      }
+      *buf = new_buf;
+      *cap = new_cap;
+    }
+
+    /* doubles and int64_ts are the same size */
+    if (!json_internal_read_num(it, integral, (char *)*buf + *len * 8)) {
+      const char *what = integral ? "an integer" : "a number";
+      JsonErr err = errno == JSON_ERR_OUT_OF_RANGE ? JSON_ERR_OUT_OF_RANGE
+                                                   : JSON_ERR_INVALID_VALUE;
+      if (row == (size_t)-1) {
+        json_internal_error(it, err, "Expected %s at index %lu", what,
+                            (unsigned long)*count);
+      } else {
+        json_internal_error(it, err, "Expected %s at [%lu][%lu]", what,
+                            (unsigned long)row, (unsigned long)*count);
+      }
+      return 0;
+    }
+    (*len)++;
+    (*count)++;
+    first = 0;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_read_nums(JsonTok *tok, JsonIt *it,
+                                            int integral, void **buf,
+                                            size_t *cap, size_t *rows,
+                                            size_t *width) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || buf == NULL || cap == NULL ||
+      rows == NULL) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator, buffer and lengths");
+    return 0;
+  } else if (tok->type != JSON_ARRAY) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Token (%d) isn't an array", tok->type);
+    return 0;
+  }
+  if (*buf == NULL) {
+    *cap = 0;
+  }
+
+  size_t len = 0;
+  int ok;
+  json_internal_ignore_whitespace(it);
+  if (width == NULL) {
+    ok = json_internal_read_row(it, integral, buf, cap, &len, rows,
+                                (size_t)-1);
+  } else {
+    size_t count = 0;
+    *rows = 0;
+    *width = 0;
+    ok = json_internal_parse_opening_braces(it);
+    int first = 1;
+    while (ok) {
+      json_internal_ignore_whitespace(it);
+      int peek = json_internal_peek_char(it);
+      if (peek == EOF) {
+        json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched [");
+        ok = 0;
+        break;
+      } else if (!first && peek != ']') {
+        if (json_internal_next_char(it) != ',') {
+          json_internal_error(it, JSON_ERR_MISSING_COMMA,
+                              "Was expecting a comma");
+          ok = 0;
+          break;
+        }
+        json_internal_ignore_whitespace(it);
+#ifndef WHY_JSON_STRICT
+        peek = json_internal_peek_char(it);
+#endif
+      }
+
+      if (peek == ']') {
+        json_internal_next_char(it);
+        it->depth--;
+        break;
+      }
+
+      ok = json_internal_read_row(it, integral, buf, cap, &len, &count,
+                                  *rows);
+      if (!ok) {
+        *width = count;
+      } else if (first) {
+        *width = count;
+      } else if (count != *width) {
+        json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                            "Row %lu has %lu numbers not %lu",
+                            (unsigned long)*rows, (unsigned long)count,
+                            (unsigned long)*width);
+        *width = count;
+        ok = 0;
+      }
+      if (ok) {
+        (*rows)++;
+      }
+      first = 0;
+    }
+  }
+
+  if (!ok) {
+    json_destroy(tok, it);
+    return 0;
+  }
+  /* as if the array was stepped through with json_next */
+  tok->type = JSON_ARRAY_END;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_read_f64_array(JsonTok *tok, JsonIt *it, double **buf,
+                                        size_t *cap, size_t *len) {
+  return json_internal_read_nums(tok, it, 0, (void **)buf, cap, len, NULL);
+}
+
+_WHY_JSON_FUNC_ int json_read_i64_array(JsonTok *tok, JsonIt *it,
+                                        int64_t **buf, size_t *cap,
+                                        size_t *len) {
+  return json_internal_read_nums(tok, it, 1, (void **)buf, cap, len, NULL);
+}
+
+_WHY_JSON_FUNC_ int json_read_f64_matrix(JsonTok *tok, JsonIt *it,
+                                         double **buf, size_t *cap,
+                                         size_t *rows, size_t *width) {
+  return json_internal_read_nums(tok, it, 0, (void **)buf, cap, rows, width);
+}
+
+_WHY_JSON_FUNC_ int json_read_i64_matrix(JsonTok *tok, JsonIt *it,
+                                         int64_t **buf, size_t *cap,
+                                         size_t *rows, size_t *width) {
+  return json_internal_read_nums(tok, it, 1, (void **)buf, cap, rows, width);
+}
+
+_WHY_JSON_FUNC_ void json_tape_init(JsonTape *tape) {
+  memset(tape, 0, sizeof(JsonTape));
+}
+
+_WHY_JSON_FUNC_ void json_tape_free(JsonTape *tape) {
+  free(tape->own_words);
+  free(tape->own_pool);
+  if (tape->file != NULL) {
+#ifdef WHY_JSON_MMAP
+    if (tape->file_mapped) {
+      munmap(tape->file, tape->file_len);
+    } else {
+      free(tape->file);
+    }
+#else
+    free(tape->file);
+#endif
+  }
+  json_tape_init(tape);
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_reserve(JsonTapeBuilder *b, size_t n) {
+  JsonTape *tape = b->tape;
+  if (tape->len + n > b->cap) {
+    size_t cap = b->cap == 0 ? 1024 : b->cap * 2;
+    while (cap < tape->len + n) {
+      cap *= 2;
+    }
+    uint64_t *words =
+        (uint64_t *)realloc(tape->own_words, cap * sizeof(uint64_t));
+    if (words == NULL) {
+      errno = JSON_ERR_OOM;
+      return 0;
+    }
+    tape->own_words = words;
+    tape->words = words;
+    b->cap = cap;
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_emit(JsonTapeBuilder *b, uint64_t word,
+                                            uint64_t extra, int n) {
+  JsonTape *tape = b->tape;
+  if (!json_internal_tape_reserve(b, (size_t)n)) {
+    return 0;
+  }
+  tape->own_words[tape->len++] = word;
+  if (n > 1) {
+    tape->own_words[tape->len++] = extra;
+  }
+  if (b->hashes != NULL && b->depth > 0) {
+    uint64_t *hash = &b->hashes[b->depth - 1];
+    *hash = (*hash ^ word) * 1099511628211ULL;
+    if (n > 1) {
+      *hash = (*hash ^ extra) * 1099511628211ULL;
+    }
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_str(JsonTapeBuilder *b,
+                                           const JsonStr *str) {
+  JsonTape *tape = b->tape;
+  /* decoded straight into the pool then dropped if we already have it */
+  size_t need = tape->pool_len + sizeof(uint32_t) + str->len + 1;
+  if (need > b->pool_cap) {
+    size_t cap = b->pool_cap == 0 ? 4096 : b->pool_cap * 2;
+    while (cap < need) {
+      cap *= 2;
+    }
+    char *pool = (char *)realloc(tape->own_pool, cap);
+    if (pool == NULL) {
+      errno = JSON_ERR_OOM;
+      return 0;
+    }
+    tape->own_pool = pool;
+    tape->pool = pool;
+    b->pool_cap = cap;
+  }
+
+  if (b->strings * 2 >= b->slot_mask) {
+    size_t mask = b->slot_mask == 0 ? 255 : b->slot_mask * 2 + 1;
+    size_t *slots = (size_t *)calloc(mask + 1, sizeof(size_t));
+    if (slots == NULL) {
+      errno = JSON_ERR_OOM;
+      return 0;
+    }
+    size_t i;
+    for (i = 0; b->slots != NULL && i <= b->slot_mask; i++) {
+      if (b->slots[i] != 0) {
+        uint32_t len;
+        const char *old = tape->pool + b->slots[i] - 1;
+        memcpy(&len, old, sizeof(uint32_t));
+        size_t slot = json_internal_hash(old + sizeof(uint32_t), len) & mask;
+        while (slots[slot] != 0) {
+          slot = (slot + 1) & mask;
+        }
+        slots[slot] = b->slots[i];
+      }
+    }
+    free(b->slots);
+    b->slots = slots;
+    b->slot_mask = mask;
+  }
+
+  size_t offset = tape->pool_len;
+  char *bytes = tape->own_pool + offset + sizeof(uint32_t);
+  uint32_t len = (uint32_t)json_decode_str_into(str, bytes);
+  size_t slot = json_internal_hash(bytes, len) & b->slot_mask;
+  while (b->slots[slot] != 0) {
+    const char *other = tape->pool + b->slots[slot] - 1;
+    uint32_t other_len;
+    memcpy(&other_len, other, sizeof(uint32_t));
+    if (other_len == len &&
+        memcmp(other + sizeof(uint32_t), bytes, len) == 0) {
+      return json_internal_tape_emit(
+          b, WHY_JSON_TAPE_WORD(JSON_STRING, b->slots[slot] - 1), 0, 1);
+    }
+    slot = (slot + 1) & b->slot_mask;
+  }
+
+  memcpy(tape->own_pool + offset, &len, sizeof(uint32_t));
+  tape->pool_len += sizeof(uint32_t) + len + 1;
+  b->slots[slot] = offset + 1;
+  b->strings++;
+  return json_internal_tape_emit(b, WHY_JSON_TAPE_WORD(JSON_STRING, offset),
+                                 0, 1);
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_index(JsonTapeBuilder *b, size_t start) {
+  JsonTape *tape = b->tape;
+  size_t count = (size_t)tape->words[start + 1];
+  size_t cap = 2;
+  while (cap < count * 2) {
+    cap *= 2;
+  }
+  if (tape->len - start + cap / 2 + 1 > UINT32_MAX) {
+    /* offsets wouldn't fit, it's left to be scanned */
+    return 1;
+  }
+  if (!json_internal_tape_reserve(b, cap / 2 + 1)) {
+    return 0;
+  }
+
+  /* written a byte at a time as it's read back as uint32_t */
+  char *slots = (char *)(tape->own_words + tape->len);
+  memset(slots, 0, cap / 2 * sizeof(uint64_t));
+  size_t cur = start + 2;
+  size_t i;
+  for (i = 0; i < count; i++) {
+    size_t len;
+    const char *key = json_tape_str(tape, cur, &len);
+    size_t slot = json_internal_hash(key, len) & (cap - 1);
+    uint32_t offset;
+    memcpy(&offset, slots + slot * sizeof(uint32_t), sizeof(uint32_t));
+    while (offset != 0) {
+      slot = (slot + 1) & (cap - 1);
+      memcpy(&offset, slots + slot * sizeof(uint32_t), sizeof(uint32_t));
+    }
+    offset = (uint32_t)(cur - start);
+    memcpy(slots + slot * sizeof(uint32_t), &offset, sizeof(uint32_t));
+    cur = json_tape_next(tape, cur + 1);
+  }
+  tape->len += cap / 2;
+  tape->own_words[tape->len++] = cap;
+  tape->own_words[start + 1] |= WHY_JSON_TAPE_INDEXED;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ size_t json_internal_tape_resolve(const JsonTape *tape,
+                                                  size_t node) {
+  if (node < tape->len &&
+      WHY_JSON_TAPE_TAG(tape->words[node]) == WHY_JSON_TAPE_REF) {
+    return (size_t)WHY_JSON_TAPE_PAYLOAD(tape->words[node]);
+  }
+  return node;
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_same(const JsonTape *tape, size_t a,
+                                            size_t b) {
+  a = json_internal_tape_resolve(tape, a);
+  b = json_internal_tape_resolve(tape, b);
+  if (a == b) {
+    return 1;
+  }
+  uint64_t word = tape->words[a];
+  JsonType tag = WHY_JSON_TAPE_TAG(word);
+  if (tag != WHY_JSON_TAPE_TAG(tape->words[b])) {
+    return 0;
+  }
+
+  switch (tag) {
+  case JSON_OBJECT:
+  case JSON_ARRAY: {
+    /* the sizes can differ if one has shared nodes inside it */
+    uint64_t n = WHY_JSON_TAPE_PAYLOAD(tape->words[a + 1]);
+    if (n != WHY_JSON_TAPE_PAYLOAD(tape->words[b + 1])) {
+      return 0;
+    }
+    n *= tag == JSON_OBJECT ? 2 : 1;
+    a += 2;
+    b += 2;
+    for (; n > 0; n--) {
+      if (!json_internal_tape_same(tape, a, b)) {
+        return 0;
+      }
+      a = json_tape_next(tape, a);
+      b = json_tape_next(tape, b);
+    }
+    return 1;
+  }
+  case JSON_INT:
+  case JSON_FLT:
+    return tape->words[a + 1] == tape->words[b + 1];
+  default:
+    return word == tape->words[b];
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_share(JsonTapeBuilder *b, size_t start,
+                                             uint64_t hash) {
+  JsonTape *tape = b->tape;
+  if (b->node_count * 2 >= b->node_mask) {
+    size_t mask = b->node_mask == 0 ? 255 : b->node_mask * 2 + 1;
+    uint64_t *nodes = (uint64_t *)calloc((mask + 1) * 2, sizeof(uint64_t));
+    if (nodes == NULL) {
+      errno = JSON_ERR_OOM;
+      return 0;
+    }
+    size_t i;
+    for (i = 0; b->nodes != NULL && i <= b->node_mask; i++) {
+      if (b->nodes[i * 2 + 1] != 0) {
+        uint64_t other = b->nodes[i * 2];
+        size_t slot = (size_t)(other ^ (other >> 32)) & mask;
+        while (nodes[slot * 2 + 1] != 0) {
+          slot = (slot + 1) & mask;
+        }
+        nodes[slot * 2] = other;
+        nodes[slot * 2 + 1] = b->nodes[i * 2 + 1];
+      }
+    }
+    free(b->nodes);
+    b->nodes = nodes;
+    b->node_mask = mask;
+  }
+
+  size_t slot = (size_t)(hash ^ (hash >> 32)) & b->node_mask;
+  while (b->nodes[slot * 2 + 1] != 0) {
+    size_t node = (size_t)b->nodes[slot * 2 + 1] - 1;
+    if (b->nodes[slot * 2] == hash &&
+        json_internal_tape_same(tape, node, start)) {
+      /*
+       Everything inside it was already shared (it all has an identical node
+       earlier on) so nothing in the table points at the words dropped here.
+      */
+      tape->shared_nodes++;
+      tape->shared_words += tape->len - start - 1;
+      tape->len = start;
+      tape->own_words[tape->len++] =
+          WHY_JSON_TAPE_WORD(WHY_JSON_TAPE_REF, node);
+      return 1;
+    }
+    slot = (slot + 1) & b->node_mask;
+  }
+  b->nodes[slot * 2] = hash;
+  b->nodes[slot * 2 + 1] = start + 1;
+  b->node_count++;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_tape_build(JsonIt *it, JsonTape *tape) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || tape == NULL || tape->len != 0) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator and an empty tape");
+    return 0;
+  }
+
+  JsonTapeBuilder b;
+  memset(&b, 0, sizeof(JsonTapeBuilder));
+  b.tape = tape;
+  tape->shared_nodes = 0;
+  tape->shared_words = 0;
+  size_t index_min =
+      tape->index_min == 0 ? WHY_JSON_TAPE_INDEX_MIN : tape->index_min;
+  JsonTok tok;
+  int ok = 1;
+  while (ok && json_next(&tok, it) && tok.type != JSON_END) {
+    if (tok.type == JSON_OBJECT_END || tok.type == JSON_ARRAY_END) {
+      size_t start = b.stack[--b.depth];
+      if (tok.type == JSON_OBJECT_END && tape->words[start + 1] >= index_min) {
+        ok = json_internal_tape_index(&b, start);
+      }
+      tape->own_words[start] |= tape->len - start;
+      if (tape->flags & JSON_TAPE_DEDUP) {
+        /* children are folded in by hash so shared ones hash the same */
+        uint64_t hash =
+            (b.hashes[b.depth] ^ tape->words[start + 1]) * 1099511628211ULL;
+        ok = ok && json_internal_tape_share(&b, start, hash);
+        if (b.depth > 0) {
+          b.hashes[b.depth - 1] =
+              (b.hashes[b.depth - 1] ^ hash) * 1099511628211ULL;
+        }
+      }
+      continue;
+    }
+
+    if (b.depth > 0) {
+      size_t parent = b.stack[b.depth - 1];
+      tape->own_words[parent + 1]++;
+      if (WHY_JSON_TAPE_TAG(tape->words[parent]) == JSON_OBJECT) {
+        ok = json_internal_tape_str(&b, &tok.key);
+      }
+    }
+
+    uint64_t bits;
+    switch (tok.type) {
+    case JSON_OBJECT:
+    case JSON_ARRAY:
+      if (b.depth == b.stack_cap) {
+        size_t cap = b.stack_cap == 0 ? 64 : b.stack_cap * 2;
+        size_t *stack = (size_t *)realloc(b.stack, cap * sizeof(size_t));
+        if (stack == NULL) {
+          errno = JSON_ERR_OOM;
+          ok = 0;
+          break;
+        }
+        b.stack = stack;
+        b.stack_cap = cap;
+        if (tape->flags & JSON_TAPE_DEDUP) {
+          uint64_t *hashes =
+              (uint64_t *)realloc(b.hashes, cap * sizeof(uint64_t));
+          if (hashes == NULL) {
+            errno = JSON_ERR_OOM;
+            ok = 0;
+            break;
+          }
+          b.hashes = hashes;
+        }
+      }
+      if (b.hashes != NULL) {
+        b.hashes[b.depth] = 14695981039346656037ULL;
+      }
+      b.stack[b.depth++] = tape->len;
+      /* the size is filled in once it ends */
+      ok = ok && json_internal_tape_emit(&b, WHY_JSON_TAPE_WORD(tok.type, 0),
+                                         0, 2);
+      break;
+    case JSON_STRING:
+      ok = ok && json_internal_tape_str(&b, &tok.value._str);
+      break;
+    case JSON_INT:
+      bits = (uint64_t)(int64_t)tok.value._int;
+      ok = ok && json_internal_tape_emit(&b, WHY_JSON_TAPE_WORD(JSON_INT, 0),
+                                         bits, 2);
+      break;
+    case JSON_NUMBER_RAW: {
+      int64_t num;
+      if (tok.value._num.integral && json_num_as_i64(&tok.value._num, &num)) {
+        bits = (uint64_t)num;
+        ok = ok && json_internal_tape_emit(
+                       &b, WHY_JSON_TAPE_WORD(JSON_INT, 0), bits, 2);
+        break;
+      }
+      double flt = json_num_as_double(&tok.value._num);
+      errno = JSON_ERR_NO_ERROR;
+      memcpy(&bits, &flt, sizeof(double));
+      ok = ok && json_internal_tape_emit(&b, WHY_JSON_TAPE_WORD(JSON_FLT, 0),
+                                         bits, 2);
+      break;
+    }
+    case JSON_FLT:
+      memcpy(&bits, &tok.value._flt, sizeof(double));
+      ok = ok && json_internal_tape_emit(&b, WHY_JSON_TAPE_WORD(JSON_FLT, 0),
+                                         bits, 2);
+      break;
+    case JSON_BOOL:
+      ok = ok && json_internal_tape_emit(
+                     &b, WHY_JSON_TAPE_WORD(JSON_BOOL, tok.value._bool != 0),
+                     0, 1);
+      break;
+    default:
+      ok = ok && json_internal_tape_emit(&b, WHY_JSON_TAPE_WORD(JSON_NULL, 0),
+                                         0, 1);
+      break;
+    }
+  }
+
+  free(b.slots);
+  free(b.stack);
+  free(b.hashes);
+  free(b.nodes);
+  if (!ok) {
+    json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+    json_destroy(&tok, it);
+  }
+  if (errno != JSON_ERR_NO_ERROR) {
+    json_tape_free(tape);
+    return 0;
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ uint64_t json_internal_tape_checksum(const void *buf,
+                                                     size_t len,
+                                                     uint64_t hash) {
+  const char *cur = (const char *)buf;
+  uint64_t word;
+  for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+    memcpy(&word, cur, sizeof(uint64_t));
+    hash = (hash ^ word) * 1099511628211ULL;
+    cur += sizeof(uint64_t);
+  }
+  if (len > 0) {
+    word = 0;
+    memcpy(&word, cur, len);
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+_WHY_JSON_FUNC_ int json_tape_write(const JsonTape *tape, FILE *file) {
+  JsonTapeHeader header;
+  memset(&header, 0, sizeof(JsonTapeHeader));
+  memcpy(header.magic, "WHYJTAPE", sizeof(header.magic));
+  header.version = WHY_JSON_TAPE_VERSION;
+  header.byte_order = 0x01020304;
+  header.len = tape->len;
+  header.pool_len = tape->pool_len;
+  header.shared_nodes = tape->shared_nodes;
+  header.shared_words = tape->shared_words;
+  header.checksum = json_internal_tape_checksum(
+      tape->words, tape->len * sizeof(uint64_t), 14695981039346656037ULL);
+  header.checksum =
+      json_internal_tape_checksum(tape->pool, tape->pool_len, header.checksum);
+
+  if (fwrite(&header, sizeof(JsonTapeHeader), 1, file) != 1 ||
+      (tape->len > 0 &&
+       fwrite(tape->words, sizeof(uint64_t), tape->len, file) != tape->len) ||
+      (tape->pool_len > 0 &&
+       fwrite(tape->pool, 1, tape->pool_len, file) != tape->pool_len)) {
+    errno = JSON_ERR_CANT_READ;
+    return 0;
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_check_index(const JsonTape *tape,
+                                                   size_t start) {
+  size_t end = start + (size_t)WHY_JSON_TAPE_PAYLOAD(tape->words[start]);
+  size_t count = (size_t)WHY_JSON_TAPE_PAYLOAD(tape->words[start + 1]);
+  size_t cap = (size_t)tape->words[end - 1];
+  const char *slots = (const char *)(tape->words + end - 1 - cap / 2);
+  size_t used = 0;
+  size_t i;
+  for (i = 0; i < cap; i++) {
+    uint32_t offset;
+    memcpy(&offset, slots + i * sizeof(uint32_t), sizeof(uint32_t));
+    used += offset != 0;
+  }
+  if (used != count) {
+    return 0;
+  }
+
+  /* so if every key can be found the slots can't point anywhere else */
+  size_t cur = start + 2;
+  for (i = 0; i < count; i++) {
+    size_t len;
+    const char *key = json_tape_str(tape, cur, &len);
+    size_t slot = json_internal_hash(key, len) & (cap - 1);
+    uint32_t offset;
+    memcpy(&offset, slots + slot * sizeof(uint32_t), sizeof(uint32_t));
+    while (offset != cur - start) {
+      if (offset == 0) {
+        return 0;
+      }
+      slot = (slot + 1) & (cap - 1);
+      memcpy(&offset, slots + slot * sizeof(uint32_t), sizeof(uint32_t));
+    }
+    cur = json_tape_next(tape, cur + 1);
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_tape_verify(const JsonTape *tape) {
+  /*
+   For each open object / array: where its items end, nodes left, is it an
+   object and where it starts.
+  */
+  size_t stack_small[4 * 64];
+  size_t *stack = stack_small;
+  size_t stack_cap = sizeof(stack_small) / sizeof(stack_small[0]);
+  size_t depth = 0;
+  size_t node = 0;
+  /* a bit per node that starts an object / array, shared nodes need one */
+  uint8_t *starts = (uint8_t *)calloc(tape->len / 8 + 1, 1);
+  int ok = starts != NULL;
+
+  while (ok && node < tape->len) {
+    uint64_t word = tape->words[node];
+    JsonType tag = WHY_JSON_TAPE_TAG(word);
+    uint64_t payload = WHY_JSON_TAPE_PAYLOAD(word);
+    size_t end = tape->len;
+    if (depth > 0) {
+      size_t *top = &stack[depth - 4];
+      /* the members of objects alternate between keys and values */
+      ok = top[1] > 0 && (!top[2] || top[1] % 2 == 1 || tag == JSON_STRING);
+      top[1]--;
+      end = top[0];
+    } else {
+      /* only one root */
+      ok = node == 0;
+    }
+
+    switch (tag) {
+    case JSON_STRING: {
+      uint32_t len;
+      ok = ok && payload + sizeof(uint32_t) <= tape->pool_len;
+      if (ok) {
+        memcpy(&len, tape->pool + payload, sizeof(uint32_t));
+        ok = payload + sizeof(uint32_t) + len < tape->pool_len &&
+             tape->pool[payload + sizeof(uint32_t) + len] == '\0';
+      }
+      node++;
+      break;
+    }
+    case JSON_BOOL:
+    case JSON_NULL:
+      node++;
+      break;
+    case WHY_JSON_TAPE_REF:
+      /* has to be an object / array that ended before this */
+      ok = ok && payload < node && (starts[payload / 8] >> (payload % 8)) & 1 &&
+           WHY_JSON_TAPE_PAYLOAD(tape->words[payload]) <= node - payload;
+      node++;
+      break;
+    case JSON_INT:
+    case JSON_FLT:
+      node += 2;
+      ok = ok && node <= end;
+      break;
+    case JSON_OBJECT:
+    case JSON_ARRAY: {
+      ok = ok && payload >= 2 && payload <= end - node;
+      if (!ok) {
+        break;
+      }
+      uint64_t info = tape->words[node + 1];
+      uint64_t count = WHY_JSON_TAPE_PAYLOAD(info);
+      size_t items_end = node + payload;
+      ok = count <= payload && (info & ~WHY_JSON_TAPE_INDEXED) == count;
+      if (ok && (info & WHY_JSON_TAPE_INDEXED)) {
+        /* the index is at the end with room for every key */
+        uint64_t slots = payload >= 3 ? tape->words[node + payload - 1] : 0;
+        ok = tag == JSON_OBJECT && slots > count &&
+             (slots & (slots - 1)) == 0 && slots / 2 + 3 <= payload;
+        items_end -= ok ? (size_t)slots / 2 + 1 : 0;
+      }
+      if (ok && depth + 4 > stack_cap) {
+        size_t cap = stack_cap * 2;
+        size_t *grown = (size_t *)malloc(cap * sizeof(size_t));
+        if (grown == NULL) {
+          ok = 0;
+          break;
+        }
+        memcpy(grown, stack, depth * sizeof(size_t));
+        if (stack != stack_small) {
+          free(stack);
+        }
+        stack = grown;
+        stack_cap = cap;
+      }
+      stack[depth++] = items_end;
+      stack[depth++] = tag == JSON_OBJECT ? count * 2 : count;
+      stack[depth++] = tag == JSON_OBJECT;
+      stack[depth++] = node;
+      starts[node / 8] |= (uint8_t)(1 << (node % 8));
+      node += 2;
+      break;
+    }
+    default:
+      ok = 0;
+      break;
+    }
+
+    /* close everything that ends here */
+    while (ok && depth > 0 && node == stack[depth - 4]) {
+      size_t start = stack[depth - 1];
+      ok = stack[depth - 3] == 0;
+      if (ok && (tape->words[start + 1] & WHY_JSON_TAPE_INDEXED)) {
+        ok = json_internal_tape_check_index(tape, start);
+        node = start + (size_t)WHY_JSON_TAPE_PAYLOAD(tape->words[start]);
+      }
+      depth -= 4;
+    }
+    ok = ok && (depth == 0 || node < stack[depth - 4]);
+  }
+
+  if (stack != stack_small) {
+    free(stack);
+  }
+  free(starts);
+  return ok && depth == 0;
+}
+
+_WHY_JSON_FUNC_ int json_tape_load(JsonTape *tape, const void *buf,
+                                   size_t len, int verify) {
+  JsonTapeHeader header;
+  json_tape_init(tape);
+  if (buf == NULL || len < sizeof(JsonTapeHeader) ||
+      ((uintptr_t)buf & (sizeof(uint64_t) - 1)) != 0) {
+    errno = JSON_ERR_INVALID_ARGS;
+    return 0;
+  }
+
+  memcpy(&header, buf, sizeof(JsonTapeHeader));
+  if (memcmp(header.magic, "WHYJTAPE", sizeof(header.magic)) != 0 ||
+      header.version != WHY_JSON_TAPE_VERSION ||
+      header.byte_order != 0x01020304 ||
+      header.len > (len - sizeof(JsonTapeHeader)) / sizeof(uint64_t) ||
+      header.pool_len > len - sizeof(JsonTapeHeader) -
+                            header.len * sizeof(uint64_t)) {
+    errno = JSON_ERR_INVALID_VALUE;
+    return 0;
+  }
+
+  tape->words =
+      (const uint64_t *)((const char *)buf + sizeof(JsonTapeHeader));
+  tape->len = header.len;
+  tape->pool = (const char *)(tape->words + header.len);
+  tape->pool_len = header.pool_len;
+  tape->shared_nodes = (size_t)header.shared_nodes;
+  tape->shared_words = (size_t)header.shared_words;
+
+  if (verify) {
+    uint64_t checksum = json_internal_tape_checksum(
+        tape->words, tape->len * sizeof(uint64_t), 14695981039346656037ULL);
+    checksum =
+        json_internal_tape_checksum(tape->pool, tape->pool_len, checksum);
+    if (checksum != header.checksum || !json_internal_tape_verify(tape)) {
+      json_tape_init(tape);
+      errno = JSON_ERR_INVALID_VALUE;
+      return 0;
+    }
+  }
+  errno = JSON_ERR_NO_ERROR;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_tape_map(JsonTape *tape, const char *path,
+                                  int verify) {
+  void *file = NULL;
+  size_t len = 0;
+  int mapped = 0;
+  json_tape_init(tape);
+
+#ifdef WHY_JSON_MMAP
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+    len = (size_t)info.st_size;
+    file = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+      file = NULL;
+    } else {
+      mapped = 1;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+
+  if (file == NULL) {
+    /* no mmap, read it in (malloc is aligned enough) */
+    FILE *in = fopen(path, "rb");
+    long size;
+    if (in == NULL || fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0 ||
+        fseek(in, 0, SEEK_SET) != 0) {
+      if (in != NULL) {
+        fclose(in);
+      }
+      errno = JSON_ERR_CANT_READ;
+      return 0;
+    }
+    len = (size_t)size;
+    file = malloc(len > 0 ? len : 1);
+    if (file == NULL || fread(file, 1, len, in) != len) {
+      free(file);
+      fclose(in);
+      errno = file == NULL ? JSON_ERR_OOM : JSON_ERR_CANT_READ;
+      return 0;
+    }
+    fclose(in);
+  }
+
+  if (!json_tape_load(tape, file, len, verify)) {
+    int err = errno;
+#ifdef WHY_JSON_MMAP
+    if (mapped) {
+      munmap(file, len);
+    } else {
+      free(file);
+    }
+#else
+    free(file);
+#endif
+    errno = err;
+    return 0;
+  }
+  tape->file = file;
+  tape->file_len = len;
+  tape->file_mapped = mapped;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ double json_tape_dedup_ratio(const JsonTape *tape) {
+  if (tape->len == 0) {
+    return 1;
+  }
+  return (double)(tape->len + tape->shared_words) / (double)tape->len;
+}
+
+_WHY_JSON_FUNC_ JsonType json_tape_type(const JsonTape *tape, size_t node) {
+  node = json_internal_tape_resolve(tape, node);
+  return node < tape->len ? WHY_JSON_TAPE_TAG(tape->words[node]) : JSON_ERROR;
+}
+
+_WHY_JSON_FUNC_ size_t json_tape_next(const JsonTape *tape, size_t node) {
+  if (node >= tape->len) {
+    return node + 1;
+  }
+  /* a shared node is a single word wherever it points */
+  switch (WHY_JSON_TAPE_TAG(tape->words[node])) {
+  case JSON_OBJECT:
+  case JSON_ARRAY:
+    return node + (size_t)WHY_JSON_TAPE_PAYLOAD(tape->words[node]);
+  case JSON_INT:
+  case JSON_FLT:
+    return node + 2;
+  default:
+    return node + 1;
+  }
+}
+
+_WHY_JSON_FUNC_ size_t json_tape_len(const JsonTape *tape, size_t node) {
+  node = json_internal_tape_resolve(tape, node);
+  JsonType type = json_tape_type(tape, node);
+  if (type != JSON_OBJECT && type != JSON_ARRAY) {
+    return 0;
+  }
+  return (size_t)WHY_JSON_TAPE_PAYLOAD(tape->words[node + 1]);
+}
+
+_WHY_JSON_FUNC_ size_t json_tape_child(const JsonTape *tape, size_t node) {
+  node = json_internal_tape_resolve(tape, node);
+  return json_tape_len(tape, node) > 0 ? node + 2 : 0;
+}
+
+_WHY_JSON_FUNC_ size_t json_tape_get(const JsonTape *tape, size_t node,
+                                     const char *key) {
+  node = json_internal_tape_resolve(tape, node);
+  if (json_tape_type(tape, node) != JSON_OBJECT) {
+    return 0;
+  }
+  size_t len = strlen(key);
+  if (tape->words[node + 1] & WHY_JSON_TAPE_INDEXED) {
+    size_t end = node + (size_t)WHY_JSON_TAPE_PAYLOAD(tape->words[node]);
+    size_t cap = (size_t)tape->words[end - 1];
+    const char *slots = (const char *)(tape->words + end - 1 - cap / 2);
+    size_t slot = json_internal_hash(key, len) & (cap - 1);
+    for (;;) {
+      uint32_t offset;
+      memcpy(&offset, slots + slot * sizeof(uint32_t), sizeof(uint32_t));
+      if (offset == 0) {
+        return 0;
+      }
+      size_t key_len;
+      const char *str = json_tape_str(tape, node + offset, &key_len);
+      if (key_len == len && memcmp(str, key, len) == 0) {
+        return node + offset + 1;
+      }
+      slot = (slot + 1) & (cap - 1);
+    }
+  }
+
+  size_t n = json_tape_len(tape, node);
+  size_t cur = node + 2;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    size_t key_len;
+    const char *str = json_tape_str(tape, cur, &key_len);
+    if (key_len == len && memcmp(str, key, len) == 0) {
+      return cur + 1;
+    }
+    cur = json_tape_next(tape, cur + 1);
+  }
+  return 0;
+}
+
+_WHY_JSON_FUNC_ size_t json_tape_at(const JsonTape *tape, size_t node,
+                                    size_t i) {
+  node = json_internal_tape_resolve(tape, node);
+  if (json_tape_type(tape, node) != JSON_ARRAY ||
+      i >= json_tape_len(tape, node)) {
+    return 0;
+  }
+  size_t cur = node + 2;
+  for (; i > 0; i--) {
+    cur = json_tape_next(tape, cur);
+  }
+  return cur;
+}
+
+_WHY_JSON_FUNC_ const char *json_tape_str(const JsonTape *tape, size_t node,
+                                          size_t *len) {
+  if (json_tape_type(tape, node) != JSON_STRING) {
+    *len = 0;
+    return NULL;
+  }
+  const char *str = tape->pool + WHY_JSON_TAPE_PAYLOAD(tape->words[node]);
+  uint32_t str_len;
+  memcpy(&str_len, str, sizeof(uint32_t));
+  *len = str_len;
+  return str + sizeof(uint32_t);
+}
+
+_WHY_JSON_FUNC_ int64_t json_tape_int(const JsonTape *tape, size_t node) {
+  switch (json_tape_type(tape, node)) {
+  case JSON_INT:
+    return (int64_t)tape->words[node + 1];
+  case JSON_FLT:
+    return (int64_t)json_tape_flt(tape, node);
+  default:
+    return 0;
+  }
+}
+
+_WHY_JSON_FUNC_ double json_tape_flt(const JsonTape *tape, size_t node) {
+  double flt;
+  switch (json_tape_type(tape, node)) {
+  case JSON_INT:
+    return (double)(int64_t)tape->words[node + 1];
+  case JSON_FLT:
+    memcpy(&flt, &tape->words[node + 1], sizeof(double));
+    return flt;
+  default:
+    return 0;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_tape_bool(const JsonTape *tape, size_t node) {
+  return json_tape_type(tape, node) == JSON_BOOL &&
+         WHY_JSON_TAPE_PAYLOAD(tape->words[node]) != 0;
+}
+
+_WHY_JSON_FUNC_ void json_internal_tee(JsonIt *it, size_t upto) {
+  JsonTee *tee = it->tee;
+  if (upto > tee->from) {
+    fwrite(it->source_str + (tee->from - it->buf_offset), 1, upto - tee->from,
+           tee->out);
+    tee->from = upto;
+  }
+}
+
+_WHY_JSON_FUNC_ size_t json_internal_path_seg(const char *path, size_t len) {
+  size_t i = 0;
+  while (i < len && path[i] != '.') {
+    i += path[i] == '\\' && i + 1 < len ? 2 : 1;
+  }
+  return i;
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_path_rest(const char *pattern,
+                                                    const char *path,
+                                                    size_t len) {
+  /* both sides are escaped the same way so segments compare as bytes */
+  const char *end = path + len;
+  size_t left = strlen(pattern);
+  while (path < end) {
+    size_t seg = json_internal_path_seg(path, (size_t)(end - path));
+    size_t pattern_len = json_internal_path_seg(pattern, left);
+    if (!(pattern_len == 1 && *pattern == '*') &&
+        (pattern_len != seg || memcmp(pattern, path, pattern_len) != 0)) {
+      return NULL;
+    }
+    pattern += pattern_len;
+    left -= pattern_len;
+    path += seg;
+    if (path < end) {
+      if (*pattern == '\0') {
+        return NULL;
+      }
+      pattern++;
+      left--;
+      path++;
+    }
+  }
+  return pattern;
+}
+
+_WHY_JSON_FUNC_ void json_internal_write_str(FILE *out, const char *buf,
+                                             size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  size_t start = 0;
+  size_t i;
+  putc('"', out);
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)buf[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    fwrite(buf + start, 1, i - start, out);
+    start = i + 1;
+    if (c == '"' || c == '\\') {
+      putc('\\', out);
+      putc(c, out);
+    } else if (c == '\n') {
+      fputs("\\n", out);
+    } else if (c == '\t') {
+      fputs("\\t", out);
+    } else if (c == '\r') {
+      fputs("\\r", out);
+    } else {
+      char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+      fwrite(escaped, 1, sizeof(escaped), out);
+    }
+  }
+  fwrite(buf + start, 1, len - start, out);
+  putc('"', out);
+}
+
+_WHY_JSON_FUNC_ void json_internal_write_scalar(JsonIt *it, const JsonTok *tok,
+                                                FILE *out) {
+  /* insitu strings are decoded over their source */
+  if (it->span.begin >= it->buf_offset &&
+      (tok->type != JSON_STRING || !(it->flags & JSON_FLAG_INSITU))) {
+    fwrite(it->source_str + (it->span.begin - it->buf_offset), 1,
+           it->span.end - it->span.begin, out);
+    return;
+  }
+
+  /* the buffer has moved on since (files only) */
+  switch (tok->type) {
+  case JSON_STRING:
+    json_internal_write_str(out, tok->value._str.buf, tok->value._str.len);
+    break;
+  case JSON_NUMBER_RAW:
+    fwrite(tok->value._num.buf, 1, tok->value._num.len, out);
+    break;
+  case JSON_BOOL:
+    fputs(tok->value._bool ? "true" : "false", out);
+    break;
+  default:
+    fputs("null", out);
+    break;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_copy_value(JsonTok *tok, JsonIt *it,
+                                             FILE *out) {
+  JsonTee tee;
+  JsonSpan span;
+  if (out != NULL) {
+    /* json_next left us at the opening bracket */
+    tee.out = out;
+    tee.from = it->buf_offset + it->cur_loc;
+    it->tee = &tee;
+  }
+  int ok = json_skip_raw(tok, it, &span);
+  if (ok && out != NULL) {
+    json_internal_tee(it, span.end);
+  }
+  it->tee = NULL;
+  return ok;
+}
+
+_WHY_JSON_FUNC_ int json_transform(JsonIt *it, const JsonTransformRule *rules,
+                                   int n, FILE *out) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || out == NULL ||
+      (rules == NULL && n > 0)) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator, rules and output");
+    return 0;
+  }
+  it->flags = (it->flags & ~(uint32_t)JSON_FLAG_LAZY_STRINGS) |
+              JSON_FLAG_SPANS | JSON_FLAG_RAW_NUMBERS;
+
+  char path[WHY_JSON_TRANSFORM_MAX_PATH];
+  /*
+   For each object / array we are writing ourselves (rather than copying):
+   how long its path is, has anything been written in it and is it an object
+  */
+  size_t prefix[WHY_JSON_TRANSFORM_MAX_PATH / 2];
+  uint8_t wrote[WHY_JSON_TRANSFORM_MAX_PATH / 2];
+  uint8_t is_object[WHY_JSON_TRANSFORM_MAX_PATH / 2];
+  int level = -1;
+  JsonTok tok;
+  int i;
+  while (json_next(&tok, it)) {
+    if (tok.type == JSON_END) {
+      if (ferror(out)) {
+        json_internal_error(it, JSON_ERR_CANT_READ, "Couldn't write the json");
+        return 0;
+      }
+      return 1;
+    } else if (tok.type == JSON_OBJECT_END || tok.type == JSON_ARRAY_END) {
+      for (i = 0; i < n && tok.type == JSON_OBJECT_END; i++) {
+        const char *rest =
+            json_internal_path_rest(rules[i].path, path, prefix[level]);
+        if (rules[i].op != JSON_TRANSFORM_INSERT || rest == NULL ||
+            (prefix[level] > 0 && *rest++ != '.') || *rest == '\0' ||
+            rest[json_internal_path_seg(rest, strlen(rest))] != '\0') {
+          continue;
+        }
+        if (wrote[level]) {
+          putc(',', out);
+        }
+        wrote[level] = 1;
+        /* the key without its escapes */
+        char key[WHY_JSON_TRANSFORM_MAX_PATH];
+        size_t key_len = 0;
+        for (; *rest != '\0' && key_len < sizeof(key); rest++) {
+          rest += rest[0] == '\\' && rest[1] != '\0';
+          key[key_len++] = *rest;
+        }
+        json_internal_write_str(out, key, key_len);
+        putc(':', out);
+        fputs(rules[i].value, out);
+      }
+      putc(tok.type == JSON_OBJECT_END ? '}' : ']', out);
+      level--;
+      continue;
+    }
+
+    /* the path of this member / item (the root's is empty) */
+    size_t len = 0;
+    int fits = 1;
+    if (level >= 0) {
+      const char *key = is_object[level] ? tok.key.buf : "*";
+      size_t key_len = is_object[level] ? tok.key.len : 1;
+      size_t j;
+      len = prefix[level];
+      if (len > 0) {
+        path[len++] = '.';
+      }
+      /* keys are escaped so a . * or \ in them isn't taken as part of a path */
+      for (j = 0; j < key_len && fits; j++) {
+        char c = key[j];
+        int escape = is_object[level] && (c == '.' || c == '*' || c == '\\');
+        fits = len + 1 + escape < sizeof(path);
+        if (fits && escape) {
+          path[len++] = '\\';
+        }
+        if (fits) {
+          path[len++] = c;
+        }
+      }
+    }
+    if (!fits) {
+      /* a rule could be meant for it so it can't just be copied */
+      json_internal_error(it, JSON_ERR_TOO_LONG, "Path longer than %d",
+                          WHY_JSON_TRANSFORM_MAX_PATH - 1);
+      json_destroy(&tok, it);
+      return 0;
+    }
+
+    /* the first rule for this path and are there any for inside of it */
+    const JsonTransformRule *rule = NULL;
+    int inside = 0;
+    for (i = 0; i < n; i++) {
+      const char *rest = json_internal_path_rest(rules[i].path, path, len);
+      if (rest == NULL) {
+        continue;
+      } else if (level >= 0 && *rest == '\0') {
+        if (rule == NULL && rules[i].op != JSON_TRANSFORM_INSERT) {
+          rule = &rules[i];
+        }
+      } else if (level < 0 ? *rest != '\0' : *rest == '.') {
+        inside = 1;
+      }
+    }
+
+    int collection = tok.type == JSON_OBJECT || tok.type == JSON_ARRAY;
+    if (rule != NULL && rule->op == JSON_TRANSFORM_DROP) {
+      if (collection && !json_internal_copy_value(&tok, it, NULL)) {
+        return 0;
+      }
+      continue;
+    }
+
+    if (level >= 0) {
+      if (wrote[level]) {
+        putc(',', out);
+      }
+      wrote[level] = 1;
+      if (is_object[level]) {
+        if (rule != NULL && rule->op == JSON_TRANSFORM_RENAME) {
+          json_internal_write_str(out, rule->value, strlen(rule->value));
+        } else {
+          json_internal_write_str(out, tok.key.buf, tok.key.len);
+        }
+        putc(':', out);
+      }
+    }
+
+    if (rule != NULL && rule->op == JSON_TRANSFORM_REPLACE) {
+      if (collection && !json_internal_copy_value(&tok, it, NULL)) {
+        return 0;
+      }
+      fputs(rule->value, out);
+    } else if (collection && inside) {
+      /* something to change inside so we go through it */
+      if (level + 1 >= (int)(sizeof(prefix) / sizeof(prefix[0]))) {
+        json_internal_error(it, JSON_ERR_TOO_DEEP, "Nested deeper than %d",
+                            (int)(sizeof(prefix) / sizeof(prefix[0])));
+        json_destroy(&tok, it);
+        return 0;
+      }
+      level++;
+      prefix[level] = len;
+      wrote[level] = 0;
+      is_object[level] = tok.type == JSON_OBJECT;
+      putc(tok.type == JSON_OBJECT ? '{' : '[', out);
+    } else if (collection) {
+      if (!json_internal_copy_value(&tok, it, out)) {
+        return 0;
+      }
+    } else {
+      json_internal_write_scalar(it, &tok, out);
+    }
+  }
+  return 0;
+}
+
+_WHY_JSON_FUNC_ int json_internal_path_uint(const char **cur, size_t *value) {
+  const char *start = *cur;
+  size_t total = 0;
+  while (**cur >= '0' && **cur <= '9') {
+    total = total * 10 + (size_t)(**cur - '0');
+    (*cur)++;
+  }
+  *value = total;
+  return *cur != start;
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_path_copy(char *strs, size_t *used,
+                                                    const char *src,
+                                                    size_t len) {
+  char *dst = strs + *used;
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+  *used += len + 1;
+  return dst;
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_path_filter(const char **cur,
+                                                      JsonPathStep *step,
+                                                      char *strs,
+                                                      size_t *used) {
+  static const char *const ops[] = {"==", "!=", "<=", ">=", "<", ">"};
+  static const JsonPathOp op_types[] = {JSON_PATH_EQ, JSON_PATH_NE,
+                                        JSON_PATH_LE, JSON_PATH_GE,
+                                        JSON_PATH_LT, JSON_PATH_GT};
+  const char *at = *cur;
+  int parens = *at == '(';
+  size_t i;
+  at += parens;
+  at += strspn(at, " \t");
+  *cur = at;
+  if (*at != '@') {
+    return "Filters start with @";
+  }
+  at++;
+  step->type = JSON_PATH_FILTER;
+  if (*at == '.') {
+    size_t len = strcspn(++at, " \t.[=!<>)]");
+    if (len == 0) {
+      *cur = at;
+      return "Expected a key after @.";
+    }
+    step->key = json_internal_path_copy(strs, used, at, len);
+    step->key_len = len;
+    at += len;
+  }
+  at += strspn(at, " \t");
+
+  step->op = JSON_PATH_EXISTS;
+  for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    size_t len = strlen(ops[i]);
+    if (strncmp(at, ops[i], len) == 0) {
+      step->op = op_types[i];
+      at += len;
+      break;
+    }
+  }
+
+  if (step->op != JSON_PATH_EXISTS) {
+    at += strspn(at, " \t");
+    *cur = at;
+    if (*at == '\'' || *at == '"') {
+      const char *end = strchr(at + 1, *at);
+      if (end == NULL) {
+        return "Missing the closing quote";
+      }
+      step->literal_type = JSON_STRING;
+      step->str_len = (size_t)(end - at - 1);
+      step->str = json_internal_path_copy(strs, used, at + 1, step->str_len);
+      at = end + 1;
+    } else if (strncmp(at, "true", 4) == 0) {
+      step->literal_type = JSON_BOOL;
+      step->num = 1;
+      at += 4;
+    } else if (strncmp(at, "false", 5) == 0) {
+      step->literal_type = JSON_BOOL;
+      at += 5;
+    } else if (strncmp(at, "null", 4) == 0) {
+      step->literal_type = JSON_NULL;
+      at += 4;
+    } else {
+      char *end;
+      step->literal_type = JSON_FLT;
+      step->num = strtod(at, &end);
+      if (end == at) {
+        return "Expected a number, string, true, false or null";
+      }
+      at = end;
+    }
+    at += strspn(at, " \t");
+  }
+
+  *cur = at;
+  if (parens) {
+    if (*at != ')') {
+      return "Expected an operator or )";
+    }
+    *cur = at + 1;
+  }
+  return NULL;
+}
+
+_WHY_JSON_FUNC_ int json_path_compile(JsonPath *path, const char *expr,
+                                      JsonErrInfo *info) {
+  memset(path, 0, sizeof(JsonPath));
+  if (info != NULL) {
+    memset(info, 0, sizeof(JsonErrInfo));
+  }
+  if (expr == NULL) {
+    errno = JSON_ERR_INVALID_ARGS;
+    return 0;
+  }
+  /* every string is a piece of expr so this is enough for all of them */
+  path->strs = (char *)malloc(strlen(expr) + 1);
+  if (path->strs == NULL) {
+    errno = JSON_ERR_OOM;
+    return 0;
+  }
+
+  size_t used = 0;
+  const char *cur = expr;
+  const char *msg = NULL;
+  if (*cur == '$') {
+    cur++;
+  } else {
+    msg = "Paths start with $";
+  }
+  while (msg == NULL && *cur != '\0') {
+    JsonPathStep *step = &path->steps[path->n];
+    int dot = 0;
+    if (path->n == WHY_JSON_PATH_MAX_STEPS) {
+      msg = "Too many steps";
+      break;
+    }
+    if (cur[0] == '.' && cur[1] == '.') {
+      step->recursive = 1;
+      cur += 2;
+      dot = *cur != '[';
+    } else if (*cur == '.') {
+      cur++;
+      dot = 1;
+    } else if (*cur != '[') {
+      msg = "Expected . or [";
+      break;
+    }
+
+    if (dot) {
+      size_t len = strcspn(cur, ".[");
+      if (len == 1 && *cur == '*') {
+        step->type = JSON_PATH_ANY;
+      } else if (len == 0) {
+        msg = "Expected a key";
+        break;
+      } else {
+        step->type = JSON_PATH_KEY;
+        step->key = json_internal_path_copy(path->strs, &used, cur, len);
+        step->key_len = len;
+      }
+      cur += len;
+      path->n++;
+      continue;
+    }
+
+    /* [...] */
+    cur++;
+    if (*cur == '*') {
+      step->type = JSON_PATH_ANY;
+      cur++;
+    } else if (*cur == '\'' || *cur == '"') {
+      const char *end = strchr(cur + 1, *cur);
+      if (end == NULL) {
+        msg = "Missing the closing quote";
+        break;
+      }
+      step->type = JSON_PATH_KEY;
+      step->key_len = (size_t)(end - cur - 1);
+      step->key =
+          json_internal_path_copy(path->strs, &used, cur + 1, step->key_len);
+      cur = end + 1;
+    } else if (*cur == '?') {
+      cur++;
+      msg = json_internal_path_filter(&cur, step, path->strs, &used);
+    } else {
+      size_t value;
+      int has_start = json_internal_path_uint(&cur, &step->start);
+      step->type = JSON_PATH_SLICE;
+      step->end = SIZE_MAX;
+      step->step = 1;
+      if (*cur == ':') {
+        cur++;
+        if (json_internal_path_uint(&cur, &value)) {
+          step->end = value;
+        }
+        if (*cur == ':') {
+          cur++;
+          if (json_internal_path_uint(&cur, &value)) {
+            step->step = value;
+          }
+        }
+        if (step->step == 0) {
+          msg = "Slice steps have to be positive";
+        }
+      } else if (has_start) {
+        step->end = step->start + 1;
+      }
+      if (msg == NULL && *cur == '-') {
+        msg = "Negative indexes aren't supported";
+      } else if (msg == NULL && !has_start && cur[-1] == '[') {
+        msg = "Expected a key, index, slice, * or filter";
+      }
+    }
+    if (msg == NULL && *cur != ']') {
+      msg = "Expected ]";
+    }
+    if (msg != NULL) {
+      break;
+    }
+    cur++;
+    path->n++;
+  }
+
+  if (msg == NULL) {
+    return 1;
+  }
+  if (info != NULL) {
+    info->err = JSON_ERR_INVALID_VALUE;
+    info->offset = (size_t)(cur - expr);
+    info->line = 1;
+    info->col = (int)info->offset + 1;
+    info->msg = msg;
+  }
+  json_path_free(path);
+  errno = JSON_ERR_INVALID_VALUE;
+  return 0;
+}
+
+_WHY_JSON_FUNC_ void json_path_free(JsonPath *path) {
+  free(path->strs);
+  path->strs = NULL;
+  path->n = 0;
+}
+
+_WHY_JSON_FUNC_ void json_internal_path_add(JsonPathFrame *frame, int state,
+                                            int64_t dep) {
+  uint64_t bit = (uint64_t)1 << state;
+  if (!(frame->states & bit) || dep < 0) {
+    frame->dep[state] = dep;
+  }
+  frame->states |= bit;
+}
+
+_WHY_JSON_FUNC_ int json_internal_path_matches(const JsonPathStep *step,
+                                               int in_object,
+                                               const JsonTok *tok,
+                                               size_t index) {
+  switch (step->type) {
+  case JSON_PATH_KEY:
+    return in_object && tok->key.len == step->key_len &&
+           memcmp(tok->key.buf, step->key, step->key_len) == 0;
+  case JSON_PATH_SLICE:
+    return !in_object && index >= step->start && index < step->end &&
+           (index - step->start) % step->step == 0;
+  default:
+    return 1;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_path_test(const JsonPathStep *step,
+                                            const JsonTok *tok) {
+  int cmp;
+  if (step->op == JSON_PATH_EXISTS) {
+    return 1;
+  }
+
+  if (step->literal_type == JSON_FLT &&
+      (tok->type == JSON_INT || tok->type == JSON_FLT ||
+       tok->type == JSON_NUMBER_RAW)) {
+    double num;
+    if (tok->type == JSON_INT) {
+      num = (double)tok->value._int;
+    } else if (tok->type == JSON_FLT) {
+      num = tok->value._flt;
+    } else {
+      int saved = errno;
+      num = json_num_as_double(&tok->value._num);
+      errno = saved;
+    }
+    cmp = (num > step->num) - (num < step->num);
+  } else if (step->literal_type == JSON_STRING && tok->type == JSON_STRING) {
+    size_t len = tok->value._str.len;
+    size_t common = len < step->str_len ? len : step->str_len;
+    cmp = common == 0 ? 0 : memcmp(tok->value._str.buf, step->str, common);
+    if (cmp == 0) {
+      cmp = (len > step->str_len) - (len < step->str_len);
+    }
+  } else if (step->literal_type == JSON_BOOL && tok->type == JSON_BOOL) {
+    cmp = (tok->value._bool != 0) - (step->num != 0);
+  } else if (step->literal_type == JSON_NULL && tok->type == JSON_NULL) {
+    cmp = 0;
+  } else {
+    /* values of different types are never equal (nor ordered) */
+    return step->op == JSON_PATH_NE;
+  }
+
+  switch (step->op) {
+  case JSON_PATH_EQ:
+    return cmp == 0;
+  case JSON_PATH_NE:
+    return cmp != 0;
+  case JSON_PATH_LT:
+    return cmp < 0;
+  case JSON_PATH_LE:
+    return cmp <= 0;
+  case JSON_PATH_GT:
+    return cmp > 0;
+  default:
+    return cmp >= 0;
+  }
+}
+
+_WHY_JSON_FUNC_ void json_internal_path_resolve(JsonPathRun *run,
+                                                size_t frame, int step,
+                                                int pass) {
+  int64_t key = (int64_t)frame * 64 + step;
+  int64_t then = run->frames[frame].then[step];
+  size_t i;
+  run->frames[frame].pending &= ~((uint64_t)1 << step);
+
+  /* only this frame and the ones in it can be waiting on it */
+  for (i = frame; i <= run->top; i++) {
+    JsonPathFrame *cur = &run->frames[i];
+    uint64_t bits = cur->states;
+    while (bits != 0) {
+      int state = json_internal_ctz(bits);
+      bits &= bits - 1;
+      if (cur->dep[state] != key) {
+        continue;
+      } else if (pass) {
+        cur->dep[state] = then;
+      } else {
+        cur->states &= ~((uint64_t)1 << state);
+      }
+    }
+
+    bits = cur->pending;
+    while (bits != 0) {
+      int other = json_internal_ctz(bits);
+      bits &= bits - 1;
+      if (cur->then[other] != key) {
+        continue;
+      } else if (pass) {
+        cur->then[other] = then;
+      } else {
+        /* nothing can match through it anymore */
+        json_internal_path_resolve(run, i, other, 0);
+      }
+    }
+  }
+
+  for (i = run->result_head; i < run->result_len; i++) {
+    if (run->results[i].dep != key) {
+      continue;
+    } else if (pass) {
+      run->results[i].dep = then;
+    } else {
+      run->results[i].dropped = 1;
+    }
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_path_result(JsonPathRun *run, int64_t dep,
+                                              JsonType type,
+                                              const JsonValue *value,
+                                              JsonSpan span, int open) {
+  if (dep < 0 && !open && run->result_head == run->result_len) {
+    /* nothing before it is waiting so it doesn't have to either */
+    if (!run->fn(run->ctx, type, value, span)) {
+      run->aborted = 1;
+      return 0;
+    }
+    return 1;
+  }
+
+  if (run->result_len == run->result_cap) {
+    size_t cap = run->result_cap == 0 ? 16 : run->result_cap * 2;
+    JsonPathResult *results = (JsonPathResult *)realloc(
+        run->results, cap * sizeof(JsonPathResult));
+    if (results == NULL) {
+      errno = JSON_ERR_OOM;
+      return 0;
+    }
+    run->results = results;
+    run->result_cap = cap;
+  }
+
+  JsonPathResult *result = &run->results[run->result_len];
+  memset(result, 0, sizeof(JsonPathResult));
+  result->dep = dep;
+  result->type = type;
+  result->open = (uint8_t)open;
+  result->span = span;
+  if (value != NULL) {
+    result->value = *value;
+  }
+
+  /*
+   Strings and raw numbers are only valid till the next token so they are
+   copied (null terminated, like the ones given straight away).
+  */
+  const char *buf = NULL;
+  size_t len = 0;
+  int copy = 1;
+  if (type == JSON_STRING) {
+    buf = value->_str.buf;
+    len = value->_str.len;
+    result->value._str.allocated = 0;
+  } else if (type == JSON_NUMBER_RAW) {
+    buf = value->_num.buf;
+    len = value->_num.len;
+    result->value._num.allocated = 0;
+  } else {
+    copy = 0;
+  }
+  if (copy) {
+    if (run->bytes_len + len + 1 > run->bytes_cap) {
+      size_t cap = run->bytes_cap == 0 ? 256 : run->bytes_cap * 2;
+      cap = cap < run->bytes_len + len + 1 ? run->bytes_len + len + 1 : cap;
+      char *bytes = (char *)realloc(run->bytes, cap);
+      if (bytes == NULL) {
+        errno = JSON_ERR_OOM;
+        return 0;
+      }
+      run->bytes = bytes;
+      run->bytes_cap = cap;
+    }
+    if (len > 0) {
+      memcpy(run->bytes + run->bytes_len, buf, len);
+    }
+    run->bytes[run->bytes_len + len] = '\0';
+    result->offset = run->bytes_len;
+    run->bytes_len += len + 1;
+  }
+  run->result_len++;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_path_flush(JsonPathRun *run) {
+  while (run->result_head < run->result_len) {
+    JsonPathResult *result = &run->results[run->result_head];
+    if (!result->dropped && (result->dep >= 0 || result->open)) {
+      return 1;
+    }
+    run->result_head++;
+    if (result->dropped) {
+      continue;
+    }
+
+    JsonValue value = result->value;
+    const char *buf = run->bytes != NULL ? run->bytes + result->offset : "";
+    if (result->type == JSON_STRING) {
+      value._str.buf = buf;
+    } else if (result->type == JSON_NUMBER_RAW) {
+      value._num.buf = buf;
+    }
+    int collection =
+        result->type == JSON_OBJECT || result->type == JSON_ARRAY;
+    if (!run->fn(run->ctx, result->type, collection ? NULL : &value,
+                 result->span)) {
+      run->aborted = 1;
+      return 0;
+    }
+  }
+  run->result_head = 0;
+  run->result_len = 0;
+  run->bytes_len = 0;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_path_query(JsonIt *it, const JsonPath *path,
+                                    int (*fn)(void *ctx, JsonType type,
+                                              const JsonValue *value,
+                                              JsonSpan span),
+                                    void *ctx) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || path == NULL || fn == NULL) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator, path and callback");
+    return 0;
+  }
+  it->flags =
+      (it->flags & ~(uint32_t)JSON_FLAG_LAZY_STRINGS) | JSON_FLAG_SPANS;
+
+  JsonPathRun run;
+  memset(&run, 0, sizeof(JsonPathRun));
+  run.path = path;
+  run.fn = fn;
+  run.ctx = ctx;
+  run.frame_cap = 16;
+  run.frames = (JsonPathFrame *)malloc(run.frame_cap * sizeof(JsonPathFrame));
+  if (run.frames == NULL) {
+    json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+    json_destroy(NULL, it);
+    return 0;
+  }
+  /* the root is the only item of a pretend array around it */
+  memset(&run.frames[0], 0, sizeof(JsonPathFrame));
+  run.frames[0].result = SIZE_MAX;
+
+  const uint64_t final = (uint64_t)1 << path->n;
+  JsonTok tok;
+  int ok = 1;
+  int done = 0;
+  while (ok && json_next(&tok, it)) {
+    if (tok.type == JSON_END) {
+      done = 1;
+      break;
+    } else if (tok.type == JSON_OBJECT_END || tok.type == JSON_ARRAY_END) {
+      JsonPathFrame *frame = &run.frames[run.top];
+      /* filters that never saw their member */
+      while (frame->pending != 0) {
+        json_internal_path_resolve(&run, run.top,
+                                   json_internal_ctz(frame->pending), 0);
+      }
+      if (frame->result != SIZE_MAX) {
+        run.results[frame->result].span.end = it->span.end;
+        run.results[frame->result].open = 0;
+      }
+      run.top--;
+      ok = json_internal_path_flush(&run);
+      continue;
+    }
+
+    if (run.top + 1 == run.frame_cap) {
+      size_t cap = run.frame_cap * 2;
+      JsonPathFrame *frames =
+          (JsonPathFrame *)realloc(run.frames, cap * sizeof(JsonPathFrame));
+      if (frames == NULL) {
+        errno = JSON_ERR_OOM;
+        ok = 0;
+        break;
+      }
+      run.frames = frames;
+      run.frame_cap = cap;
+    }
+    JsonPathFrame *parent = &run.frames[run.top];
+    JsonPathFrame *child = &run.frames[run.top + 1];
+    size_t index = parent->index++;
+    int collection = tok.type == JSON_OBJECT || tok.type == JSON_ARRAY;
+    int i;
+
+    /* filters waiting on this member can be decided now */
+    uint64_t bits = parent->pending;
+    while (bits != 0) {
+      i = json_internal_ctz(bits);
+      bits &= bits - 1;
+      const JsonPathStep *step = &path->steps[i];
+      if (tok.key.len == step->key_len &&
+          memcmp(tok.key.buf, step->key, step->key_len) == 0) {
+        json_internal_path_resolve(&run, run.top, i,
+                                   json_internal_path_test(step, &tok));
+      }
+    }
+
+    child->states = 0;
+    child->pending = 0;
+    child->index = 0;
+    child->result = SIZE_MAX;
+    child->is_object = tok.type == JSON_OBJECT;
+    if (run.top == 0) {
+      json_internal_path_add(child, 0, -1);
+    }
+    bits = run.top == 0 ? 0 : parent->states & ~final;
+    while (bits != 0) {
+      i = json_internal_ctz(bits);
+      bits &= bits - 1;
+      const JsonPathStep *step = &path->steps[i];
+      int64_t dep = parent->dep[i];
+      if (step->recursive) {
+        json_internal_path_add(child, i, dep);
+      }
+      if (!json_internal_path_matches(step, parent->is_object, &tok, index)) {
+        continue;
+      } else if (step->type != JSON_PATH_FILTER) {
+        json_internal_path_add(child, i + 1, dep);
+      } else if (step->key == NULL) {
+        if (json_internal_path_test(step, &tok)) {
+          json_internal_path_add(child, i + 1, dep);
+        }
+      } else if (child->is_object) {
+        /* has to wait till we get to the member */
+        uint64_t bit = (uint64_t)1 << i;
+        if (!(child->pending & bit) || dep < 0) {
+          child->then[i] = dep;
+        }
+        child->pending |= bit;
+        json_internal_path_add(child, i + 1, (int64_t)(run.top + 1) * 64 + i);
+      }
+    }
+
+    int matched = (child->states & final) != 0;
+    if (collection && ((child->states & ~final) != 0 || child->pending != 0)) {
+      /* could still match something in it */
+      run.top++;
+      if (matched) {
+        ok = json_internal_path_result(&run, child->dep[path->n], tok.type,
+                                       NULL, it->span, 1);
+        child->result = run.result_len - 1;
+      }
+    } else if (collection) {
+      JsonType type = tok.type;
+      JsonSpan span;
+      ok = json_skip_raw(&tok, it, &span);
+      if (ok && matched) {
+        ok = json_internal_path_result(&run, child->dep[path->n], type, NULL,
+                                       span, 0);
+      }
+    } else if (matched) {
+      ok = json_internal_path_result(&run, child->dep[path->n], tok.type,
+                                     &tok.value, it->span, 0);
+    }
+    ok = ok && json_internal_path_flush(&run);
+  }
+
+  if (run.aborted) {
+    json_internal_error(it, JSON_ERR_ABORTED, "Aborted by the callback");
+  } else if (!ok && errno == JSON_ERR_OOM) {
+    json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+  }
+  if (!done) {
+    json_destroy(&tok, it);
+  }
+  free(run.frames);
+  free(run.results);
+  free(run.bytes);
+  return done;
+}
+
+_WHY_JSON_FUNC_ int json_filter_init(JsonFilter *filter, JsonFilterTerm *terms,
+                                     int n, const char *buf, size_t len) {
+  int i;
+  memset(filter, 0, sizeof(JsonFilter));
+  if (n < 0 || n > WHY_JSON_FILTER_MAX_TERMS || (terms == NULL && n > 0) ||
+      (buf == NULL && len > 0)) {
+    errno = JSON_ERR_INVALID_ARGS;
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (terms[i].needle == NULL && terms[i].len > 0) {
+      errno = JSON_ERR_INVALID_ARGS;
+      return 0;
+    }
+    terms[i].tested = 0;
+    terms[i].passed = 0;
+    terms[i].scanned = 0;
+    filter->order[i] = (uint8_t)i;
+  }
+  filter->terms = terms;
+  filter->n = n;
+  filter->buf = buf;
+  filter->cur = buf;
+  filter->end = buf == NULL ? NULL : buf + len;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ double json_internal_filter_rank(const JsonFilterTerm *term) {
+  /* smoothed so terms that were barely searched for aren't extremes */
+  double cost = (double)(term->scanned + 1) / (double)(term->tested + 1);
+  double ruled_out =
+      (double)(term->tested - term->passed + 1) / (double)(term->tested + 2);
+  return cost / ruled_out;
+}
+
+_WHY_JSON_FUNC_ void json_internal_filter_reorder(JsonFilter *filter) {
+  double ranks[WHY_JSON_FILTER_MAX_TERMS];
+  int i, j;
+  for (i = 0; i < filter->n; i++) {
+    ranks[i] = json_internal_filter_rank(&filter->terms[i]);
+  }
+  /* insertion sort, there are only a handful and mostly in order already */
+  for (i = 1; i < filter->n; i++) {
+    uint8_t term = filter->order[i];
+    for (j = i; j > 0 && ranks[filter->order[j - 1]] > ranks[term]; j--) {
+      filter->order[j] = filter->order[j - 1];
+    }
+    filter->order[j] = term;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_filter_next(JsonFilter *filter, JsonIt *it) {
+  while (filter->cur < filter->end) {
+    const char *start = filter->cur;
+    const char *stop = (const char *)memchr(
+        start, '\n', (size_t)(filter->end - start));
+    if (stop == NULL) {
+      stop = filter->end;
+      filter->cur = filter->end;
+    } else {
+      filter->cur = stop + 1;
+    }
+    if (stop > start && stop[-1] == '\r') {
+      stop--;
+    }
+    start = json_internal_skip_whitespace(start, stop);
+    if (start == stop) {
+      continue;
+    }
+
+    filter->records++;
+    if (filter->n > 1 && filter->records % WHY_JSON_FILTER_REORDER == 0) {
+      json_internal_filter_reorder(filter);
+    }
+
+    int i;
+    int candidate = 1;
+    size_t len = (size_t)(stop - start);
+    for (i = 0; candidate && i < filter->n; i++) {
+      JsonFilterTerm *term = &filter->terms[filter->order[i]];
+      const char *found =
+          json_internal_find_substr(start, stop, term->needle, term->len);
+      candidate = found != stop;
+      term->tested++;
+      term->passed += candidate;
+      term->scanned +=
+          candidate ? (size_t)(found - start) + term->len : len;
+    }
+    if (!candidate) {
+      continue;
+    }
+
+    filter->candidates++;
+    filter->record.begin = (size_t)(start - filter->buf);
+    filter->record.end = (size_t)(stop - filter->buf);
+    if (json_internal_str(it, start, len)) {
+      errno = JSON_ERR_NO_ERROR;
+      return 1;
+    }
+    /* can't be parsed so it can't match either */
+  }
+  errno = JSON_ERR_NO_ERROR;
+  return 0;
+}
+
+_WHY_JSON_FUNC_ int json_internal_re_compile(JsonRe *out, const char *re) {
+  out->len = 0;
+  out->bol = *re == '^';
+  out->eol = 0;
+  re += out->bol;
+  while (*re != '\0') {
+    if (re[0] == '$' && re[1] == '\0') {
+      out->eol = 1;
+      break;
+    } else if (strchr("()|{}*+?", *re) != NULL ||
+               (re[0] == '\\' && re[1] == '\0') ||
+               out->len == WHY_JSON_SCHEMA_MAX_ATOMS) {
+      return 0;
+    }
+    JsonReAtom *atom = &out->atoms[out->len++];
+    atom->re = re;
+    atom->len = json_internal_re_atom_len(re);
+    atom->quantifier = 0;
+    if (*re == '[' && re[atom->len - 1] != ']') {
+      return 0;
+    }
+    re += atom->len;
+    if (*re == '*' || *re == '+' || *re == '?') {
+      atom->quantifier = *re++;
+    }
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ size_t json_internal_re_atom_len(const char *re) {
+  if (*re == '\\') {
+    return re[1] == '\0' ? 1 : 2;
+  } else if (*re != '[') {
+    return 1;
+  }
+
+  const char *cur = re + 1;
+  if (*cur == '^') {
+    cur++;
+  }
+  /* a ] straight away is part of the class */
+  if (*cur == ']') {
+    cur++;
+  }
+  while (*cur != '\0' && *cur != ']') {
+    cur += cur[0] == '\\' && cur[1] != '\0' ? 2 : 1;
+  }
+  return (size_t)(cur - re) + (*cur == ']');
+}
+
+_WHY_JSON_FUNC_ int json_internal_re_escape(char e, unsigned char c) {
+  int word = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+             (c >= '0' && c <= '9') || c == '_';
+  int space = c == ' ' || (c >= '\t' && c <= '\r');
+  switch (e) {
+  case 'd':
+    return c >= '0' && c <= '9';
+  case 'D':
+    return !(c >= '0' && c <= '9');
+  case 'w':
+    return word;
+  case 'W':
+    return !word;
+  case 's':
+    return space;
+  case 'S':
+    return !space;
+  case 'n':
+    return c == '\n';
+  case 't':
+    return c == '\t';
+  case 'r':
+    return c == '\r';
+  default:
+    return (unsigned char)e == c;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_re_atom(const char *re, size_t len,
+                                          unsigned char c) {
+  if (*re == '.') {
+    return c != '\n';
+  } else if (*re == '\\') {
+    return json_internal_re_escape(re[1], c);
+  } else if (*re != '[') {
+    return (unsigned char)*re == c;
+  }
+
+  const char *cur = re + 1;
+  const char *end = re + len - 1;
+  int negate = *cur == '^';
+  int match = 0;
+  cur += negate;
+  while (cur < end) {
+    if (*cur == '\\') {
+      match |= json_internal_re_escape(cur[1], c);
+      cur += 2;
+      continue;
+    }
+    unsigned char lo = (unsigned char)cur[0];
+    unsigned char hi = lo;
+    if (cur + 2 < end && cur[1] == '-') {
+      hi = (unsigned char)cur[2];
+      cur += 3;
+    } else {
+      cur++;
+    }
+    match |= c >= lo && c <= hi;
+  }
+  return match != negate;
+}
+
+_WHY_JSON_FUNC_ void json_internal_re_closure(const JsonRe *re, uint64_t *set) {
+  /* skipping a * or ? only ever goes forward so one pass is enough */
+  size_t i;
+  for (i = 0; i < re->len; i++) {
+    if ((set[i / 64] >> (i % 64) & 1) &&
+        (re->atoms[i].quantifier == '*' || re->atoms[i].quantifier == '?')) {
+      set[(i + 1) / 64] |= (uint64_t)1 << ((i + 1) % 64);
+    }
   }
+}
 
-  if (len) {
-    *len = str->len;
+_WHY_JSON_FUNC_ int json_internal_re_search(const char *re, const char *text,
+                                            size_t len) {
+  enum { WORDS = WHY_JSON_SCHEMA_MAX_ATOMS / 64 + 1 };
+  JsonRe compiled;
+  uint64_t set[WORDS];
+  uint64_t next[WORDS];
+  size_t pos, w;
+  if (!json_internal_re_compile(&compiled, re)) {
+    return 0;
   }
+  size_t words = compiled.len / 64 + 1;
+  size_t accept = compiled.len;
+  memset(set, 0, sizeof(set));
+  for (pos = 0;; pos++) {
+    /* unanchored patterns can start matching at any byte */
+    if (pos == 0 || !compiled.bol) {
+      set[0] |= 1;
+    }
+    json_internal_re_closure(&compiled, set);
+    int accepted = (set[accept / 64] >> (accept % 64)) & 1;
+    if (accepted && (!compiled.eol || pos == len)) {
+      return 1;
+    } else if (pos == len) {
+      return 0;
+    }
 
-  if (str->allocated) {
-    str->allocated = 0;
-    char *tmp = (char *)str->buf;
-    str->buf = NULL;
-    str->len = 0;
-    return tmp;
-  } else {
-    char *tmp = malloc(sizeof(char) * (str->len + 1));
-    strncpy(tmp, str->buf, str->len + 1);
-    return tmp;
+    unsigned char c = (unsigned char)text[pos];
+    int any = 0;
+    memset(next, 0, sizeof(next));
+    for (w = 0; w < words; w++) {
+      uint64_t bits = set[w];
+      while (bits != 0) {
+        size_t i = w * 64 + (size_t)json_internal_ctz(bits);
+        bits &= bits - 1;
+        const JsonReAtom *atom = &compiled.atoms[i];
+        if (i == accept || !json_internal_re_atom(atom->re, atom->len, c)) {
+          continue;
+        }
+        /* a repeated atom can go again */
+        if (atom->quantifier == '*' || atom->quantifier == '+') {
+          next[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+        next[(i + 1) / 64] |= (uint64_t)1 << ((i + 1) % 64);
+        any = 1;
+      }
+    }
+    if (!any && compiled.bol) {
+      return 0;
+    }
+    memcpy(set, next, sizeof(set));
   }
 }
 
-_WHY_JSON_FUNC_ int json_internal_error(JsonIt *it, int err, const char *fmt,
-                                        ...) {
-  int res;
-  if (it->stream != NULL && ferror(it->stream)) {
-    errno = JSON_ERR_CANT_READ;
-    res = snprintf(it->err, WHY_JSON_ERR_BUF_SIZE, "Read failure occurred");
-  } else if (it->state == WHY_JSON_UTF8_REJECT ||
-             (it->stream != NULL && feof(it->stream) &&
-              it->state != WHY_JSON_UTF8_ACCEPT)) {
-    errno = JSON_ERR_INVALID_UTF8;
-    res = snprintf(it->err, WHY_JSON_ERR_BUF_SIZE, "Invalid Utf8 Sequence");
-  } else {
-    va_list ap;
-    va_start(ap, fmt);
-    errno = err;
-    res = vsnprintf(it->err, WHY_JSON_ERR_BUF_SIZE, fmt, ap);
-    va_end(ap);
+_WHY_JSON_FUNC_ int json_internal_schema_grow(void **buf, size_t len,
+                                              size_t *cap, size_t size) {
+  if (len < *cap) {
+    return 1;
   }
-  return res;
+  size_t new_cap = *cap == 0 ? 8 : *cap * 2;
+  void *new_buf = realloc(*buf, new_cap * size);
+  if (new_buf == NULL) {
+    return 0;
+  }
+  *buf = new_buf;
+  *cap = new_cap;
+  return 1;
 }
 
-_WHY_JSON_FUNC_ uint32_t json_internal_is_legal_utf8(uint32_t *state,
-                                                     const char *bytes,
-                                                     size_t length) {
-  uint32_t type;
-  if (bytes == NULL || state == NULL) {
+_WHY_JSON_FUNC_ size_t json_internal_schema_str(JsonSchema *schema,
+                                                const char *str, size_t len) {
+  if (schema->strs_len + len + 1 > schema->strs_cap) {
+    size_t cap = schema->strs_cap == 0 ? 256 : schema->strs_cap * 2;
+    cap = cap < schema->strs_len + len + 1 ? schema->strs_len + len + 1 : cap;
+    char *strs = (char *)realloc(schema->strs, cap);
+    if (strs == NULL) {
+      return SIZE_MAX;
+    }
+    schema->strs = strs;
+    schema->strs_cap = cap;
+  }
+  size_t at = schema->strs_len;
+  if (len > 0) {
+    memcpy(schema->strs + at, str, len);
+  }
+  schema->strs[at + len] = '\0';
+  schema->strs_len += len + 1;
+  return at;
+}
+
+_WHY_JSON_FUNC_ int json_internal_schema_number(const JsonTok *tok,
+                                                double *num) {
+  if (tok->type == JSON_INT) {
+    *num = (double)tok->value._int;
+  } else if (tok->type == JSON_FLT) {
+    *num = tok->value._flt;
+  } else if (tok->type == JSON_NUMBER_RAW) {
+    int saved = errno;
+    *num = json_num_as_double(&tok->value._num);
+    errno = saved;
+  } else {
     return 0;
   }
+  return 1;
+}
 
-  size_t i;
-  for (i = 0; i < length; i++) {
-    type = utf8d[(uint8_t)bytes[i]];
-    *state = utf8d[256 + (*state) * 16 + type];
+_WHY_JSON_FUNC_ int json_internal_schema_node(JsonSchema *schema, JsonIt *it,
+                                              JsonTok *tok, const char **msg) {
+  static const char *const types[] = {"string", "number", "integer",
+                                      "boolean", "null", "object", "array"};
+  if (!json_internal_schema_grow((void **)&schema->nodes, schema->nodes_len,
+                                 &schema->nodes_cap, sizeof(JsonSchemaNode))) {
+    *msg = "Out of memory";
+    return -1;
+  }
+  /* the arrays can move as we go so only ever go through the index */
+  int index = (int)schema->nodes_len++;
+  JsonSchemaNode *node = &schema->nodes[index];
+  memset(node, 0, sizeof(JsonSchemaNode));
+  node->props = -1;
+  node->items = -1;
+  node->pattern = SIZE_MAX;
+  if (tok->type == JSON_BOOL) {
+    node->types = tok->value._bool ? 0 : JSON_SCHEMA_NOTHING;
+    return index;
+  } else if (tok->type != JSON_OBJECT) {
+    *msg = "A schema has to be an object or a boolean";
+    return -1;
+  }
 
-    if (*state == 0) {
-      break;
+  while (json_next(tok, it) && tok->type != JSON_OBJECT_END) {
+    const char *key = tok->key.buf;
+    double num = 0;
+    size_t i;
+    if (strcmp(key, "type") == 0) {
+      int many = tok->type == JSON_ARRAY;
+      while (!many || (json_next(tok, it) && tok->type != JSON_ARRAY_END)) {
+        uint32_t bit = 0;
+        for (i = 0; tok->type == JSON_STRING && i < 7; i++) {
+          if (strcmp(tok->value._str.buf, types[i]) == 0) {
+            bit = (uint32_t)1 << i;
+          }
+        }
+        if (bit == 0) {
+          *msg = "Unknown type";
+          return -1;
+        }
+        schema->nodes[index].types |= bit;
+        if (!many) {
+          break;
+        }
+      }
+      if (many && tok->type != JSON_ARRAY_END) {
+        return -1;
+      }
+    } else if (strcmp(key, "properties") == 0) {
+      if (tok->type != JSON_OBJECT) {
+        *msg = "properties has to be an object";
+        return -1;
+      }
+      while (json_next(tok, it) && tok->type != JSON_OBJECT_END) {
+        size_t len = tok->key.len;
+        size_t name = json_internal_schema_str(schema, tok->key.buf, len);
+        if (name == SIZE_MAX) {
+          *msg = "Out of memory";
+          return -1;
+        }
+        int child = json_internal_schema_node(schema, it, tok, msg);
+        if (child < 0) {
+          return -1;
+        } else if (!json_internal_schema_grow(
+                       (void **)&schema->props, schema->props_len,
+                       &schema->props_cap, sizeof(JsonSchemaProp))) {
+          *msg = "Out of memory";
+          return -1;
+        }
+        JsonSchemaProp *prop = &schema->props[schema->props_len];
+        prop->name = name;
+        prop->len = len;
+        prop->node = child;
+        prop->next = schema->nodes[index].props;
+        schema->nodes[index].props = (int)schema->props_len++;
+      }
+      if (tok->type != JSON_OBJECT_END) {
+        return -1;
+      }
+    } else if (strcmp(key, "required") == 0) {
+      if (tok->type != JSON_ARRAY) {
+        *msg = "required has to be an array of strings";
+        return -1;
+      }
+      schema->nodes[index].required = (int)schema->props_len;
+      schema->nodes[index].required_len = 0;
+      while (json_next(tok, it) && tok->type != JSON_ARRAY_END) {
+        if (tok->type != JSON_STRING) {
+          *msg = "required has to be an array of strings";
+          return -1;
+        } else if (schema->nodes[index].required_len == 64) {
+          *msg = "At most 64 members can be required";
+          return -1;
+        }
+        size_t len = tok->value._str.len;
+        size_t name =
+            json_internal_schema_str(schema, tok->value._str.buf, len);
+        if (name == SIZE_MAX ||
+            !json_internal_schema_grow(
+                (void **)&schema->props, schema->props_len,
+                &schema->props_cap, sizeof(JsonSchemaProp))) {
+          *msg = "Out of memory";
+          return -1;
+        }
+        JsonSchemaProp *prop = &schema->props[schema->props_len++];
+        prop->name = name;
+        prop->len = len;
+        prop->node = -1;
+        prop->next = -1;
+        schema->nodes[index].required_len++;
+      }
+      if (tok->type != JSON_ARRAY_END) {
+        return -1;
+      }
+    } else if (strcmp(key, "items") == 0) {
+      if (tok->type == JSON_ARRAY) {
+        *msg = "items has to be a single schema";
+        return -1;
+      }
+      int child = json_internal_schema_node(schema, it, tok, msg);
+      if (child < 0) {
+        return -1;
+      }
+      schema->nodes[index].items = child;
+    } else if (strcmp(key, "enum") == 0) {
+      if (tok->type != JSON_ARRAY) {
+        *msg = "enum has to be an array";
+        return -1;
+      }
+      schema->nodes[index].enums = (int)schema->enums_len;
+      schema->nodes[index].enums_len = 0;
+      while (json_next(tok, it) && tok->type != JSON_ARRAY_END) {
+        JsonSchemaEnum value;
+        memset(&value, 0, sizeof(JsonSchemaEnum));
+        value.type = tok->type;
+        if (tok->type == JSON_STRING) {
+          value.len = tok->value._str.len;
+          value.str =
+              json_internal_schema_str(schema, tok->value._str.buf, value.len);
+          if (value.str == SIZE_MAX) {
+            *msg = "Out of memory";
+            return -1;
+          }
+        } else if (json_internal_schema_number(tok, &value.num)) {
+          value.type = JSON_FLT;
+        } else if (tok->type == JSON_BOOL) {
+          value.num = tok->value._bool != 0;
+        } else if (tok->type != JSON_NULL) {
+          *msg = "enum can only have strings, numbers, booleans and null";
+          return -1;
+        }
+        if (!json_internal_schema_grow((void **)&schema->enums,
+                                       schema->enums_len, &schema->enums_cap,
+                                       sizeof(JsonSchemaEnum))) {
+          *msg = "Out of memory";
+          return -1;
+        }
+        schema->enums[schema->enums_len++] = value;
+        schema->nodes[index].enums_len++;
+      }
+      if (tok->type != JSON_ARRAY_END) {
+        return -1;
+      }
+    } else if (strcmp(key, "minimum") == 0 || strcmp(key, "maximum") == 0) {
+      if (!json_internal_schema_number(tok, &num)) {
+        *msg = "minimum / maximum have to be numbers";
+        return -1;
+      }
+      node = &schema->nodes[index];
+      if (key[1] == 'i') {
+        node->minimum = num;
+        node->limits |= JSON_SCHEMA_MINIMUM;
+      } else {
+        node->maximum = num;
+        node->limits |= JSON_SCHEMA_MAXIMUM;
+      }
+    } else if (strcmp(key, "minLength") == 0 ||
+               strcmp(key, "maxLength") == 0 ||
+               strcmp(key, "minItems") == 0 || strcmp(key, "maxItems") == 0) {
+      if (!json_internal_schema_number(tok, &num) || num < 0 ||
+          num > 1e15 || num != (double)(size_t)num) {
+        *msg = "Lengths have to be non negative integers";
+        return -1;
+      }
+      node = &schema->nodes[index];
+      if (strcmp(key, "minLength") == 0) {
+        node->min_length = (size_t)num;
+        node->limits |= JSON_SCHEMA_MIN_LENGTH;
+      } else if (strcmp(key, "maxLength") == 0) {
+        node->max_length = (size_t)num;
+        node->limits |= JSON_SCHEMA_MAX_LENGTH;
+      } else if (strcmp(key, "minItems") == 0) {
+        node->min_items = (size_t)num;
+        node->limits |= JSON_SCHEMA_MIN_ITEMS;
+      } else {
+        node->max_items = (size_t)num;
+        node->limits |= JSON_SCHEMA_MAX_ITEMS;
+      }
+    } else if (strcmp(key, "pattern") == 0) {
+      /* too big for the stack of something recursive */
+      JsonRe *re = (JsonRe *)malloc(sizeof(JsonRe));
+      int oom = re == NULL;
+      int valid = !oom && tok->type == JSON_STRING &&
+                  json_internal_re_compile(re, tok->value._str.buf);
+      free(re);
+      if (!valid) {
+        *msg = oom ? "Out of memory"
+                   : "Unsupported pattern (no groups, alternation or counts)";
+        return -1;
+      }
+      size_t pattern = json_internal_schema_str(schema, tok->value._str.buf,
+                                                tok->value._str.len);
+      if (pattern == SIZE_MAX) {
+        *msg = "Out of memory";
+        return -1;
+      }
+      schema->nodes[index].pattern = pattern;
+    } else if (tok->type == JSON_OBJECT || tok->type == JSON_ARRAY) {
+      /* a keyword we don't support */
+      JsonSpan span;
+      if (!json_skip_raw(tok, it, &span)) {
+        return -1;
+      }
+    }
+  }
+  if (tok->type != JSON_OBJECT_END) {
+    return -1;
+  }
+  return index;
+}
+
+_WHY_JSON_FUNC_ int json_schema_compile(JsonSchema *schema, const char *json,
+                                        JsonErrInfo *info) {
+  JsonIt it;
+  JsonTok tok;
+  const char *msg = NULL;
+  memset(schema, 0, sizeof(JsonSchema));
+  if (info != NULL) {
+    memset(info, 0, sizeof(JsonErrInfo));
+  }
+  if (!json_str(&it, json)) {
+    if (info != NULL) {
+      info->err = errno;
+      info->msg = "Schema should be valid json";
     }
+    return 0;
   }
+  it.flags &= ~(uint32_t)JSON_FLAG_LAZY_STRINGS;
 
-  return *state;
+  int ok = json_next(&tok, &it) &&
+           json_internal_schema_node(schema, &it, &tok, &msg) == 0 &&
+           json_next(&tok, &it) && tok.type == JSON_END;
+  if (ok) {
+    return 1;
+  }
+
+  JsonErr err = msg != NULL ? JSON_ERR_INVALID_VALUE : (JsonErr)errno;
+  if (info != NULL) {
+    info->err = err;
+    info->offset = it.buf_offset + it.cur_loc;
+    info->line = it.cur_line;
+    info->col = it.cur_col;
+    info->msg = msg != NULL ? msg : it.err;
+  }
+  json_destroy(&tok, &it);
+  json_schema_free(schema);
+  errno = err;
+  return 0;
 }
 
-#define WHY_JSON_GET_COUNT(byte) ((byte) & ~0x80)
-#define WHY_JSON_CAN_ADD(byte) (WHY_JSON_GET_COUNT(byte) < (UINT8_MAX & ~0x80))
+_WHY_JSON_FUNC_ void json_schema_free(JsonSchema *schema) {
+  free(schema->nodes);
+  free(schema->props);
+  free(schema->enums);
+  free(schema->strs);
+  memset(schema, 0, sizeof(JsonSchema));
+}
 
-_WHY_JSON_FUNC_ int json_internal_peek_char(JsonIt *it) {
-  if (it->state == WHY_JSON_UTF8_REJECT) {
-    return EOF;
+_WHY_JSON_FUNC_ const char *json_internal_schema_check(const JsonSchema *schema,
+                                                       int index,
+                                                       const JsonTok *tok) {
+  const JsonSchemaNode *node = &schema->nodes[index];
+  uint32_t type;
+  double num = 0;
+  int i;
+  switch (tok->type) {
+  case JSON_STRING:
+    type = JSON_SCHEMA_STRING;
+    break;
+  case JSON_BOOL:
+    type = JSON_SCHEMA_BOOLEAN;
+    break;
+  case JSON_NULL:
+    type = JSON_SCHEMA_NULL;
+    break;
+  case JSON_OBJECT:
+    type = JSON_SCHEMA_OBJECT;
+    break;
+  case JSON_ARRAY:
+    type = JSON_SCHEMA_ARRAY;
+    break;
+  default:
+    json_internal_schema_number(tok, &num);
+    type = JSON_SCHEMA_NUMBER;
+    /* 1.0 is an integer too */
+    if (tok->type == JSON_INT ||
+        (num > -9e18 && num < 9e18 && num == (double)(int64_t)num)) {
+      type |= JSON_SCHEMA_INTEGER;
+    }
+    break;
   }
 
-  if (it->stream != NULL) {
-    if (it->cur_loc == it->buf_len) {
-      it->cur_loc = 0;
-      it->buf_len = fread(it->buf, sizeof(char), WHY_JSON_BUF_SIZE, it->stream);
-      if (it->buf_len == 0 || it->state == WHY_JSON_UTF8_REJECT) {
-        it->buf_len = 0;
-        it->buf[0] = '\0';
-        return EOF;
+  if (node->types & JSON_SCHEMA_NOTHING) {
+    return "Isn't allowed by the schema";
+  } else if (node->types != 0 && !(node->types & type)) {
+    return "Has the wrong type";
+  }
+
+  if (type & JSON_SCHEMA_NUMBER) {
+    if ((node->limits & JSON_SCHEMA_MINIMUM) && num < node->minimum) {
+      return "Is less than the minimum";
+    } else if ((node->limits & JSON_SCHEMA_MAXIMUM) && num > node->maximum) {
+      return "Is more than the maximum";
+    }
+  } else if (type == JSON_SCHEMA_STRING) {
+    const char *buf = tok->value._str.buf;
+    size_t len = tok->value._str.len;
+    if (node->limits & (JSON_SCHEMA_MIN_LENGTH | JSON_SCHEMA_MAX_LENGTH)) {
+      /* lengths are in code points so don't count continuation bytes */
+      size_t chars = 0;
+      size_t j;
+      for (j = 0; j < len; j++) {
+        chars += ((unsigned char)buf[j] & 0xC0) != 0x80;
+      }
+      if ((node->limits & JSON_SCHEMA_MIN_LENGTH) &&
+          chars < node->min_length) {
+        return "Is shorter than minLength";
+      } else if ((node->limits & JSON_SCHEMA_MAX_LENGTH) &&
+                 chars > node->max_length) {
+        return "Is longer than maxLength";
       }
     }
-    return it->buf[it->cur_loc];
-  } else if (it->source_str != NULL) {
-    if (it->cur_loc >= it->buf_len) {
-      return EOF;
-    } else {
-      return it->source_str[it->cur_loc];
+    if (node->pattern != SIZE_MAX &&
+        !json_internal_re_search(schema->strs + node->pattern, buf, len)) {
+      return "Doesn't match the pattern";
     }
-  } else {
-    errno = JSON_ERR_INVALID_ARGS;
-    return 0;
   }
+
+  if (node->enums_len == 0) {
+    return NULL;
+  }
+  for (i = 0; i < node->enums_len; i++) {
+    const JsonSchemaEnum *value = &schema->enums[node->enums + i];
+    if (value->type == JSON_FLT) {
+      if ((type & JSON_SCHEMA_NUMBER) && value->num == num) {
+        return NULL;
+      }
+    } else if (value->type == JSON_STRING) {
+      if (tok->type == JSON_STRING && tok->value._str.len == value->len &&
+          (value->len == 0 || memcmp(tok->value._str.buf,
+                                     schema->strs + value->str,
+                                     value->len) == 0)) {
+        return NULL;
+      }
+    } else if (value->type == tok->type &&
+               (tok->type == JSON_NULL ||
+                (tok->value._bool != 0) == (value->num != 0))) {
+      return NULL;
+    }
+  }
+  return "Isn't one of the enum values";
 }
 
-_WHY_JSON_FUNC_ int json_internal_init(JsonIt *it) {
-  it->stream = NULL;
-  it->source_str = NULL;
-  it->cur_line = it->cur_col = 1;
-  it->state = WHY_JSON_UTF8_ACCEPT;
-  it->buf_len = 0;
-  it->tok_init = 0;
-#ifndef WHY_JSON_ALLOCATE_BUF
-  it->buf[0] = '\0';
-#else
-  it->buf = NULL;
-#endif
-  it->depth = 0;
-  it->cur_loc = 0;
-  it->err[0] = '\0';
-  it->match_stack = malloc(sizeof(uint8_t) * WHY_JSON_INITIAL_MATCH_STACK);
-  it->match_len = 0;
+_WHY_JSON_FUNC_ size_t json_internal_schema_segment(char *path, size_t len,
+                                                    const char *key,
+                                                    size_t key_len,
+                                                    int is_object,
+                                                    size_t index) {
+  char buf[32];
+  size_t i;
+  int plain = key_len > 0;
+  if (!is_object) {
+    key_len = (size_t)snprintf(buf, sizeof(buf), "[%lu]", (unsigned long)index);
+    key = buf;
+  } else {
+    for (i = 0; i < key_len && plain; i++) {
+      char c = key[i];
+      plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '_';
+    }
+  }
+
+  /* quoted keys have ' \ and " escaped */
+  size_t extra = !is_object ? 0 : plain ? 1 : 4;
+  for (i = 0; is_object && !plain && i < key_len; i++) {
+    extra += key[i] == '\'' || key[i] == '\\' || key[i] == '"';
+  }
+  if (len + key_len + extra >= WHY_JSON_SCHEMA_MAX_PATH) {
+    /* cut short */
+    return len;
+  }
+  if (is_object) {
+    path[len++] = plain ? '.' : '[';
+    if (!plain) {
+      path[len++] = '\'';
+    }
+  }
+  for (i = 0; i < key_len; i++) {
+    char c = key[i];
+    if (is_object && !plain && (c == '\'' || c == '\\' || c == '"')) {
+      path[len++] = '\\';
+    }
+    path[len++] = c;
+  }
+  if (is_object && !plain) {
+    path[len++] = '\'';
+    path[len++] = ']';
+  }
+  path[len] = '\0';
+  return len;
+}
 
-  if (it->match_stack == NULL) {
+_WHY_JSON_FUNC_ int json_schema_validate(JsonIt *it, const JsonSchema *schema,
+                                         JsonSchemaErr *err) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || schema == NULL ||
+      schema->nodes_len == 0) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator and schema");
+    return 0;
+  }
+  if (err != NULL) {
+    memset(err, 0, sizeof(JsonSchemaErr));
+  }
+  it->flags =
+      (it->flags & ~(uint32_t)JSON_FLAG_LAZY_STRINGS) | JSON_FLAG_SPANS;
+
+  size_t cap = 16;
+  size_t top = 0;
+  JsonSchemaFrame *frames =
+      (JsonSchemaFrame *)malloc(cap * sizeof(JsonSchemaFrame));
+  if (frames == NULL) {
     json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+    json_destroy(NULL, it);
     return 0;
   }
+  /* the root is the only item of a pretend array around it */
+  memset(&frames[0], 0, sizeof(JsonSchemaFrame));
+  frames[0].node = -1;
+  frames[0].path_len = 1;
+  char path[WHY_JSON_SCHEMA_MAX_PATH] = "$";
+
+  JsonTok tok;
+  const char *msg = NULL;
+  size_t msg_len = 0;
+  size_t offset = 0;
+  int done = 0;
+  while (json_next(&tok, it)) {
+    if (tok.type == JSON_END) {
+      done = 1;
+      break;
+    } else if (tok.type == JSON_OBJECT_END || tok.type == JSON_ARRAY_END) {
+      const JsonSchemaFrame *frame = &frames[top];
+      const JsonSchemaNode *node = &schema->nodes[frame->node];
+      uint64_t all = node->required_len == 64
+                         ? ~(uint64_t)0
+                         : ((uint64_t)1 << node->required_len) - 1;
+      offset = it->span.begin;
+      msg_len = frame->path_len;
+      /* required is only about objects, arrays never have members */
+      if (frame->is_object && (frame->seen & all) != all) {
+        const JsonSchemaProp *name =
+            &schema->props[node->required +
+                           json_internal_ctz(~frame->seen & all)];
+        msg = "Is required but missing";
+        msg_len = json_internal_schema_segment(
+            path, frame->path_len, schema->strs + name->name, name->len, 1,
+            0);
+      } else if (!frame->is_object &&
+                 (node->limits & JSON_SCHEMA_MIN_ITEMS) &&
+                 frame->count < node->min_items) {
+        msg = "Has fewer items than minItems";
+      } else if (!frame->is_object &&
+                 (node->limits & JSON_SCHEMA_MAX_ITEMS) &&
+                 frame->count > node->max_items) {
+        msg = "Has more items than maxItems";
+      }
+      if (msg != NULL) {
+        break;
+      }
+      top--;
+      continue;
+    }
 
-  memset(it->match_stack, 0, sizeof(uint8_t) * WHY_JSON_INITIAL_MATCH_STACK);
-  /*
-    This acts as a null terminating character for us
-    TODO: Is this even worth the memory saved..
-          It is quite esoteric idk..
-  */
-  it->match_stack[WHY_JSON_INITIAL_MATCH_STACK - 1] = UINT8_MAX;
-  return 1;
+    if (top + 1 == cap) {
+      JsonSchemaFrame *more = (JsonSchemaFrame *)realloc(
+          frames, cap * 2 * sizeof(JsonSchemaFrame));
+      if (more == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        json_destroy(&tok, it);
+        break;
+      }
+      frames = more;
+      cap *= 2;
+    }
+
+    /* the schema for this member / item */
+    JsonSchemaFrame *parent = &frames[top];
+    size_t index = parent->count++;
+    int node = top == 0 ? 0 : -1;
+    int i;
+    if (top > 0 && parent->is_object) {
+      const JsonSchemaNode *object = &schema->nodes[parent->node];
+      for (i = object->props; i >= 0; i = schema->props[i].next) {
+        const JsonSchemaProp *prop = &schema->props[i];
+        if (prop->len == tok.key.len &&
+            memcmp(schema->strs + prop->name, tok.key.buf, prop->len) == 0) {
+          node = prop->node;
+          break;
+        }
+      }
+      for (i = 0; i < object->required_len; i++) {
+        const JsonSchemaProp *prop = &schema->props[object->required + i];
+        if (prop->len == tok.key.len &&
+            memcmp(schema->strs + prop->name, tok.key.buf, prop->len) == 0) {
+          parent->seen |= (uint64_t)1 << i;
+        }
+      }
+    } else if (top > 0) {
+      node = schema->nodes[parent->node].items;
+    }
+
+    size_t len = top == 0 ? 1
+                          : json_internal_schema_segment(
+                                path, parent->path_len, tok.key.buf,
+                                tok.key.len, parent->is_object, index);
+    msg = node < 0 ? NULL : json_internal_schema_check(schema, node, &tok);
+    if (msg != NULL) {
+      msg_len = len;
+      offset = it->span.begin;
+      break;
+    }
+
+    if (tok.type != JSON_OBJECT && tok.type != JSON_ARRAY) {
+      continue;
+    }
+    const JsonSchemaNode *child = node < 0 ? NULL : &schema->nodes[node];
+    if (child == NULL ||
+        (child->props < 0 && child->required_len == 0 && child->items < 0 &&
+         !(child->limits & (JSON_SCHEMA_MIN_ITEMS | JSON_SCHEMA_MAX_ITEMS)))) {
+      /* nothing to check inside of it */
+      JsonSpan span;
+      if (!json_skip_raw(&tok, it, &span)) {
+        break;
+      }
+      continue;
+    }
+    top++;
+    frames[top].node = node;
+    frames[top].is_object = tok.type == JSON_OBJECT;
+    frames[top].seen = 0;
+    frames[top].count = 0;
+    frames[top].path_len = len;
+  }
+
+  if (msg != NULL) {
+    path[msg_len] = '\0';
+    if (err != NULL) {
+      memcpy(err->path, path, msg_len + 1);
+      err->msg = msg;
+      err->offset = offset;
+    }
+    json_destroy(&tok, it);
+    json_internal_error(it, JSON_ERR_SCHEMA, "%s: %s", path, msg);
+  }
+  free(frames);
+  return done;
 }
 
-_WHY_JSON_FUNC_ int json_file(JsonIt *it, FILE *file) {
-  if (file == NULL) {
-    json_internal_error(it, JSON_ERR_INVALID_ARGS, "File should be valid");
-    return 0;
+_WHY_JSON_FUNC_ void json_intern_init(JsonIntern *table) {
+  memset(table, 0, sizeof(JsonIntern));
+}
+
+_WHY_JSON_FUNC_ void json_intern_free(JsonIntern *table) {
+  json_arena_free(&table->strs);
+  free(table->entries);
+  free(table->slots);
+  json_intern_init(table);
+}
+
+_WHY_JSON_FUNC_ uint32_t json_internal_hash(const char *buf, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash ^= (uint8_t)buf[i];
+    hash *= 16777619u;
   }
+  return hash;
+}
 
-  int res = json_internal_init(it);
-  it->stream = file;
-#ifdef WHY_JSON_ALLOCATE_BUF
-  it->buf = malloc(sizeof(char) * (WHY_JSON_BUF_SIZE + 1));
-  it->buf[0] = '\0';
-#endif
+_WHY_JSON_FUNC_ int json_intern_find(const JsonIntern *table, const char *buf,
+                                     size_t len) {
+  if (table->slots == NULL) {
+    return -1;
+  }
 
-  return res;
+  uint32_t hash = json_internal_hash(buf, len);
+  uint32_t slot = hash & table->slot_mask;
+  while (table->slots[slot] != 0) {
+    const JsonInternEntry *entry = &table->entries[table->slots[slot] - 1];
+    if (entry->hash == hash && entry->len == len &&
+        memcmp(entry->buf, buf, len) == 0) {
+      return table->slots[slot] - 1;
+    }
+    slot = (slot + 1) & table->slot_mask;
+  }
+  return -1;
+}
+
+_WHY_JSON_FUNC_ int json_intern(JsonIntern *table, const char *buf,
+                                size_t len) {
+  int id = json_intern_find(table, buf, len);
+  if (id >= 0) {
+    return id;
+  } else if (table->count >= WHY_JSON_INTERN_MAX ||
+             len > WHY_JSON_MAX_STR_LEN) {
+    return -1;
+  }
+
+  /* keep the slots at most half full */
+  if ((uint32_t)(table->count + 1) * 2 > table->slot_mask + 1 ||
+      table->slots == NULL) {
+    uint32_t size = table->slots == NULL ? 64 : (table->slot_mask + 1) * 2;
+    uint16_t *slots = (uint16_t *)calloc(size, sizeof(uint16_t));
+    if (slots == NULL) {
+      return -1;
+    }
+    int i;
+    for (i = 0; i < table->count; i++) {
+      uint32_t slot = table->entries[i].hash & (size - 1);
+      while (slots[slot] != 0) {
+        slot = (slot + 1) & (size - 1);
+      }
+      slots[slot] = (uint16_t)(i + 1);
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slot_mask = size - 1;
+  }
+
+  if (table->count == table->cap) {
+    int cap = table->cap == 0 ? 32 : table->cap * 2;
+    JsonInternEntry *entries = (JsonInternEntry *)realloc(
+        table->entries, sizeof(JsonInternEntry) * cap);
+    if (entries == NULL) {
+      return -1;
+    }
+    table->entries = entries;
+    table->cap = cap;
+  }
+
+  char *copy = (char *)json_internal_arena_alloc(&table->strs, len + 1, 1);
+  if (copy == NULL) {
+    return -1;
+  }
+  memcpy(copy, buf, len);
+  copy[len] = '\0';
+
+  id = table->count++;
+  table->entries[id].buf = copy;
+  table->entries[id].len = (uint32_t)len;
+  table->entries[id].hash = json_internal_hash(buf, len);
+
+  uint32_t slot = table->entries[id].hash & table->slot_mask;
+  while (table->slots[slot] != 0) {
+    slot = (slot + 1) & table->slot_mask;
+  }
+  table->slots[slot] = (uint16_t)(id + 1);
+  return id;
+}
+
+_WHY_JSON_FUNC_ void json_internal_intern_str(JsonIt *it, JsonStr *str,
+                                              int16_t *id) {
+  *id = -1;
+  if (str->buf == NULL || str->len > WHY_JSON_INTERN_MAX_LEN ||
+      (str->raw && str->has_escapes)) {
+    return;
+  }
+
+  int found = json_intern(it->intern, str->buf, str->len);
+  if (found < 0) {
+    return;
+  }
+
+  if (str->allocated) {
+    free((char *)str->buf);
+  }
+  str->buf = it->intern->entries[found].buf;
+  str->allocated = 0;
+  str->raw = 0;
+  str->has_escapes = 0;
+  *id = (int16_t)found;
+}
+
+_WHY_JSON_FUNC_ const char *json_intern_str(const JsonIntern *table, int id,
+                                            size_t *len) {
+  if (id < 0 || id >= table->count) {
+    return NULL;
+  }
+  if (len) {
+    *len = table->entries[id].len;
+  }
+  return table->entries[id].buf;
 }
 
 _WHY_JSON_FUNC_ int json_str(JsonIt *it, const char *str) {
   if (str == NULL) {
+    json_internal_init(it);
     json_internal_error(it, JSON_ERR_INVALID_ARGS, "String should be valid");
     return 0;
   }
+  return json_internal_str(it, str, strlen(str));
+}
 
+_WHY_JSON_FUNC_ int json_internal_str(JsonIt *it, const char *str,
+                                      size_t len) {
   int res = json_internal_init(it);
   it->source_str = str;
-  it->buf_len = strlen(str);
+  it->buf_len = len;
   it->state = json_internal_is_legal_utf8(&it->state, str, it->buf_len);
   if (it->state != WHY_JSON_UTF8_ACCEPT) {
     /*
@@ -592,7 +6544,28 @@ _WHY_JSON_FUNC_ int json_str(JsonIt *it, const char *str) {
      since it's waiting for more.  This catches it
     */
     it->state = WHY_JSON_UTF8_REJECT;
-    json_internal_error(it, JSON_ERR_NO_ERROR, "");
+    json_internal_clear_error(it);
+    return 0;
+  }
+
+  return res;
+}
+
+_WHY_JSON_FUNC_ int json_insitu(JsonIt *it, char *buf, size_t len) {
+  int res = json_internal_init(it);
+  if (buf == NULL) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS, "Buffer should be valid");
+    return 0;
+  }
+
+  it->source_str = buf;
+  it->buf_len = len;
+  it->flags |= JSON_FLAG_INSITU;
+  it->state = json_internal_is_legal_utf8(&it->state, buf, len);
+  if (it->state != WHY_JSON_UTF8_ACCEPT) {
+    /* same as json_str, catches half finished wide chars */
+    it->state = WHY_JSON_UTF8_REJECT;
+    json_internal_clear_error(it);
     return 0;
   }
 
@@ -625,6 +6598,10 @@ _WHY_JSON_FUNC_ int json_internal_into_buf(char **tmp, size_t *tmp_len,
     *tmp_len = 1;
     (*tmp)[0] = c;
     (*tmp)[1] = '\0';
+  } else if (*tmp_len >= WHY_JSON_MAX_STR_LEN) {
+    json_internal_error(it, JSON_ERR_TOO_LONG, "String longer than %lu",
+                        (unsigned long)WHY_JSON_MAX_STR_LEN);
+    return 0;
   } else if (*tmp_len < *tmp_cap) {
     (*tmp)[(*tmp_len)++] = c;
     (*tmp)[*tmp_len] = '\0';
@@ -632,11 +6609,16 @@ _WHY_JSON_FUNC_ int json_internal_into_buf(char **tmp, size_t *tmp_len,
     if (*tmp_cap < 4) {
       *tmp_cap = 4;
     }
-    char *new = (char *)realloc(*tmp, sizeof(char) * (*tmp_cap * 2 + 1));
+    int small = json_internal_is_small_str(it, *tmp);
+    char *new = small ? (char *)malloc(sizeof(char) * (*tmp_cap * 2 + 1))
+                      : (char *)realloc(*tmp, sizeof(char) * (*tmp_cap * 2 + 1));
     if (new == NULL) {
       json_internal_error(it, JSON_ERR_OOM, "Out of memory");
       return 0;
     }
+    if (small) {
+      memcpy(new, *tmp, *tmp_len);
+    }
     *tmp = new;
     *tmp_cap *= 2;
     (*tmp)[(*tmp_len)++] = c;
@@ -646,52 +6628,884 @@ _WHY_JSON_FUNC_ int json_internal_into_buf(char **tmp, size_t *tmp_len,
   return 1;
 }
 
-_WHY_JSON_FUNC_ int json_internal_is_whitespace(char c) {
-  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
-}
+_WHY_JSON_FUNC_ int json_internal_into_buf_n(char **tmp, size_t *tmp_len,
+                                             size_t *tmp_cap, JsonIt *it,
+                                             const char *src, size_t n) {
+  if (*tmp_len + n > WHY_JSON_MAX_STR_LEN) {
+    json_internal_error(it, JSON_ERR_TOO_LONG, "String longer than %lu",
+                        (unsigned long)WHY_JSON_MAX_STR_LEN);
+    return 0;
+  }
+  if (*tmp == NULL || *tmp_len + n > *tmp_cap) {
+    size_t cap = *tmp == NULL || *tmp_cap < WHY_JSON_INITIAL_TMP_BUF_SIZE
+                     ? WHY_JSON_INITIAL_TMP_BUF_SIZE
+                     : *tmp_cap * 2;
+    while (cap < *tmp_len + n) {
+      cap *= 2;
+    }
+    int small = *tmp != NULL && json_internal_is_small_str(it, *tmp);
+    char *new = small ? (char *)malloc(sizeof(char) * (cap + 1))
+                      : (char *)realloc(*tmp, sizeof(char) * (cap + 1));
+    if (new == NULL) {
+      json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+      return 0;
+    }
+    if (small) {
+      memcpy(new, *tmp, *tmp_len);
+    }
+    *tmp = new;
+    *tmp_cap = cap;
+  }
+
+  memcpy(*tmp + *tmp_len, src, n);
+  *tmp_len += n;
+  (*tmp)[*tmp_len] = '\0';
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_ctz(uint64_t mask) {
+#if defined __GNUC__
+  return __builtin_ctzll(mask);
+#else
+  int count = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    count++;
+  }
+  return count;
+#endif
+}
+
+/*
+ == Scanning Kernels ==
+ Each kernel has a scalar version and one per instruction set, the vector
+ versions just handle full chunks and leave the rest to the scalar version.
+ */
+
+/*
+ Bit tricks to check 8 bytes at once, each sets the high bit of a byte if
+ it matches (the lowest match is always exact).
+ */
+#define WHY_JSON_ONES (0x0101010101010101ull)
+#define WHY_JSON_HAS_ZERO(v) (((v)-WHY_JSON_ONES) & ~(v) & (WHY_JSON_ONES * 0x80))
+#define WHY_JSON_HAS_BYTE(v, b) WHY_JSON_HAS_ZERO((v) ^ (WHY_JSON_ONES * (b)))
+#define WHY_JSON_HAS_LESS(v, n)                                                \
+  (((v)-WHY_JSON_ONES * (n)) & ~(v) & (WHY_JSON_ONES * 0x80))
+
+#define WHY_JSON_IS_STR_SPECIAL(c, ending)                                     \
+  ((uint8_t)(c) < 0x20 || (c) == '"' || (c) == '\\' || (c) == (ending))
+#define WHY_JSON_IS_STRUCTURAL(c)                                              \
+  ((c) == '"' || (c) == '[' || (c) == ']' || (c) == '{' || (c) == '}')
+
+_WHY_JSON_FUNC_ const char *json_internal_find_str_special_scalar(
+    const char *cur, const char *end, char ending) {
+  while (end - cur >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, cur, sizeof(chunk));
+    if (WHY_JSON_HAS_BYTE(chunk, '"') | WHY_JSON_HAS_BYTE(chunk, '\\') |
+        WHY_JSON_HAS_BYTE(chunk, (uint8_t)ending) |
+        WHY_JSON_HAS_LESS(chunk, 0x20)) {
+      /* it's in this chunk, just find it below */
+      break;
+    }
+    cur += 8;
+  }
+
+  while (cur < end && !WHY_JSON_IS_STR_SPECIAL(*cur, ending)) {
+    cur++;
+  }
+  return cur;
+}
+
+_WHY_JSON_FUNC_ const char *
+json_internal_skip_whitespace_scalar(const char *cur, const char *end) {
+  /* whitespace runs are normally short so don't bother with chunks */
+  while (cur < end && json_internal_is_whitespace(*cur)) {
+    cur++;
+  }
+  return cur;
+}
+
+_WHY_JSON_FUNC_ const char *
+json_internal_find_structural_scalar(const char *cur, const char *end) {
+  while (end - cur >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, cur, sizeof(chunk));
+    if (WHY_JSON_HAS_BYTE(chunk, '"') | WHY_JSON_HAS_BYTE(chunk, '[') |
+        WHY_JSON_HAS_BYTE(chunk, ']') | WHY_JSON_HAS_BYTE(chunk, '{') |
+        WHY_JSON_HAS_BYTE(chunk, '}')) {
+      break;
+    }
+    cur += 8;
+  }
+
+  while (cur < end && !WHY_JSON_IS_STRUCTURAL(*cur)) {
+    cur++;
+  }
+  return cur;
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_skip_ascii_scalar(const char *cur,
+                                                           const char *end) {
+  while (end - cur >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, cur, sizeof(chunk));
+    if (chunk & (WHY_JSON_ONES * 0x80)) {
+      break;
+    }
+    cur += 8;
+  }
+
+  while (cur < end && (uint8_t)*cur < 0x80) {
+    cur++;
+  }
+  return cur;
+}
+
+/*
+ The substring kernels look for the first and last byte of the needle
+ (len - 1 apart) at the same time and only compare the whole of it where
+ both are, so they rarely have to.
+ */
+_WHY_JSON_FUNC_ const char *json_internal_find_substr_scalar(
+    const char *cur, const char *end, const char *needle, size_t len) {
+  const uint64_t first = WHY_JSON_ONES * (uint8_t)needle[0];
+  const uint64_t last = WHY_JSON_ONES * (uint8_t)needle[len - 1];
+  while ((size_t)(end - cur) >= len + 7) {
+    uint64_t head, tail;
+    memcpy(&head, cur, sizeof(head));
+    memcpy(&tail, cur + len - 1, sizeof(tail));
+    if (WHY_JSON_HAS_ZERO(head ^ first) & WHY_JSON_HAS_ZERO(tail ^ last)) {
+      /* could be a false positive so just check each */
+      int i;
+      for (i = 0; i < 8; i++) {
+        if (memcmp(cur + i, needle, len) == 0) {
+          return cur + i;
+        }
+      }
+    }
+    cur += 8;
+  }
+
+  while ((size_t)(end - cur) >= len) {
+    if (*cur == needle[0] && memcmp(cur, needle, len) == 0) {
+      return cur;
+    }
+    cur++;
+  }
+  return end;
+}
+
+#ifdef WHY_JSON_SSE2
+WHY_JSON_TARGET("sse2")
+_WHY_JSON_FUNC_ const char *json_internal_find_str_special_sse2(
+    const char *cur, const char *end, char ending) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i slash = _mm_set1_epi8('\\');
+  const __m128i end_char = _mm_set1_epi8(ending);
+  const __m128i control = _mm_set1_epi8(0x1F);
+  while (end - cur >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+    /* max(c, 0x1F) == 0x1F only if c <= 0x1F (unsigned) */
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, slash)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, end_char),
+                     _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control)));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 16;
+  }
+  return json_internal_find_str_special_scalar(cur, end, ending);
+}
+
+WHY_JSON_TARGET("sse2")
+_WHY_JSON_FUNC_ const char *
+json_internal_skip_whitespace_sse2(const char *cur, const char *end) {
+  while (end - cur >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+    __m128i space = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+    int mask = ~_mm_movemask_epi8(space) & 0xFFFF;
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 16;
+  }
+  return json_internal_skip_whitespace_scalar(cur, end);
+}
+
+WHY_JSON_TARGET("sse2")
+_WHY_JSON_FUNC_ const char *
+json_internal_find_structural_sse2(const char *cur, const char *end) {
+  while (end - cur >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+    __m128i structural = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('[')),
+                                  _mm_cmpeq_epi8(chunk, _mm_set1_epi8(']')))),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('{')),
+                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('}'))));
+    int mask = _mm_movemask_epi8(structural);
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 16;
+  }
+  return json_internal_find_structural_scalar(cur, end);
+}
+
+WHY_JSON_TARGET("sse2")
+_WHY_JSON_FUNC_ const char *json_internal_skip_ascii_sse2(const char *cur,
+                                                         const char *end) {
+  while (end - cur >= 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)cur));
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 16;
+  }
+  return json_internal_skip_ascii_scalar(cur, end);
+}
+
+WHY_JSON_TARGET("sse2")
+_WHY_JSON_FUNC_ const char *json_internal_find_substr_sse2(
+    const char *cur, const char *end, const char *needle, size_t len) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[len - 1]);
+  while ((size_t)(end - cur) >= len + 15) {
+    __m128i head = _mm_loadu_si128((const __m128i *)cur);
+    __m128i tail = _mm_loadu_si128((const __m128i *)(cur + len - 1));
+    int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+    while (mask != 0) {
+      const char *at = cur + json_internal_ctz(mask);
+      if (memcmp(at, needle, len) == 0) {
+        return at;
+      }
+      mask &= mask - 1;
+    }
+    cur += 16;
+  }
+  return json_internal_find_substr_scalar(cur, end, needle, len);
+}
+#endif
+
+#ifdef WHY_JSON_DISPATCH
+/*
+ SSE4.2 can match against a set (or ranges) of characters in a single
+ instruction.  Ascii and substrings don't gain anything over SSE2 so they
+ just use that.
+ */
+#define WHY_JSON_SSE42_ANY (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY)
+
+WHY_JSON_TARGET("sse4.2")
+_WHY_JSON_FUNC_ const char *json_internal_find_str_special_sse42(
+    const char *cur, const char *end, char ending) {
+  const __m128i ranges = _mm_setr_epi8(0x00, 0x1F, '"', '"', '\\', '\\',
+                                       ending, ending, 0, 0, 0, 0, 0, 0, 0, 0);
+  while (end - cur >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+    int index = _mm_cmpestri(ranges, 8, chunk, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES);
+    if (index != 16) {
+      return cur + index;
+    }
+    cur += 16;
+  }
+  return json_internal_find_str_special_scalar(cur, end, ending);
+}
+
+WHY_JSON_TARGET("sse4.2")
+_WHY_JSON_FUNC_ const char *
+json_internal_skip_whitespace_sse42(const char *cur, const char *end) {
+  const __m128i space = _mm_setr_epi8(' ', '\t', '\n', '\r', 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0, 0);
+  while (end - cur >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+    int index = _mm_cmpestri(space, 4, chunk, 16,
+                             WHY_JSON_SSE42_ANY | _SIDD_NEGATIVE_POLARITY);
+    if (index != 16) {
+      return cur + index;
+    }
+    cur += 16;
+  }
+  return json_internal_skip_whitespace_scalar(cur, end);
+}
+
+WHY_JSON_TARGET("sse4.2")
+_WHY_JSON_FUNC_ const char *
+json_internal_find_structural_sse42(const char *cur, const char *end) {
+  const __m128i structural = _mm_setr_epi8('"', '[', ']', '{', '}', 0, 0, 0, 0,
+                                           0, 0, 0, 0, 0, 0, 0);
+  while (end - cur >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+    int index = _mm_cmpestri(structural, 5, chunk, 16, WHY_JSON_SSE42_ANY);
+    if (index != 16) {
+      return cur + index;
+    }
+    cur += 16;
+  }
+  return json_internal_find_structural_scalar(cur, end);
+}
+
+#undef WHY_JSON_SSE42_ANY
+
+WHY_JSON_TARGET("avx2")
+_WHY_JSON_FUNC_ const char *json_internal_find_str_special_avx2(
+    const char *cur, const char *end, char ending) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i slash = _mm256_set1_epi8('\\');
+  const __m256i end_char = _mm256_set1_epi8(ending);
+  const __m256i control = _mm256_set1_epi8(0x1F);
+  while (end - cur >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)cur);
+    __m256i special = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                        _mm256_cmpeq_epi8(chunk, slash)),
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(chunk, end_char),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control)));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 32;
+  }
+  return json_internal_find_str_special_sse2(cur, end, ending);
+}
+
+WHY_JSON_TARGET("avx2")
+_WHY_JSON_FUNC_ const char *
+json_internal_skip_whitespace_avx2(const char *cur, const char *end) {
+  while (end - cur >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)cur);
+    __m256i space = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r'))));
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(space);
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 32;
+  }
+  return json_internal_skip_whitespace_sse2(cur, end);
+}
+
+WHY_JSON_TARGET("avx2")
+_WHY_JSON_FUNC_ const char *
+json_internal_find_structural_avx2(const char *cur, const char *end) {
+  while (end - cur >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)cur);
+    __m256i structural = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"')),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('[')),
+                            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(']')))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('{')),
+                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('}'))));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(structural);
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 32;
+  }
+  return json_internal_find_structural_sse2(cur, end);
+}
+
+WHY_JSON_TARGET("avx2")
+_WHY_JSON_FUNC_ const char *json_internal_skip_ascii_avx2(const char *cur,
+                                                         const char *end) {
+  while (end - cur >= 32) {
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+        _mm256_loadu_si256((const __m256i *)cur));
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 32;
+  }
+  return json_internal_skip_ascii_sse2(cur, end);
+}
+
+WHY_JSON_TARGET("avx2")
+_WHY_JSON_FUNC_ const char *json_internal_find_substr_avx2(
+    const char *cur, const char *end, const char *needle, size_t len) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[len - 1]);
+  while ((size_t)(end - cur) >= len + 31) {
+    __m256i head = _mm256_loadu_si256((const __m256i *)cur);
+    __m256i tail = _mm256_loadu_si256((const __m256i *)(cur + len - 1));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+    while (mask != 0) {
+      const char *at = cur + json_internal_ctz(mask);
+      if (memcmp(at, needle, len) == 0) {
+        return at;
+      }
+      mask &= mask - 1;
+    }
+    cur += 32;
+  }
+  return json_internal_find_substr_sse2(cur, end, needle, len);
+}
+
+WHY_JSON_TARGET("avx512f,avx512bw")
+_WHY_JSON_FUNC_ const char *json_internal_find_str_special_avx512(
+    const char *cur, const char *end, char ending) {
+  const __m512i quote = _mm512_set1_epi8('"');
+  const __m512i slash = _mm512_set1_epi8('\\');
+  const __m512i end_char = _mm512_set1_epi8(ending);
+  const __m512i control = _mm512_set1_epi8(0x1F);
+  while (end - cur >= 64) {
+    __m512i chunk = _mm512_loadu_si512((const void *)cur);
+    uint64_t mask = _mm512_cmpeq_epi8_mask(chunk, quote) |
+                    _mm512_cmpeq_epi8_mask(chunk, slash) |
+                    _mm512_cmpeq_epi8_mask(chunk, end_char) |
+                    _mm512_cmple_epu8_mask(chunk, control);
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 64;
+  }
+  return json_internal_find_str_special_avx2(cur, end, ending);
+}
+
+WHY_JSON_TARGET("avx512f,avx512bw")
+_WHY_JSON_FUNC_ const char *
+json_internal_skip_whitespace_avx512(const char *cur, const char *end) {
+  while (end - cur >= 64) {
+    __m512i chunk = _mm512_loadu_si512((const void *)cur);
+    uint64_t mask = ~(_mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(' ')) |
+                      _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\t')) |
+                      _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\n')) |
+                      _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\r')));
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 64;
+  }
+  return json_internal_skip_whitespace_avx2(cur, end);
+}
+
+WHY_JSON_TARGET("avx512f,avx512bw")
+_WHY_JSON_FUNC_ const char *
+json_internal_find_structural_avx512(const char *cur, const char *end) {
+  while (end - cur >= 64) {
+    __m512i chunk = _mm512_loadu_si512((const void *)cur);
+    uint64_t mask = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('"')) |
+                    _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('[')) |
+                    _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(']')) |
+                    _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('{')) |
+                    _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('}'));
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 64;
+  }
+  return json_internal_find_structural_avx2(cur, end);
+}
+
+WHY_JSON_TARGET("avx512f,avx512bw")
+_WHY_JSON_FUNC_ const char *json_internal_skip_ascii_avx512(const char *cur,
+                                                           const char *end) {
+  while (end - cur >= 64) {
+    uint64_t mask =
+        _mm512_movepi8_mask(_mm512_loadu_si512((const void *)cur));
+    if (mask != 0) {
+      return cur + json_internal_ctz(mask);
+    }
+    cur += 64;
+  }
+  return json_internal_skip_ascii_avx2(cur, end);
+}
+
+WHY_JSON_TARGET("avx512f,avx512bw")
+_WHY_JSON_FUNC_ const char *json_internal_find_substr_avx512(
+    const char *cur, const char *end, const char *needle, size_t len) {
+  const __m512i first = _mm512_set1_epi8(needle[0]);
+  const __m512i last = _mm512_set1_epi8(needle[len - 1]);
+  while ((size_t)(end - cur) >= len + 63) {
+    __m512i head = _mm512_loadu_si512((const void *)cur);
+    __m512i tail = _mm512_loadu_si512((const void *)(cur + len - 1));
+    uint64_t mask = _mm512_cmpeq_epi8_mask(head, first) &
+                    _mm512_cmpeq_epi8_mask(tail, last);
+    while (mask != 0) {
+      const char *at = cur + json_internal_ctz(mask);
+      if (memcmp(at, needle, len) == 0) {
+        return at;
+      }
+      mask &= mask - 1;
+    }
+    cur += 64;
+  }
+  return json_internal_find_substr_avx2(cur, end, needle, len);
+}
+#endif
+
+/* clang-format off */
+static const JsonKernels json_internal_all_kernels[] = {
+  { JSON_ISA_SCALAR, json_internal_find_str_special_scalar,
+    json_internal_skip_whitespace_scalar, json_internal_find_structural_scalar,
+    json_internal_skip_ascii_scalar, json_internal_find_substr_scalar },
+#ifdef WHY_JSON_SSE2
+  { JSON_ISA_SSE2, json_internal_find_str_special_sse2,
+    json_internal_skip_whitespace_sse2, json_internal_find_structural_sse2,
+    json_internal_skip_ascii_sse2, json_internal_find_substr_sse2 },
+#endif
+#ifdef WHY_JSON_DISPATCH
+  { JSON_ISA_SSE42, json_internal_find_str_special_sse42,
+    json_internal_skip_whitespace_sse42, json_internal_find_structural_sse42,
+    json_internal_skip_ascii_sse2, json_internal_find_substr_sse2 },
+  { JSON_ISA_AVX2, json_internal_find_str_special_avx2,
+    json_internal_skip_whitespace_avx2, json_internal_find_structural_avx2,
+    json_internal_skip_ascii_avx2, json_internal_find_substr_avx2 },
+  { JSON_ISA_AVX512, json_internal_find_str_special_avx512,
+    json_internal_skip_whitespace_avx512, json_internal_find_structural_avx512,
+    json_internal_skip_ascii_avx512, json_internal_find_substr_avx512 },
+#endif
+};
+/* clang-format on */
+
+/*
+ NULL until the first use.  With runtime dispatch any thread can be the first
+ one to parse something so it's read and written atomically, otherwise every
+ thread picks the same kernels so a plain pointer does.  Define
+ WHY_JSON_LOAD_KERNELS(ptr) and WHY_JSON_STORE_KERNELS(ptr, kernels) to use
+ your own atomics instead (i.e. to call json_set_isa while parsing).
+ */
+static const JsonKernels *json_internal_active_kernels = NULL;
+#if defined WHY_JSON_LOAD_KERNELS && defined WHY_JSON_STORE_KERNELS
+#define WHY_JSON_INTERNAL_LOAD_KERNELS()                                       \
+  WHY_JSON_LOAD_KERNELS(&json_internal_active_kernels)
+#define WHY_JSON_INTERNAL_STORE_KERNELS(kernels)                               \
+  WHY_JSON_STORE_KERNELS(&json_internal_active_kernels, (kernels))
+#elif defined WHY_JSON_DISPATCH
+#define WHY_JSON_INTERNAL_LOAD_KERNELS()                                       \
+  __atomic_load_n(&json_internal_active_kernels, __ATOMIC_ACQUIRE)
+#define WHY_JSON_INTERNAL_STORE_KERNELS(kernels)                               \
+  __atomic_store_n(&json_internal_active_kernels, (kernels), __ATOMIC_RELEASE)
+#else
+#define WHY_JSON_INTERNAL_LOAD_KERNELS() json_internal_active_kernels
+#define WHY_JSON_INTERNAL_STORE_KERNELS(kernels)                               \
+  (json_internal_active_kernels = (kernels))
+#endif
+
+_WHY_JSON_FUNC_ int json_internal_isa_supported(JsonIsa isa) {
+  switch (isa) {
+  case JSON_ISA_SCALAR:
+    return 1;
+#if defined WHY_JSON_DISPATCH
+  case JSON_ISA_SSE2:
+    return __builtin_cpu_supports("sse2") != 0;
+  case JSON_ISA_SSE42:
+    return __builtin_cpu_supports("sse4.2") != 0;
+  case JSON_ISA_AVX2:
+    return __builtin_cpu_supports("avx2") != 0;
+  case JSON_ISA_AVX512:
+    return __builtin_cpu_supports("avx512bw") != 0;
+#elif defined WHY_JSON_SSE2
+  case JSON_ISA_SSE2:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+_WHY_JSON_FUNC_ const JsonKernels *json_internal_kernels(void) {
+  const JsonKernels *kernels = WHY_JSON_INTERNAL_LOAD_KERNELS();
+  if (kernels == NULL) {
+    /*
+     The table is in order of preference so just take the last one we can.
+     Racing threads all come to the same answer.
+     */
+#ifdef WHY_JSON_DISPATCH
+    __builtin_cpu_init();
+#endif
+    size_t count =
+        sizeof(json_internal_all_kernels) / sizeof(json_internal_all_kernels[0]);
+    size_t i = count - 1;
+    while (i > 0 && !json_internal_isa_supported(json_internal_all_kernels[i].isa)) {
+      i--;
+    }
+    kernels = &json_internal_all_kernels[i];
+    WHY_JSON_INTERNAL_STORE_KERNELS(kernels);
+  }
+  return kernels;
+}
+
+_WHY_JSON_FUNC_ JsonIsa json_active_isa(void) {
+  return json_internal_kernels()->isa;
+}
+
+_WHY_JSON_FUNC_ const char *json_isa_name(JsonIsa isa) {
+  switch (isa) {
+  case JSON_ISA_SCALAR:
+    return "scalar";
+  case JSON_ISA_SSE2:
+    return "sse2";
+  case JSON_ISA_SSE42:
+    return "sse4.2";
+  case JSON_ISA_AVX2:
+    return "avx2";
+  case JSON_ISA_AVX512:
+    return "avx512";
+  default:
+    return "unknown";
+  }
+}
+
+_WHY_JSON_FUNC_ int json_set_isa(JsonIsa isa) {
+  size_t i;
+  for (i = 0; i < sizeof(json_internal_all_kernels) /
+                      sizeof(json_internal_all_kernels[0]);
+       i++) {
+    if (json_internal_all_kernels[i].isa == isa &&
+        json_internal_isa_supported(isa)) {
+      WHY_JSON_INTERNAL_STORE_KERNELS(&json_internal_all_kernels[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+_WHY_JSON_FUNC_ const char *
+json_internal_find_str_special(const char *cur, const char *end, char ending) {
+  return json_internal_kernels()->find_str_special(cur, end, ending);
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_skip_whitespace(const char *cur,
+                                                         const char *end) {
+  return json_internal_kernels()->skip_whitespace(cur, end);
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_find_structural(const char *cur,
+                                                         const char *end) {
+  return json_internal_kernels()->find_structural(cur, end);
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_skip_ascii(const char *cur,
+                                                    const char *end) {
+  return json_internal_kernels()->skip_ascii(cur, end);
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_find_substr(const char *cur,
+                                                     const char *end,
+                                                     const char *needle,
+                                                     size_t len) {
+  if (len == 0) {
+    return cur;
+  }
+  return json_internal_kernels()->find_substr(cur, end, needle, len);
+}
+
+_WHY_JSON_FUNC_ int json_internal_str_run(JsonIt *it, char **tmp,
+                                          size_t *tmp_len, size_t *tmp_cap,
+                                          char ending) {
+  /* peek will refill the buffer for us if we are reading from a file */
+  while (json_internal_peek_char(it) != EOF) {
+    const char *base = it->source_str;
+    const char *cur = base + it->cur_loc;
+    const char *end = base + it->buf_len;
+    const char *special = json_internal_find_str_special(cur, end, ending);
+    size_t run = special - cur;
+    if (run > 0 &&
+        !json_internal_into_buf_n(tmp, tmp_len, tmp_cap, it, cur, run)) {
+      return 0;
+    }
+
+    /* strings can't have newlines so we are always on the same line */
+    it->cur_loc += run;
+    it->cur_col += run;
+    if (special != end) {
+      break;
+    }
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_is_whitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+_WHY_JSON_FUNC_ void json_internal_advance(JsonIt *it, const char *to) {
+  const char *cur = it->source_str + it->cur_loc;
+  const char *line;
+  while ((line = memchr(cur, '\n', to - cur)) != NULL) {
+    it->cur_line++;
+    it->cur_col = 0;
+    cur = line + 1;
+  }
+  it->cur_col += to - cur;
+  it->cur_loc = to - it->source_str;
+}
+
+_WHY_JSON_FUNC_ void json_internal_ignore_whitespace(JsonIt *it) {
+  /* peek will refill the buffer for us if we are reading from a file */
+  while (json_internal_is_whitespace(json_internal_peek_char(it))) {
+    const char *base = it->source_str;
+    json_internal_advance(it,
+                          json_internal_skip_whitespace(base + it->cur_loc,
+                                                        base + it->buf_len));
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_skip_str(JsonIt *it) {
+  while (json_internal_peek_char(it) != EOF) {
+    const char *base = it->source_str;
+    const char *special = json_internal_find_str_special(
+        base + it->cur_loc, base + it->buf_len, '"');
+    /* strings can't have newlines so we are always on the same line */
+    it->cur_col += special - (base + it->cur_loc);
+    it->cur_loc = special - base;
+    if (special == base + it->buf_len) {
+      continue;
+    }
+
+    int next = json_internal_next_char(it);
+    if (next == '"') {
+      return 1;
+    } else if (next != '\\' || json_internal_next_char(it) == EOF) {
+      break;
+    }
+  }
+
+  json_internal_error(it, JSON_ERR_MISSING_QUOTE, "Missing \"");
+  return 0;
+}
+
+_WHY_JSON_FUNC_ int json_internal_skip_value(JsonIt *it) {
+  int peek = json_internal_peek_char(it);
+  if (peek == '"') {
+    json_internal_next_char(it);
+    return json_internal_skip_str(it);
+  } else if (peek != '{' && peek != '[') {
+    /* numbers, true/false/null (or identifiers) just run till a delimiter */
+    size_t len = 0;
+    while (peek != EOF && !json_internal_is_whitespace(peek) && peek != ',' &&
+           peek != '}' && peek != ']') {
+      json_internal_next_char(it);
+      peek = json_internal_peek_char(it);
+      len++;
+    }
+    if (len == 0) {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE, "Expected a value");
+      return 0;
+    }
+    return 1;
+  }
+
+  /* the nesting is tracked like normal so mismatched brackets still fail */
+  int depth = it->depth;
+  do {
+    if (json_internal_peek_char(it) == EOF) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched %c",
+                          json_internal_in_object(it) ? '{' : '[');
+      return 0;
+    }
+    const char *base = it->source_str;
+    const char *next =
+        json_internal_find_structural(base + it->cur_loc, base + it->buf_len);
+    json_internal_advance(it, next);
+    if (next == base + it->buf_len) {
+      continue;
+    }
+
+    int c = json_internal_next_char(it);
+    if (c == '"') {
+      if (!json_internal_skip_str(it)) {
+        return 0;
+      }
+    } else if (c == '{' || c == '[') {
+      if (!json_internal_push_nesting(it, c == '{')) {
+        return 0;
+      }
+    } else if (json_internal_in_object(it) != (c == '}')) {
+      json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched %c",
+                          json_internal_in_object(it) ? '{' : '[');
+      return 0;
+    } else {
+      it->depth--;
+    }
+  } while (it->depth > depth);
+  return 1;
+}
+
+#define WHY_JSON_NESTING_INLINE_WORDS ((WHY_JSON_INLINE_DEPTH + 63) / 64)
 
-_WHY_JSON_FUNC_ void json_internal_ignore_whitespace(JsonIt *it) {
-  while (json_internal_is_whitespace(json_internal_peek_char(it))) {
-    json_internal_next_char(it);
+_WHY_JSON_FUNC_ int json_internal_in_object(const JsonIt *it) {
+  if (it->depth == 0) {
+    return 0;
   }
+
+  size_t level = it->depth - 1;
+  size_t word = level / 64;
+  uint64_t bits = word < WHY_JSON_NESTING_INLINE_WORDS
+                      ? it->nesting[word]
+                      : it->nesting_spill[word - WHY_JSON_NESTING_INLINE_WORDS];
+  return (bits >> (level % 64)) & 1;
 }
 
-_WHY_JSON_FUNC_ int json_internal_resize_match_stack(JsonIt *it) {
-  /*
-   if the next one is uint8_max then we have found end
-   of our buffer and we have to reallocate
-  */
-  if (it->match_stack[it->match_len] == UINT8_MAX) {
-    uint8_t *tmp =
-        realloc(it->match_stack, sizeof(uint8_t) * it->match_len * 2);
-    if (tmp == NULL) {
-      json_internal_error(it, JSON_ERR_OOM, "Out of memory");
-      return 0;
+_WHY_JSON_FUNC_ int json_internal_push_nesting(JsonIt *it, int is_object) {
+  if (it->depth >= it->max_depth) {
+    json_internal_error(it, JSON_ERR_TOO_DEEP, "Nested deeper than %d",
+                        it->max_depth);
+    return 0;
+  }
+
+  size_t level = it->depth;
+  size_t word = level / 64;
+  uint64_t *bits;
+  if (word < WHY_JSON_NESTING_INLINE_WORDS) {
+    bits = &it->nesting[word];
+  } else {
+    word -= WHY_JSON_NESTING_INLINE_WORDS;
+    if (word >= it->nesting_spill_cap) {
+      uint32_t cap = it->nesting_spill_cap == 0 ? 4 : it->nesting_spill_cap * 2;
+      uint64_t *tmp =
+          (uint64_t *)realloc(it->nesting_spill, sizeof(uint64_t) * cap);
+      if (tmp == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        return 0;
+      }
+      it->nesting_spill = tmp;
+      it->nesting_spill_cap = cap;
     }
-    it->match_stack = tmp;
-    memset(it->match_stack + it->match_len, 0, it->match_len);
-    it->match_stack[it->match_len * 2 - 1] = UINT8_MAX;
+    bits = &it->nesting_spill[word];
+  }
+
+  if (is_object) {
+    *bits |= (uint64_t)1 << (level % 64);
+  } else {
+    *bits &= ~((uint64_t)1 << (level % 64));
   }
+  it->depth++;
   return 1;
 }
 
+#undef WHY_JSON_NESTING_INLINE_WORDS
+
 _WHY_JSON_FUNC_ int json_internal_count_braces(JsonTok *tok, JsonIt *it) {
   char open = '[';
   char close = ']';
   uint8_t end_type = JSON_ARRAY_END;
-  uint8_t required_mask = 0;
-  if (it->match_len > 0 &&
-      (it->match_stack[it->match_len - 1] & 0x80) == 0x80) {
+  if (json_internal_in_object(it)) {
     open = '{';
     close = '}';
     end_type = JSON_OBJECT_END;
-    required_mask = 0x80;
   }
 
   int peek = json_internal_peek_char(it);
 
   if (peek == 0) {
-    if (it->match_len == 0) {
+    if (it->depth == 0) {
       tok->type = JSON_END;
       errno = JSON_ERR_NO_ERROR;
       return 0;
@@ -703,17 +7517,13 @@ _WHY_JSON_FUNC_ int json_internal_count_braces(JsonTok *tok, JsonIt *it) {
 
   if (peek == close) {
     json_internal_next_char(it);
-    it->depth--;
-    if (it->match_len == 0 ||
-        (it->match_stack[it->match_len - 1] & 0x80) != required_mask) {
+    /* close always matches the innermost collection if we are in one */
+    if (it->depth == 0) {
       json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS,
                           "Extraneous unmatched %c", close);
       return 0;
     }
-
-    if (WHY_JSON_GET_COUNT(--it->match_stack[it->match_len - 1]) == 0) {
-      it->match_stack[--it->match_len] = 0;
-    }
+    it->depth--;
 
     tok->type = end_type;
     errno = JSON_ERR_NO_ERROR;
@@ -730,27 +7540,31 @@ _WHY_JSON_FUNC_ void json_internal_free_str(JsonStr *str) {
   str->buf = NULL;
   str->len = 0;
   str->allocated = 0;
+  str->raw = 0;
+  str->has_escapes = 0;
 }
 
 _WHY_JSON_FUNC_ void json_destroy(JsonTok *tok, JsonIt *it) {
   if (it) {
-    if (it->match_stack) {
-      free(it->match_stack);
-      it->match_stack = NULL;
-      it->match_len = 0;
+    if (it->nesting_spill) {
+      free(it->nesting_spill);
+      it->nesting_spill = NULL;
+      it->nesting_spill_cap = 0;
     }
-#ifdef WHY_JSON_ALLOCATE_BUF
-    if (it->buf) {
-      free(it->buf);
-      it->buf = NULL;
+    it->flags |= JSON_FLAG_DESTROYED;
+    if (it->stream != NULL && it->source_str != NULL) {
+      free((char *)it->source_str);
+      it->source_str = NULL;
     }
-#endif
+    free(it->keyset);
+    it->keyset = NULL;
   }
   if (tok) {
     if (tok->key.buf) {
       json_internal_free_str(&tok->key);
     }
-    if (tok->type == JSON_STRING && tok->value._str.buf) {
+    if ((tok->type == JSON_STRING || tok->type == JSON_NUMBER_RAW) &&
+        tok->value._str.buf) {
       json_internal_free_str(&tok->value._str);
     }
     /* NOTE: Error is the default value */
@@ -765,9 +7579,9 @@ _WHY_JSON_FUNC_ int json_internal_char_needs_escaping(int c) {
 _WHY_JSON_FUNC_ int json_internal_hex(int c) {
   if (c >= '0' && c <= '9') {
     return c - '0';
-  } else if (c >= 'a' && c <= 'z') {
+  } else if (c >= 'a' && c <= 'f') {
     return c - 'a' + 10;
-  } else if (c >= 'A' && c <= 'Z') {
+  } else if (c >= 'A' && c <= 'F') {
     return c - 'A' + 10;
   } else {
     return -1;
@@ -791,52 +7605,337 @@ json_internal_parse_codepoint(JsonIt *it, uint32_t *codepoint, int len) {
   return 1;
 }
 
-_WHY_JSON_FUNC_ int json_internal_to_utf8(char **tmp, size_t *tmp_len,
-                                          size_t *tmp_cap, JsonIt *it,
-                                          uint32_t cp) {
+_WHY_JSON_FUNC_ int json_internal_encode_utf8(uint32_t cp, char *out) {
   if (cp <= 0x7Ful) {
-    return json_internal_into_buf(tmp, tmp_len, tmp_cap, it, cp);
+    out[0] = cp;
+    return 1;
   } else if (cp <= 0x7FFul) {
-    int first = (cp >> 6 & 0x1F) | 0xC0;
-    int second = (cp & 0x3F) | 0x80;
-    return json_internal_into_buf(tmp, tmp_len, tmp_cap, it, first) &&
-           json_internal_into_buf(tmp, tmp_len, tmp_cap, it, second);
+    out[0] = (cp >> 6 & 0x1F) | 0xC0;
+    out[1] = (cp & 0x3F) | 0x80;
+    return 2;
   } else if (cp <= 0xFFFF) {
-    int first = (cp >> 12 & 0x0F) | 0xE0;
-    int second = (cp >> 6 & 0x3F) | 0x80;
-    int third = (cp & 0x3F) | 0x80;
-    return json_internal_into_buf(tmp, tmp_len, tmp_cap, it, first) &&
-           json_internal_into_buf(tmp, tmp_len, tmp_cap, it, second) &&
-           json_internal_into_buf(tmp, tmp_len, tmp_cap, it, third);
+    out[0] = (cp >> 12 & 0x0F) | 0xE0;
+    out[1] = (cp >> 6 & 0x3F) | 0x80;
+    out[2] = (cp & 0x3F) | 0x80;
+    return 3;
   } else if (cp <= 0x10FFFF) {
-    int first = (cp >> 18 & 0x07) | 0xF0;
-    int second = (cp >> 12 & 0x3F) | 0x80;
-    int third = (cp >> 6 & 0x3F) | 0x80;
-    int fourth = (cp & 0x3F) | 0x80;
-    return json_internal_into_buf(tmp, tmp_len, tmp_cap, it, first) &&
-           json_internal_into_buf(tmp, tmp_len, tmp_cap, it, second) &&
-           json_internal_into_buf(tmp, tmp_len, tmp_cap, it, third) &&
-           json_internal_into_buf(tmp, tmp_len, tmp_cap, it, fourth);
+    out[0] = (cp >> 18 & 0x07) | 0xF0;
+    out[1] = (cp >> 12 & 0x3F) | 0x80;
+    out[2] = (cp >> 6 & 0x3F) | 0x80;
+    out[3] = (cp & 0x3F) | 0x80;
+    return 4;
   } else {
+    return 0;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_internal_to_utf8(char **tmp, size_t *tmp_len,
+                                          size_t *tmp_cap, JsonIt *it,
+                                          uint32_t cp) {
+  char utf8[4];
+  int len = json_internal_encode_utf8(cp, utf8);
+  if (len == 0) {
     json_internal_error(it, JSON_ERR_INVALID_UTF8, "Invalid Utf8 Character %u",
                         cp);
     return 0;
   }
+
+  int i;
+  for (i = 0; i < len; i++) {
+    if (!json_internal_into_buf(tmp, tmp_len, tmp_cap, it, utf8[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_hex_codepoint(const char *src, size_t len,
+                                                uint32_t *codepoint) {
+  *codepoint = 0;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    int hex = json_internal_hex(src[i]);
+    if (hex == -1) {
+      return 0;
+    }
+    *codepoint = (*codepoint << 4) | hex;
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_unescape(JsonIt *it, const char *src,
+                                           size_t len, char *out,
+                                           size_t *out_len) {
+  /* the iterator is optional so without one errors only set errno */
+  size_t i = 0;
+  size_t written = 0;
+  while (i < len) {
+    /* copy everything up to the next escape in one go */
+    const char *slash = (const char *)memchr(src + i, '\\', len - i);
+    size_t run = slash ? (size_t)(slash - (src + i)) : len - i;
+    if (out && run > 0 && out + written != src + i) {
+      memmove(out + written, src + i, run);
+    }
+    written += run;
+    i += run;
+    if (i >= len) {
+      break;
+    }
+
+    /* skip the '\' */
+    i++;
+    int c = i < len ? src[i++] : EOF;
+    char utf8[4];
+    int utf8_len = 1;
+    if (c == 'u' || c == 'U') {
+      size_t hex_len = c == 'u' ? 4 : 8;
+      uint32_t cp;
+      if (i + hex_len > len ||
+          !json_internal_hex_codepoint(src + i, hex_len, &cp)) {
+        if (it) {
+          json_internal_error(it, JSON_ERR_INVALID_UTF8,
+                              "Invalid Hex Character %c",
+                              i < len ? src[i] : ' ');
+        } else {
+          errno = JSON_ERR_INVALID_UTF8;
+        }
+        return 0;
+      }
+      i += hex_len;
+
+      if (c == 'u' && cp >= 0xD800 && cp <= 0xDBFF) {
+        /* we have the high point now we need low */
+        uint32_t high = cp;
+        uint32_t low;
+        if (i + 6 > len || src[i] != '\\' || src[i + 1] != 'u') {
+          if (it) {
+            json_internal_error(
+                it, JSON_ERR_INVALID_UTF8,
+                "Was expecting low surrogate character and not %c",
+                i + 1 < len ? src[i + 1] : ' ');
+          } else {
+            errno = JSON_ERR_INVALID_UTF8;
+          }
+          return 0;
+        }
+        if (!json_internal_hex_codepoint(src + i + 2, 4, &low)) {
+          if (it) {
+            json_internal_error(it, JSON_ERR_INVALID_UTF8,
+                                "Invalid Hex Character %c", src[i + 2]);
+          } else {
+            errno = JSON_ERR_INVALID_UTF8;
+          }
+          return 0;
+        }
+        if (low < 0xDC00 || low > 0xDFFF) {
+          if (it) {
+            json_internal_error(
+                it, JSON_ERR_INVALID_UTF8,
+                "Was expecting low surrogate codepoint and not %u", low);
+          } else {
+            errno = JSON_ERR_INVALID_UTF8;
+          }
+          return 0;
+        }
+        i += 6;
+        cp = ((high - 0xD800) * 0x400) + (low - 0xDC00) + 0x10000;
+      } else if (c == 'u' && cp >= 0xDC00 && cp <= 0xDFFF) {
+        if (it) {
+          json_internal_error(
+              it, JSON_ERR_INVALID_UTF8,
+              "Out of place low surrogate (no high surrogate before it) %u",
+              cp);
+        } else {
+          errno = JSON_ERR_INVALID_UTF8;
+        }
+        return 0;
+      }
+
+      utf8_len = json_internal_encode_utf8(cp, utf8);
+      if (utf8_len == 0) {
+        if (it) {
+          json_internal_error(it, JSON_ERR_INVALID_UTF8,
+                              "Invalid Utf8 Character %u", cp);
+        } else {
+          errno = JSON_ERR_INVALID_UTF8;
+        }
+        return 0;
+      }
+    } else if (c == '\\' || c == '/' || c == '"') {
+      utf8[0] = c;
+    } else if (c == 'b') {
+      utf8[0] = '\b';
+    } else if (c == 'f') {
+      utf8[0] = '\f';
+    } else if (c == 't') {
+      utf8[0] = '\t';
+    } else if (c == 'n') {
+      utf8[0] = '\n';
+    } else if (c == 'r') {
+      utf8[0] = '\r';
+    } else {
+      if (it) {
+        json_internal_error(it, JSON_ERR_UNKNOWN_TOK,
+                            "Invalid Escaping char %c", c);
+      } else {
+        errno = JSON_ERR_UNKNOWN_TOK;
+      }
+      return 0;
+    }
+
+    if (out) {
+      memcpy(out + written, utf8, utf8_len);
+    }
+    written += utf8_len;
+  }
+
+  if (out_len) {
+    *out_len = written;
+  }
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_scan_str(JsonStr *out, JsonIt *it) {
+  json_internal_free_str(out);
+  int escapes = 0;
+
+  if (it->stream == NULL) {
+    const char *start = it->source_str + it->cur_loc;
+    const char *end = it->source_str + it->buf_len;
+    const char *cur = json_internal_find_str_special(start, end, '"');
+    while (cur < end && *cur == '\\') {
+      /* skip over the escaped character, we validate them after */
+      escapes = 1;
+      cur = cur + 2 < end ? json_internal_find_str_special(cur + 2, end, '"')
+                          : end;
+    }
+
+    /* strings can't have newlines so we are always on the same line */
+    it->cur_col += cur - start;
+    it->cur_loc += cur - start;
+    if (cur >= end || *cur != '"') {
+      json_internal_error(it, JSON_ERR_MISSING_QUOTE, "Missing \"");
+      return 0;
+    } else if ((size_t)(cur - start) > WHY_JSON_MAX_STR_LEN) {
+      json_internal_error(it, JSON_ERR_TOO_LONG, "String longer than %lu",
+                          (unsigned long)WHY_JSON_MAX_STR_LEN);
+      return 0;
+    }
+    json_internal_next_char(it);
+
+    out->buf = start;
+    out->len = cur - start;
+  } else {
+    /* have to copy it out of the buffer since it'll get overwritten */
+    char *tmp = NULL;
+    size_t tmp_len = 0;
+    size_t tmp_cap = 0;
+    int next;
+    while (1) {
+      if (!json_internal_str_run(it, &tmp, &tmp_len, &tmp_cap, '"')) {
+        free(tmp);
+        return 0;
+      }
+      next = json_internal_next_char(it);
+      if (next == '"') {
+        break;
+      } else if (next == '\\') {
+        escapes = 1;
+        if (!json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, next)) {
+          free(tmp);
+          return 0;
+        }
+        next = json_internal_next_char(it);
+      } else if (json_internal_char_needs_escaping(next)) {
+        next = EOF;
+      }
+      if (next == EOF) {
+        free(tmp);
+        json_internal_error(it, JSON_ERR_MISSING_QUOTE, "Missing \"");
+        return 0;
+      }
+      if (!json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, next)) {
+        free(tmp);
+        return 0;
+      }
+    }
+
+    if (tmp == NULL) {
+      tmp = (char *)malloc(sizeof(char));
+      if (tmp == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        return 0;
+      }
+      tmp[0] = '\0';
+    }
+    out->buf = tmp;
+    out->len = tmp_len;
+    out->allocated = 1;
+  }
+
+  /* we still want to error out on invalid escapes now rather than later */
+  if (escapes && !json_internal_unescape(it, out->buf, out->len, NULL, NULL)) {
+    json_internal_free_str(out);
+    return 0;
+  }
+
+  out->raw = 1;
+  out->has_escapes = escapes;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_is_small_str(const JsonIt *it,
+                                               const char *buf) {
+  return buf == it->small_key || buf == it->small_value;
 }
 
 _WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
-                                                 char ending) {
-  char *tmp;
-  size_t tmp_len;
-  size_t tmp_cap;
+                                                 char ending, char *small) {
+  if (ending == '"' &&
+      (it->flags & (JSON_FLAG_LAZY_STRINGS | JSON_FLAG_INSITU))) {
+    if (!json_internal_scan_str(out, it)) {
+      return 0;
+    }
+
+    if (it->flags & JSON_FLAG_INSITU) {
+      /*
+       Decoding only ever shrinks the string so we can just write it back
+       over itself, the closing quote (atleast) becomes the null terminator.
+      */
+      char *buf = (char *)out->buf;
+      size_t len = out->len;
+      if (!(it->flags & JSON_FLAG_LAZY_STRINGS)) {
+        if (out->has_escapes &&
+            !json_internal_unescape(it, buf, out->len, buf, &len)) {
+          return 0;
+        }
+        out->raw = 0;
+      }
+      buf[len] = '\0';
+      out->len = len;
+    }
+    return 1;
+  }
+
+  char *tmp = NULL;
+  size_t tmp_len = 0;
+  size_t tmp_cap = 0;
+  int escapes = 0;
   if (out->allocated && out->buf) {
+    /* re-use the previous string, it has room for atleast it's length */
     tmp = (char *)out->buf;
-    tmp_len = 0;
-    tmp_cap = tmp_len;
+    tmp_cap = out->len;
+  } else if (small != NULL) {
+    /* most strings are short, only allocate once it outgrows this */
+    tmp = small;
+    tmp_cap = WHY_JSON_SMALL_STR_SIZE - 1;
   } else {
-    tmp = malloc(sizeof(char) * 9);
-    tmp_len = 0;
-    tmp_cap = 8;
+    tmp = (char *)malloc(sizeof(char) * (WHY_JSON_INITIAL_TMP_BUF_SIZE + 1));
+    tmp_cap = WHY_JSON_INITIAL_TMP_BUF_SIZE;
+    if (tmp == NULL) {
+      json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+      return 0;
+    }
   }
   tmp[0] = '\0';
 
@@ -845,10 +7944,16 @@ _WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
     out->len = 0;
     out->allocated = 0;
   }
+  out->raw = 0;
 
   int next = 0;
 
   while (1) {
+    /* the common case of normal characters is copied in bulk */
+    if (!json_internal_str_run(it, &tmp, &tmp_len, &tmp_cap, ending)) {
+      goto fail;
+    }
+
     next = json_internal_next_char(it);
     if (next == EOF) {
       break;
@@ -858,10 +7963,11 @@ _WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
       break;
     } else if (next == '\\') {
       int c = json_internal_next_char(it);
+      escapes = 1;
       if (c == 'u') {
         uint32_t cp = 0;
         if (!json_internal_parse_codepoint(it, &cp, 4)) {
-          return 0;
+          goto fail;
         }
 
         uint32_t low = 0;
@@ -877,11 +7983,11 @@ _WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
                 it, JSON_ERR_INVALID_UTF8,
                 "Was expecting low surrogate character and not %c", next);
             errno = JSON_ERR_INVALID_UTF8;
-            return 0;
+            goto fail;
           }
 
           if (!json_internal_parse_codepoint(it, &cp, 4)) {
-            return 0;
+            goto fail;
           }
 
           low = cp;
@@ -889,7 +7995,7 @@ _WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
             json_internal_error(
                 it, JSON_ERR_INVALID_UTF8,
                 "Was expecting low surrogate codepoint and not %u", low);
-            return 0;
+            goto fail;
           }
           cp = ((high - 0xD800) * 0x400) + (low - 0xDC00) + 0x10000;
         } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
@@ -897,18 +8003,18 @@ _WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
               it, JSON_ERR_INVALID_UTF8,
               "Out of place low surrogate (no high surrogate before it) %u",
               cp);
-          return 0;
+          goto fail;
         }
         if (!json_internal_to_utf8(&tmp, &tmp_len, &tmp_cap, it, cp)) {
-          return 0;
+          goto fail;
         }
       } else if (c == 'U') {
         uint32_t cp = 0;
         if (!json_internal_parse_codepoint(it, &cp, 8)) {
-          return 0;
+          goto fail;
         }
         if (!json_internal_to_utf8(&tmp, &tmp_len, &tmp_cap, it, cp)) {
-          return 0;
+          goto fail;
         }
       } else {
         int to_write = 0;
@@ -931,41 +8037,49 @@ _WHY_JSON_FUNC_ int json_internal_parse_str_till(JsonStr *out, JsonIt *it,
         } else {
           json_internal_error(it, JSON_ERR_UNKNOWN_TOK,
                               "Invalid Escaping char %c", c);
-          return 0;
+          goto fail;
         }
         if (!json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, to_write)) {
-          return 0;
+          goto fail;
         }
       }
     } else if (json_internal_char_needs_escaping(next)) {
       break;
     } else {
       if (!json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, next)) {
-        return 0;
+        goto fail;
       }
     }
   }
 
   if (it->buf_len == 0 || next != ending) {
     json_internal_error(it, JSON_ERR_MISSING_QUOTE, "Missing \"");
-    return 0;
+    goto fail;
   }
 
   out->buf = tmp;
   out->len = tmp_len;
-  out->allocated = 1;
+  out->allocated = !json_internal_is_small_str(it, tmp);
+  out->has_escapes = escapes;
 
   return 1;
+
+fail:
+  if (!json_internal_is_small_str(it, tmp)) {
+    free(tmp);
+  }
+  return 0;
 }
 
-_WHY_JSON_FUNC_ int json_internal_parse_identifier(JsonStr *out, JsonIt *it) {
+_WHY_JSON_FUNC_ int json_internal_parse_identifier(JsonStr *out, JsonIt *it,
+                                                   char *small) {
   /*
    We support identifiers that are just numbers
    but also identifiers that are a sequence of any bytes before a `:`
    we don't support multi-line identifiers
    We also cut all trailing spaces
   */
-  if (!json_internal_parse_str_till(out, it, ':')) {
+  if (!json_internal_parse_str_till(out, it, ':', small)) {
     return 0;
   }
 
@@ -995,12 +8109,12 @@ _WHY_JSON_FUNC_ int json_internal_parse_identifier(JsonStr *out, JsonIt *it) {
 _WHY_JSON_FUNC_ int json_internal_parse_key(JsonTok *tok, JsonIt *it) {
   if (json_internal_peek_char(it) == '"') {
     json_internal_next_char(it);
-    if (!json_internal_parse_str_till(&tok->key, it, '"')) {
+    if (!json_internal_parse_str_till(&tok->key, it, '"', it->small_key)) {
       return 0;
     }
   } else {
 #ifndef WHY_JSON_STRICT
-    if (!json_internal_parse_identifier(&tok->key, it)) {
+    if (!json_internal_parse_identifier(&tok->key, it, it->small_key)) {
       return 0;
     }
 #else
@@ -1024,8 +8138,8 @@ _WHY_JSON_FUNC_ int json_internal_matches(const char *str, JsonIt *it) {
   }
 
   int peek = json_internal_peek_char(it);
-  if (*str != '\0' ||
-      (peek != EOF && !json_internal_is_whitespace(peek) && peek != ',')) {
+  if (*str != '\0' || (peek != EOF && !json_internal_is_whitespace(peek) &&
+                        peek != ',' && peek != '}' && peek != ']')) {
     json_internal_error(
         it, JSON_ERR_INVALID_VALUE,
         "Iterator doesn't match %s, the invalid character is %c", str, peek);
@@ -1037,95 +8151,263 @@ _WHY_JSON_FUNC_ int json_internal_matches(const char *str, JsonIt *it) {
 
 _WHY_JSON_FUNC_ int json_internal_parse_num(JsonType *type, JsonValue *value,
                                             JsonIt *it) {
-  int sign = 1;
+  /*
+   Most numbers are tiny so we avoid allocating unless we need to
+   (i.e. a huge number or we need to hand back a raw copy)
+  */
+  char small[WHY_JSON_NUM_BUF_SIZE];
+  char *tmp = small;
+  size_t tmp_len = 0;
+  size_t tmp_cap = sizeof(small);
+  size_t start = it->cur_loc;
+  /* is the number in the source exactly what is in tmp */
+  int exact = it->stream == NULL;
+
   int peek = json_internal_peek_char(it);
   if (peek == '-') {
-    sign = -1;
+    tmp[tmp_len++] = '-';
     json_internal_next_char(it);
   } else if (peek == '+') {
+    exact = 0;
     json_internal_next_char(it);
   }
 
   *type = JSON_INT;
-  char *tmp = NULL;
-  size_t tmp_len = 0;
-  size_t tmp_cap = 0;
+  size_t digits = 0;
   int seen_dot = 0;
   int seen_exp = 0;
   int prev_exp = 0;
   int prev_underscore = 0;
 
-  while (1) {
-    int next = json_internal_peek_char(it);
-    if (json_internal_is_whitespace(next) || next == '}' || next == ',' ||
-        next == ']') {
-      break;
+  while (1) {
+    int next = json_internal_peek_char(it);
+    if (json_internal_is_whitespace(next) || next == '}' || next == ',' ||
+        next == ']') {
+      break;
+    }
+
+    next = json_internal_next_char(it);
+    if (next == EOF && digits > 0) {
+      break;
+    } else if (next == EOF) {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE, "Unexpected EOF");
+      goto fail;
+    } else if (next >= '0' && next <= '9') {
+      digits += !seen_exp;
+      prev_exp = prev_underscore = 0;
+    } else if (next == '.' && !seen_dot && !seen_exp) {
+      seen_dot = 1;
+      prev_underscore = 0;
+      *type = JSON_FLT;
+    } else if ((next == 'e' || next == 'E') && !seen_exp && digits > 0) {
+      seen_exp = 1;
+      prev_exp = 1;
+      prev_underscore = 0;
+      *type = JSON_FLT;
+    } else if (next == '_' && !prev_underscore) {
+      /* ignore underscores */
+      prev_underscore = 1;
+      exact = 0;
+      continue;
+    } else if ((next == '+' || next == '-') && prev_exp) {
+      prev_exp = prev_underscore = 0;
+    } else {
+      json_internal_error(it, JSON_ERR_INVALID_VALUE, "Invalid character %c",
+                          next);
+      goto fail;
+    }
+
+    if (tmp_len + 1 == tmp_cap) {
+      char *new = tmp == small ? (char *)malloc(sizeof(char) * tmp_cap * 2)
+                               : (char *)realloc(tmp, sizeof(char) * tmp_cap * 2);
+      if (new == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        goto fail;
+      }
+      if (tmp == small) {
+        memcpy(new, small, tmp_len);
+      }
+      tmp = new;
+      tmp_cap *= 2;
+    }
+    tmp[tmp_len++] = next;
+  }
+  tmp[tmp_len] = '\0';
+
+  if (digits == 0) {
+    json_internal_error(it, JSON_ERR_INVALID_VALUE, "Not a valid number %s",
+                        tmp);
+    goto fail;
+  }
+
+  if (it->flags & JSON_FLAG_RAW_NUMBERS) {
+    if (tmp_len > WHY_JSON_MAX_STR_LEN) {
+      json_internal_error(it, JSON_ERR_TOO_LONG, "Number longer than %lu",
+                          (unsigned long)WHY_JSON_MAX_STR_LEN);
+      goto fail;
+    }
+    value->_num.integral = *type == JSON_INT;
+    value->_num.len = tmp_len;
+    *type = JSON_NUMBER_RAW;
+    if (exact) {
+      /* no need to copy just point into the source */
+      value->_num.buf = it->source_str + start;
+      value->_num.allocated = 0;
+      if (tmp != small) {
+        free(tmp);
+      }
+    } else if (tmp != small) {
+      value->_num.buf = tmp;
+      value->_num.allocated = 1;
+    } else {
+      char *copy = (char *)malloc(sizeof(char) * (tmp_len + 1));
+      if (copy == NULL) {
+        json_internal_error(it, JSON_ERR_OOM, "Out of memory");
+        return 0;
+      }
+      memcpy(copy, tmp, tmp_len + 1);
+      value->_num.buf = copy;
+      value->_num.allocated = 1;
+    }
+    return 1;
+  }
+
+  if (*type == JSON_INT) {
+    value->_int = strtol(tmp, NULL, 10);
+  } else {
+    value->_flt = strtod(tmp, NULL);
+  }
+
+  if (tmp != small) {
+    free(tmp);
+  }
+  return 1;
+
+fail:
+  if (tmp != small) {
+    free(tmp);
+  }
+  return 0;
+}
+
+_WHY_JSON_FUNC_ int json_num_as_i64(const JsonNum *num, int64_t *out) {
+  uint64_t res;
+  int negative = num->len > 0 && num->buf[0] == '-';
+  /* we just need to handle the sign on top of the unsigned conversion */
+  JsonNum tmp = *num;
+  tmp.buf += negative;
+  tmp.len -= negative;
+  if (!json_num_as_u64(&tmp, &res)) {
+    return 0;
+  }
+
+  if ((!negative && res > (uint64_t)INT64_MAX) ||
+      (negative && res > (uint64_t)INT64_MAX + 1)) {
+    errno = JSON_ERR_OUT_OF_RANGE;
+    return 0;
+  }
+
+  *out = negative ? (int64_t)(0 - res) : (int64_t)res;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_num_as_u64(const JsonNum *num, uint64_t *out) {
+  if (!num->integral || num->len == 0) {
+    errno = JSON_ERR_INVALID_VALUE;
+    return 0;
+  }
+
+  uint64_t res = 0;
+  size_t i = 0;
+  if (num->buf[0] == '-') {
+    /* -0 is the only negative number that is allowed */
+    for (i = 1; i < num->len && num->buf[i] == '0'; i++) {
+    }
+    if (i != num->len) {
+      errno = JSON_ERR_OUT_OF_RANGE;
+      return 0;
     }
+  }
 
-    next = json_internal_next_char(it);
-    if (next == EOF && tmp_len > 0) {
-      break;
-    } else if (next == EOF) {
-      json_internal_error(it, JSON_ERR_INVALID_VALUE, "Unexpected EOF");
+  for (; i < num->len; i++) {
+    uint64_t digit = num->buf[i] - '0';
+    if (res > (UINT64_MAX - digit) / 10) {
+      errno = JSON_ERR_OUT_OF_RANGE;
       return 0;
-    } else if (next >= '0' && next <= '9') {
-      json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, next);
-      prev_exp = prev_underscore = 0;
-    } else if (next == '.' && !seen_dot && !seen_exp) {
-      seen_dot = 1;
-      json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, next);
-      prev_underscore = 0;
-      *type = JSON_FLT;
-    } else if ((next == 'e' || next == 'E') && !seen_exp &&
-               tmp_len - seen_dot > 0) {
-      seen_exp = 1;
-      prev_exp = 1;
-      json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, next);
-      prev_underscore = 0;
-      *type = JSON_FLT;
-    } else if (next == '_' && !prev_underscore) {
-      /* ignore underscores */
-      prev_underscore = 1;
-    } else if ((next == '+' || next == '-') && prev_exp) {
-      prev_exp = prev_underscore = 0;
-      json_internal_into_buf(&tmp, &tmp_len, &tmp_cap, it, next);
-    } else {
-      json_internal_error(it, JSON_ERR_INVALID_VALUE, "Invalid character %c",
-                          next);
+    }
+    res = res * 10 + digit;
+  }
+
+  *out = res;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ double json_num_as_double(const JsonNum *num) {
+  /* strtod needs a null terminated string so copy it */
+  char small[WHY_JSON_NUM_BUF_SIZE];
+  char *tmp = small;
+  if (num->len >= sizeof(small)) {
+    tmp = (char *)malloc(sizeof(char) * (num->len + 1));
+    if (tmp == NULL) {
+      errno = JSON_ERR_OOM;
       return 0;
     }
   }
+  memcpy(tmp, num->buf, num->len);
+  tmp[num->len] = '\0';
 
-  if (tmp_len - seen_dot == 0) {
-    json_internal_error(it, JSON_ERR_INVALID_VALUE, "Not a valid number %s",
-                        tmp ? tmp : "null");
+  double res = strtod(tmp, NULL);
+  if (tmp != small) {
     free(tmp);
-    return 0;
   }
+  return res;
+}
 
-  if (*type == JSON_INT) {
-    value->_int = sign * strtol(tmp, NULL, 10);
-  } else {
-    value->_flt = sign * strtod(tmp, NULL);
+_WHY_JSON_FUNC_ char *json_num_as_str(JsonNum *num, size_t *len) {
+  if (!num->buf) {
+    return NULL;
   }
 
-  free(tmp);
+  if (len) {
+    *len = num->len;
+  }
 
-  return 1;
+  /* raw numbers that we allocated are always null terminated */
+  if (num->allocated) {
+    char *tmp = (char *)num->buf;
+    num->allocated = 0;
+    num->buf = NULL;
+    num->len = 0;
+    return tmp;
+  }
+
+  char *tmp = (char *)malloc(sizeof(char) * (num->len + 1));
+  if (tmp == NULL) {
+    errno = JSON_ERR_OOM;
+    return NULL;
+  }
+  memcpy(tmp, num->buf, num->len);
+  tmp[num->len] = '\0';
+  return tmp;
 }
 
 _WHY_JSON_FUNC_ int json_internal_parse_value(JsonType *type, JsonValue *value,
                                               JsonIt *it) {
   int next = json_internal_peek_char(it);
   if (next == '"') {
+    if (*type == JSON_NUMBER_RAW) {
+      json_internal_free_str(&value->_str);
+    }
     if (*type != JSON_STRING) {
       /* we have to toggle this off so it won't try to re-use it */
       value->_str.allocated = 0;
       *type = JSON_STRING;
     }
     json_internal_next_char(it);
-    return json_internal_parse_str_till(&value->_str, it, '"');
-  } else if (*type == JSON_STRING) {
+    return json_internal_parse_str_till(&value->_str, it, '"',
+                                        it->small_value);
+  } else if (*type == JSON_STRING || *type == JSON_NUMBER_RAW) {
+    /* raw numbers share the same layout as strings */
     json_internal_free_str(&value->_str);
   }
   if (next == 't') {
@@ -1174,31 +8456,16 @@ _WHY_JSON_FUNC_ int json_internal_parse_value(JsonType *type, JsonValue *value,
 
 _WHY_JSON_FUNC_ int json_internal_parse_opening_braces(JsonIt *it) {
   int next = json_internal_next_char(it);
-  uint8_t mask = 0;
-  if (next == '{') {
-    mask = 0x80;
-  } else if (next != '[') {
+  if (next != '{' && next != '[') {
     json_internal_error(it, JSON_ERR_UNKNOWN_TOK, "Invalid %c", next);
     return 0;
   }
 
-  it->depth++;
-  if (it->match_len > 0 &&
-      (it->match_stack[it->match_len - 1] & 0x80) == mask &&
-      WHY_JSON_CAN_ADD(it->match_stack[it->match_len - 1])) {
-    it->match_stack[it->match_len - 1]++;
-  } else {
-    if (!json_internal_resize_match_stack(it)) {
-      return 0;
-    }
-    it->match_stack[it->match_len++] = 1 | mask;
-  }
-
-  return 1;
+  return json_internal_push_nesting(it, next == '{');
 }
 
 _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
-  if (it->match_stack == NULL) {
+  if (it->flags & JSON_FLAG_DESTROYED) {
     /*
        indication that we destroyed the iterator than are trying
        to call next!! This is bad
@@ -1220,9 +8487,15 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
   } else {
     tok->first = 0;
   }
+  tok->key_id = -1;
+  tok->value_id = -1;
+  tok->key_index = -1;
 
   int collection_start = tok->type == JSON_ARRAY || tok->type == JSON_OBJECT;
-  int comma = 0;
+  int comma;
+
+next_member:
+  comma = 0;
   json_internal_ignore_whitespace(it);
 
   if (collection_start) {
@@ -1243,12 +8516,20 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
 #endif
   }
 
+  JsonType prev_type = tok->type;
+  size_t begin = it->buf_offset + it->cur_loc;
   if (!json_internal_count_braces(tok, it)) {
     if (errno == JSON_ERR_NO_ERROR) {
       uint8_t tok_type = tok->type;
+      /* so that we still free the previous string value */
+      tok->type = prev_type;
       json_destroy(tok, NULL);
       tok->first = 1;
       tok->type = tok_type;
+      if (it->flags & JSON_FLAG_SPANS) {
+        it->span.begin = begin;
+        it->span.end = it->buf_offset + it->cur_loc;
+      }
       return 1;
     } else {
       json_destroy(tok, it);
@@ -1260,7 +8541,7 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
   if (json_internal_peek_char(it) == EOF) {
     /* cleanup token/iterator stuff */
     json_destroy(tok, it);
-    if (json_internal_error(it, JSON_ERR_NO_ERROR, "") != 0) {
+    if (json_internal_clear_error(it) != 0) {
       /* means an error occurred most likely ferror so error out */
       return 0;
     } else {
@@ -1269,7 +8550,7 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
     }
   }
 
-  if (!collection_start && !comma && !tok->first && it->match_len > 0 &&
+  if (!collection_start && !comma && !tok->first && it->depth > 0 &&
       json_internal_next_char(it) != ',') {
     json_internal_error(it, JSON_ERR_MISSING_COMMA, "Was expecting a comma");
     json_destroy(tok, it);
@@ -1277,13 +8558,15 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
   }
 
   json_internal_ignore_whitespace(it);
-  if (it->match_len > 0 &&
-      (it->match_stack[it->match_len - 1] & 0x80) == 0x80) {
+  if (json_internal_in_object(it)) {
     /* Object */
     if (!json_internal_parse_key(tok, it)) {
       json_destroy(tok, it);
       return 0;
     }
+    if (it->intern != NULL) {
+      json_internal_intern_str(it, &tok->key, &tok->key_id);
+    }
 
     json_internal_ignore_whitespace(it);
     int next = json_internal_next_char(it);
@@ -1294,19 +8577,51 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
       return 0;
     }
     json_internal_ignore_whitespace(it);
+
+    if (it->keyset != NULL) {
+      /* lazy keys with escapes have to be decoded to compare them */
+      char scratch[WHY_JSON_INTERN_MAX_LEN + 1];
+      size_t len;
+      const char *key = json_internal_decoded_key(&tok->key, scratch, &len);
+      if (key != NULL) {
+        tok->key_index =
+            (int16_t)json_internal_keyset_find(it->keyset, key, len);
+      }
+
+      if (tok->key_index < 0 && (it->flags & JSON_FLAG_SKIP_UNKNOWN_KEYS)) {
+        if (!json_internal_skip_value(it)) {
+          json_destroy(tok, it);
+          return 0;
+        }
+        /* carry on as if we just gave them this member */
+        tok->first = 0;
+        collection_start = 0;
+        tok->key_id = -1;
+        goto next_member;
+      }
+    }
   } else {
     /* Clear the token string/key allocations since we can't re-use them */
     json_destroy(tok, NULL);
   }
 
+  begin = it->buf_offset + it->cur_loc;
   if (!json_internal_parse_value(&tok->type, &tok->value, it)) {
     json_destroy(tok, it);
     return 0;
   }
+  if (it->flags & JSON_FLAG_SPANS) {
+    it->span.begin = begin;
+    it->span.end = it->buf_offset + it->cur_loc;
+  }
+  if (it->intern != NULL && tok->type == JSON_STRING &&
+      (it->flags & JSON_FLAG_INTERN_VALUES)) {
+    json_internal_intern_str(it, &tok->value._str, &tok->value_id);
+  }
 
   int is_collection = tok->type == JSON_OBJECT || tok->type == JSON_ARRAY;
   json_internal_ignore_whitespace(it);
-  if (it->match_len == 0 &&
+  if (it->depth == 0 &&
       ((tok->first && json_internal_peek_char(it) != EOF && !is_collection) ||
        (!tok->first))) {
     json_destroy(tok, it);
@@ -1316,7 +8631,7 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
   }
 
   /* Same logic as before check if ferror was triggered */
-  if (json_internal_error(it, JSON_ERR_NO_ERROR, "") == 0) {
+  if (json_internal_clear_error(it) == 0) {
     return 1;
   } else {
     json_destroy(tok, it);
@@ -1325,7 +8640,7 @@ _WHY_JSON_FUNC_ int json_next(JsonTok *tok, JsonIt *it) {
 }
 
 _WHY_JSON_FUNC_ int json_skip(JsonTok *tok, JsonIt *it) {
-  if (it->match_stack == NULL) {
+  if (it->flags & JSON_FLAG_DESTROYED) {
     /*
       indication that we destroyed the iterator than are trying
       to call next!! This is bad
@@ -1354,8 +8669,563 @@ _WHY_JSON_FUNC_ int json_skip(JsonTok *tok, JsonIt *it) {
   return errno == 0;
 }
 
-#undef WHY_JSON_GET_COUNT
-#undef WHY_JSON_CAN_ADD
+_WHY_JSON_FUNC_ int json_skip_raw(JsonTok *tok, JsonIt *it, JsonSpan *span) {
+  if (it->flags & JSON_FLAG_DESTROYED) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Can't destroy iterator than call next");
+    return 0;
+  }
+
+  if (tok->type != JSON_ARRAY && tok->type != JSON_OBJECT) {
+    if (!(it->flags & JSON_FLAG_SPANS)) {
+      json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                          "Type of token (%d) isn't array or object and "
+                          "JSON_FLAG_SPANS isn't set",
+                          tok->type);
+      return 0;
+    }
+    /* already read so json_next knows where it was */
+    *span = it->span;
+    return 1;
+  }
+
+  /* we are still at the opening bracket */
+  json_internal_ignore_whitespace(it);
+  span->begin = it->buf_offset + it->cur_loc;
+  if (!json_internal_skip_value(it)) {
+    json_destroy(tok, it);
+    return 0;
+  }
+  span->end = it->buf_offset + it->cur_loc;
+  if (it->flags & JSON_FLAG_SPANS) {
+    it->span = *span;
+  }
+  /* as if it was stepped through with json_next */
+  tok->type = tok->type == JSON_ARRAY ? JSON_ARRAY_END : JSON_OBJECT_END;
+  return 1;
+}
+
+_WHY_JSON_FUNC_ int json_internal_sax_value(const JsonHandler *handler,
+                                            void *ctx, JsonType type,
+                                            JsonValue *value) {
+  switch (type) {
+  case JSON_STRING:
+    return !handler->string ||
+           handler->string(ctx, value->_str.buf, value->_str.len);
+  case JSON_INT:
+    return !handler->integer || handler->integer(ctx, value->_int);
+  case JSON_FLT:
+    return !handler->flt || handler->flt(ctx, value->_flt);
+  case JSON_BOOL:
+    return !handler->boolean || handler->boolean(ctx, value->_bool);
+  case JSON_NULL:
+    return !handler->null || handler->null(ctx);
+  case JSON_NUMBER_RAW:
+    return !handler->number || handler->number(ctx, &value->_num);
+  default:
+    return 1;
+  }
+}
+
+_WHY_JSON_FUNC_ int json_parse_sax(JsonIt *it, const JsonHandler *handler,
+                                   void *ctx) {
+  if ((it->flags & JSON_FLAG_DESTROYED) || handler == NULL) {
+    json_internal_error(it, JSON_ERR_INVALID_ARGS,
+                        "Need a valid iterator and handler");
+    return 0;
+  }
+  /* handlers only get the bytes so they have to be decoded already */
+  it->flags &= ~(uint32_t)JSON_FLAG_LAZY_STRINGS;
+
+  /*
+   The key and value are re-used for the entire parse so we only
+   allocate when a string outgrows the previous one.
+  */
+  JsonStr key = {0};
+  JsonType type = JSON_ERROR;
+  JsonValue value;
+  int first = 1;
+  int cont = 1;
+  memset(&value, 0, sizeof(JsonValue));
+  errno = JSON_ERR_NO_ERROR;
+
+  while (1) {
+    json_internal_ignore_whitespace(it);
+    if (it->depth == 0 && first && json_internal_peek_char(it) == EOF) {
+      /* just like json_next an empty json is just the end */
+      json_internal_clear_error(it);
+      break;
+    }
+
+    if (it->depth == 0 && !first) {
+      /* finished the outer value, only whitespace can follow */
+      if (json_internal_peek_char(it) != EOF) {
+        json_internal_error(it, JSON_ERR_INVALID_VALUE,
+                            "Can only have one outer value");
+      } else {
+        json_internal_clear_error(it);
+      }
+      break;
+    }
+
+    if (it->depth > 0) {
+      int is_obj = json_internal_in_object(it);
+      int close = is_obj ? '}' : ']';
+      int peek = json_internal_peek_char(it);
+      if (!first && peek != close) {
+        if (json_internal_next_char(it) != ',') {
+          json_internal_error(it, JSON_ERR_MISSING_COMMA,
+                              "Was expecting a comma");
+          break;
+        }
+        json_internal_ignore_whitespace(it);
+#ifndef WHY_JSON_STRICT
+        peek = json_internal_peek_char(it);
+#endif
+      }
+
+      if (peek == close) {
+        JsonTok end;
+        if (json_internal_count_braces(&end, it) || errno != 0) {
+          break;
+        }
+        cont = is_obj ? (!handler->end_object || handler->end_object(ctx))
+                      : (!handler->end_array || handler->end_array(ctx));
+        first = 0;
+        if (!cont) {
+          break;
+        }
+        continue;
+      }
+
+      if (peek == EOF) {
+        json_internal_error(it, JSON_ERR_UNMATCHED_TOKENS, "Unmatched %c",
+                            is_obj ? '{' : '[');
+        break;
+      }
+
+      if (is_obj) {
+        JsonTok tok;
+        tok.key = key;
+        if (!json_internal_parse_key(&tok, it)) {
+          key = tok.key;
+          break;
+        }
+        key = tok.key;
+
+        json_internal_ignore_whitespace(it);
+        int next = json_internal_next_char(it);
+        if (next == EOF || next != ':') {
+          json_internal_error(it, JSON_ERR_UNKNOWN_TOK,
+                              "Didn't expect %c was expecting ':'", next);
+          break;
+        }
+        json_internal_ignore_whitespace(it);
+        if (handler->key && !handler->key(ctx, key.buf, key.len)) {
+          cont = 0;
+          break;
+        }
+      }
+    }
+
+    if (!json_internal_parse_value(&type, &value, it)) {
+      break;
+    }
+
+    if (type == JSON_OBJECT || type == JSON_ARRAY) {
+      if (!json_internal_parse_opening_braces(it)) {
+        break;
+      }
+      cont = type == JSON_OBJECT
+                 ? (!handler->start_object || handler->start_object(ctx))
+                 : (!handler->start_array || handler->start_array(ctx));
+      first = 1;
+      /* don't want parse_value to think we still own a string */
+      type = JSON_ERROR;
+    } else {
+      cont = json_internal_sax_value(handler, ctx, type, &value);
+      first = 0;
+    }
+
+    if (!cont) {
+      break;
+    }
+  }
+
+  if (!cont) {
+    json_internal_error(it, JSON_ERR_ABORTED, "Aborted by handler");
+  }
+
+  json_internal_free_str(&key);
+  if (type == JSON_STRING || type == JSON_NUMBER_RAW) {
+    json_internal_free_str(&value._str);
+  }
+  json_destroy(NULL, it);
+  return errno == JSON_ERR_NO_ERROR;
+}
+
+_WHY_JSON_FUNC_ size_t json_internal_utf8_invalid_at(const char *bytes,
+                                                    size_t length) {
+  uint32_t state = WHY_JSON_UTF8_ACCEPT;
+  size_t start = 0;
+  size_t i = 0;
+  while (i < length) {
+    if (state == WHY_JSON_UTF8_ACCEPT) {
+      i = json_internal_skip_ascii(bytes + i, bytes + length) - bytes;
+      if (i == length) {
+        break;
+      }
+      start = i;
+    }
+
+    state = utf8d[256 + state * 16 + utf8d[(uint8_t)bytes[i]]];
+    if (state == WHY_JSON_UTF8_REJECT) {
+      return start;
+    }
+    i++;
+  }
+
+  return state == WHY_JSON_UTF8_ACCEPT ? length : start;
+}
+
+_WHY_JSON_FUNC_ size_t json_internal_validate_escape(const char *cur,
+                                                    const char *end) {
+  if (cur >= end) {
+    errno = JSON_ERR_UNKNOWN_TOK;
+    return 0;
+  }
+
+  char c = *cur;
+  if (c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' ||
+      c == 'n' || c == 'r' || c == 't') {
+    return 1;
+  } else if (c != 'u' && c != 'U') {
+    errno = JSON_ERR_UNKNOWN_TOK;
+    return 0;
+  }
+
+  /* same rules as json_internal_unescape */
+  size_t hex_len = c == 'u' ? 4 : 8;
+  uint32_t cp;
+  char utf8[4];
+  if ((size_t)(end - cur - 1) < hex_len ||
+      !json_internal_hex_codepoint(cur + 1, hex_len, &cp)) {
+    errno = JSON_ERR_INVALID_UTF8;
+    return 0;
+  }
+
+  if (c == 'u' && cp >= 0xD800 && cp <= 0xDBFF) {
+    uint32_t low;
+    cur += 5;
+    if (end - cur < 6 || cur[0] != '\\' || cur[1] != 'u' ||
+        !json_internal_hex_codepoint(cur + 2, 4, &low) || low < 0xDC00 ||
+        low > 0xDFFF) {
+      errno = JSON_ERR_INVALID_UTF8;
+      return 0;
+    }
+    return 11;
+  } else if ((c == 'u' && cp >= 0xDC00 && cp <= 0xDFFF) ||
+             json_internal_encode_utf8(cp, utf8) == 0) {
+    errno = JSON_ERR_INVALID_UTF8;
+    return 0;
+  }
+
+  return hex_len + 1;
+}
+
+_WHY_JSON_FUNC_ const char *
+json_internal_validate_str(const char *cur, const char *end, char ending,
+                           const char **msg, const char **fail_at) {
+  while (1) {
+    cur = json_internal_find_str_special(cur, end, ending);
+    if (cur < end && *cur == ending) {
+      return cur + 1;
+    } else if (cur < end && *cur == '\\') {
+      size_t len = json_internal_validate_escape(cur + 1, end);
+      if (len == 0) {
+        *msg = errno == JSON_ERR_INVALID_UTF8 ? "Invalid unicode escape"
+                                              : "Invalid escaping char";
+        *fail_at = cur;
+        return NULL;
+      }
+      cur += len + 1;
+    } else {
+      /* EOF, a control character or a quote inside of an identifier */
+      errno = JSON_ERR_MISSING_QUOTE;
+      *msg = "Missing \"";
+      *fail_at = cur;
+      return NULL;
+    }
+  }
+}
+
+_WHY_JSON_FUNC_ const char *json_internal_validate_num(const char *cur,
+                                                      const char *end,
+                                                      const char **msg,
+                                                      const char **fail_at) {
+  const char *start = cur;
+  size_t digits = 0;
+  int seen_dot = 0;
+  int seen_exp = 0;
+  int prev_exp = 0;
+  int prev_underscore = 0;
+
+  if (cur < end && (*cur == '-' || *cur == '+')) {
+    cur++;
+  }
+
+  for (; cur < end; cur++) {
+    char c = *cur;
+    if (json_internal_is_whitespace(c) || c == '}' || c == ',' || c == ']') {
+      break;
+    } else if (c >= '0' && c <= '9') {
+      digits += !seen_exp;
+      prev_exp = prev_underscore = 0;
+    } else if (c == '.' && !seen_dot && !seen_exp) {
+      seen_dot = 1;
+      prev_underscore = 0;
+    } else if ((c == 'e' || c == 'E') && !seen_exp && digits > 0) {
+      seen_exp = prev_exp = 1;
+      prev_underscore = 0;
+    } else if (c == '_' && !prev_underscore) {
+      prev_underscore = 1;
+    } else if ((c == '+' || c == '-') && prev_exp) {
+      prev_exp = prev_underscore = 0;
+    } else {
+      errno = JSON_ERR_INVALID_VALUE;
+      *msg = "Expected value";
+      *fail_at = cur;
+      return NULL;
+    }
+  }
+
+  if (digits == 0) {
+    errno = JSON_ERR_INVALID_VALUE;
+    *msg = "Not a valid number";
+    *fail_at = start;
+    return NULL;
+  }
+  return cur;
+}
+
+/* Is the innermost collection an object */
+#define WHY_JSON_IN_OBJECT                                                     \
+  ((stack[(depth - 1) / 64] >> ((depth - 1) % 64)) & 1)
+
+#define WHY_JSON_VALIDATE_FAIL(at, code, text)                                 \
+  do {                                                                         \
+    fail_at = (at);                                                            \
+    errno = (code);                                                            \
+    msg = (text);                                                              \
+    goto fail;                                                                 \
+  } while (0)
+
+_WHY_JSON_FUNC_ int json_validate(const char *buf, size_t len,
+                                  JsonErrInfo *info) {
+  if (buf == NULL) {
+    errno = JSON_ERR_INVALID_ARGS;
+    if (info) {
+      memset(info, 0, sizeof(JsonErrInfo));
+      info->err = JSON_ERR_INVALID_ARGS;
+      info->msg = "Buffer should be valid";
+    }
+    return 0;
+  }
+
+  const char *cur = buf;
+  const char *end = buf + len;
+  const char *fail_at = NULL;
+  const char *msg = NULL;
+  const char *literal;
+  /* one bit per level, set if it's an object */
+  uint64_t stack[WHY_JSON_MAX_DEPTH / 64 + 1];
+  int depth = 0;
+  /* we check utf8 up front so bad bytes just look like normal characters */
+  size_t bad_utf8 = json_internal_utf8_invalid_at(buf, len);
+
+  cur = json_internal_skip_whitespace(cur, end);
+  if (cur == end) {
+    /* same as json_next, there just aren't any tokens */
+    goto done;
+  }
+
+value:
+  if (cur == end) {
+    WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_INVALID_VALUE, "Unexpected EOF");
+  }
+
+  switch (*cur) {
+  case '{':
+  case '[':
+    if (depth == WHY_JSON_MAX_DEPTH) {
+      WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_TOO_DEEP, "Nested too deeply");
+    }
+    if (*cur == '{') {
+      stack[depth / 64] |= (uint64_t)1 << (depth % 64);
+    } else {
+      stack[depth / 64] &= ~((uint64_t)1 << (depth % 64));
+    }
+    depth++;
+    cur = json_internal_skip_whitespace(cur + 1, end);
+    if (cur < end && *cur == (WHY_JSON_IN_OBJECT ? '}' : ']')) {
+      cur++;
+      depth--;
+      goto after_value;
+    }
+    if (WHY_JSON_IN_OBJECT) {
+      goto key;
+    }
+    goto value;
+  case '"':
+    cur = json_internal_validate_str(cur + 1, end, '"', &msg, &fail_at);
+    if (cur == NULL) {
+      goto fail;
+    }
+    goto after_value;
+  case 't':
+    literal = "true";
+    break;
+  case 'f':
+    literal = "false";
+    break;
+  case 'n':
+    literal = "null";
+    break;
+  default:
+    cur = json_internal_validate_num(cur, end, &msg, &fail_at);
+    if (cur == NULL) {
+      goto fail;
+    }
+    goto after_value;
+  }
+
+  /* the literals, they have to be followed by something that ends a value */
+  while (*literal != '\0' && cur < end && *cur == *literal) {
+    cur++;
+    literal++;
+  }
+  if (*literal != '\0' ||
+      (cur < end && !json_internal_is_whitespace(*cur) && *cur != ',' &&
+       *cur != '}' && *cur != ']')) {
+    WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_INVALID_VALUE, "Invalid literal");
+  }
+  goto after_value;
+
+key:
+  if (cur < end && *cur == '"') {
+    cur = json_internal_validate_str(cur + 1, end, '"', &msg, &fail_at);
+  } else {
+#ifndef WHY_JSON_STRICT
+    /* unquoted keys are everything up till the ':' */
+    cur = json_internal_validate_str(cur, end, ':', &msg, &fail_at);
+    cur = cur ? cur - 1 : NULL;
+#else
+    WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_MISSING_QUOTE,
+                           "Missing initial quote");
+#endif
+  }
+  if (cur == NULL) {
+    goto fail;
+  }
+
+  cur = json_internal_skip_whitespace(cur, end);
+  if (cur == end || *cur != ':') {
+    WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_UNKNOWN_TOK, "Was expecting ':'");
+  }
+  cur = json_internal_skip_whitespace(cur + 1, end);
+  goto value;
+
+after_value:
+  cur = json_internal_skip_whitespace(cur, end);
+  if (depth == 0) {
+    if (cur != end && (*cur == '}' || *cur == ']')) {
+      WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_UNMATCHED_TOKENS,
+                             *cur == '}' ? "Extraneous unmatched }"
+                                         : "Extraneous unmatched ]");
+    } else if (cur != end) {
+      WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_INVALID_VALUE,
+                             "Can only have one outer value");
+    }
+    goto done;
+  }
+
+  if (cur == end) {
+    WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_UNMATCHED_TOKENS,
+                           WHY_JSON_IN_OBJECT ? "Unmatched {" : "Unmatched [");
+  } else if (*cur == ',') {
+    cur = json_internal_skip_whitespace(cur + 1, end);
+#ifndef WHY_JSON_STRICT
+    /* extra commas are fine */
+    if (cur < end && *cur == (WHY_JSON_IN_OBJECT ? '}' : ']')) {
+      cur++;
+      depth--;
+      goto after_value;
+    }
+#endif
+    if (WHY_JSON_IN_OBJECT) {
+      goto key;
+    }
+    goto value;
+  } else if (*cur == '}' || *cur == ']') {
+    if (*cur != (WHY_JSON_IN_OBJECT ? '}' : ']')) {
+      WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_UNMATCHED_TOKENS,
+                             *cur == '}' ? "Extraneous unmatched }"
+                                         : "Extraneous unmatched ]");
+    }
+    cur++;
+    depth--;
+    goto after_value;
+  } else {
+    WHY_JSON_VALIDATE_FAIL(cur, JSON_ERR_MISSING_COMMA,
+                           "Was expecting a comma");
+  }
+
+done:
+  if (bad_utf8 == len) {
+    if (info) {
+      info->err = JSON_ERR_NO_ERROR;
+      info->offset = len;
+      info->line = info->col = 0;
+      info->msg = NULL;
+    }
+    return 1;
+  }
+  /* the only place it could have been is inside of a string */
+  fail_at = buf + bad_utf8;
+
+fail:
+  if (bad_utf8 < len && fail_at >= buf + bad_utf8) {
+    fail_at = buf + bad_utf8;
+    errno = JSON_ERR_INVALID_UTF8;
+    msg = "Invalid Utf8 Sequence";
+  }
+
+  if (info) {
+    const char *line_start = buf;
+    const char *line;
+    info->err = errno;
+    info->offset = fail_at - buf;
+    info->line = 1;
+    info->msg = msg;
+    while ((line = (const char *)memchr(line_start, '\n',
+                                        fail_at - line_start)) != NULL) {
+      info->line++;
+      line_start = line + 1;
+    }
+    info->col = (int)(fail_at - line_start) + 1;
+  }
+  return 0;
+}
+
+#undef WHY_JSON_IN_OBJECT
+#undef WHY_JSON_VALIDATE_FAIL
+
+#undef WHY_JSON_ONES
+#undef WHY_JSON_HAS_ZERO
+#undef WHY_JSON_HAS_BYTE
+#undef WHY_JSON_HAS_LESS
+#undef WHY_JSON_IS_STR_SPECIAL
+#undef WHY_JSON_IS_STRUCTURAL
 
 #endif
 